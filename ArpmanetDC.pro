@@ -31,6 +31,19 @@ SOURCES += main.cpp\
     networkbootstrap.cpp \
     networktopology.cpp \
     util.cpp \
+    datagrampool.cpp \
+    trafficshaper.cpp \
+    mappedfileregion.cpp \
+    uploadblockcache.cpp \
+    uploadscheduler.cpp \
+    feccodec.cpp \
+    fectransfersegment.cpp \
+    btptransfersegment.cpp \
+    downloadfilemap.cpp \
+    bucketpool.cpp \
+    buckethashpool.cpp \
+    pathmtudiscovery.cpp \
+    fstpcongestioncontrol.cpp \
     transfermanager.cpp \
     transfer.cpp \
     uploadtransfer.cpp \
@@ -67,6 +80,21 @@ HEADERS  += arpmanetdc.h \
     networkbootstrap.h \
     networktopology.h \
     util.h \
+    bytecursor.h \
+    demuxtable.h \
+    datagrampool.h \
+    trafficshaper.h \
+    mappedfileregion.h \
+    uploadblockcache.h \
+    uploadscheduler.h \
+    feccodec.h \
+    fectransfersegment.h \
+    btptransfersegment.h \
+    downloadfilemap.h \
+    bucketpool.h \
+    buckethashpool.h \
+    pathmtudiscovery.h \
+    fstpcongestioncontrol.h \
     transfermanager.h \
     transfer.h \
     uploadtransfer.h \
@@ -95,6 +95,9 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
     qRegisterMetaType<QList<TransferItemStatus> >("QList<TransferItemStatus>");
     qRegisterMetaType<QList<QDir> >("QList<QDir>");
     qRegisterMetaType<QByteArray>("QByteArray");
+    qRegisterMetaType<QByteArray*>("QByteArray*");
+    qRegisterMetaType<MappedDatagramStruct>("MappedDatagramStruct");
+    qRegisterMetaType<TrafficShaperStatusStruct>("TrafficShaperStatusStruct");
     qRegisterMetaType<QHash<QString, UserCommandStruct> >("QHash<QString, UserCommandStruct>");
 
     /*if (!pSettings->contains("nick"))
@@ -184,9 +187,16 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
 
     // Tell Dispatcher what protocols we support from a nice and central place
     //pDispatcher->setProtocolCapabilityBitmask(FailsafeTransferProtocol);
-    pDispatcher->setProtocolCapabilityBitmask(FailsafeTransferProtocol | uTPProtocol);
+    pDispatcher->setProtocolCapabilityBitmask(FailsafeTransferProtocol | BasicTransferProtocol | uTPProtocol | ArpmanetFECProtocol);
     //pDispatcher->setProtocolCapabilityBitmask(uTPProtocol);
 
+    // Upload shaping limits
+    pDispatcher->setUploadRateLimits((qint64)pSettingsManager->getSetting(SettingsManager::MAX_UPLOAD_RATE_KB) << 10,
+                                     (qint64)pSettingsManager->getSetting(SettingsManager::MAX_PEER_UPLOAD_RATE_KB) << 10);
+    UploadBlockCache::setCapacity((qint64)pSettingsManager->getSetting(SettingsManager::UPLOAD_CACHE_SIZE_MB) << 20);
+    FECTransferSegment::setRepairPercent(pSettingsManager->getSetting(SettingsManager::FEC_REPAIR_PERCENT));
+    DownloadFileMap::setEnabled(pSettingsManager->getSetting(SettingsManager::MAPPED_DOWNLOADS));
+
     //Connect Dispatcher to GUI - handle search replies from other clients
     connect(pDispatcher, SIGNAL(bootstrapStatusChanged(int)), this, SLOT(bootstrapStatusChanged(int)), Qt::QueuedConnection);
     connect(pDispatcher, SIGNAL(searchResultsReceived(QHostAddress, QByteArray, quint64, QByteArray)),
@@ -201,19 +211,22 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
     pTransferManager = new TransferManager();
     pTransferManager->setMaximumSimultaneousDownloads(pSettingsManager->getSetting(SettingsManager::MAX_SIMULTANEOUS_DOWNLOADS));
     pTransferManager->setMaximumSimultaneousUploads(pSettingsManager->getSetting(SettingsManager::MAX_SIMULTANEOUS_UPLOADS));
+    pTransferManager->setMaximumUploadsPerPeer(pSettingsManager->getSetting(SettingsManager::MAX_UPLOADS_PER_PEER));
     pTransferManager->setProtocolOrderPreference(pSettingsManager->getSetting(SettingsManager::PROTOCOL_HINT).toAscii());
 
     //Connect Dispatcher to TransferManager - handles upload/download requests and transfers
     connect(pDispatcher, SIGNAL(incomingUploadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32)),
             pTransferManager, SLOT(incomingUploadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32)), Qt::QueuedConnection);
-    connect(pDispatcher, SIGNAL(incomingDataPacket(quint8,QHostAddress,QByteArray)),
-            pTransferManager, SLOT(incomingDataPacket(quint8,QHostAddress,QByteArray)), Qt::QueuedConnection);
-    connect(pDispatcher, SIGNAL(incomingDirectDataPacket(quint32,qint64,QByteArray)),
-            pTransferManager, SLOT(incomingDirectDataPacket(quint32,qint64,QByteArray)), Qt::QueuedConnection);
+    connect(pDispatcher, SIGNAL(incomingDataPacket(quint8,QHostAddress,QByteArray*)),
+            pTransferManager, SLOT(incomingDataPacket(quint8,QHostAddress,QByteArray*)), Qt::QueuedConnection);
+    connect(pDispatcher, SIGNAL(incomingDirectDataPacket(quint32,qint64,QByteArray*)),
+            pTransferManager, SLOT(incomingDirectDataPacket(quint32,qint64,QByteArray*)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)),
             pDispatcher, SLOT(sendUnicastRawDatagram(QHostAddress,QByteArray*)), Qt::QueuedConnection);
-    connect(pDispatcher, SIGNAL(receivedTTHTree(QByteArray,QByteArray)),
-            pTransferManager, SLOT(incomingTTHTree(QByteArray,QByteArray)), Qt::QueuedConnection);
+    connect(pTransferManager, SIGNAL(transmitMappedDatagram(QHostAddress,MappedDatagramStruct)),
+            pDispatcher, SLOT(sendUnicastMappedDatagram(QHostAddress,MappedDatagramStruct)), Qt::QueuedConnection);
+    connect(pDispatcher, SIGNAL(receivedTTHTree(QHostAddress,QByteArray,QByteArray)),
+            pTransferManager, SLOT(incomingTTHTree(QHostAddress,QByteArray,QByteArray)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(TTHTreeRequest(QHostAddress,QByteArray,quint32,quint32)),
             pDispatcher, SLOT(sendTTHTreeRequest(QHostAddress,QByteArray,quint32,quint32)), Qt::QueuedConnection);
     connect(pDispatcher, SIGNAL(TTHSearchResultsReceived(QByteArray,QHostAddress,QByteArray)),
@@ -222,6 +235,8 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
             pDispatcher, SLOT(initiateTTHSearch(QByteArray)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(sendDownloadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32,QByteArray)),
             pDispatcher, SLOT(sendDownloadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32,QByteArray)), Qt::QueuedConnection);
+    connect(pTransferManager, SIGNAL(sendSelectiveDownloadRequest(quint8,QHostAddress,QByteArray,QByteArray,quint32,QByteArray)),
+            pDispatcher, SLOT(sendSelectiveDownloadRequest(quint8,QHostAddress,QByteArray,QByteArray,quint32,QByteArray)), Qt::QueuedConnection);
     connect(pDispatcher, SIGNAL(incomingProtocolCapabilityResponse(QHostAddress,char)),
             pTransferManager, SLOT(incomingProtocolCapabilityResponse(QHostAddress,char)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(requestProtocolCapability(QHostAddress)),
@@ -230,16 +245,24 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
             pTransferManager, SLOT(incomingTransferError(QHostAddress,QByteArray,qint64,quint8)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(sendTransferError(QHostAddress,quint8,QByteArray,qint64)),
             pDispatcher, SLOT(sendTransferError(QHostAddress,quint8,QByteArray,qint64)), Qt::QueuedConnection);
+    connect(pDispatcher, SIGNAL(incomingUploadQueued(QHostAddress,QByteArray,qint64,int,int)),
+            pTransferManager, SLOT(incomingUploadQueued(QHostAddress,QByteArray,qint64,int,int)), Qt::QueuedConnection);
+    connect(pTransferManager, SIGNAL(sendUploadQueued(QHostAddress,QByteArray,qint64,int,int)),
+            pDispatcher, SLOT(sendUploadQueued(QHostAddress,QByteArray,qint64,int,int)), Qt::QueuedConnection);
+    connect(pDispatcher, SIGNAL(incomingRevConnect(QHostAddress,QByteArray,quint32)),
+            pTransferManager, SLOT(incomingRevConnect(QHostAddress,QByteArray,quint32)), Qt::QueuedConnection);
+    connect(pTransferManager, SIGNAL(sendRevConnect(QHostAddress,QByteArray,quint32)),
+            pDispatcher, SLOT(sendRevConnect(QHostAddress,QByteArray,quint32)), Qt::QueuedConnection);
     /*connect(pDispatcher, SIGNAL(incomingUploadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32)),
             pTransferManager, SLOT(incomingUploadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32)));
-    connect(pDispatcher, SIGNAL(incomingDataPacket(quint8,QHostAddress,QByteArray)),
-            pTransferManager, SLOT(incomingDataPacket(quint8,QHostAddress,QByteArray)));
-    connect(pDispatcher, SIGNAL(incomingDirectDataPacket(quint32,qint64,QByteArray)),
-            pTransferManager, SLOT(incomingDirectDataPacket(quint32,qint64,QByteArray)));
+    connect(pDispatcher, SIGNAL(incomingDataPacket(quint8,QHostAddress,QByteArray*)),
+            pTransferManager, SLOT(incomingDataPacket(quint8,QHostAddress,QByteArray*)));
+    connect(pDispatcher, SIGNAL(incomingDirectDataPacket(quint32,qint64,QByteArray*)),
+            pTransferManager, SLOT(incomingDirectDataPacket(quint32,qint64,QByteArray*)));
     connect(pTransferManager, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)),
             pDispatcher, SLOT(sendUnicastRawDatagram(QHostAddress,QByteArray*)));
-    connect(pDispatcher, SIGNAL(receivedTTHTree(QByteArray,QByteArray)),
-            pTransferManager, SLOT(incomingTTHTree(QByteArray,QByteArray)));
+    connect(pDispatcher, SIGNAL(receivedTTHTree(QHostAddress,QByteArray,QByteArray)),
+            pTransferManager, SLOT(incomingTTHTree(QHostAddress,QByteArray,QByteArray)));
     connect(pTransferManager, SIGNAL(TTHTreeRequest(QHostAddress,QByteArray,quint32,quint32)),
             pDispatcher, SLOT(sendTTHTreeRequest(QHostAddress,QByteArray,quint32,quint32)));
     connect(pDispatcher, SIGNAL(TTHSearchResultsReceived(QByteArray,QHostAddress)),
@@ -378,18 +401,13 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
     //connect(pShare, SIGNAL(tthSourceLoaded(QByteArray, QHostAddress)),
     //        pTransferManager, SLOT(incomingTTHSource(QByteArray, QHostAddress)), Qt::QueuedConnection);
 
-    connect(pShare, SIGNAL(restoreBucketFlushStateBitmap(QByteArray, QByteArray)),
-        pTransferManager, SLOT(restoreBucketFlushStateBitmap(QByteArray, QByteArray)), Qt::QueuedConnection);
-    connect(pTransferManager, SIGNAL(saveBucketFlushStateBitmap(QByteArray, QByteArray)),
-        pShare, SLOT(saveBucketFlushStateBitmap(QByteArray, QByteArray)), Qt::QueuedConnection);
+    connect(pShare, SIGNAL(restoreBucketFlushStateBitmap(QByteArray, QByteArray, QByteArray)),
+        pTransferManager, SLOT(restoreBucketFlushStateBitmap(QByteArray, QByteArray, QByteArray)), Qt::QueuedConnection);
+    connect(pTransferManager, SIGNAL(saveBucketFlushStateBitmap(QByteArray, QByteArray, QByteArray)),
+        pShare, SLOT(saveBucketFlushStateBitmap(QByteArray, QByteArray, QByteArray)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(loadBucketFlushStateBitmap(QByteArray)),
         pShare, SLOT(loadBucketFlushStateBitmap(QByteArray)), Qt::QueuedConnection);
 
-    connect(pTransferManager, SIGNAL(hashBucketRequest(QByteArray,int,QByteArray,QHostAddress)),
-            pShare, SLOT(hashBucketRequest(QByteArray, int, QByteArray,QHostAddress)), Qt::QueuedConnection);
-    connect(pShare, SIGNAL(hashBucketReply(QByteArray, int, QByteArray,QHostAddress)),
-            pTransferManager, SLOT(hashBucketReply(QByteArray,int,QByteArray,QHostAddress)), Qt::QueuedConnection);
-
     //Temporary signal to search local database
 
     //connect(pShare, SIGNAL(returnSearchResult(QHostAddress,QByteArray,quint64,QByteArray)),
@@ -403,10 +421,12 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
             pBucketFlushThread, SLOT(flushBucket(QString,QByteArray*)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(assembleOutputFile(QString,QString,int,int)),
             pBucketFlushThread, SLOT(assembleOutputFile(QString,QString,int,int)), Qt::QueuedConnection);
-    connect(pTransferManager, SIGNAL(flushBucketDirect(QString,int,QByteArray*,QByteArray)),
-            pBucketFlushThread, SLOT(flushBucketDirect(QString,int,QByteArray*,QByteArray)), Qt::QueuedConnection);
+    connect(pTransferManager, SIGNAL(flushBucketDirect(QString,int,QByteArray*,QByteArray,qint64)),
+            pBucketFlushThread, SLOT(flushBucketDirect(QString,int,QByteArray*,QByteArray,qint64)), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(renameIncompleteFile(QString)),
             pBucketFlushThread, SLOT(renameIncompleteFile(QString)), Qt::QueuedConnection);
+    connect(pTransferManager, SIGNAL(closeIncompleteFile(QByteArray)),
+            pBucketFlushThread, SLOT(closeIncompleteFile(QByteArray)), Qt::QueuedConnection);
     connect(pBucketFlushThread, SIGNAL(bucketFlushed(QByteArray,int)),
             pTransferManager, SLOT(bucketFlushed(QByteArray,int)), Qt::QueuedConnection);
     connect(pBucketFlushThread, SIGNAL(bucketFlushFailed(QByteArray,int)),
@@ -443,6 +463,10 @@ ArpmanetDC::ArpmanetDC(QStringList arguments, QWidget *parent, Qt::WFlags flags)
     pTransferManager->moveToThread(transferThread);
     transferThread->start();
 
+    //Stream transfers listen on the dispatch port number, from the transfer thread
+    QMetaObject::invokeMethod(pTransferManager, "setBasicTransferPort", Qt::QueuedConnection,
+                              Q_ARG(quint16, (quint16)pSettingsManager->getSetting(SettingsManager::EXTERNAL_PORT)));
+
     arpmanetDCLogoNormal = new QPixmap(":/ArpmanetDC/Resources/Logo128x128.png");
     arpmanetDCLogoNotify = new QPixmap(":/ArpmanetDC/Resources/Logo128x128Notify.png");
 
@@ -712,9 +736,11 @@ bool ArpmanetDC::setupDatabase()
     //Create UserCommands table - saves user commands
     queries.append("CREATE TABLE UserCommands (rowID INTEGER PRIMARY KEY, name TEXT, command TEXT, parameterCount INT, output TEXT, UNIQUE(command));");
 
-    //Create FileStateBitmaps table - saves bitmap data for a specific file for resuming
-    queries.append("CREATE TABLE FileStateBitmaps (rowID INTEGER PRIMARY KEY, tthRoot TEXT, bitmap TEXT, UNIQUE(tthRoot));");
+    //Create FileStateBitmaps table - saves bitmap data and received hash tree leaves for a specific file for resuming
+    queries.append("CREATE TABLE FileStateBitmaps (rowID INTEGER PRIMARY KEY, tthRoot TEXT, bitmap TEXT, leaves TEXT, UNIQUE(tthRoot));");
     queries.append("CREATE INDEX IDX_FILE_STATE_BITMAPS on FileStateBitmaps(tthRoot);");
+    //Databases from before the leaves were kept get the column added, this fails harmlessly when it is there
+    queries.append("ALTER TABLE FileStateBitmaps ADD COLUMN leaves TEXT;");
 
     QList<QString> queryErrors(queries);
 
@@ -1079,6 +1105,34 @@ void ArpmanetDC::chatLineEditReturnPressed()
         appendChatLine(pDispatcher->getDebugCIDHostContents());
         chatLineEdit->setText("");
     }
+    //Display datagram buffer pool hit/miss counters
+    else if (chatLineEdit->text().compare("/debugpool") == 0)
+    {
+        appendChatLine("DEBUG Datagram pool statistics");
+        appendChatLine(DatagramPool::getDebugStatistics());
+        chatLineEdit->setText("");
+    }
+    //Display discovered path MTUs
+    else if (chatLineEdit->text().compare("/debugpathmtu") == 0)
+    {
+        appendChatLine("DEBUG Path MTU cache contents");
+        appendChatLine(pDispatcher->getDebugPathMTUContents());
+        chatLineEdit->setText("");
+    }
+    //Display upload block cache hit rates
+    else if (chatLineEdit->text().compare("/debuguploadcache") == 0)
+    {
+        appendChatLine("DEBUG Upload block cache statistics");
+        appendChatLine(UploadBlockCache::getDebugStatistics());
+        chatLineEdit->setText("");
+    }
+    //Display download bucket pool usage
+    else if (chatLineEdit->text().compare("/debugbucketpool") == 0)
+    {
+        appendChatLine("DEBUG Download bucket pool statistics");
+        appendChatLine(BucketPool::getDebugStatistics());
+        chatLineEdit->setText("");
+    }
     //Scan network for hosts (overuse can be dangerous)
     else if (chatLineEdit->text().compare("/linscan") == 0)
     {
@@ -1815,7 +1869,10 @@ void ArpmanetDC::settingsSaved()
     QMetaObject::invokeMethod(pDispatcher, "getDispatchIP", Qt::BlockingQueuedConnection, Q_RETURN_ARG(QHostAddress, oldExternalIP));
     QMetaObject::invokeMethod(pDispatcher, "getDispatchPort", Qt::BlockingQueuedConnection, Q_RETURN_ARG(quint16, oldExternalPort));
     if (externalIP != oldExternalIP.toString() || externalPort != oldExternalPort)
+    {
         QMetaObject::invokeMethod(pDispatcher, "reconfigureDispatchHostPort", Qt::QueuedConnection, Q_ARG(QHostAddress, QHostAddress(externalIP)), Q_ARG(quint16, externalPort));
+        QMetaObject::invokeMethod(pTransferManager, "setBasicTransferPort", Qt::QueuedConnection, Q_ARG(quint16, externalPort));
+    }
 
     //Reset CID from nick/password
     QCryptographicHash hash(QCryptographicHash::Sha1);
@@ -1834,6 +1891,20 @@ void ArpmanetDC::settingsSaved()
     //Reconfigure protocol preference order in transfer manager
     QMetaObject::invokeMethod(pTransferManager, "setProtocolOrderPreference", Qt::QueuedConnection, Q_ARG(QByteArray, pSettingsManager->getSetting(SettingsManager::PROTOCOL_HINT).toAscii()));
 
+    //Reconfigure upload rate limits in dispatcher
+    QMetaObject::invokeMethod(pDispatcher, "setUploadRateLimits", Qt::QueuedConnection,
+                              Q_ARG(qint64, (qint64)pSettingsManager->getSetting(SettingsManager::MAX_UPLOAD_RATE_KB) << 10),
+                              Q_ARG(qint64, (qint64)pSettingsManager->getSetting(SettingsManager::MAX_PEER_UPLOAD_RATE_KB) << 10));
+
+    //Resize the shared upload block cache
+    UploadBlockCache::setCapacity((qint64)pSettingsManager->getSetting(SettingsManager::UPLOAD_CACHE_SIZE_MB) << 20);
+
+    //Repair overhead for new FEC uploads
+    FECTransferSegment::setRepairPercent(pSettingsManager->getSetting(SettingsManager::FEC_REPAIR_PERCENT));
+
+    //Downloads started from now on
+    DownloadFileMap::setEnabled(pSettingsManager->getSetting(SettingsManager::MAPPED_DOWNLOADS));
+
     //Delete settings tab
     if (settingsWidget)
     {
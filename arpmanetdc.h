@@ -37,6 +37,9 @@
 #include "dispatcher.h"
 #include "transfermanager.h"
 #include "bucketflushthread.h"
+#include "datagrampool.h"
+#include "uploadblockcache.h"
+#include "bucketpool.h"
 #include "resourceextractor.h"
 #include "ftpupdate.h"
 #include "util.h"
@@ -51,7 +54,7 @@
 static QString shareDatabasePath;
 
 //#define UNSUPPORTED_TRANSFER_PROTOCOLS "BTP;uTP;FECTP" //Semi-colon separated - only used to gray out protocol in settings
-#define UNSUPPORTED_TRANSFER_PROTOCOLS "BTP;FECTP"
+#define UNSUPPORTED_TRANSFER_PROTOCOLS ""
 
 //Initialize the protocol map
 static QMap<QString, char> initMapValues() {
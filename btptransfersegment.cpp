@@ -0,0 +1,471 @@
+#include "btptransfersegment.h"
+#include "bytecursor.h"
+#include "uploadblockcache.h"
+#include <QAtomicInt>
+#include <QTimer>
+
+#ifdef Q_WS_WIN //If windows
+#include <winsock2.h>
+#else //If Q_OS_LINUX
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <errno.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#endif
+
+namespace
+{
+
+QAtomicInt basicTransferPort(0);
+
+}
+
+BTPTransferSegment::BTPTransferSegment(Transfer *parent) : TransferSegment(parent)
+{
+    status = TRANSFER_STATE_INITIALIZING;
+    prev_status = -1;
+    segmentMode = UndefinedSegment;
+
+    socket = 0;
+    writeNotifier = 0;
+    connectingRole = BTPDownloaderRole;
+    connectionReady = false;
+    lastActivityTime = 0;
+
+    receiveOffset = 0;
+    frameRemaining = 0;
+    uploadQueuedUntil = 0;
+
+    pParent = parent;
+}
+
+BTPTransferSegment::~BTPTransferSegment()
+{
+    dropConnection();
+    if (inputFile.isOpen())
+        inputFile.close();
+}
+
+void BTPTransferSegment::setPort(quint16 port)
+{
+    basicTransferPort.fetchAndStoreRelaxed(port);
+}
+
+void BTPTransferSegment::setFileName(QString filename)
+{
+    filePathName = filename;
+    inputFile.setFileName(filePathName);
+    inputFile.open(QIODevice::ReadOnly);
+    fileSize = inputFile.size();
+}
+
+void BTPTransferSegment::setFileSize(quint64 size)
+{
+    fileSize = size;
+}
+
+// Everything arrives over the connection
+void BTPTransferSegment::incomingDataPacket(qint64, const char *, int)
+{
+}
+
+// ------------------------------------ Connection ------------------------------------
+
+void BTPTransferSegment::openConnection(BTPConnectionRole role)
+{
+    connectingRole = role;
+    connectionReady = false;
+    socket = new QTcpSocket(this);
+    connect(socket, SIGNAL(connected()), this, SLOT(socketConnected()));
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
+    socket->connectToHost(remoteHost, (quint16)(int)basicTransferPort);
+    QTimer::singleShot(BTP_CONNECT_TIMEOUT, this, SLOT(connectTimeout()));
+}
+
+void BTPTransferSegment::socketConnected()
+{
+    QByteArray hello(BTP_HELLO_SIZE, 0);
+    ByteWriter writer(hello.data(), hello.size());
+    writer.writeUInt8(BasicTransferProtocol);
+    writer.writeUInt8(connectingRole);
+    writer.writeUInt32(segmentId);
+    writer.writeBytes(TTH);
+    socket->write(hello);
+    socket->flush();
+
+    setupConnection();
+}
+
+void BTPTransferSegment::connectTimeout()
+{
+    if (socket && !connectionReady)
+        connectionFailed();
+}
+
+// A connection the peer opened to us, handed over by the transfer manager once it read the hello
+bool BTPTransferSegment::attachStreamConnection(QTcpSocket *connection, int role, QByteArray tth)
+{
+    if (socket || tth != TTH)
+        return false;
+    if (!(segmentMode == UploadingSegment && role == BTPDownloaderRole) && !(segmentMode == DownloadingSegment && role == BTPUploaderRole))
+        return false;
+
+    socket = connection;
+    socket->setParent(this);
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
+    setupConnection();
+    return true;
+}
+
+// The uploader could not get through to us, so we connect to it
+void BTPTransferSegment::reverseConnect(QByteArray tth)
+{
+    if (socket || tth != TTH || segmentMode != DownloadingSegment || status != TRANSFER_STATE_RUNNING)
+        return;
+
+    openConnection(BTPDownloaderRole);
+}
+
+void BTPTransferSegment::setupConnection()
+{
+    connectionReady = true;
+    lastActivityTime = QDateTime::currentMSecsSinceEpoch();
+
+    int bufferSize = BTP_SOCKET_BUFFER_SIZE;
+    ::setsockopt(socket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&bufferSize, sizeof(bufferSize));
+    ::setsockopt(socket->socketDescriptor(), SOL_SOCKET, SO_RCVBUF, (char *)&bufferSize, sizeof(bufferSize));
+    socket->setReadBufferSize(BTP_SOCKET_BUFFER_SIZE);
+
+    connect(socket, SIGNAL(readyRead()), this, SLOT(socketReadyRead()));
+    connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(socketBytesWritten(qint64)));
+
+    if (segmentMode == UploadingSegment)
+        sendUploadData();
+    else
+        // Whatever came in behind the hello is not announced again
+        socketReadyRead();
+}
+
+void BTPTransferSegment::socketError(QAbstractSocket::SocketError)
+{
+    if (socket)
+        connectionFailed();
+}
+
+void BTPTransferSegment::connectionFailed()
+{
+    bool wasReady = connectionReady;
+    dropConnection();
+
+    if (segmentMode == UploadingSegment)
+    {
+        // The downloader may be behind a firewall or NAT, it can still reach us
+        if (!wasReady && connectingRole == BTPUploaderRole)
+            emit sendRevConnect(remoteHost, TTH, segmentId);
+        else
+            pendingUploadRanges.clear();
+    }
+    else if (segmentMode == DownloadingSegment && status == TRANSFER_STATE_RUNNING && wasReady)
+    {
+        // A broken connection does not come back by itself, a connection that never came up leaves the uploader
+        // to try the reverse way and is left to the stall timeout
+        status = TRANSFER_STATE_FAILED;
+        emit transferRequestFailed(this);
+    }
+}
+
+void BTPTransferSegment::dropConnection()
+{
+    // The notifier has to go before the socket descriptor does
+    delete writeNotifier;
+    writeNotifier = 0;
+
+    if (socket)
+    {
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+        socket = 0;
+    }
+    connectionReady = false;
+}
+
+// ------------------------------------ Uploading ------------------------------------
+
+void BTPTransferSegment::startUploading()
+{
+    maxUploadRequestOffset = 0;
+    segmentMode = UploadingSegment;
+
+    if (segmentStart > fileSize)
+    {
+        emit sendTransferError(remoteHost, InvalidOffsetError, TTH, segmentStart);
+        return;
+    }
+    else if (segmentStart + segmentLength > fileSize)
+        segmentLength = fileSize - segmentStart;
+
+    maxUploadRequestOffset = maxUploadRequestOffset < segmentStart ? segmentStart : maxUploadRequestOffset;
+    if (segmentStart + segmentLength == fileSize)
+        maxUploadRequestOffset = fileSize;
+
+    if (segmentLength <= 0)
+        return;
+
+    // Without a segment id the downloader could not tell our connection apart from its other ones
+    if (segmentId == 0 || !inputFile.isOpen())
+    {
+        emit sendTransferError(remoteHost, segmentId == 0 ? TransferAbortingError : FileIOError, TTH, segmentStart);
+        return;
+    }
+
+    // A re-request for something still waiting in the queue would only send it twice
+    qint64 end = segmentStart + segmentLength;
+    foreach (BTPUploadRangeStruct range, pendingUploadRanges)
+        if (segmentStart >= range.offset && end <= range.end)
+            return;
+
+    BTPUploadRangeStruct range;
+    range.offset = segmentStart;
+    range.end = end;
+    range.headerSent = false;
+    pendingUploadRanges.enqueue(range);
+
+    if (!socket)
+        openConnection(BTPUploaderRole);
+    else if (connectionReady)
+        sendUploadData();
+}
+
+void BTPTransferSegment::sendUploadData()
+{
+    if (!socket || !connectionReady)
+        return;
+
+    while (!pendingUploadRanges.isEmpty())
+    {
+        // Data the socket still holds goes first, bytesWritten() brings us back
+        if (socket->bytesToWrite() > 0)
+            return;
+
+        BTPUploadRangeStruct &range = pendingUploadRanges.head();
+        if (!range.headerSent)
+        {
+            QByteArray header(BTP_FRAME_HEADER_SIZE, 0);
+            ByteWriter writer(header.data(), header.size());
+            writer.writeUInt64((quint64)range.offset);
+            writer.writeUInt64((quint64)(range.end - range.offset));
+            socket->write(header);
+            socket->flush();
+            range.headerSent = true;
+            continue;
+        }
+
+        qint64 n = writeFileData(range.offset, range.end - range.offset);
+        if (n < 0)
+        {
+            emit sendTransferError(remoteHost, FileIOError, TTH, range.offset);
+            dropConnection();
+            pendingUploadRanges.clear();
+            return;
+        }
+        if (n == 0)
+            return;
+
+        range.offset += n;
+        bytesTransferred += n;
+        lastActivityTime = QDateTime::currentMSecsSinceEpoch();
+        emit updateDirectBytesStats(n);
+        if (range.offset >= range.end)
+            pendingUploadRanges.dequeue();
+    }
+}
+
+// Writes what the socket takes of the file range, 0 if it is full, -1 on error
+qint64 BTPTransferSegment::writeFileData(qint64 offset, qint64 length)
+{
+#ifdef Q_OS_LINUX
+    // Straight from the page cache into the socket, the data never comes up to us
+    off_t fileOffset = offset;
+    ssize_t n = ::sendfile(socket->socketDescriptor(), inputFile.handle(), &fileOffset, (size_t)qMin(length, (qint64)BTP_SENDFILE_CHUNK));
+    if (n > 0)
+        return n;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // Qt only watches the socket while it has something buffered itself, which it has not now
+        if (!writeNotifier)
+        {
+            writeNotifier = new QSocketNotifier(socket->socketDescriptor(), QSocketNotifier::Write, this);
+            connect(writeNotifier, SIGNAL(activated(int)), this, SLOT(socketWritable()));
+        }
+        writeNotifier->setEnabled(true);
+        return 0;
+    }
+    return -1;
+#else
+    // No sendfile, the socket gets its copy from the shared block cache
+    MappedFileRegion *region = UploadBlockCache::acquireBlock(TTH, filePathName, calculateBucketNumber(offset));
+    if (!region)
+        return -1;
+    qint64 n = qMin(length, region->offset() + region->length() - offset);
+    n = socket->write(region->data() + (offset - region->offset()), n);
+    region->deref();
+    return n;
+#endif
+}
+
+void BTPTransferSegment::socketWritable()
+{
+    writeNotifier->setEnabled(false);
+    sendUploadData();
+}
+
+void BTPTransferSegment::socketBytesWritten(qint64)
+{
+    if (segmentMode == UploadingSegment)
+        sendUploadData();
+}
+
+// ------------------------------------ Downloading ------------------------------------
+
+void BTPTransferSegment::startDownloading()
+{
+    if (!(pParent->getTransferStatus() & (TRANSFER_STATE_STALLED | TRANSFER_STATE_RUNNING)))
+        return;
+    if (status & (TRANSFER_STATE_INITIALIZING | TRANSFER_STATE_FINISHED))
+    {
+        segmentMode = DownloadingSegment;
+        segmentStartTime = QDateTime::currentMSecsSinceEpoch();
+        receiveOffset = segmentStart;
+        frameRemaining = 0;
+        uploadQueuedUntil = 0;
+        status = TRANSFER_STATE_RUNNING;
+        requestSegment();
+    }
+}
+
+// The whole segment in one request, the uploader streams it in one frame
+void BTPTransferSegment::requestSegment()
+{
+    lastActivityTime = QDateTime::currentMSecsSinceEpoch();
+    checkSendDownloadRequest(remoteHost, TTH, receiveOffset, segmentEnd - receiveOffset, status, BasicTransferProtocol);
+}
+
+void BTPTransferSegment::pauseDownload()
+{
+    prev_status = status;
+    status = TRANSFER_STATE_PAUSED;
+}
+
+void BTPTransferSegment::unpauseDownload()
+{
+    if (prev_status != -1)
+        status = prev_status;
+}
+
+void BTPTransferSegment::abortTransfer()
+{
+    dropConnection();
+    emit transferRequestFailed(this, 0, false);
+}
+
+// Nothing arrives until the uploader has a slot for us, ask again once the retry hint runs out
+void BTPTransferSegment::uploadQueued(int, int retryMsecs)
+{
+    if (status != TRANSFER_STATE_RUNNING || receiveOffset != segmentStart)
+        return;
+
+    uploadQueuedUntil = QDateTime::currentMSecsSinceEpoch() + retryMsecs;
+}
+
+// Reads straight into the mapped file or the buckets, as much as the socket holds at a time
+void BTPTransferSegment::socketReadyRead()
+{
+    if (!socket)
+        return;
+
+    // The downloader sends nothing after its hello
+    if (segmentMode != DownloadingSegment)
+    {
+        socket->readAll();
+        return;
+    }
+
+    while (status == TRANSFER_STATE_RUNNING)
+    {
+        if (frameRemaining == 0)
+        {
+            if (socket->bytesAvailable() < BTP_FRAME_HEADER_SIZE)
+                return;
+
+            QByteArray header = socket->read(BTP_FRAME_HEADER_SIZE);
+            ByteReader reader(header);
+            qint64 offset = (qint64)reader.readUInt64();
+            qint64 length = (qint64)reader.readUInt64();
+            // Frames come in the order they were asked for and the data must be what we asked for
+            if (!reader.ok() || offset != receiveOffset || length <= 0 || length > segmentEnd - receiveOffset)
+            {
+                connectionFailed();
+                return;
+            }
+            frameRemaining = length;
+        }
+
+        qint64 available = socket->bytesAvailable();
+        if (available <= 0)
+            return;
+
+        int bucketNumber = calculateBucketNumber(receiveOffset);
+        int bucketOffset = receiveOffset - (qint64)bucketNumber * HASH_BUCKET_SIZE;
+        qint64 bucketEnd = qMin((qint64)(bucketNumber + 1) * HASH_BUCKET_SIZE, segmentEnd);
+        int n = (int)qMin(qMin(available, frameRemaining), bucketEnd - receiveOffset);
+
+        n = socket->read(downloadBucketData(bucketNumber, bucketOffset + n) + bucketOffset, n);
+        if (n <= 0)
+            return;
+
+        addReceivedBucketBytes(receiveOffset, n);
+        hashReceivedRange(receiveOffset, receiveOffset + n);
+        receiveOffset += n;
+        frameRemaining -= n;
+        bytesTransferred += n;
+        lastActivityTime = QDateTime::currentMSecsSinceEpoch();
+        emit updateDirectBytesStats(n);
+
+        if (receiveOffset == bucketEnd)
+            downloadBucketComplete(bucketNumber);
+
+        if (receiveOffset >= segmentEnd)
+        {
+            status = TRANSFER_STATE_FINISHED;  // local segment
+            emit requestNextSegment(this);
+            return;
+        }
+    }
+}
+
+void BTPTransferSegment::transferTimerEvent()
+{
+    if (!(pParent->getTransferStatus() & (TRANSFER_STATE_STALLED | TRANSFER_STATE_RUNNING)))
+        return;
+    if (status != TRANSFER_STATE_RUNNING)
+        return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (uploadQueuedUntil > 0)
+    {
+        // Queued at the uploader, ask again once the retry hint runs out
+        if (now < uploadQueuedUntil)
+            return;
+        uploadQueuedUntil = 0;
+        requestSegment();
+    }
+    else if (now - lastActivityTime > BTP_STALL_TIMEOUT)
+    {
+        dropConnection();
+        status = TRANSFER_STATE_FAILED;
+        emit transferRequestFailed(this);
+    }
+}
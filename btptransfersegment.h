@@ -0,0 +1,121 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BTPTRANSFERSEGMENT_H
+#define BTPTRANSFERSEGMENT_H
+#include <QQueue>
+#include <QTcpSocket>
+#include <QSocketNotifier>
+#include "transfersegment.h"
+
+// BasicTransferProtocol: bulk transfers over a TCP connection.
+//
+// For fast clean links between well connected peers, where the kernel's congestion control, segmentation offload and
+// sendfile beat anything done per packet in user space. The download request still goes over the dispatcher, so that
+// upload slots and queueing work the same as for the datagram protocols. The uploader then connects to the downloader
+// on the dispatch port number; if that does not get through it sends a RevConnectPacket and the downloader connects
+// the other way. Either side opens with a hello naming the segment, and the connection lasts as long as the segment.
+//
+// Hello:  quint8 protocol, quint8 role of the side connecting, quint32 segment id, 24 byte TTH
+// Then per request the uploader sends a frame: quint64 offset, quint64 length, followed by the data.
+
+#define BTP_HELLO_SIZE 30
+#define BTP_FRAME_HEADER_SIZE 16
+// Unanswered connection attempts are given up after this long
+#define BTP_CONNECT_TIMEOUT 5000
+// Sockets that connected to us have this long to say what they want
+#define BTP_HELLO_TIMEOUT 10000
+// A download that gets nothing for this long fails, the other protocols get their turn
+#define BTP_STALL_TIMEOUT 20000
+// Kernel socket buffers, big enough to keep a fast link busy between two reads
+#define BTP_SOCKET_BUFFER_SIZE 4194304
+// Largest single sendfile call, so one segment does not hog the transfer thread
+#define BTP_SENDFILE_CHUNK 1048576
+
+enum BTPConnectionRole
+{
+    BTPDownloaderRole=0x01,
+    BTPUploaderRole=0x02
+};
+
+typedef struct
+{
+    qint64 offset;
+    qint64 end;
+    bool headerSent;
+} BTPUploadRangeStruct;
+
+class Transfer;
+
+class BTPTransferSegment : public TransferSegment
+{
+    Q_OBJECT
+public:
+    BTPTransferSegment(Transfer *parent = 0);
+    ~BTPTransferSegment();
+
+    // Port the peers listen on, thread safe
+    static void setPort(quint16 port);
+
+public slots:
+    void incomingDataPacket(qint64 offset, const char *data, int length);
+    void transferTimerEvent();
+    void setFileName(QString filename);
+    void setFileSize(quint64 size);
+    void startUploading();
+    void startDownloading();
+    void pauseDownload();
+    void unpauseDownload();
+    void abortTransfer();
+    void uploadQueued(int position, int retryMsecs);
+    bool attachStreamConnection(QTcpSocket *connection, int role, QByteArray tth);
+    void reverseConnect(QByteArray tth);
+
+private slots:
+    void socketConnected();
+    void socketError(QAbstractSocket::SocketError error);
+    void socketReadyRead();
+    void socketBytesWritten(qint64 bytes);
+    void socketWritable();
+    void connectTimeout();
+
+private:
+    void openConnection(BTPConnectionRole role);
+    void setupConnection();
+    void dropConnection();
+    void connectionFailed();
+
+    // Uploading
+    void sendUploadData();
+    qint64 writeFileData(qint64 offset, qint64 length);
+    QQueue<BTPUploadRangeStruct> pendingUploadRanges;
+    QSocketNotifier *writeNotifier;
+
+    // Downloading
+    void requestSegment();
+    qint64 receiveOffset;
+    qint64 frameRemaining;
+    qint64 uploadQueuedUntil;
+
+    QTcpSocket *socket;
+    BTPConnectionRole connectingRole;
+    bool connectionReady;
+    qint64 lastActivityTime;
+    SegmentMode segmentMode;
+};
+
+#endif // BTPTRANSFERSEGMENT_H
@@ -1,9 +1,23 @@
 #include "bucketflushthread.h"
+#include "bucketpool.h"
 #include <QDir>
 
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
 BucketFlushThread::BucketFlushThread(QObject *parent) :
     QObject(parent)
 {
+    writeScheduled = false;
+}
+
+BucketFlushThread::~BucketFlushThread()
+{
+    foreach (QByteArray tth, incompleteFiles.keys())
+        closeFile(tth);
 }
 
 
@@ -91,61 +105,203 @@ void BucketFlushThread::assembleOutputFile(QString tmpfilebase, QString outfile,
         outf.close();
 }
 
-void BucketFlushThread::flushBucketDirect(QString filename, int bucketno, QByteArray *bucket, QByteArray tth)
+// Buckets are only queued here. Once the flush requests already waiting in our event queue have all come in,
+// writePendingBuckets() writes the adjacent ones in one go.
+void BucketFlushThread::flushBucketDirect(QString filename, int bucketno, QByteArray *bucket, QByteArray tth, qint64 fileSize)
 {
-    //Go to directory
-    QString pathStr = filename.left(filename.lastIndexOf("/"));
-    QDir path(pathStr);
-    if (!path.exists())
-        path.mkpath(pathStr);
-
-    QString incompleteFilename = filename + ".incomplete";
-    QFile outf(incompleteFilename);
-    if (!outf.open(QIODevice::ReadWrite))
+    if (!openIncompleteFile(filename, tth, fileSize))
     {
-        delete bucket;
+        BucketPool::release(bucket);
         emit bucketFlushFailed(tth, bucketno);
         return;
     }
 
-    //Ensure enough space is available for the map
-    if (outf.size() < (quint64)bucketno * HASH_BUCKET_SIZE + bucket->size())
-        outf.resize((quint64)bucketno * HASH_BUCKET_SIZE + bucket->size());
+    // A bucket queued again replaces the copy still waiting. Both passed the hash check, so the old one is answered
+    // as flushed, or the download would keep counting it as queued.
+    QByteArray *previous = incompleteFiles[tth].pendingBuckets.value(bucketno);
+    incompleteFiles[tth].pendingBuckets.insert(bucketno, bucket);
+    if (previous)
+    {
+        if (previous != bucket)
+            BucketPool::release(previous);
+        emit bucketFlushed(tth, bucketno);
+    }
 
-#ifndef USE_MMAPFILES_FOR_DOWNLOAD
-    outf.seek((quint64)bucketno * HASH_BUCKET_SIZE);
-    outf.write(*bucket);
+    if (!writeScheduled)
+    {
+        writeScheduled = true;
+        QMetaObject::invokeMethod(this, "writePendingBuckets", Qt::QueuedConnection);
+    }
+}
+
+// Opens the .incomplete file once per download and reserves its full size, so that bucket writes neither reopen
+// nor grow it.
+QFile *BucketFlushThread::openIncompleteFile(QString filename, QByteArray tth, qint64 fileSize)
+{
+    if (incompleteFiles.contains(tth))
+        return incompleteFiles.value(tth).file;
+
+    // Make room by closing a file of a download that went quiet
+    if (incompleteFiles.size() >= BUCKET_FLUSH_MAX_OPEN_FILES)
+    {
+        QHashIterator<QByteArray, IncompleteFileStruct> i(incompleteFiles);
+        while (i.hasNext())
+        {
+            i.next();
+            if (i.value().pendingBuckets.isEmpty())
+            {
+                closeFile(i.key());
+                break;
+            }
+        }
+    }
+
+    QString incompleteFilename = filename + ".incomplete";
+    if (!QFile::exists(incompleteFilename))
+    {
+        //Go to directory
+        QString pathStr = filename.left(filename.lastIndexOf("/"));
+        QDir path(pathStr);
+        if (!path.exists())
+            path.mkpath(pathStr);
+    }
+
+    // Unbuffered, buckets go straight to the descriptor whether written by pwritev() or QFile
+    QFile *file = new QFile(incompleteFilename);
+    if (!file->open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+    {
+        delete file;
+        return 0;
+    }
+
+    if (file->size() < fileSize)
+    {
+#ifdef Q_OS_LINUX
+        // Allocates the blocks for real, so the file does not end up fragmented by out of order buckets.
+        // Falls back to a sparse file where that is not possible.
+        if (::posix_fallocate(file->handle(), 0, fileSize) != 0)
+            file->resize(fileSize);
+#else
+        file->resize(fileSize);
 #endif
+    }
 
-#ifdef USE_MMAPFILES_FOR_DOWNLOAD
-    //Map file to memory
-    uchar *f = outf.map((quint64)bucketno * HASH_BUCKET_SIZE, bucket->size());
-            
-    //Write to memory if map succeeded
-    if (f != 0)
+    IncompleteFileStruct incompleteFile;
+    incompleteFile.file = file;
+    incompleteFile.fileName = filename;
+    incompleteFiles.insert(tth, incompleteFile);
+    return file;
+}
+
+void BucketFlushThread::writePendingBuckets()
+{
+    writeScheduled = false;
+    QMutableHashIterator<QByteArray, IncompleteFileStruct> i(incompleteFiles);
+    while (i.hasNext())
     {
-        memmove(f, (const uchar *)bucket->constData(), bucket->size());
-        outf.flush();
+        i.next();
+        writeBuckets(i.key(), i.value());
     }
-    else
+}
+
+// Writes the pending buckets of one file, adjacent ones together
+void BucketFlushThread::writeBuckets(QByteArray tth, IncompleteFileStruct &incompleteFile)
+{
+    QList<QByteArray *> run;
+    int firstBucket = 0;
+    QMapIterator<int, QByteArray *> i(incompleteFile.pendingBuckets);
+    while (i.hasNext())
     {
-        qWarning() << "BucketFlushThread::flushBucketDirect: Big booboo for map! Could not map file. bucket : size" << bucketno << bucket->size();
-        emit bucketFlushFailed(tth, bucketno);
+        i.next();
+        // Only the last bucket of a file is short, so a full previous bucket means this one follows it on disk
+        bool adjacent = !run.isEmpty() && i.key() == firstBucket + run.size() && run.last()->size() == HASH_BUCKET_SIZE;
+        if (!run.isEmpty() && (!adjacent || run.size() == BUCKET_FLUSH_MAX_BATCH))
+        {
+            writeRun(tth, incompleteFile.file, firstBucket, run);
+            run.clear();
+        }
+        if (run.isEmpty())
+            firstBucket = i.key();
+        run.append(i.value());
     }
+    if (!run.isEmpty())
+        writeRun(tth, incompleteFile.file, firstBucket, run);
 
-    if (!outf.unmap(f))
-        qWarning() << "BucketFlushThread::flushBucketDirect: Big booboo for map! Could not unmap file. bucket : size" << bucketno << bucket->size();
+    incompleteFile.pendingBuckets.clear();
+}
+
+void BucketFlushThread::writeRun(QByteArray tth, QFile *file, int firstBucket, const QList<QByteArray *> &buckets)
+{
+    qint64 offset = (qint64)firstBucket * HASH_BUCKET_SIZE;
+    qint64 written = 0;
+
+#ifdef Q_OS_LINUX
+    struct iovec iov[BUCKET_FLUSH_MAX_BATCH];
+    for (int i = 0; i < buckets.size(); i++)
+    {
+        iov[i].iov_base = (void *)buckets.at(i)->constData();
+        iov[i].iov_len = buckets.at(i)->size();
+    }
+    ssize_t n;
+    do
+        n = ::pwritev(file->handle(), iov, buckets.size(), offset);
+    while (n == -1 && errno == EINTR);
+    if (n > 0)
+        written = n;
 #endif
 
-    if (outf.isOpen())
-        outf.close();
+    // Whatever one call did not get to is written bucket by bucket
+    qint64 bucketOffset = offset;
+    for (int i = 0; i < buckets.size(); i++)
+    {
+        QByteArray *bucket = buckets.at(i);
+        int bucketno = firstBucket + i;
+        bool ok = true;
+        if (bucketOffset + bucket->size() > offset + written)
+        {
+            ok = file->seek(bucketOffset) && file->write(*bucket) == bucket->size();
+            if (!ok)
+                qWarning() << "BucketFlushThread::writeRun: could not write bucket" << file->fileName() << bucketno << file->errorString();
+        }
+        bucketOffset += bucket->size();
+        BucketPool::release(bucket);
+        if (ok)
+            emit bucketFlushed(tth, bucketno);
+        else
+            emit bucketFlushFailed(tth, bucketno);
+    }
+}
 
-    delete bucket;
-    emit bucketFlushed(tth, bucketno);
+void BucketFlushThread::closeFile(QByteArray tth)
+{
+    if (!incompleteFiles.contains(tth))
+        return;
+
+    writeBuckets(tth, incompleteFiles[tth]);
+    IncompleteFileStruct incompleteFile = incompleteFiles.take(tth);
+    incompleteFile.file->close();
+    delete incompleteFile.file;
+}
+
+void BucketFlushThread::closeIncompleteFile(QByteArray tth)
+{
+    closeFile(tth);
 }
 
 void BucketFlushThread::renameIncompleteFile(QString filename)
 {
+    // The file has to be closed before it can be renamed everywhere
+    QHashIterator<QByteArray, IncompleteFileStruct> i(incompleteFiles);
+    while (i.hasNext())
+    {
+        i.next();
+        if (i.value().fileName == filename)
+        {
+            closeFile(i.key());
+            break;
+        }
+    }
+
     QString incompleteFilename = filename + ".incomplete";
     QFile f(incompleteFilename);
     if (!f.rename(filename))
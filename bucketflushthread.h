@@ -23,14 +23,29 @@
 
 #include <QObject>
 #include <QFile>
+#include <QHash>
+#include <QMap>
 #include "protocoldef.h"
 #include <QDebug>
 
+// Longest run of adjacent buckets written with one call
+#define BUCKET_FLUSH_MAX_BATCH 16
+#define BUCKET_FLUSH_MAX_OPEN_FILES 64
+
+// An .incomplete file kept open for as long as its download runs, with the buckets waiting to be written to it
+typedef struct
+{
+    QFile *file;
+    QString fileName;
+    QMap<int, QByteArray *> pendingBuckets;
+} IncompleteFileStruct;
+
 class BucketFlushThread : public QObject
 {
     Q_OBJECT
 public:
     explicit BucketFlushThread(QObject *parent = 0);
+    ~BucketFlushThread();
 
 signals:
     void fileAssemblyComplete(QString fileName);
@@ -40,8 +55,21 @@ signals:
 public slots:
     void flushBucket(QString filename, QByteArray *bucket);
     void assembleOutputFile(QString tmpfilebase, QString outfile, int startbucket, int lastbucket);
-    void flushBucketDirect(QString filename, int bucketno, QByteArray *bucket, QByteArray tth);
+    void flushBucketDirect(QString filename, int bucketno, QByteArray *bucket, QByteArray tth, qint64 fileSize);
     void renameIncompleteFile(QString filename);
+    void closeIncompleteFile(QByteArray tth);
+
+private slots:
+    void writePendingBuckets();
+
+private:
+    QFile *openIncompleteFile(QString filename, QByteArray tth, qint64 fileSize);
+    void writeBuckets(QByteArray tth, IncompleteFileStruct &incompleteFile);
+    void writeRun(QByteArray tth, QFile *file, int firstBucket, const QList<QByteArray *> &buckets);
+    void closeFile(QByteArray tth);
+
+    QHash<QByteArray, IncompleteFileStruct> incompleteFiles;
+    bool writeScheduled;
 };
 
 #endif // BUCKETFLUSHTHREAD_H
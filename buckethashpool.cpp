@@ -0,0 +1,98 @@
+#include "buckethashpool.h"
+#include <QRunnable>
+#include <QThread>
+#include <QMutexLocker>
+
+using namespace CryptoPP;
+
+void IncrementalBucketHash::update(const char *data, int length)
+{
+    tiger.Update((const byte *)data, length);
+    hashedLength += length;
+}
+
+QByteArray IncrementalBucketHash::digest()
+{
+    QByteArray tth;
+    tth.resize(tiger.DigestSize());
+    tiger.Final((byte *)tth.data());
+    return tth;
+}
+
+class BucketHashTask : public QRunnable
+{
+public:
+    BucketHashTask(BucketHashPool *pool, QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer)
+    {
+        pPool = pool;
+        result.rootTTH = rootTTH;
+        result.bucketNumber = bucketNumber;
+        result.peer = peer;
+        this->bucket = bucket;
+    }
+
+    void run()
+    {
+        // Downloads hand us views of their mapped file, which must not be detached and copied
+        IncrementalBucketHash hash;
+        hash.update(bucket.constData(), bucket.size());
+        result.bucketTTH = hash.digest();
+        bucket.clear();
+
+        pPool->addResult(result);
+    }
+
+private:
+    BucketHashPool *pPool;
+    BucketHashResultStruct result;
+    QByteArray bucket;
+};
+
+BucketHashPool::BucketHashPool(QObject *parent) :
+    QObject(parent)
+{
+    deliveryPending = false;
+    workers.setMaxThreadCount(qMax(QThread::idealThreadCount(), 1));
+}
+
+BucketHashPool::~BucketHashPool()
+{
+    // Tasks still running report back to us
+    workers.waitForDone();
+}
+
+void BucketHashPool::hashBucket(QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer)
+{
+    workers.start(new BucketHashTask(this, rootTTH, bucketNumber, bucket, peer));
+}
+
+void BucketHashPool::addResult(const BucketHashResultStruct &result)
+{
+    QMutexLocker locker(&resultsMutex);
+    results.append(result);
+    if (deliveryPending)
+        return;
+
+    // Everything that finishes before the owner's thread gets to this goes along with it
+    deliveryPending = true;
+    QMetaObject::invokeMethod(this, "deliverResults", Qt::QueuedConnection);
+}
+
+void BucketHashPool::deliverResults()
+{
+    emit resultsReady();
+}
+
+QList<BucketHashResultStruct> BucketHashPool::takeResults()
+{
+    QMutexLocker locker(&resultsMutex);
+    QList<BucketHashResultStruct> r = results;
+    results.clear();
+    deliveryPending = false;
+    return r;
+}
+
+int BucketHashPool::getWorkerCount()
+{
+    return workers.maxThreadCount();
+}
@@ -0,0 +1,91 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUCKETHASHPOOL_H
+#define BUCKETHASHPOOL_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHostAddress>
+#include <QList>
+#include <QMutex>
+#include <QThreadPool>
+#include <cryptopp/tiger.h>
+
+// Verifies downloaded buckets against their tiger tree leaves.
+//
+// Every download's buckets used to go through the single hash bucket thread in ShareSearch, so a few fast downloads
+// queued up behind one core until congestionTest() started dropping packets. The pool hashes on as many worker
+// threads as there are cores. Buckets are handed over by implicitly shared QByteArray, the data itself is never
+// copied. Finished hashes are collected and handed back to the owner's thread in batches, so a burst of completed
+// buckets costs one event there instead of one per bucket.
+
+typedef struct
+{
+    QByteArray rootTTH;
+    int bucketNumber;
+    QByteArray bucketTTH;
+    QHostAddress peer;
+} BucketHashResultStruct;
+
+// Hash of a bucket that is being received in order, advanced as its data comes in. By the time the last packet
+// lands only the digest is left to do, and nothing has to read the megabyte back after it went cold in the cache.
+class IncrementalBucketHash
+{
+public:
+    IncrementalBucketHash() {hashedLength = 0;}
+
+    void update(const char *data, int length);
+    int getHashedLength() {return hashedLength;}
+    QByteArray digest();
+
+private:
+    CryptoPP::Tiger tiger;
+    int hashedLength;
+};
+
+class BucketHashPool : public QObject
+{
+    Q_OBJECT
+public:
+    explicit BucketHashPool(QObject *parent = 0);
+    ~BucketHashPool();
+
+    // Thread safe, hashing starts right away when a worker is free
+    void hashBucket(QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer);
+    // Results that came in since the last call, in the order they finished
+    QList<BucketHashResultStruct> takeResults();
+    int getWorkerCount();
+
+signals:
+    // Emitted on the pool's thread once per batch, takeResults() collects it
+    void resultsReady();
+
+private slots:
+    void deliverResults();
+
+private:
+    friend class BucketHashTask;
+    void addResult(const BucketHashResultStruct &result);
+
+    QThreadPool workers;
+    QMutex resultsMutex;
+    QList<BucketHashResultStruct> results;
+    bool deliveryPending;
+};
+
+#endif // BUCKETHASHPOOL_H
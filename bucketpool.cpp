@@ -0,0 +1,140 @@
+#include "bucketpool.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QVector>
+#include <QAtomicInt>
+
+namespace
+{
+
+struct BucketPoolDepot
+{
+    QMutex mutex;
+    QVector<QByteArray *> buckets;
+    BucketPoolStatistics stats;
+
+    BucketPoolDepot()
+    {
+        buckets.reserve(BUCKET_POOL_IDLE_BUCKETS);
+        stats.hits = 0;
+        stats.misses = 0;
+        stats.recycled = 0;
+        stats.discarded = 0;
+        stats.outstanding = 0;
+        stats.pooled = 0;
+    }
+
+    ~BucketPoolDepot()
+    {
+        qDeleteAll(buckets);
+    }
+};
+
+Q_GLOBAL_STATIC(BucketPoolDepot, depot)
+
+// Read on every incoming packet, so it is kept outside the mutex
+QAtomicInt outstandingBuckets(0);
+
+}
+
+QByteArray *BucketPool::acquire(int length)
+{
+    outstandingBuckets.ref();
+
+    // Pooled buckets are kept at their full size. Qt4 reallocates a QByteArray that is resized to less than half its
+    // allocation, reserve() or not, so a short bucket can not be cut from a pooled one without losing the megabyte.
+    // Short buckets only come at the end of a file and are allocated as they are.
+    QByteArray *bucket = 0;
+    BucketPoolDepot *d = depot();
+    if (d)
+    {
+        QMutexLocker locker(&d->mutex);
+        if (length == HASH_BUCKET_SIZE && !d->buckets.isEmpty())
+        {
+            bucket = d->buckets.last();
+            d->buckets.removeLast();
+            d->stats.hits++;
+        }
+        else
+            d->stats.misses++;
+    }
+
+    if (!bucket)
+    {
+        bucket = new QByteArray;
+        bucket->resize(length);
+    }
+    return bucket;
+}
+
+void BucketPool::release(QByteArray *bucket)
+{
+    if (!bucket)
+        return;
+
+    outstandingBuckets.deref();
+
+    BucketPoolDepot *d = depot();
+    // Only full size buckets are kept, and not one that is still shared with a copy somewhere else
+    if (!d || bucket->size() != HASH_BUCKET_SIZE || !bucket->isDetached())
+    {
+        delete bucket;
+        if (d)
+        {
+            QMutexLocker locker(&d->mutex);
+            d->stats.discarded++;
+        }
+        return;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    if (d->buckets.size() >= BUCKET_POOL_IDLE_BUCKETS)
+    {
+        d->stats.discarded++;
+        locker.unlock();
+        delete bucket;
+        return;
+    }
+
+    d->buckets.append(bucket);
+    d->stats.recycled++;
+}
+
+bool BucketPool::underPressure()
+{
+    return (int)outstandingBuckets > BUCKET_POOL_PRESSURE_BUCKETS;
+}
+
+bool BucketPool::exhausted()
+{
+    return (int)outstandingBuckets >= BUCKET_POOL_MAX_BUCKETS;
+}
+
+BucketPoolStatistics BucketPool::getStatistics()
+{
+    BucketPoolStatistics stats;
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.recycled = 0;
+    stats.discarded = 0;
+    stats.pooled = 0;
+
+    BucketPoolDepot *d = depot();
+    if (d)
+    {
+        QMutexLocker locker(&d->mutex);
+        stats = d->stats;
+        stats.pooled = d->buckets.size();
+    }
+    stats.outstanding = outstandingBuckets;
+    return stats;
+}
+
+QString BucketPool::getDebugStatistics()
+{
+    BucketPoolStatistics stats = getStatistics();
+    qint64 total = stats.hits + stats.misses;
+    return QString("Bucket pool: %1 hits, %2 misses (%3% hit rate), %4 recycled, %5 discarded, %6 of %7 buckets out, %8 pooled")
+            .arg(stats.hits).arg(stats.misses).arg(total ? stats.hits * 100 / total : 0)
+            .arg(stats.recycled).arg(stats.discarded).arg(stats.outstanding).arg(BUCKET_POOL_MAX_BUCKETS).arg(stats.pooled);
+}
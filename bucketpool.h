@@ -0,0 +1,69 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUCKETPOOL_H
+#define BUCKETPOOL_H
+
+#include <QByteArray>
+#include <QString>
+#include "protocoldef.h"
+
+// Recycles the 1MB buffers downloads collect hash buckets in.
+//
+// Every bucket used to be a fresh QByteArray with a megabyte reserved, deleted again by the bucket flush thread or
+// cleared when its checksum did not match, which on a fast link is a megabyte malloc and free every few milliseconds
+// and fragments the heap over a day of running. Buckets now come from a small shared free list and go back to it after
+// they are flushed or dropped.
+//
+// The pool also counts the buckets that are out, which is what downloads use to tell that memory is running short:
+// above BUCKET_POOL_PRESSURE_BUCKETS they pause their segments until the hasher and disk catch up, and at
+// BUCKET_POOL_MAX_BUCKETS they drop packets that would start a new bucket as a last resort.
+//
+// Thread safe, all static.
+
+#define BUCKET_POOL_IDLE_BUCKETS 16
+#define BUCKET_POOL_MAX_BUCKETS 256
+#define BUCKET_POOL_PRESSURE_BUCKETS (BUCKET_POOL_MAX_BUCKETS * 3 / 4)
+
+typedef struct
+{
+    qint64 hits;        // acquire() served from the free list, without allocating
+    qint64 misses;      // acquire() had to allocate, the free list was empty or the bucket short
+    qint64 recycled;    // release() put the bucket back
+    qint64 discarded;   // release() freed the bucket, it was shared, too small or the free list was full
+    int outstanding;    // buckets handed out and not released
+    int pooled;         // buckets sitting in the free list
+} BucketPoolStatistics;
+
+class BucketPool
+{
+public:
+    // Returns a bucket of length bytes, which is left as it is: it is never shrunk or grown by the pool. Buckets of
+    // HASH_BUCKET_SIZE come from the free list, shorter ones are allocated. Hand it back with release().
+    static QByteArray *acquire(int length);
+    static void release(QByteArray *bucket);
+
+    // So many buckets are out that downloads should wait for them to be flushed
+    static bool underPressure();
+    // No more buckets should be filled at all
+    static bool exhausted();
+
+    static BucketPoolStatistics getStatistics();
+    static QString getDebugStatistics();
+};
+
+#endif // BUCKETPOOL_H
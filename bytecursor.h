@@ -0,0 +1,242 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BYTECURSOR_H
+#define BYTECURSOR_H
+
+#include <QByteArray>
+#include <QString>
+#include <QtEndian>
+#include <string.h>
+
+// Cursor based packet parsing and assembly.
+// The getQuint*FromByteArray() family in util.h pops bytes off the front of a QByteArray, which memmoves the remainder
+// of the packet on every field. ByteReader and ByteWriter just walk a pointer over a buffer owned by somebody else,
+// so a packet is parsed or built without a single allocation or copy.
+// All multibyte values are big endian on the wire, the same as quint32ToByteArray() and friends.
+//
+// Reading or writing past the end of the buffer does not crash: the cursor is parked at the end, the call returns 0
+// and ok() turns false. Parse a whole header, then check ok() once.
+
+class ByteReader
+{
+public:
+    ByteReader(const char *data, int length)
+    {
+        begin = data;
+        ptr = data;
+        end = data + (length > 0 ? length : 0);
+        valid = true;
+    }
+
+    explicit ByteReader(const QByteArray &data)
+    {
+        begin = data.constData();
+        ptr = begin;
+        end = begin + data.size();
+        valid = true;
+    }
+
+    bool ok() const {return valid;}
+    bool atEnd() const {return ptr >= end;}
+    int remaining() const {return end - ptr;}
+    int position() const {return ptr - begin;}
+    const char *current() const {return ptr;}
+
+    bool skip(int n)
+    {
+        if (!require(n))
+            return false;
+        ptr += n;
+        return true;
+    }
+
+    quint8 readUInt8()
+    {
+        if (!require(1))
+            return 0;
+        return (quint8)*ptr++;
+    }
+
+    quint16 readUInt16()
+    {
+        if (!require(2))
+            return 0;
+        quint16 num = qFromBigEndian<quint16>((const uchar *)ptr);
+        ptr += 2;
+        return num;
+    }
+
+    qint16 readInt16() {return (qint16)readUInt16();}
+
+    quint32 readUInt32()
+    {
+        if (!require(4))
+            return 0;
+        quint32 num = qFromBigEndian<quint32>((const uchar *)ptr);
+        ptr += 4;
+        return num;
+    }
+
+    quint64 readUInt64()
+    {
+        if (!require(8))
+            return 0;
+        quint64 num = qFromBigEndian<quint64>((const uchar *)ptr);
+        ptr += 8;
+        return num;
+    }
+
+    qint64 readInt64() {return (qint64)readUInt64();}
+
+    // Returns a pointer into the underlying buffer, valid for as long as the buffer is. 0 if n bytes are not available.
+    const char *readBytes(int n)
+    {
+        if (!require(n))
+            return 0;
+        const char *p = ptr;
+        ptr += n;
+        return p;
+    }
+
+    // Deep copy of the next n bytes, for fields that must outlive the packet (hashes, CIDs, queued signal arguments).
+    QByteArray readByteArray(int n)
+    {
+        const char *p = readBytes(n);
+        return p ? QByteArray(p, n) : QByteArray();
+    }
+
+    // Deep copy of everything that is left.
+    QByteArray readRemaining()
+    {
+        return readByteArray(remaining());
+    }
+
+    // quint16 length prefixed string, as written by stringToByteArray()
+    QString readString()
+    {
+        int n = readUInt16();
+        const char *p = readBytes(n);
+        if (!p)
+            return QString();
+        // QString(const char *) stopped at the first null, keep doing the same.
+        const char *nul = (const char *)memchr(p, 0, n);
+        return QString::fromAscii(p, nul ? nul - p : n);
+    }
+
+private:
+    bool require(int n)
+    {
+        if (valid && n >= 0 && end - ptr >= n)
+            return true;
+        valid = false;
+        ptr = end;
+        return false;
+    }
+
+    const char *begin;
+    const char *ptr;
+    const char *end;
+    bool valid;
+};
+
+class ByteWriter
+{
+public:
+    ByteWriter(char *data, int capacity)
+    {
+        begin = data;
+        ptr = data;
+        end = data + (capacity > 0 ? capacity : 0);
+        valid = true;
+    }
+
+    bool ok() const {return valid;}
+    int remaining() const {return end - ptr;}
+    int position() const {return ptr - begin;}
+    char *current() const {return ptr;}
+
+    void writeUInt8(quint8 num)
+    {
+        if (require(1))
+            *ptr++ = (char)num;
+    }
+
+    void writeUInt16(quint16 num)
+    {
+        if (!require(2))
+            return;
+        qToBigEndian<quint16>(num, (uchar *)ptr);
+        ptr += 2;
+    }
+
+    void writeUInt32(quint32 num)
+    {
+        if (!require(4))
+            return;
+        qToBigEndian<quint32>(num, (uchar *)ptr);
+        ptr += 4;
+    }
+
+    void writeUInt64(quint64 num)
+    {
+        if (!require(8))
+            return;
+        qToBigEndian<quint64>(num, (uchar *)ptr);
+        ptr += 8;
+    }
+
+    void writeBytes(const char *data, int n)
+    {
+        if (!require(n))
+            return;
+        memcpy(ptr, data, n);
+        ptr += n;
+    }
+
+    void writeBytes(const QByteArray &data)
+    {
+        writeBytes(data.constData(), data.size());
+    }
+
+    // Writes data left justified into a fixed width field, padding or truncating like QByteArray::leftJustified()
+    void writeFixedBytes(const QByteArray &data, int width, char fill = 0x00)
+    {
+        if (!require(width))
+            return;
+        int n = data.size() < width ? data.size() : width;
+        memcpy(ptr, data.constData(), n);
+        memset(ptr + n, fill, width - n);
+        ptr += width;
+    }
+
+private:
+    bool require(int n)
+    {
+        if (valid && n >= 0 && end - ptr >= n)
+            return true;
+        valid = false;
+        return false;
+    }
+
+    char *begin;
+    char *ptr;
+    char *end;
+    bool valid;
+};
+
+#endif // BYTECURSOR_H
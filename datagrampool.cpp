@@ -0,0 +1,271 @@
+#include "datagrampool.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThreadStorage>
+#include <QVector>
+#include <QList>
+
+namespace
+{
+
+struct DatagramPoolCache;
+
+struct DatagramPoolDepot
+{
+    QMutex mutex;
+    QVector<QByteArray *> buffers[DATAGRAM_POOL_SIZE_CLASSES];
+    QList<DatagramPoolCache *> caches;
+    // counters of threads that have already exited
+    DatagramPoolStatistics retired;
+
+    DatagramPoolDepot()
+    {
+        retired.hits = 0;
+        retired.misses = 0;
+        retired.bypassed = 0;
+        retired.recycled = 0;
+        retired.discarded = 0;
+        retired.pooled = 0;
+    }
+
+    ~DatagramPoolDepot()
+    {
+        for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+            qDeleteAll(buffers[i]);
+    }
+};
+
+Q_GLOBAL_STATIC(DatagramPoolDepot, depot)
+
+struct DatagramPoolCache
+{
+    QVector<QByteArray *> buffers[DATAGRAM_POOL_SIZE_CLASSES];
+    qint64 hits;
+    qint64 misses;
+    qint64 bypassed;
+    qint64 recycled;
+    qint64 discarded;
+
+    DatagramPoolCache()
+    {
+        for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+            buffers[i].reserve(DATAGRAM_POOL_THREAD_CACHE_SIZE + 1);
+        hits = 0;
+        misses = 0;
+        bypassed = 0;
+        recycled = 0;
+        discarded = 0;
+        DatagramPoolDepot *d = depot();
+        if (d)
+        {
+            QMutexLocker locker(&d->mutex);
+            d->caches.append(this);
+        }
+    }
+
+    // Thread is exiting, hand the free lists to the depot and keep the counters.
+    ~DatagramPoolCache()
+    {
+        DatagramPoolDepot *d = depot();
+        if (!d)
+        {
+            for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+                qDeleteAll(buffers[i]);
+            return;
+        }
+        QMutexLocker locker(&d->mutex);
+        d->caches.removeOne(this);
+        d->retired.hits += hits;
+        d->retired.misses += misses;
+        d->retired.bypassed += bypassed;
+        d->retired.recycled += recycled;
+        d->retired.discarded += discarded;
+        for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+        {
+            while (!buffers[i].isEmpty())
+            {
+                if (d->buffers[i].size() < DATAGRAM_POOL_DEPOT_SIZE)
+                    d->buffers[i].append(buffers[i].last());
+                else
+                    delete buffers[i].last();
+                buffers[i].removeLast();
+            }
+        }
+    }
+};
+
+QThreadStorage<DatagramPoolCache *> threadCache;
+
+inline DatagramPoolCache *localCache()
+{
+    if (!threadCache.hasLocalData())
+        threadCache.setLocalData(new DatagramPoolCache);
+    return threadCache.localData();
+}
+
+inline int classCapacity(int sizeClass)
+{
+    return DATAGRAM_POOL_BUFFER_CAPACITY << sizeClass;
+}
+
+// Smallest class that holds length, or -1 if length is too short or too long to be pooled.
+// QByteArray::resize() only reallocates down below half the allocation, so half the capacity is the floor.
+inline int sizeClassForLength(int length)
+{
+    for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+    {
+        if (length <= classCapacity(i))
+            return length >= (classCapacity(i) >> 1) ? i : -1;
+    }
+    return -1;
+}
+
+// Pooled buffers keep exactly the capacity they were reserved with, anything else never came from the pool.
+inline int sizeClassForCapacity(int capacity)
+{
+    for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+    {
+        if (capacity == classCapacity(i))
+            return i;
+    }
+    return -1;
+}
+
+}
+
+QByteArray *DatagramPool::acquire(int length)
+{
+    DatagramPoolCache *cache = localCache();
+
+    int sizeClass = sizeClassForLength(length);
+    if (sizeClass < 0)
+    {
+        // Allocated to the exact length, release() will see it does not fit a class and free it
+        QByteArray *datagram = new QByteArray;
+        datagram->resize(length);
+        cache->bypassed++;
+        return datagram;
+    }
+
+    QVector<QByteArray *> &buffers = cache->buffers[sizeClass];
+    if (buffers.isEmpty())
+    {
+        DatagramPoolDepot *d = depot();
+        if (d)
+        {
+            QMutexLocker locker(&d->mutex);
+            int n = qMin(DATAGRAM_POOL_BATCH_SIZE, d->buffers[sizeClass].size());
+            for (int i = 0; i < n; i++)
+            {
+                buffers.append(d->buffers[sizeClass].last());
+                d->buffers[sizeClass].removeLast();
+            }
+        }
+    }
+
+    QByteArray *datagram;
+    if (!buffers.isEmpty())
+    {
+        datagram = buffers.last();
+        buffers.removeLast();
+        cache->hits++;
+    }
+    else
+    {
+        // reserve() on an empty array allocates exactly the class capacity
+        datagram = new QByteArray;
+        datagram->reserve(classCapacity(sizeClass));
+        cache->misses++;
+    }
+
+    // length is between half and all of the capacity, so resize() neither grows nor shrinks the allocation.
+    datagram->resize(length);
+    return datagram;
+}
+
+void DatagramPool::release(QByteArray *datagram)
+{
+    if (!datagram)
+        return;
+
+    DatagramPoolCache *cache = localCache();
+
+    // QByteArray::resize(0) drops the allocation and appending past the capacity grows it,
+    // either way the capacity no longer matches a class and the buffer is not ours to keep.
+    int sizeClass = sizeClassForCapacity(datagram->capacity());
+    if (sizeClass < 0)
+    {
+        delete datagram;
+        return;
+    }
+
+    // Somebody else still references it
+    if (!datagram->isDetached())
+    {
+        delete datagram;
+        cache->discarded++;
+        return;
+    }
+
+    QVector<QByteArray *> &buffers = cache->buffers[sizeClass];
+    buffers.append(datagram);
+    cache->recycled++;
+
+    if (buffers.size() > DATAGRAM_POOL_THREAD_CACHE_SIZE)
+    {
+        DatagramPoolDepot *d = depot();
+        if (!d)
+            return;
+        QMutexLocker locker(&d->mutex);
+        for (int i = 0; i < DATAGRAM_POOL_BATCH_SIZE; i++)
+        {
+            if (d->buffers[sizeClass].size() < DATAGRAM_POOL_DEPOT_SIZE)
+                d->buffers[sizeClass].append(buffers.last());
+            else
+                delete buffers.last();
+            buffers.removeLast();
+        }
+    }
+}
+
+// The per thread counters are read without their owners' cooperation, good enough for statistics.
+DatagramPoolStatistics DatagramPool::getStatistics()
+{
+    DatagramPoolStatistics stats;
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.bypassed = 0;
+    stats.recycled = 0;
+    stats.discarded = 0;
+    stats.pooled = 0;
+
+    DatagramPoolDepot *d = depot();
+    if (!d)
+        return stats;
+
+    QMutexLocker locker(&d->mutex);
+    stats = d->retired;
+    stats.pooled = 0;
+    for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+        stats.pooled += d->buffers[i].size();
+    foreach (DatagramPoolCache *cache, d->caches)
+    {
+        stats.hits += cache->hits;
+        stats.misses += cache->misses;
+        stats.bypassed += cache->bypassed;
+        stats.recycled += cache->recycled;
+        stats.discarded += cache->discarded;
+        for (int i = 0; i < DATAGRAM_POOL_SIZE_CLASSES; i++)
+            stats.pooled += cache->buffers[i].size();
+    }
+    return stats;
+}
+
+QString DatagramPool::getDebugStatistics()
+{
+    DatagramPoolStatistics stats = getStatistics();
+    qint64 total = stats.hits + stats.misses;
+    return QString("Datagram pool: %1 hits, %2 misses (%3% hit rate), %4 bypassed, %5 recycled, %6 discarded, %7 buffers pooled")
+            .arg(stats.hits).arg(stats.misses).arg(total ? stats.hits * 100 / total : 0)
+            .arg(stats.bypassed).arg(stats.recycled).arg(stats.discarded).arg(stats.pooled);
+}
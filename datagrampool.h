@@ -0,0 +1,68 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DATAGRAMPOOL_H
+#define DATAGRAMPOOL_H
+
+#include <QByteArray>
+#include <QString>
+#include "protocoldef.h"
+
+// Recycles MTU sized datagram buffers so that the send and receive paths stop hammering the global allocator.
+//
+// Buffers are plain QByteArrays, so they keep their implicit sharing reference count and can still be handed around
+// by pointer or value like before. release() only takes a buffer back if nobody else holds a reference to it; a buffer
+// that escaped to another thread by value is simply freed by its last owner.
+//
+// Qt4's QByteArray::resize() reallocates a buffer down as soon as the new size drops below half its allocation. Pooled
+// buffers therefore come in size classes of exactly DATAGRAM_POOL_BUFFER_CAPACITY << n bytes, and a class only serves
+// lengths of at least half its capacity, which it can hold without reallocating either way. Shorter control packets
+// bypass the pool and get a buffer of their own length, as they did before there was a pool.
+//
+// Every thread gets its own small free list per class, so the common case takes no lock. Free lists spill to and
+// refill from a shared depot in batches, which takes care of buffers that are acquired in the transfer thread and
+// released in the dispatcher thread.
+
+#define DATAGRAM_POOL_BUFFER_CAPACITY PACKET_MTU
+// PACKET_MTU up to 8 * PACKET_MTU, which still covers the jumbo sized datagrams of path MTU discovery
+#define DATAGRAM_POOL_SIZE_CLASSES 4
+#define DATAGRAM_POOL_THREAD_CACHE_SIZE 256
+#define DATAGRAM_POOL_DEPOT_SIZE 4096
+#define DATAGRAM_POOL_BATCH_SIZE 64
+
+typedef struct
+{
+    qint64 hits;        // acquire() served from a free list
+    qint64 misses;      // acquire() had to allocate a buffer for a size class
+    qint64 bypassed;    // acquire() allocated a short or oversized buffer that is never pooled
+    qint64 recycled;    // release() put the buffer back
+    qint64 discarded;   // release() freed a pooled size buffer somebody else still referenced
+    int pooled;         // buffers sitting in free lists right now
+} DatagramPoolStatistics;
+
+class DatagramPool
+{
+public:
+    // Returns a buffer resized to length. Ownership passes to the caller, hand it back with release() or delete it.
+    static QByteArray *acquire(int length);
+    static void release(QByteArray *datagram);
+
+    static DatagramPoolStatistics getStatistics();
+    static QString getDebugStatistics();
+};
+
+#endif // DATAGRAMPOOL_H
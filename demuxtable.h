@@ -0,0 +1,214 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEMUXTABLE_H
+#define DEMUXTABLE_H
+
+#include <QtGlobal>
+#include <string.h>
+
+class Transfer;
+class TransferSegment;
+
+// Fixed size lookup tables used by TransferManager to route data packets without touching the heap.
+// Both use open addressing with linear probing and backward shift deletion, so there are no tombstones
+// and a lookup stops at the first empty slot. Sizes must be powers of two.
+// When a table is full, insert() returns false and the caller keeps the entry in its ordinary QHash.
+
+#define SEGMENT_DEMUX_TABLE_SIZE 4096
+#define TTH_DEMUX_TABLE_SIZE 256
+#define TTH_DEMUX_KEY_LENGTH 24
+
+// segmentId -> TransferSegment*
+// Our own segment ids are handed out sequentially, so masking the id is enough to spread them out.
+class SegmentDemuxTable
+{
+public:
+    SegmentDemuxTable()
+    {
+        memset(table, 0, sizeof(table));
+        count = 0;
+    }
+
+    TransferSegment *value(quint32 segmentId) const
+    {
+        int i = segmentId & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+        while (table[i].segment)
+        {
+            if (table[i].segmentId == segmentId)
+                return table[i].segment;
+            i = (i + 1) & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+        }
+        return 0;
+    }
+
+    bool insert(quint32 segmentId, TransferSegment *segment)
+    {
+        if (!segment)
+            return false;
+        int i = segmentId & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+        while (table[i].segment)
+        {
+            if (table[i].segmentId == segmentId)
+            {
+                table[i].segment = segment;
+                return true;
+            }
+            i = (i + 1) & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+        }
+        // keep one slot open so that lookups always terminate
+        if (count >= SEGMENT_DEMUX_TABLE_SIZE - 1)
+            return false;
+        table[i].segmentId = segmentId;
+        table[i].segment = segment;
+        count++;
+        return true;
+    }
+
+    bool remove(quint32 segmentId)
+    {
+        int i = segmentId & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+        while (table[i].segment)
+        {
+            if (table[i].segmentId == segmentId)
+            {
+                // shift the rest of the cluster back so that no entry ends up behind an empty slot
+                int j = i;
+                while (true)
+                {
+                    j = (j + 1) & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+                    if (!table[j].segment)
+                        break;
+                    int home = table[j].segmentId & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+                    if (((j - home) & (SEGMENT_DEMUX_TABLE_SIZE - 1)) >= ((j - i) & (SEGMENT_DEMUX_TABLE_SIZE - 1)))
+                    {
+                        table[i] = table[j];
+                        i = j;
+                    }
+                }
+                table[i].segment = 0;
+                count--;
+                return true;
+            }
+            i = (i + 1) & (SEGMENT_DEMUX_TABLE_SIZE - 1);
+        }
+        return false;
+    }
+
+private:
+    struct Slot
+    {
+        quint32 segmentId;
+        TransferSegment *segment;
+    };
+    Slot table[SEGMENT_DEMUX_TABLE_SIZE];
+    int count;
+};
+
+// TTH root -> download Transfer*
+// Keys are compared straight out of the packet, a TTH is already a good hash so its first bytes index the table.
+class TTHDemuxTable
+{
+public:
+    TTHDemuxTable()
+    {
+        memset(table, 0, sizeof(table));
+        count = 0;
+    }
+
+    Transfer *value(const char *tth) const
+    {
+        int i = home(tth);
+        while (table[i].transfer)
+        {
+            if (memcmp(table[i].tth, tth, TTH_DEMUX_KEY_LENGTH) == 0)
+                return table[i].transfer;
+            i = (i + 1) & (TTH_DEMUX_TABLE_SIZE - 1);
+        }
+        return 0;
+    }
+
+    bool insert(const char *tth, Transfer *transfer)
+    {
+        if (!transfer)
+            return false;
+        int i = home(tth);
+        while (table[i].transfer)
+        {
+            if (memcmp(table[i].tth, tth, TTH_DEMUX_KEY_LENGTH) == 0)
+            {
+                table[i].transfer = transfer;
+                return true;
+            }
+            i = (i + 1) & (TTH_DEMUX_TABLE_SIZE - 1);
+        }
+        if (count >= TTH_DEMUX_TABLE_SIZE - 1)
+            return false;
+        memcpy(table[i].tth, tth, TTH_DEMUX_KEY_LENGTH);
+        table[i].transfer = transfer;
+        count++;
+        return true;
+    }
+
+    // Only removes the entry if it still points to transfer.
+    bool remove(const char *tth, Transfer *transfer)
+    {
+        int i = home(tth);
+        while (table[i].transfer)
+        {
+            if (memcmp(table[i].tth, tth, TTH_DEMUX_KEY_LENGTH) == 0)
+            {
+                if (table[i].transfer != transfer)
+                    return false;
+                int j = i;
+                while (true)
+                {
+                    j = (j + 1) & (TTH_DEMUX_TABLE_SIZE - 1);
+                    if (!table[j].transfer)
+                        break;
+                    int h = home(table[j].tth);
+                    if (((j - h) & (TTH_DEMUX_TABLE_SIZE - 1)) >= ((j - i) & (TTH_DEMUX_TABLE_SIZE - 1)))
+                    {
+                        table[i] = table[j];
+                        i = j;
+                    }
+                }
+                table[i].transfer = 0;
+                count--;
+                return true;
+            }
+            i = (i + 1) & (TTH_DEMUX_TABLE_SIZE - 1);
+        }
+        return false;
+    }
+
+private:
+    static int home(const char *tth)
+    {
+        return (((quint8)tth[0] << 8) | (quint8)tth[1]) & (TTH_DEMUX_TABLE_SIZE - 1);
+    }
+
+    struct Slot
+    {
+        char tth[TTH_DEMUX_KEY_LENGTH];
+        Transfer *transfer;
+    };
+    Slot table[TTH_DEMUX_TABLE_SIZE];
+    int count;
+};
+
+#endif // DEMUXTABLE_H
@@ -1,4 +1,7 @@
 #include "dispatcher.h"
+#include "datagrampool.h"
+#include "transfer.h"
+#include "uploadscheduler.h"
 
 #ifdef Q_WS_WIN //If windows
 #include <winsock2.h>
@@ -6,6 +9,10 @@
 #else //If Q_OS_LINUX
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
 #endif
 
 Dispatcher::Dispatcher(QHostAddress ip, quint16 port, QObject *parent) :
@@ -18,6 +25,8 @@ Dispatcher::Dispatcher(QHostAddress ip, quint16 port, QObject *parent) :
     bcastAddress = QHostAddress("255.255.255.255");
     protocolCapabilityBitmask = 0;
     maximumSendBufferSize = 0;
+    sendQueueDrainScheduled = false;
+    senderWriteNotifier = 0;
 
     // Init P2P dispatch socket
     receiverUdpSocket = new QUdpSocket(this);
@@ -37,6 +46,9 @@ Dispatcher::Dispatcher(QHostAddress ip, quint16 port, QObject *parent) :
     }
 
     senderUdpSocket = new QUdpSocket(this);
+    // Bound up front so that the descriptor exists for the send buffer size and the scatter gather sends
+    senderUdpSocket->bind(QHostAddress::Any, 0);
+    setSendBufferSize();
 
     // Bootstrapping
     networkBootstrap = new NetworkBootstrap(this);
@@ -72,6 +84,15 @@ Dispatcher::Dispatcher(QHostAddress ip, quint16 port, QObject *parent) :
     connect(rejoinMulticastTimer, SIGNAL(timeout()), this, SLOT(rejoinMulticastTimeout()));
     rejoinMulticastTimer->start();
 
+    // Path MTU discovery
+    pathMTUDiscovery = new PathMTUDiscovery(dispatchPort, this);
+
+    // Upload shaping
+    trafficShaper = new TrafficShaper(this);
+    trafficShaperTimer = new QTimer(this);
+    trafficShaperTimer->setSingleShot(true);
+    connect(trafficShaperTimer, SIGNAL(timeout()), this, SLOT(drainSendQueues()));
+
     tthSearchId = qrand();
     if (tthSearchId == 0)
         tthSearchId++;
@@ -87,6 +108,8 @@ Dispatcher::~Dispatcher()
     networkTopology->deleteLater();
     senderUdpSocket->deleteLater();
     receiverUdpSocket->deleteLater();
+    while (!blockedSendQueue.isEmpty())
+        releaseMappedDatagram(blockedSendQueue.dequeue().second);
 }
 
 void Dispatcher::reconfigureDispatchHostPort(QHostAddress ip, quint16 port)
@@ -113,6 +136,7 @@ void Dispatcher::reconfigureDispatchHostPort(QHostAddress ip, quint16 port)
     receiverUdpSocket->setSocketOption(QAbstractSocket::MulticastTtlOption, 16);
     receiverUdpSocket->setSocketOption(QAbstractSocket::MulticastLoopbackOption, false);
 #endif
+    pathMTUDiscovery->setDispatchPort(dispatchPort);
 }
 
 // ------------------=====================   Initial receive and dispatching   =====================----------------------
@@ -121,10 +145,19 @@ void Dispatcher::receiveP2PData()
 {
     while (receiverUdpSocket->hasPendingDatagrams())
     {
-        QByteArray datagram;
         QHostAddress senderHost;
         quint16 senderPort; // ignoreer
-        datagram.resize(receiverUdpSocket->pendingDatagramSize());
+        qint64 size = receiverUdpSocket->pendingDatagramSize();
+        if (size < 2)
+        {
+            receiverUdpSocket->readDatagram(0, 0);
+            emit invalidPacketReceived();
+            continue;
+        }
+        // Data packets hand the buffer over to the transfer thread, which gives it back to the pool.
+        // Everything else is done with it by the end of this iteration.
+        QByteArray *pooledDatagram = DatagramPool::acquire(size);
+        QByteArray &datagram = *pooledDatagram;
         receiverUdpSocket->readDatagram(datagram.data(), datagram.size(), &senderHost, &senderPort);
         //receiverUdpSocket->readDatagram(datagram.data(), datagram.size(), &senderHost, &senderPort);
         //QByteArray datagramType(datagram.left(1));
@@ -136,12 +169,12 @@ void Dispatcher::receiveP2PData()
         switch(quint8DatagramType)
         {
         case DirectDataPacket:
-            dispatchDirectDataPacket(datagram);
-            break;
+            dispatchDirectDataPacket(pooledDatagram);
+            continue;
 
         case DataPacket:
-            emit incomingDataPacket(quint8ProtocolInstruction, senderHost, datagram);
-            break;
+            emit incomingDataPacket(quint8ProtocolInstruction, senderHost, pooledDatagram);
+            continue;
 
         case MulticastPacket:
             handleProtocolInstruction(quint8DatagramType, quint8ProtocolInstruction, datagram, senderHost);
@@ -161,6 +194,7 @@ void Dispatcher::receiveP2PData()
         default:
             emit invalidPacketReceived();
         }
+        DatagramPool::release(pooledDatagram);
     }
 }
 
@@ -189,7 +223,8 @@ void Dispatcher::handleProtocolInstruction(quint8 &quint8DatagramType, quint8 &q
         break;
 
     case BucketExchangePacket:
-        emit bucketContentsArrived(datagram.mid(2), senderHost);
+        datagram.remove(0, 2);
+        emit bucketContentsArrived(datagram, senderHost);
         break;
 
     case RequestBucketPacket:
@@ -231,6 +266,10 @@ void Dispatcher::handleProtocolInstruction(quint8 &quint8DatagramType, quint8 &q
         handleIncomingUploadRequest(senderHost, datagram);
         break;
 
+    case SelectiveDownloadRequestPacket:
+        handleIncomingSelectiveUploadRequest(senderHost, datagram);
+        break;
+
     case SearchForwardRequestPacket:
         handleReceivedSearchForwardRequest(senderHost, datagram);
         break;
@@ -251,6 +290,14 @@ void Dispatcher::handleProtocolInstruction(quint8 &quint8DatagramType, quint8 &q
         handleReceivedProtocolCapabilityResponse(senderHost, datagram);
         break;
 
+    case PathMTUProbePacket:
+        handleReceivedPathMTUProbe(senderHost, datagram);
+        break;
+
+    case PathMTUProbeReplyPacket:
+        handleReceivedPathMTUProbeReply(senderHost, datagram);
+        break;
+
     case CIDPingPacket:
         handleCIDPingReply(datagram, senderHost);
         break;
@@ -272,11 +319,12 @@ void Dispatcher::handleProtocolInstruction(quint8 &quint8DatagramType, quint8 &q
         break;
 
     case TTHTreeReplyPacket:
-        handleReceivedTTHTree(datagram);
+        handleReceivedTTHTree(senderHost, datagram);
         break;
 
     // NAT traversal
     case RevConnectPacket:
+        handleReceivedRevConnect(senderHost, datagram);
         break;
 
     case RevConnectReplyPacket:
@@ -288,14 +336,20 @@ void Dispatcher::handleProtocolInstruction(quint8 &quint8DatagramType, quint8 &q
     }
 }
 
-void Dispatcher::dispatchDirectDataPacket(QByteArray datagram)
+void Dispatcher::dispatchDirectDataPacket(QByteArray *datagram)
 {
-    datagram.remove(0, 2);
-    quint64 offset = getQuint64FromByteArray(&datagram);
-    if (offset > LLONG_MAX)
+    ByteReader reader(*datagram);
+    reader.skip(2);
+    quint64 offset = reader.readUInt64();
+    quint32 segmentId = reader.readUInt32();
+    if (!reader.ok() || offset > LLONG_MAX)
+    {
+        DatagramPool::release(datagram);
         return;
-    quint32 segmentId = getQuint32FromByteArray(&datagram);
-    //qDebug() << "Dispatcher::dispatchDirectDataPacket()" << segmentId, offset, datagram.length();
+    }
+    // The datagram is not shared, so chopping the header off is a single memmove without reallocating.
+    datagram->remove(0, reader.position());
+    //qDebug() << "Dispatcher::dispatchDirectDataPacket()" << segmentId, offset, datagram->length();
     emit incomingDirectDataPacket(segmentId, (qint64)offset, datagram);
 }
 
@@ -326,13 +380,14 @@ void Dispatcher::sendBroadcastAnnounce()
 void Dispatcher::sendUnicastAnnounce(QHostAddress dst)
 {
     // Unicast announces should be treated as forwarded, so that they do not confuse other bucket IDs elsewhere
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(54);
-    datagram->append(UnicastPacket);
-    datagram->append(AnnounceForwardedPacket);
-    datagram->append(quint32ToByteArray(dispatchIP.toIPv4Address()));
-    datagram->append(CID);
-    datagram->append(networkTopology->getOwnBucketId());
+    QByteArray bucketId = networkTopology->getOwnBucketId();
+    QByteArray *datagram = DatagramPool::acquire(6 + CID.length() + bucketId.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(AnnounceForwardedPacket);
+    writer.writeUInt32(dispatchIP.toIPv4Address());
+    writer.writeBytes(CID);
+    writer.writeBytes(bucketId);
     sendUnicastRawDatagram(dst, datagram);
 }
 
@@ -373,32 +428,35 @@ void Dispatcher::sendUnicastAnnounceReply(QHostAddress &dstHost)
 
     announceForwardToHostTimestamps[dstHost] = currentTime;
     
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(50);
-    datagram->append(UnicastPacket);
-    datagram->append(AnnounceReplyPacket);
-    datagram->append(CID);
-    datagram->append(networkTopology->getOwnBucketId());
+    QByteArray bucketId = networkTopology->getOwnBucketId();
+    QByteArray *datagram = DatagramPool::acquire(2 + CID.length() + bucketId.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(AnnounceReplyPacket);
+    writer.writeBytes(CID);
+    writer.writeBytes(bucketId);
     sendUnicastRawDatagram(dstHost, datagram);
 }
 
 void Dispatcher::sendUnicastAnnounceForwardRequest(QHostAddress toAddr)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(54);
-    datagram->append(UnicastPacket);
-    datagram->append(AnnounceForwardRequestPacket);
-    datagram->append(toQByteArray(dispatchIP.toIPv4Address()));
-    datagram->append(CID);
-    datagram->append(networkTopology->getOwnBucketId());
+    QByteArray bucketId = networkTopology->getOwnBucketId();
+    QByteArray *datagram = DatagramPool::acquire(6 + CID.length() + bucketId.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(AnnounceForwardRequestPacket);
+    writer.writeUInt32(dispatchIP.toIPv4Address());
+    writer.writeBytes(CID);
+    writer.writeBytes(bucketId);
     sendUnicastRawDatagram(toAddr, datagram);
 }
 
 void Dispatcher::handleReceivedAnnounceForwardRequest(QHostAddress &fromHost, QByteArray &datagram)
 {
-    QByteArray tmp = datagram.mid(2, 4);
-    QHostAddress allegedFromHost = QHostAddress(getQuint32FromByteArray(&tmp));
-    if (fromHost != allegedFromHost)
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QHostAddress allegedFromHost = QHostAddress(reader.readUInt32());
+    if (!reader.ok() || fromHost != allegedFromHost)
         return;
 
     QByteArray sendData;
@@ -408,21 +466,24 @@ void Dispatcher::handleReceivedAnnounceForwardRequest(QHostAddress &fromHost, QB
     case NETWORK_MCAST:
         sendData.append(MulticastPacket);
         sendData.append(AnnounceForwardedPacket);
-        sendData.append(datagram.mid(2));
+        sendData.append(datagram.constData() + 2, datagram.length() - 2);
         sendMulticastRawDatagram(sendData);
         break;
     case NETWORK_BCAST:
         sendData.append(BroadcastPacket);
         sendData.append(AnnounceForwardedPacket);
-        sendData.append(datagram.mid(2));
+        sendData.append(datagram.constData() + 2, datagram.length() - 2);
         sendBroadcastRawDatagram(sendData);
     }
 }
 
 void Dispatcher::handleReceivedForwardedAnnounce(QByteArray &datagram)
 {
-    QByteArray tmp = datagram.mid(2, 4);
-    QHostAddress announcingHost(getQuint32FromByteArray(&tmp));
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QHostAddress announcingHost(reader.readUInt32());
+    if (!reader.ok())
+        return;
     datagram.remove(2, 4);
     handleReceivedAnnounce(UnicastPacket, announcingHost, datagram);
 }
@@ -431,8 +492,10 @@ void Dispatcher::handleReceivedAnnounce(quint8 datagramType, QHostAddress &sende
 {
     if (datagram.length() == 50)
     {
-        QByteArray cid = datagram.mid(2, 24);
-        QByteArray bucket = datagram.mid(26);
+        ByteReader reader(datagram);
+        reader.skip(2);
+        QByteArray cid = reader.readByteArray(24);
+        QByteArray bucket = reader.readRemaining();
 
         switch(datagramType)
         {
@@ -483,11 +546,17 @@ bool Dispatcher::initiateSearch(quint64 searchId, QByteArray searchData)
 void Dispatcher::sendSearchResult(QHostAddress toHost, QByteArray senderCID, quint64 searchID, QByteArray searchResult)
 {
     // TODO: we can lose senderCID in the function call since it is our own CID we are sending here.
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(300);
-    datagram->append(UnicastPacket);
-    datagram->append(SearchResultPacket);
-    datagram->append(assembleSearchPacket(dispatchIP, searchID, searchResult, false));  // TODO: add bucket on first result per host
+    QByteArray *datagram = DatagramPool::acquire(2 + 38 + searchResult.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(SearchResultPacket);
+    // same layout as assembleSearchPacket(dispatchIP, searchID, searchResult, false), written straight into the datagram
+    // TODO: add bucket on first result per host
+    writer.writeUInt32(dispatchIP.toIPv4Address());
+    writer.writeUInt64(searchID);
+    writer.writeFixedBytes(CID, 24);
+    writer.writeUInt16((quint16)searchResult.length());
+    writer.writeBytes(searchResult);
     sendUnicastRawDatagram(toHost, datagram);
 }
 
@@ -512,17 +581,19 @@ void Dispatcher::parseArrivedSearchResult(QByteArray &datagram, QHostAddress sen
         emit invalidPacketReceived();
         return;
     }
-    datagram.remove(0, 2);
-    QHostAddress allegedSenderHost(getQuint32FromByteArray(&datagram));
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QHostAddress allegedSenderHost(reader.readUInt32());
     //if (senderHost != allegedSenderHost)
     //    return;
 
-    quint64 searchID = getQuint64FromByteArray(&datagram);
-    QByteArray senderCID = datagram.mid(0, 24);
-    datagram.remove(0, 24);
-    int searchResultLength = getQuint16FromByteArray(&datagram);
-    QByteArray searchResult = datagram.mid(0, searchResultLength);
-    QByteArray bucket = datagram.mid(searchResultLength);
+    quint64 searchID = reader.readUInt64();
+    QByteArray senderCID = reader.readByteArray(24);
+    int searchResultLength = reader.readUInt16();
+    if (searchResultLength > reader.remaining())
+        searchResultLength = reader.remaining();
+    QByteArray searchResult = reader.readByteArray(searchResultLength);
+    QByteArray bucket = reader.readRemaining();
 
     if (searchResult.length() > 0)
         emit searchResultsReceived(senderHost, senderCID, searchID, searchResult);
@@ -553,19 +624,20 @@ void Dispatcher::sendSearchMulticast(QByteArray &searchPacket)
 
 void Dispatcher::sendSearchForwardRequest(QHostAddress &forwardingNode, QByteArray &searchPacket)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(300);
-    datagram->append(UnicastPacket);
-    datagram->append(SearchForwardRequestPacket);
-    datagram->append(searchPacket);
+    QByteArray *datagram = DatagramPool::acquire(2 + searchPacket.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(SearchForwardRequestPacket);
+    writer.writeBytes(searchPacket);
     sendUnicastRawDatagram(forwardingNode, datagram);
 }
 
 void Dispatcher::handleReceivedSearchForwardRequest(QHostAddress &fromAddr, QByteArray &datagram)
 {
-    QByteArray tmp = datagram.mid(2, 4);
-    QHostAddress allegedFromHost = QHostAddress(getQuint32FromByteArray(&tmp));
-    if (fromAddr != allegedFromHost)
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QHostAddress allegedFromHost = QHostAddress(reader.readUInt32());
+    if (!reader.ok() || fromAddr != allegedFromHost)
         return;
 
     QByteArray searchToForward;
@@ -576,7 +648,7 @@ void Dispatcher::handleReceivedSearchForwardRequest(QHostAddress &fromAddr, QByt
         searchToForward.append(BroadcastPacket);
 
     searchToForward.append(SearchRequestPacket);
-    searchToForward.append(datagram.mid(2));
+    searchToForward.append(datagram.constData() + 2, datagram.length() - 2);
     if (networkBootstrap->getBootstrapStatus() == NETWORK_MCAST)
         sendMulticastRawDatagram(searchToForward);
     else if (networkBootstrap->getBootstrapStatus() == NETWORK_BCAST)
@@ -595,15 +667,19 @@ void Dispatcher::handleReceivedSearchForwardRequest(QHostAddress &fromAddr, QByt
 //       : TODO: dink oor 'n manier om die DDoS moontlikheid wat hierin skuil aan te spreek :)
 void Dispatcher::handleReceivedSearchQuestion(QHostAddress &fromHost, QByteArray &datagram)
 {
-    datagram.remove(0, 2);
-    QHostAddress sendToHost = QHostAddress(getQuint32FromByteArray(&datagram));
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QHostAddress sendToHost = QHostAddress(reader.readUInt32());
     //QString q = sendToHost.toString();
-    quint64 searchID = getQuint64FromByteArray(&datagram);
-    QByteArray clientCID = datagram.left(24);
-    datagram.remove(0, 24);
-    int searchLength = getQuint16FromByteArray(&datagram);
-    QByteArray searchData = datagram.left(searchLength);
-    QByteArray bucket = datagram.right(datagram.length() - searchLength);
+    quint64 searchID = reader.readUInt64();
+    QByteArray clientCID = reader.readByteArray(24);
+    int searchLength = reader.readUInt16();
+    if (!reader.ok())
+        return;
+    if (searchLength > reader.remaining())
+        searchLength = reader.remaining();
+    QByteArray searchData = reader.readByteArray(searchLength);
+    QByteArray bucket = reader.readRemaining();
 
     if (searchData.length() > 0)
         emit searchQuestionReceived(sendToHost, clientCID, searchID, searchData);
@@ -651,14 +727,14 @@ bool Dispatcher::initiateTTHSearch(QByteArray tth)
 
 void Dispatcher::sendTTHSearchResult(QHostAddress toHost, QByteArray tth)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(30);
-    datagram->append(UnicastPacket);
-    datagram->append(TTHSearchResultPacket);
-    datagram->append(toQByteArray(dispatchIP.toIPv4Address()));
-    datagram->append(tth);
-    //TODO: uncomment post 0.1.9
-    //datagram->append(CID);
+    QByteArray *datagram = DatagramPool::acquire(6 + tth.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(TTHSearchResultPacket);
+    writer.writeUInt32(dispatchIP.toIPv4Address());
+    writer.writeBytes(tth);
+    //TODO: uncomment post 0.1.9 (and add CID.length() above)
+    //writer.writeBytes(CID);
     sendUnicastRawDatagram(toHost, datagram);
 }
 
@@ -686,21 +762,22 @@ void Dispatcher::sendTTHSearchMulticast(QByteArray &tth)
 
 void Dispatcher::sendTTHSearchForwardRequest(QHostAddress &forwardingNode, QByteArray &tth)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(30);
-    datagram->append(UnicastPacket);
-    datagram->append(TTHSearchForwardRequestPacket);
-    datagram->append(toQByteArray(dispatchIP.toIPv4Address()));
-    datagram->append(tth);
+    QByteArray *datagram = DatagramPool::acquire(6 + tth.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(TTHSearchForwardRequestPacket);
+    writer.writeUInt32(dispatchIP.toIPv4Address());
+    writer.writeBytes(tth);
     sendUnicastRawDatagram(forwardingNode, datagram);
     //qDebug() << "Dispatcher::sendTTHSearchForwardRequest() forwardingNode tth" << forwardingNode << tth.toBase64();
 }
 
 void Dispatcher::handleReceivedTTHSearchForwardRequest(QHostAddress &fromAddr, QByteArray &datagram)
 {
-    QByteArray tmp = datagram.mid(2, 4);
-    QHostAddress allegedFromHost = QHostAddress(getQuint32FromByteArray(&tmp));
-    if (fromAddr != allegedFromHost)
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QHostAddress allegedFromHost = QHostAddress(reader.readUInt32());
+    if (!reader.ok() || fromAddr != allegedFromHost)
         return;
 
     QByteArray searchToForward;
@@ -711,7 +788,7 @@ void Dispatcher::handleReceivedTTHSearchForwardRequest(QHostAddress &fromAddr, Q
         searchToForward.append(BroadcastPacket);
 
     searchToForward.append(TTHSearchRequestPacket);
-    searchToForward.append(datagram.mid(2));
+    searchToForward.append(datagram.constData() + 2, datagram.length() - 2);
     if (networkBootstrap->getBootstrapStatus() == NETWORK_MCAST)
         sendMulticastRawDatagram(searchToForward);
     else if (networkBootstrap->getBootstrapStatus() == NETWORK_BCAST)
@@ -726,16 +803,18 @@ void Dispatcher::handleReceivedTTHSearchForwardRequest(QHostAddress &fromAddr, Q
 
 void Dispatcher::handleArrivedTTHSearchResult(QHostAddress &fromAddr, QByteArray &datagram)
 {
-    datagram.remove(0, 2);
-    quint32 allegedFromAddr = getQuint32FromByteArray(&datagram);
-    if (fromAddr != QHostAddress(allegedFromAddr)) // mainly to catch misconfigured nodes behind NAT
+    ByteReader reader(datagram);
+    reader.skip(2);
+    quint32 allegedFromAddr = reader.readUInt32();
+    if (!reader.ok() || fromAddr != QHostAddress(allegedFromAddr)) // mainly to catch misconfigured nodes behind NAT
         return;
 
-    QByteArray tth(datagram.left(24));
-    datagram.remove(0, 24);
+    QByteArray tth = reader.readByteArray(24);
+    if (!reader.ok())
+        return;
     QByteArray cid;
-    if (datagram.length() >= 24)
-        cid = datagram.left(24);
+    if (reader.remaining() >= 24)
+        cid = reader.readByteArray(24);
     emit TTHSearchResultsReceived(tth, fromAddr, cid);
     //qDebug() << "Dispatcher::handleArrivedTTHSearchResult() fromAddr tth" << fromAddr << tth.toBase64();
 }
@@ -751,13 +830,15 @@ void Dispatcher::handleReceivedTTHSearchQuestion(QHostAddress &fromAddr, QByteAr
     //emit TTHSearchQuestionReceived(tth, fromAddr);
 
     // update: results must go to address specified in packet, otherwise they end up at the forwarding node.
-    datagram.remove(0, 2);
-    QHostAddress sendToHost = QHostAddress(getQuint32FromByteArray(&datagram));
-    QByteArray tth = datagram.left(24);
-    datagram.remove(0, 24);
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QHostAddress sendToHost = QHostAddress(reader.readUInt32());
+    QByteArray tth = reader.readByteArray(24);
+    if (!reader.ok())
+        return;
     quint32 searchId = 0;
-    if (datagram.length() >= 4)
-        searchId = getQuint32FromByteArray(&datagram);
+    if (reader.remaining() >= 4)
+        searchId = reader.readUInt32();
 
     if (searchId > 0)
     {
@@ -786,18 +867,23 @@ void Dispatcher::handleIncomingUploadRequest(QHostAddress &fromHost, QByteArray
     //tmp = datagram.mid(35, 8);
     //quint64 length = getQuint64FromByteArray(&tmp);
 
-    datagram.remove(0, 2);
-    quint8 protocol = getQuint8FromByteArray(&datagram);
-    QByteArray tth = datagram.left(24);
-    datagram.remove(0, 24);
-    qint64 offset = (qint64)getQuint64FromByteArray(&datagram);
-    qint64 length = (qint64)getQuint64FromByteArray(&datagram);
+    ByteReader reader(datagram);
+    reader.skip(2);
+    quint8 protocol = reader.readUInt8();
+    QByteArray tth = reader.readByteArray(24);
+    qint64 offset = reader.readInt64();
+    qint64 length = reader.readInt64();
+    if (!reader.ok())
+        return;
     quint32 segmentId = 0;
     QByteArray cid;
-    if (datagram.length() >= 4)
-        segmentId = getQuint32FromByteArray(&datagram);
-    if (datagram.length() >= 24)
-        cid = datagram.left(24);
+    if (reader.remaining() >= 4)
+        segmentId = reader.readUInt32();
+    if (reader.remaining() >= 24)
+        cid = reader.readByteArray(24);
+    // Largest datagram the downloader wants to receive from us
+    if (reader.remaining() >= 2)
+        receivedPeerMTU(fromHost, reader.readUInt16());
 
     qDebug() << "Dispatcher::handleIncomingUploadRequest()" << protocol << fromHost << segmentId << tth.toBase64() << cid.toBase64();
     // TODO: remove length check post 0.1.9
@@ -805,109 +891,250 @@ void Dispatcher::handleIncomingUploadRequest(QHostAddress &fromHost, QByteArray
         emit incomingUploadRequest(protocol, fromHost, tth, offset, length, segmentId);
 }
 
+// A selective request is a batch of ordinary requests for the holes in a segment, the upload side treats every range
+// exactly like a download request of its own.
+void Dispatcher::handleIncomingSelectiveUploadRequest(QHostAddress &fromHost, QByteArray &datagram)
+{
+    ByteReader reader(datagram);
+    reader.skip(2);
+    quint8 protocol = reader.readUInt8();
+    QByteArray tth = reader.readByteArray(24);
+    quint32 segmentId = reader.readUInt32();
+    reader.skip(24); // cid
+    int rangeCount = reader.readUInt8();
+    if (!reader.ok())
+        return;
+
+    for (int i = 0; i < rangeCount; i++)
+    {
+        qint64 offset = reader.readInt64();
+        qint64 length = reader.readUInt32();
+        if (!reader.ok())
+            return;
+        emit incomingUploadRequest(protocol, fromHost, tth, offset, length, segmentId);
+    }
+}
+
+void Dispatcher::sendSelectiveDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, QByteArray ranges, quint32 segmentId, QByteArray cid)
+{
+    QByteArray *datagram = DatagramPool::acquire(32 + tth.length() + ranges.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(SelectiveDownloadRequestPacket);
+    writer.writeUInt8(protocol);
+    writer.writeBytes(tth);
+    writer.writeUInt32(segmentId);
+    writer.writeFixedBytes(cid, 24);
+    writer.writeUInt8(ranges.length() / 12);
+    writer.writeBytes(ranges);
+    sendUnicastRawDatagram(dstHost, datagram);
+}
+
 void Dispatcher::sendDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, qint64 offset, qint64 length, quint32 segmentId, QByteArray cid)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(71);
-    datagram->append(UnicastPacket);
-    datagram->append(DownloadRequestPacket);
-    datagram->append(protocol);
-    datagram->append(tth);
-    datagram->append(quint64ToByteArray((quint64)offset));
-    datagram->append(quint64ToByteArray((quint64)length));
-    datagram->append(quint32ToByteArray(segmentId));
-    datagram->append(fixedCIDLength(cid));
+    QByteArray *datagram = DatagramPool::acquire(49 + tth.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(DownloadRequestPacket);
+    writer.writeUInt8(protocol);
+    writer.writeBytes(tth);
+    writer.writeUInt64((quint64)offset);
+    writer.writeUInt64((quint64)length);
+    writer.writeUInt32(segmentId);
+    writer.writeFixedBytes(cid, 24);
+    writer.writeUInt16(PathMTUDiscovery::pathMTU(dstHost));
     sendUnicastRawDatagram(dstHost, datagram);
+
+    // Next segment might get bigger packets
+    pathMTUDiscovery->discover(dstHost);
 }
 
 void Dispatcher::sendTransferError(QHostAddress dstHost, quint8 error, QByteArray tth, qint64 offset)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(35);
-    datagram->append(UnicastPacket);
-    datagram->append(TransferErrorPacket);
-    datagram->append(error);
-    datagram->append(tth);
-    datagram->append(quint64ToByteArray((quint64)offset));
+    QByteArray *datagram = DatagramPool::acquire(11 + tth.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(TransferErrorPacket);
+    writer.writeUInt8(error);
+    writer.writeBytes(tth);
+    writer.writeUInt64((quint64)offset);
+    sendUnicastRawDatagram(dstHost, datagram);
+}
+
+// A transfer error packet with the queue position and retry hint tacked on, old clients read it as a plain error
+void Dispatcher::sendUploadQueued(QHostAddress dstHost, QByteArray tth, qint64 offset, int position, int retryMsecs)
+{
+    QByteArray *datagram = DatagramPool::acquire(19 + tth.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(TransferErrorPacket);
+    writer.writeUInt8(UploadQueued);
+    writer.writeBytes(tth);
+    writer.writeUInt64((quint64)offset);
+    writer.writeUInt32((quint32)position);
+    writer.writeUInt32((quint32)retryMsecs);
+    sendUnicastRawDatagram(dstHost, datagram);
+}
+
+// Asks the peer to open the stream connection for a segment, we could not reach it
+void Dispatcher::sendRevConnect(QHostAddress dstHost, QByteArray tth, quint32 segmentId)
+{
+    QByteArray *datagram = DatagramPool::acquire(6 + tth.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(RevConnectPacket);
+    writer.writeBytes(tth);
+    writer.writeUInt32(segmentId);
     sendUnicastRawDatagram(dstHost, datagram);
 }
 
 void Dispatcher::sendTTHTreeRequest(QHostAddress host, QByteArray tthRoot, quint32 startOffset, quint32 numberOfBuckets)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(34);
-    datagram->append(UnicastPacket);
-    datagram->append(TTHTreeRequestPacket);
-    datagram->append(tthRoot);
-    datagram->append(toQByteArray(startOffset));
-    datagram->append(toQByteArray(numberOfBuckets));
+    QByteArray *datagram = DatagramPool::acquire(12 + tthRoot.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(TTHTreeRequestPacket);
+    writer.writeBytes(tthRoot);
+    writer.writeUInt32(startOffset);
+    writer.writeUInt32(numberOfBuckets);
+    writer.writeUInt16(PathMTUDiscovery::pathMTU(host));
     sendUnicastRawDatagram(host, datagram);
+
+    pathMTUDiscovery->discover(host);
 }
 
 void Dispatcher::sendTTHTreeReply(QHostAddress host, QByteArray tthTreePacket)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(1400);
-    datagram->append(UnicastPacket);
-    datagram->append(TTHTreeReplyPacket);
-    datagram->append(tthTreePacket);
+    QByteArray *datagram = DatagramPool::acquire(2 + tthTreePacket.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(TTHTreeReplyPacket);
+    writer.writeBytes(tthTreePacket);
     sendUnicastRawDatagram(host, datagram);
 }
 
 void Dispatcher::handleReceivedTTHTreeRequest(QHostAddress &senderHost, QByteArray &datagram)
 {
-    QByteArray tth = datagram.mid(2, 24);
-    datagram.remove(0, 26);
-    quint32 startOffset = getQuint32FromByteArray(&datagram);
-    quint32 numberOfBuckets = getQuint32FromByteArray(&datagram);
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QByteArray tth = reader.readByteArray(24);
+    quint32 startOffset = reader.readUInt32();
+    quint32 numberOfBuckets = reader.readUInt32();
+    if (!reader.ok())
+        return;
+    if (reader.remaining() >= 2)
+        receivedPeerMTU(senderHost, reader.readUInt16());
     emit incomingTTHTreeRequest(senderHost, tth, startOffset, numberOfBuckets);
     //qDebug() << "Dispatcher::handleReceivedTTHTreeRequest: Tree request TTH:offset:number" << tth.toBase64() << startOffset << numberOfBuckets;
 }
 
-void Dispatcher::handleReceivedTTHTree(QByteArray &datagram)
+void Dispatcher::handleReceivedTTHTree(QHostAddress &fromHost, QByteArray &datagram)
+{
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QByteArray tth = reader.readByteArray(24);
+    if (!reader.ok())
+        return;
+    QByteArray tree = reader.readRemaining();
+    emit receivedTTHTree(fromHost, tth, tree);
+}
+
+// The peer's word alone does not get it bigger datagrams, our own probes have to get them through first
+void Dispatcher::receivedPeerMTU(QHostAddress &fromHost, int mtu)
+{
+    PathMTUDiscovery::setPeerMTU(fromHost, mtu);
+    if (mtu > PACKET_MTU)
+        pathMTUDiscovery->discover(fromHost);
+}
+
+// Path MTU probes are answered with the size that made it here, the prober does the rest
+void Dispatcher::handleReceivedPathMTUProbe(QHostAddress &fromHost, QByteArray &datagram)
+{
+    ByteReader reader(datagram);
+    reader.skip(2);
+    quint32 probeId = reader.readUInt32();
+    if (!reader.ok())
+        return;
+
+    QByteArray *reply = DatagramPool::acquire(8);
+    ByteWriter writer(reply->data(), reply->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(PathMTUProbeReplyPacket);
+    writer.writeUInt32(probeId);
+    writer.writeUInt16(datagram.size());
+    sendUnicastRawDatagram(fromHost, reply);
+}
+
+void Dispatcher::handleReceivedPathMTUProbeReply(QHostAddress &fromHost, QByteArray &datagram)
 {
-    QByteArray tth = datagram.mid(2, 24);
-    QByteArray tree = datagram.mid(26);
-    emit receivedTTHTree(tth, tree);
+    ByteReader reader(datagram);
+    reader.skip(2);
+    quint32 probeId = reader.readUInt32();
+    quint16 size = reader.readUInt16();
+    if (!reader.ok())
+        return;
+    pathMTUDiscovery->probeReplyArrived(fromHost, size, probeId);
 }
 
 void Dispatcher::handleReceivedProtocolCapabilityQuery(QHostAddress host)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(3);
-    datagram->append(UnicastPacket);
-    datagram->append(ProtocolCapabilityResponsePacket);
-    datagram->append(protocolCapabilityBitmask);
+    QByteArray *datagram = DatagramPool::acquire(3);
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(ProtocolCapabilityResponsePacket);
+    writer.writeUInt8(protocolCapabilityBitmask);
     sendUnicastRawDatagram(host, datagram);
 }
 
 void Dispatcher::handleReceivedProtocolCapabilityResponse(QHostAddress fromHost, QByteArray &datagram)
 {
+    if (datagram.length() < 3)
+        return;
     char capability = datagram.at(2);
     emit incomingProtocolCapabilityResponse(fromHost, capability);
 }
 
 void Dispatcher::sendProtocolCapabilityQuery(QHostAddress dstHost)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(2);
-    datagram->append(UnicastPacket);
-    datagram->append(ProtocolCapabilityQueryPacket);
+    QByteArray *datagram = DatagramPool::acquire(2);
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(ProtocolCapabilityQueryPacket);
     sendUnicastRawDatagram(dstHost, datagram);
 }
 
 void Dispatcher::handleReceivedTransferError(QHostAddress fromHost, QByteArray datagram)
 {
-    datagram.remove(0, 2);
-    quint8 error = getQuint8FromByteArray(&datagram);
-    QByteArray tth = datagram.left(24);
-    datagram.remove(0, 24);
-    quint64 offset = getQuint64FromByteArray(&datagram);
-    if (offset > LLONG_MAX)
+    ByteReader reader(datagram);
+    reader.skip(2);
+    quint8 error = reader.readUInt8();
+    QByteArray tth = reader.readByteArray(24);
+    quint64 offset = reader.readUInt64();
+    if (!reader.ok() || offset > LLONG_MAX)
+        return;
+    if (error == UploadQueued)
+    {
+        quint32 position = reader.readUInt32();
+        quint32 retryMsecs = reader.readUInt32();
+        if (!reader.ok())
+            return;
+        emit incomingUploadQueued(fromHost, tth, (qint64)offset, (int)position, (int)qMin(retryMsecs, (quint32)UPLOAD_QUEUE_MAXIMUM_RETRY));
         return;
+    }
     emit incomingTransferError(fromHost, tth, (qint64)offset, error);
 }
 
+void Dispatcher::handleReceivedRevConnect(QHostAddress fromHost, QByteArray datagram)
+{
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QByteArray tth = reader.readByteArray(24);
+    quint32 segmentId = reader.readUInt32();
+    if (!reader.ok())
+        return;
+    emit incomingRevConnect(fromHost, tth, segmentId);
+}
+
 // ------------------=====================   CID functions   =====================----------------------
 
 void Dispatcher::dispatchCIDPing(QByteArray &cid)
@@ -951,27 +1178,30 @@ void Dispatcher::sendMulticastCIDPing(QByteArray &cid)
 
 void Dispatcher::sendCIDPingForwardRequest(QHostAddress &forwardingNode, QByteArray &cid)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(30);
-    datagram->append(UnicastPacket);
-    datagram->append(CIDPingForwardRequestPacket);
-    datagram->append(toQByteArray(dispatchIP.toIPv4Address()));
-    datagram->append(cid);
+    QByteArray *datagram = DatagramPool::acquire(6 + cid.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(CIDPingForwardRequestPacket);
+    writer.writeUInt32(dispatchIP.toIPv4Address());
+    writer.writeBytes(cid);
     sendUnicastRawDatagram(forwardingNode, datagram);
 }
 
 // reply to CID pings forwarded by peers
 void Dispatcher::handleCIDPingForwardedReply(QByteArray &data)
 {
-    data.remove(0, 2);
-    QHostAddress dst = QHostAddress(getQuint32FromByteArray(&data));
+    ByteReader reader(data);
+    reader.skip(2);
+    QHostAddress dst = QHostAddress(reader.readUInt32());
+    const char *cid = reader.readBytes(24);
 
-    if (CID == data.left(24))
+    if (cid && CID.length() == 24 && memcmp(cid, CID.constData(), 24) == 0)
     {
-        QByteArray *datagram = new QByteArray;
-        datagram->append(UnicastPacket);
-        datagram->append(CIDPingReplyPacket);
-        datagram->append(CID);
+        QByteArray *datagram = DatagramPool::acquire(2 + CID.length());
+        ByteWriter writer(datagram->data(), datagram->length());
+        writer.writeUInt8(UnicastPacket);
+        writer.writeUInt8(CIDPingReplyPacket);
+        writer.writeBytes(CID);
         sendUnicastRawDatagram(dst, datagram);
     }
 }
@@ -979,15 +1209,17 @@ void Dispatcher::handleCIDPingForwardedReply(QByteArray &data)
 // reply to CID pings broadcasted or multicasted directly
 void Dispatcher::handleCIDPingReply(QByteArray &data, QHostAddress &dstHost)
 {
-    data.remove(0, 2);
+    ByteReader reader(data);
+    reader.skip(2);
+    const char *cid = reader.readBytes(24);
 
-    if (CID == data.left(24))
+    if (cid && CID.length() == 24 && memcmp(cid, CID.constData(), 24) == 0)
     {
-        QByteArray *datagram = new QByteArray;
-        datagram->reserve(26);
-        datagram->append(UnicastPacket);
-        datagram->append(CIDPingReplyPacket);
-        datagram->append(CID);
+        QByteArray *datagram = DatagramPool::acquire(2 + CID.length());
+        ByteWriter writer(datagram->data(), datagram->length());
+        writer.writeUInt8(UnicastPacket);
+        writer.writeUInt8(CIDPingReplyPacket);
+        writer.writeBytes(CID);
         sendUnicastRawDatagram(dstHost, datagram);
     }
 }
@@ -995,10 +1227,10 @@ void Dispatcher::handleCIDPingReply(QByteArray &data, QHostAddress &dstHost)
 // forward the CID ping to own bucket on request
 void Dispatcher::handleReceivedCIDPingForwardRequest(QHostAddress &fromAddr, QByteArray &data)
 {
-    data.remove(0, 2);
-    QByteArray tmp = data.mid(0, 4);
-    QHostAddress allegedFromHost = QHostAddress(getQuint32FromByteArray(&tmp));
-    if (fromAddr != allegedFromHost)
+    ByteReader reader(data);
+    reader.skip(2);
+    QHostAddress allegedFromHost = QHostAddress(reader.readUInt32());
+    if (!reader.ok() || fromAddr != allegedFromHost)
         return;
 
     QByteArray datagram;
@@ -1008,13 +1240,13 @@ void Dispatcher::handleReceivedCIDPingForwardRequest(QHostAddress &fromAddr, QBy
     case NETWORK_MCAST:
         datagram.append(MulticastPacket);
         datagram.append(CIDPingForwardedPacket);
-        datagram.append(data);
+        datagram.append(data.constData() + 2, data.length() - 2);
         sendMulticastRawDatagram(datagram);
         break;
     case NETWORK_BCAST:
         datagram.append(BroadcastPacket);
         datagram.append(CIDPingForwardedPacket);
-        datagram.append(data);
+        datagram.append(data.constData() + 2, data.length() - 2);
         sendBroadcastRawDatagram(datagram);
         break;
     }
@@ -1022,8 +1254,11 @@ void Dispatcher::handleReceivedCIDPingForwardRequest(QHostAddress &fromAddr, QBy
 
 void Dispatcher::handleReceivedCIDReply(QHostAddress &fromAddr, QByteArray &datagram)
 {
-    datagram.remove(0, 2);
-    QByteArray cid = datagram.left(24);
+    ByteReader reader(datagram);
+    reader.skip(2);
+    QByteArray cid = reader.readByteArray(24);
+    if (!reader.ok())
+        return;
     emit CIDReplyArrived(fromAddr, cid);
 }
 
@@ -1035,11 +1270,11 @@ void Dispatcher::sendLocalBucket(QHostAddress &host)
     if (bucket.isEmpty())
         return;
 
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(200);
-    datagram->append(UnicastPacket);
-    datagram->append(BucketExchangePacket);
-    datagram->append(bucket);
+    QByteArray *datagram = DatagramPool::acquire(2 + bucket.length());
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(BucketExchangePacket);
+    writer.writeBytes(bucket);
     sendUnicastRawDatagram(host, datagram);
 }
 
@@ -1049,30 +1284,31 @@ void Dispatcher::sendAllBuckets(QHostAddress &host)
     QListIterator<QByteArray> it(bucketList);
     while (it.hasNext())
     {
-        QByteArray *datagram = new QByteArray;
-        datagram->reserve(200);
-        datagram->append(UnicastPacket);
-        datagram->append(BucketExchangePacket);
-        datagram->append(it.next());
+        const QByteArray &bucket = it.next();
+        QByteArray *datagram = DatagramPool::acquire(2 + bucket.length());
+        ByteWriter writer(datagram->data(), datagram->length());
+        writer.writeUInt8(UnicastPacket);
+        writer.writeUInt8(BucketExchangePacket);
+        writer.writeBytes(bucket);
         sendUnicastRawDatagram(host, datagram);
     }
 }
 
 void Dispatcher::requestBucketContents(QHostAddress host)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(2);
-    datagram->append(UnicastPacket);
-    datagram->append(RequestBucketPacket);
+    QByteArray *datagram = DatagramPool::acquire(2);
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(RequestBucketPacket);
     sendUnicastRawDatagram(host, datagram);
 }
 
 void Dispatcher::requestAllBuckets(QHostAddress host)
 {
-    QByteArray *datagram = new QByteArray;
-    datagram->reserve(2);
-    datagram->append(UnicastPacket);
-    datagram->append(RequestAllBucketsPacket);
+    QByteArray *datagram = DatagramPool::acquire(2);
+    ByteWriter writer(datagram->data(), datagram->length());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(RequestAllBucketsPacket);
     sendUnicastRawDatagram(host, datagram);
 }
 
@@ -1096,7 +1332,111 @@ void Dispatcher::initiateLinscan()
 
 // ------------------=====================   Raw transmission functions   =====================----------------------
 
+// Unicast sends are split into two priority classes. Data packets from transfers are bulk, everything else is control.
+// An upload dumps a whole segment worth of datagrams on us in one go, which used to sit in front of protocol capability
+// replies, tree replies and search results in the event queue. Now control packets are written straight away, while bulk
+// packets go into the traffic shaper. The shaper is drained from a posted event, a batch at a time, so that incoming
+// datagrams and new control traffic get in between batches. When the rate limits hold the shaper back, a timer wakes
+// the drain up again once enough tokens have built up.
 void Dispatcher::sendUnicastRawDatagram(QHostAddress dstAddress, QByteArray *datagram)
+{
+    if (dstAddress.isNull() || datagram->isEmpty())
+    {
+        DatagramPool::release(datagram);
+        return;
+    }
+
+    quint8 datagramType = datagram->at(0);
+    if (datagramType != DataPacket && datagramType != DirectDataPacket)
+    {
+        trafficShaper->accountUnshaped(datagram);
+        writeUnicastRawDatagram(dstAddress, datagram);
+        return;
+    }
+
+    trafficShaper->enqueue(dstAddress, datagram);
+    if (!trafficShaperTimer->isActive())
+        scheduleSendQueueDrain();
+}
+
+void Dispatcher::scheduleSendQueueDrain()
+{
+    if (sendQueueDrainScheduled)
+        return;
+
+    sendQueueDrainScheduled = true;
+    QMetaObject::invokeMethod(this, "drainSendQueues", Qt::QueuedConnection);
+}
+
+void Dispatcher::sendUnicastMappedDatagram(QHostAddress dstAddress, MappedDatagramStruct datagram)
+{
+    if (dstAddress.isNull() || datagram.header->isEmpty())
+    {
+        releaseMappedDatagram(datagram);
+        return;
+    }
+
+    trafficShaper->enqueue(dstAddress, datagram);
+    if (!trafficShaperTimer->isActive())
+        scheduleSendQueueDrain();
+}
+
+void Dispatcher::drainSendQueues()
+{
+    sendQueueDrainScheduled = false;
+
+    // Nothing goes out until the kernel has room for what it turned away last time
+    if (senderWriteNotifier && senderWriteNotifier->isEnabled())
+        return;
+
+    QHostAddress dstAddresses[DISPATCHER_BULK_SEND_BATCH];
+    MappedDatagramStruct datagrams[DISPATCHER_BULK_SEND_BATCH];
+    int count = 0;
+    while (count < DISPATCHER_BULK_SEND_BATCH && !blockedSendQueue.isEmpty())
+    {
+        QPair<QHostAddress, MappedDatagramStruct> blocked = blockedSendQueue.dequeue();
+        dstAddresses[count] = blocked.first;
+        datagrams[count] = blocked.second;
+        count++;
+    }
+    while (count < DISPATCHER_BULK_SEND_BATCH && trafficShaper->dequeue(dstAddresses[count], datagrams[count]))
+        count++;
+    if (count > 0)
+        writeUnicastMappedDatagrams(dstAddresses, datagrams, count);
+
+    if (senderWriteNotifier && senderWriteNotifier->isEnabled())
+        return;
+
+    int wait = trafficShaper->msecsUntilReady();
+    if (wait == 0 || !blockedSendQueue.isEmpty())
+        scheduleSendQueueDrain();
+    else if (wait > 0 && !trafficShaperTimer->isActive())
+        trafficShaperTimer->start(wait);
+}
+
+void Dispatcher::senderSocketWritable()
+{
+    senderWriteNotifier->setEnabled(false);
+    drainSendQueues();
+}
+
+void Dispatcher::setUploadRateLimits(qint64 globalBytesPerSecond, qint64 peerBytesPerSecond)
+{
+    trafficShaper->setGlobalRateLimit(globalBytesPerSecond);
+    trafficShaper->setPeerRateLimit(peerBytesPerSecond);
+
+    // Whatever was waiting for tokens might be allowed through now
+    trafficShaperTimer->stop();
+    if (!trafficShaper->isEmpty())
+        scheduleSendQueueDrain();
+}
+
+void Dispatcher::requestTrafficShaperStatus()
+{
+    emit returnTrafficShaperStatus(trafficShaper->getStatus());
+}
+
+void Dispatcher::writeUnicastRawDatagram(QHostAddress &dstAddress, QByteArray *datagram)
 {
     // moontlike aborsie wat wag hier:
     //Warning: Calling this function on a connected UDP socket may result in an error and no packet being sent.
@@ -1111,23 +1451,6 @@ void Dispatcher::sendUnicastRawDatagram(QHostAddress dstAddress, QByteArray *dat
     //    emit writeUdpUnicastFailed();
 
 
-    // **************************************
-    /* man 7 socket:
-       SO_SNDBUF
-              Sets or gets the maximum socket send buffer in bytes.  The  ker‐
-              nel doubles this value (to allow space for bookkeeping overhead)
-              when it is set using setsockopt(2), and this  doubled  value  is
-              returned  by  getsockopt(2).   The  default  value is set by the
-              /proc/sys/net/core/wmem_default file  and  the  maximum  allowed
-              value is set by the /proc/sys/net/core/wmem_max file.  The mini‐
-              mum (doubled) value for this option is 2048.
-    */
-    if (dstAddress.isNull())
-    {
-        delete datagram;
-        return;
-    }
-
     /*if (senderUdpSocket->peerAddress() != dstAddress)
     {
         senderUdpSocket->disconnectFromHost();
@@ -1135,41 +1458,116 @@ void Dispatcher::sendUnicastRawDatagram(QHostAddress dstAddress, QByteArray *dat
     }*/
 
     QAbstractSocket::SocketState state = senderUdpSocket->state();
-    int size = 0;
-    int maxSize = getMaximumSendBufferSize();
-    socklen_t *s = new socklen_t(sizeof(size));
-    if (::getsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, s) != -1) //successfully read
+
+    int res;
+    //if ((res = senderUdpSocket->write(*datagram)) == -1)
+    //    emit writeUdpUnicastFailed();
+
+    if (res = senderUdpSocket->writeDatagram(*datagram, dstAddress, dispatchPort) == -1)
+        emit writeUdpUnicastFailed();
+
+    DatagramPool::release(datagram);
+}
+
+void Dispatcher::writeUnicastMappedDatagrams(QHostAddress *dstAddresses, MappedDatagramStruct *datagrams, int count)
+{
+    int fd = senderUdpSocket->socketDescriptor();
+#ifdef Q_WS_WIN
+    for (int i = 0; i < count; i++)
     {
-        if (size != maxSize) //set if not already set
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(dispatchPort);
+        addr.sin_addr.s_addr = htonl(dstAddresses[i].toIPv4Address());
+
+        WSABUF buffers[2];
+        buffers[0].buf = datagrams[i].header->data();
+        buffers[0].len = datagrams[i].header->size();
+        buffers[1].buf = (char *)datagrams[i].payload;
+        buffers[1].len = datagrams[i].payloadLength;
+
+        DWORD sent = 0;
+        if (WSASendTo(fd, buffers, datagrams[i].region ? 2 : 1, &sent, 0, (sockaddr *)&addr, sizeof(addr), 0, 0) == SOCKET_ERROR)
+            emit writeUdpUnicastFailed();
+        releaseMappedDatagram(datagrams[i]);
+    }
+#else
+    sockaddr_in addrs[DISPATCHER_BULK_SEND_BATCH];
+    iovec iovecs[DISPATCHER_BULK_SEND_BATCH][2];
+#ifdef Q_OS_LINUX
+    mmsghdr messages[DISPATCHER_BULK_SEND_BATCH];
+#else
+    msghdr messages[DISPATCHER_BULK_SEND_BATCH];
+#endif
+    memset(messages, 0, sizeof(messages));
+
+    for (int i = 0; i < count; i++)
+    {
+        memset(&addrs[i], 0, sizeof(sockaddr_in));
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_port = htons(dispatchPort);
+        addrs[i].sin_addr.s_addr = htonl(dstAddresses[i].toIPv4Address());
+
+        iovecs[i][0].iov_base = datagrams[i].header->data();
+        iovecs[i][0].iov_len = datagrams[i].header->size();
+        iovecs[i][1].iov_base = (void *)datagrams[i].payload;
+        iovecs[i][1].iov_len = datagrams[i].payloadLength;
+
+#ifdef Q_OS_LINUX
+        msghdr &message = messages[i].msg_hdr;
+#else
+        msghdr &message = messages[i];
+#endif
+        message.msg_name = &addrs[i];
+        message.msg_namelen = sizeof(sockaddr_in);
+        message.msg_iov = iovecs[i];
+        message.msg_iovlen = datagrams[i].region ? 2 : 1;
+    }
+
+    // A datagram the kernel refuses is dropped like a failed writeDatagram(), the rest of the batch still goes.
+    // When it has no room, the rest of the batch waits for the socket to become writable instead.
+    int sent = 0;
+    bool blocked = false;
+    while (sent < count)
+    {
+#ifdef Q_OS_LINUX
+        int res = ::sendmmsg(fd, messages + sent, count - sent, 0);
+#else
+        int res = ::sendmsg(fd, messages + sent, 0) == -1 ? -1 : 1;
+#endif
+        if (res == -1)
         {
-            size = maxSize;
-            if (::setsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(size)) == -1) //couldn't write
-            {
-                qDebug() << "Dispatcher::sendUnicastRawDatagram: Could not set sending buffer size";
-            }
-#ifndef Q_OS_LINUX
-            else
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
             {
-                //verify if set correctly
-                if (::getsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, s) != -1) //successfully read
-                {
-                    if (size != maxSize)
-                        qDebug() << "Dispatcher::sendUnicastRawDatagram: Value returned inconsistent with value set " << size << maxSize;
-                }
+                blocked = true;
+                break;
             }
-#endif
+            emit writeUdpUnicastFailed();
+            res = 1;
         }
+        sent += res;
     }
-    delete s;
 
-    int res;
-    //if ((res = senderUdpSocket->write(*datagram)) == -1)
-    //    emit writeUdpUnicastFailed();
+    for (int i = 0; i < sent; i++)
+        releaseMappedDatagram(datagrams[i]);
 
-    if (res = senderUdpSocket->writeDatagram(*datagram, dstAddress, dispatchPort) == -1)
-        emit writeUdpUnicastFailed();
+    if (blocked)
+    {
+        for (int i = sent; i < count; i++)
+            blockedSendQueue.enqueue(qMakePair(dstAddresses[i], datagrams[i]));
 
-    delete datagram;
+        // Created on first use, so that it lives in the dispatcher thread
+        if (!senderWriteNotifier)
+        {
+            senderWriteNotifier = new QSocketNotifier(fd, QSocketNotifier::Write, this);
+            connect(senderWriteNotifier, SIGNAL(activated(int)), this, SLOT(senderSocketWritable()));
+        }
+        senderWriteNotifier->setEnabled(true);
+    }
+#endif
 }
 
 void Dispatcher::sendBroadcastRawDatagram(QByteArray &datagram)
@@ -1184,33 +1582,6 @@ void Dispatcher::sendBroadcastRawDatagram(QByteArray &datagram)
         senderUdpSocket->connectToHost(bcastAddress, dispatchPort);
     }*/
 
-    int size = 0;
-    int maxSize = getMaximumSendBufferSize();
-    socklen_t *s = new socklen_t(sizeof(size));
-    if (::getsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, s) != -1) //successfully read
-    {
-        if (size != maxSize) //set if not already set
-        {
-            size = maxSize;
-            if (::setsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(size)) == -1) //couldn't write
-            {
-                qDebug() << "Dispatcher::sendBroadcastRawDatagram: Could not set sending buffer size";
-            }
-#ifndef Q_OS_LINUX
-            else
-            {
-                //verify if set correctly
-                if (::getsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, s) != -1) //successfully read
-                {
-                    if (size != maxSize)
-                        qDebug() << "Dispatcher::sendBroadcastRawDatagram: Value returned inconsistent with value set " << size << maxSize;
-                }
-            }
-#endif
-        }
-    }
-    delete s;
-
     int res;
     //if ((res = senderUdpSocket->write(datagram)) == -1)
     //    emit writeUdpBroadcastFailed();
@@ -1230,33 +1601,6 @@ void Dispatcher::sendMulticastRawDatagram(QByteArray &datagram)
         senderUdpSocket->connectToHost(mcastAddress, dispatchPort);
     }*/
 
-    int size = 0;
-    int maxSize = getMaximumSendBufferSize();
-    socklen_t *s = new socklen_t(sizeof(size));
-    if (::getsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, s) != -1) //successfully read
-    {
-        if (size != maxSize) //set if not already set
-        {
-            size = maxSize;
-            if (::setsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(size)) == -1) //couldn't write
-            {
-                qDebug() << "Dispatcher::sendMulticastRawDatagram: Could not set sending buffer size";
-            }
-#ifndef Q_OS_LINUX
-            else
-            {
-                //verify if set correctly
-                if (::getsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, s) != -1) //successfully read
-                {
-                    if (size != maxSize)
-                        qDebug() << "Dispatcher::sendMulticastRawDatagram: Value returned inconsistent with value set " << size << maxSize;
-                }
-            }
-#endif
-        }
-    }
-    delete s;
-
     int res;
     //if ((res = senderUdpSocket->write(datagram)) == -1)
     //    emit writeUdpMulticastFailed();
@@ -1318,6 +1662,37 @@ int Dispatcher::getMaximumSendBufferSize()
     return maximumSendBufferSize;
 }
 
+/* man 7 socket:
+   SO_SNDBUF
+          Sets or gets the maximum socket send buffer in bytes.  The  ker‐
+          nel doubles this value (to allow space for bookkeeping overhead)
+          when it is set using setsockopt(2), and this  doubled  value  is
+          returned  by  getsockopt(2).   The  default  value is set by the
+          /proc/sys/net/core/wmem_default file  and  the  maximum  allowed
+          value is set by the /proc/sys/net/core/wmem_max file.  The mini‐
+          mum (doubled) value for this option is 2048.
+*/
+// The sender socket lives as long as we do, so this is done once instead of checked on every send
+void Dispatcher::setSendBufferSize()
+{
+    int size = getMaximumSendBufferSize();
+    if (::setsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(size)) == -1) //couldn't write
+    {
+        qDebug() << "Dispatcher::setSendBufferSize: Could not set sending buffer size";
+        return;
+    }
+#ifndef Q_OS_LINUX
+    //verify if set correctly
+    int setSize = 0;
+    socklen_t s = sizeof(setSize);
+    if (::getsockopt(senderUdpSocket->socketDescriptor(), SOL_SOCKET, SO_SNDBUF, (char *)&setSize, &s) != -1) //successfully read
+    {
+        if (setSize != size)
+            qDebug() << "Dispatcher::setSendBufferSize: Value returned inconsistent with value set " << setSize << size;
+    }
+#endif
+}
+
 // ------------------=====================   GET FUNCTIONS   =====================----------------------
 
 //Get functions to avoid reconfiguration if no change was made
@@ -1369,3 +1744,8 @@ QString Dispatcher::getDebugCIDHostContents()
     return networkTopology->getDebugCIDHostContents();
 }
 
+QString Dispatcher::getDebugPathMTUContents()
+{
+    return PathMTUDiscovery::getDebugCacheContents();
+}
+
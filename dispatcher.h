@@ -30,10 +30,20 @@
 #include <QHostAddress>
 #include <QTimer>
 #include <QHash>
+#include <QQueue>
+#include <QPair>
+#include <QSocketNotifier>
 #include "networkbootstrap.h"
 #include "networktopology.h"
 #include "util.h"
 #include "protocoldef.h"
+#include "bytecursor.h"
+
+#include "trafficshaper.h"
+#include "pathmtudiscovery.h"
+
+// Bulk data packets sent per pass over the shaper before the event loop gets another look in
+#define DISPATCHER_BULK_SEND_BATCH 32
 
 class Dispatcher : public QObject
 {
@@ -79,15 +89,18 @@ signals:
     void CIDReplyArrived(QHostAddress &fromAddr, QByteArray &cid);
 
     // TTH Tree
-    void receivedTTHTree(QByteArray tthRoot, QByteArray tthTree);
+    void receivedTTHTree(QHostAddress fromHost, QByteArray tthRoot, QByteArray tthTree);
     void incomingTTHTreeRequest(QHostAddress fromHost, QByteArray tth, quint32 startOffset, quint32 numberOfBuckets);
 
     // Transfers
     void incomingProtocolCapabilityResponse(QHostAddress fromHost, char capability);
     void incomingUploadRequest(quint8 protocol, QHostAddress fromHost, QByteArray tth, qint64 offset, qint64 length, quint32 segmentId);
-    void incomingDataPacket(quint8 protocolInstruction, QHostAddress senderHost, QByteArray datagram);
-    void incomingDirectDataPacket(quint32 segmentId, qint64 offset, QByteArray data);
+    // Ownership of the pooled datagram passes to the receiver, which must hand it back with DatagramPool::release()
+    void incomingDataPacket(quint8 protocolInstruction, QHostAddress senderHost, QByteArray *datagram);
+    void incomingDirectDataPacket(quint32 segmentId, qint64 offset, QByteArray *data);
     void incomingTransferError(QHostAddress senderHost, QByteArray tth, qint64 offset, quint8 error);
+    void incomingUploadQueued(QHostAddress senderHost, QByteArray tth, qint64 offset, int position, int retryMsecs);
+    void incomingRevConnect(QHostAddress senderHost, QByteArray tth, quint32 segmentId);
     //
     // Debug messages
     void appendChatLine(QString message);
@@ -95,11 +108,16 @@ signals:
     //GUI user count
     void returnHostCount(int hostCount, int bucketCount);
 
+    // Upload rates
+    void returnTrafficShaperStatus(TrafficShaperStatusStruct status);
+
 public slots:
     void setCID(QByteArray cid);
     //void setDispatchIP(QHostAddress &dispatchIP);
     void setProtocolCapabilityBitmask(char protocols);
     void reconfigureDispatchHostPort(QHostAddress dispatchIP, quint16 dispatchPort);
+    // Upload rate limits in bytes per second, 0 for unlimited
+    void setUploadRateLimits(qint64 globalBytesPerSecond, qint64 peerBytesPerSecond);
 
     //Get functions to avoid reconfiguration if no change was made
     QHostAddress getDispatchIP();
@@ -129,7 +147,10 @@ public slots:
     // Transfers
     void sendProtocolCapabilityQuery(QHostAddress dstHost);
     void sendDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, qint64 offset, qint64 length, quint32 segmentId=0, QByteArray cid = QByteArray());
+    void sendSelectiveDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, QByteArray ranges, quint32 segmentId, QByteArray cid);
     void sendTransferError(QHostAddress dstHost, quint8 error, QByteArray tth, qint64 offset);
+    void sendUploadQueued(QHostAddress dstHost, QByteArray tth, qint64 offset, int position, int retryMsecs);
+    void sendRevConnect(QHostAddress dstHost, QByteArray tth, quint32 segmentId);
 
     // Buckets
     void requestBucketContents(QHostAddress host);
@@ -145,18 +166,23 @@ public slots:
 
     // Misc
     void sendUnicastRawDatagram(QHostAddress dstAddress, QByteArray *datagram);
+    void sendUnicastMappedDatagram(QHostAddress dstAddress, MappedDatagramStruct datagram);
     void sendBroadcastRawDatagram(QByteArray &datagram);
     void sendMulticastRawDatagram(QByteArray &datagram);
 
     //GUI user count
     void getHostCount();
+    void requestTrafficShaperStatus();
 
     // debugging
     QString getDebugBucketsContents();
     QString getDebugCIDHostContents();
+    QString getDebugPathMTUContents();
 
 private slots:
     void receiveP2PData();
+    void drainSendQueues();
+    void senderSocketWritable();
     void changeBootstrapStatus(int);
     void rejoinMulticastTimeout();
 
@@ -186,7 +212,7 @@ private:
     void handleReceivedTTHSearchForwardRequest(QHostAddress &fromAddr, QByteArray &datagram);
     void handleArrivedTTHSearchResult(QHostAddress &fromAddr, QByteArray &datagram);
     void handleReceivedTTHSearchQuestion(QHostAddress &fromHost, QByteArray &datagram);
-    void handleReceivedTTHTree(QByteArray &datagram);
+    void handleReceivedTTHTree(QHostAddress &fromHost, QByteArray &datagram);
 
     // CID related network functions
     void sendBroadcastCIDPing(QByteArray &cid);
@@ -205,7 +231,7 @@ private:
     // P2P protocol helper
     void handleProtocolInstruction(quint8 &quint8DatagramType, quint8 &quint8ProtocolInstruction, QByteArray &datagram,
                                    QHostAddress &senderHost);
-    void dispatchDirectDataPacket(QByteArray datagram);
+    void dispatchDirectDataPacket(QByteArray *datagram);
 
     // Buckets
     void sendLocalBucket(QHostAddress &host);
@@ -217,8 +243,13 @@ private:
     // Transfers
     void handleReceivedProtocolCapabilityQuery(QHostAddress fromHost);
     void handleReceivedProtocolCapabilityResponse(QHostAddress fromHost, QByteArray &datagram);
+    void handleReceivedPathMTUProbe(QHostAddress &fromHost, QByteArray &datagram);
+    void receivedPeerMTU(QHostAddress &fromHost, int mtu);
+    void handleReceivedPathMTUProbeReply(QHostAddress &fromHost, QByteArray &datagram);
     void handleIncomingUploadRequest(QHostAddress &fromHost, QByteArray &datagram);
+    void handleIncomingSelectiveUploadRequest(QHostAddress &fromHost, QByteArray &datagram);
     void handleReceivedTransferError(QHostAddress fromHost, QByteArray datagram);
+    void handleReceivedRevConnect(QHostAddress fromHost, QByteArray datagram);
 
     // Bootstrap object
     NetworkBootstrap *networkBootstrap;
@@ -229,15 +260,31 @@ private:
     // Protocol capability bitmask
     char protocolCapabilityBitmask;
 
+    // Path MTU discovery for data packets
+    PathMTUDiscovery *pathMTUDiscovery;
+
     // Misc functions
     QByteArray fixedCIDLength(QByteArray);
     int getMaximumSendBufferSize();
+    void setSendBufferSize();
     int maximumSendBufferSize;
     quint32 tthSearchId;
 
     // Multicast rejoin timer
     QTimer *rejoinMulticastTimer;
 
+    // Transfer data is queued in the shaper, control packets go out immediately
+    void writeUnicastRawDatagram(QHostAddress &dstAddress, QByteArray *datagram);
+    // Header and payload go to the kernel as separate pieces, several datagrams per system call where possible
+    void writeUnicastMappedDatagrams(QHostAddress *dstAddresses, MappedDatagramStruct *datagrams, int count);
+    void scheduleSendQueueDrain();
+    TrafficShaper *trafficShaper;
+    QTimer *trafficShaperTimer;
+    bool sendQueueDrainScheduled;
+    // Datagrams the kernel had no room for go out first, once the sender socket says it is writable again
+    QQueue<QPair<QHostAddress, MappedDatagramStruct> > blockedSendQueue;
+    QSocketNotifier *senderWriteNotifier;
+
     QHash<QHostAddress, qint64> announceForwardToHostTimestamps;
     QHash<quint32, qint64> searchIdTimestamps;
 };
@@ -0,0 +1,176 @@
+#include "downloadfilemap.h"
+#include "protocoldef.h"
+#include <QFile>
+#include <QDir>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+
+#ifdef Q_WS_WIN //If windows
+#include <windows.h>
+#include <io.h>
+#else //If Q_OS_LINUX
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Leave room in a 32 bit address space for everything else
+#define DOWNLOAD_FILE_MAP_MAX_32BIT_SIZE (1LL << 30)
+
+namespace
+{
+
+QAtomicInt mappedDownloadsEnabled(1);
+
+// Maps held for buckets in the hash thread, per TTH in the order they were sent
+struct HashHolds
+{
+    QMutex mutex;
+    QHash<QByteArray, QList<DownloadFileMap *> > holds;
+};
+
+Q_GLOBAL_STATIC(HashHolds, hashHolds)
+
+}
+
+DownloadFileMap::DownloadFileMap()
+{
+    base = 0;
+    mapLength = 0;
+}
+
+DownloadFileMap::~DownloadFileMap()
+{
+    if (!base)
+        return;
+#ifdef Q_WS_WIN
+    UnmapViewOfFile(base);
+#else
+    ::munmap(base, mapLength);
+#endif
+}
+
+DownloadFileMap *DownloadFileMap::open(const QString &fileName, qint64 fileSize, const QByteArray &tth)
+{
+    if (!isEnabled() || fileSize <= 0)
+        return 0;
+    if (sizeof(void *) < 8 && fileSize > DOWNLOAD_FILE_MAP_MAX_32BIT_SIZE)
+        return 0;
+
+    //Go to directory
+    QString pathStr = fileName.left(fileName.lastIndexOf("/"));
+    QDir path(pathStr);
+    if (!path.exists())
+        path.mkpath(pathStr);
+
+    QFile file(fileName + ".incomplete");
+    if (!file.open(QIODevice::ReadWrite))
+        return 0;
+
+    // Reserve the blocks up front, so that running out of disk space shows up here instead of as a bus error when
+    // a page gets written back.
+#ifdef Q_OS_LINUX
+    if (::posix_fallocate(file.handle(), 0, fileSize) != 0)
+    {
+        qWarning() << "DownloadFileMap::open() could not preallocate" << file.fileName() << fileSize;
+        return 0;
+    }
+#endif
+    if (file.size() != fileSize && !file.resize(fileSize))
+        return 0;
+
+#ifdef Q_WS_WIN
+    HANDLE fileHandle = (HANDLE)_get_osfhandle(file.handle());
+    HANDLE mapping = CreateFileMapping(fileHandle, 0, PAGE_READWRITE, 0, 0, 0);
+    if (!mapping)
+        return 0;
+    // The view keeps the mapping object and the file open by itself
+    void *p = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)fileSize);
+    CloseHandle(mapping);
+    if (!p)
+        return 0;
+#else
+    // The mapping outlives the descriptor
+    void *p = ::mmap(0, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, file.handle(), 0);
+    if (p == MAP_FAILED)
+        return 0;
+#endif
+
+    DownloadFileMap *map = new DownloadFileMap;
+    map->base = (char *)p;
+    map->mapLength = fileSize;
+    map->TTH = tth;
+    map->refCount = 1;
+    return map;
+}
+
+char *DownloadFileMap::bucketData(int bucketNumber) const
+{
+    return base + (qint64)bucketNumber * HASH_BUCKET_SIZE;
+}
+
+int DownloadFileMap::bucketLength(int bucketNumber) const
+{
+    qint64 bucketStart = (qint64)bucketNumber * HASH_BUCKET_SIZE;
+    return (int)qBound((qint64)0, mapLength - bucketStart, (qint64)HASH_BUCKET_SIZE);
+}
+
+QByteArray DownloadFileMap::bucket(int bucketNumber) const
+{
+    return QByteArray::fromRawData(bucketData(bucketNumber), bucketLength(bucketNumber));
+}
+
+bool DownloadFileMap::flush()
+{
+#ifdef Q_WS_WIN
+    return FlushViewOfFile(base, 0) != 0;
+#else
+    return ::msync(base, mapLength, MS_SYNC) == 0;
+#endif
+}
+
+void DownloadFileMap::ref()
+{
+    refCount.ref();
+}
+
+void DownloadFileMap::deref()
+{
+    if (!refCount.deref())
+        delete this;
+}
+
+void DownloadFileMap::holdForHashing()
+{
+    ref();
+    QMutexLocker locker(&hashHolds()->mutex);
+    hashHolds()->holds[TTH].append(this);
+}
+
+void DownloadFileMap::releaseFromHashing(const QByteArray &tth)
+{
+    DownloadFileMap *map = 0;
+    {
+        QMutexLocker locker(&hashHolds()->mutex);
+        QHash<QByteArray, QList<DownloadFileMap *> >::iterator i = hashHolds()->holds.find(tth);
+        if (i == hashHolds()->holds.end())
+            return;
+        map = i.value().takeFirst();
+        if (i.value().isEmpty())
+            hashHolds()->holds.erase(i);
+    }
+    map->deref();
+}
+
+void DownloadFileMap::setEnabled(bool enabled)
+{
+    mappedDownloadsEnabled.fetchAndStoreRelaxed(enabled ? 1 : 0);
+}
+
+bool DownloadFileMap::isEnabled()
+{
+    return (int)mappedDownloadsEnabled != 0;
+}
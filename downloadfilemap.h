@@ -0,0 +1,73 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DOWNLOADFILEMAP_H
+#define DOWNLOADFILEMAP_H
+
+#include <QString>
+#include <QByteArray>
+#include <QAtomicInt>
+
+// Writable memory map of a whole .incomplete download file.
+//
+// Downloads used to land in 1MB QByteArray buckets that were hashed, queued to the bucket flush thread and only then
+// written to the file, so every byte was copied into the bucket and again into the page cache, and the buckets were
+// held for the whole trip. The file is now preallocated and mapped once when the download starts; the segments write
+// received data straight to its place in the file and the hasher reads it from there. A bucket that hashes fine is done,
+// one that does not is simply downloaded again over the same pages.
+//
+// Reference counted like MappedFileRegion: the transfer holds one reference and every bucket waiting in the hash thread
+// holds another, so that the pages stay mapped until the hasher is done with them even if the download goes away.
+
+class DownloadFileMap
+{
+public:
+    // Creates, preallocates and maps fileName + ".incomplete", keeping whatever it already holds.
+    // Returns 0 if the file can not be mapped, in which case the download should fall back to buckets.
+    // The caller holds the first reference.
+    static DownloadFileMap *open(const QString &fileName, qint64 fileSize, const QByteArray &tth);
+
+    char *bucketData(int bucketNumber) const;
+    int bucketLength(int bucketNumber) const;
+    // View of a bucket that does not copy it, only valid while a reference is held
+    QByteArray bucket(int bucketNumber) const;
+    qint64 size() const {return mapLength;}
+
+    // Writes the dirty pages back to the file
+    bool flush();
+
+    void ref();
+    void deref();
+
+    // Takes a reference for a bucket sent to the hash thread, released when its reply comes back
+    void holdForHashing();
+    static void releaseFromHashing(const QByteArray &tth);
+
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+
+private:
+    DownloadFileMap();
+    ~DownloadFileMap();
+
+    QAtomicInt refCount;
+    char *base;
+    qint64 mapLength;
+    QByteArray TTH;
+};
+
+#endif // DOWNLOADFILEMAP_H
@@ -1,9 +1,12 @@
 #include "downloadtransfer.h"
+#include "bytecursor.h"
+#include "bucketpool.h"
 #include <QThread>
 
 DownloadTransfer::DownloadTransfer(QObject *parent) : Transfer(parent)
 {
     downloadBucketTable = new QHash<int, QByteArray *>();
+    downloadFileMap = 0;
     transferRate = 0;
     transferProgress = 0;
     bytesWrittenSinceUpdate = 0;
@@ -11,15 +14,27 @@ DownloadTransfer::DownloadTransfer(QObject *parent) : Transfer(parent)
     initializationStateTimerBrakes = 0;
     status = TRANSFER_STATE_INITIALIZING;
     remoteHost = QHostAddress("0.0.0.0");
-    treeRequestHost = QHostAddress();
     //currentActiveSegments = 0;
-    hashTreeWindowEnd = 0;
+    hashTreeKnownEnd = 0;
+    nextHashTreeWindow = 0;
+    hashTreeRequestRotation = 0;
+    savedHashTreeLeafCount = -1;
     bucketHashQueueLength = 0;
     bucketFlushQueueLength = 0;
     iowait = false;
     treeUpdatesSinceTimer = 0;
     zeroSegmentTimeoutCount = 0;
 
+    segmentLimit = INITIAL_SIMULTANEOUS_SEGMENTS;
+    segmentLimitDecision = SegmentLimitHeld;
+    lastSegmentLimitChange = 0;
+    segmentControlHold = 0;
+    segmentControlTicks = 0;
+    segmentControlBytes = 0;
+    segmentControlSegmentTicks = 0;
+    segmentControlStalledTicks = 0;
+    lastControlGoodput = 0;
+
     transferRateCalculationTimer = new QTimer(this);
     //Rather use the frequency of updates from the GUI, otherwise bytes might be missing and it would be unreliable to determine total bytes sent/received
     // OK, that is fine, but this timer switches a transfer into stalled mode when nothing is going on.
@@ -55,14 +70,20 @@ DownloadTransfer::~DownloadTransfer()
     // save bucketFlushStateBitmap to db
     saveBucketStateBitmap();
 
+    // The flush thread keeps the .incomplete file open while we are around. Buckets still on their way get written first.
+    emit closeIncompleteFile(TTH);
+
     QHashIterator<int, QByteArray*> itdb(*downloadBucketTable);
     while (itdb.hasNext())
     {
         // TODO: save halwe buckets na files toe
-        delete itdb.next().value();
+        BucketPool::release(itdb.next().value());
     }
 
     delete downloadBucketTable;
+
+    if (downloadFileMap)
+        downloadFileMap->deref();
     
     QMapIterator<int, QByteArray*> ithb(downloadBucketHashLookupTable);
     while (ithb.hasNext())
@@ -90,10 +111,11 @@ DownloadTransfer::~DownloadTransfer()
 // Data packets that are related to our TTH gets dispatched to this entry point.
 // Here, we dispatch them to their relevant segments.
 // We perform binary lookups on transferSegmentTable on the offset in the datagram header and dispatch accordingly.
-void DownloadTransfer::incomingDataPacket(quint8, qint64 offset, QByteArray data)
+void DownloadTransfer::incomingDataPacket(quint8, qint64 offset, const char *data, int length)
 {
-    // If the segment is critically IO bound, we start dropping packets as a last resort
-    if (Q_UNLIKELY(bucketHashQueueLength + bucketFlushQueueLength > HASH_BUCKET_QUEUE_CRITICAL_THRESHOLD))
+    // If buckets are piling up faster than they can be hashed and flushed, we stop starting new ones as a last resort.
+    // Buckets already being filled can still complete and make room. Downloads into a mapped file do not hold buckets.
+    if (Q_UNLIKELY(!downloadFileMap && BucketPool::exhausted() && !downloadBucketTable->contains(calculateBucketNumber(offset))))
         return;
 
     // The iteration code below does not expect an empty table.
@@ -106,12 +128,12 @@ void DownloadTransfer::incomingDataPacket(quint8, qint64 offset, QByteArray data
     if (Q_UNLIKELY(i == transferSegmentTable.constEnd()))
         --i;
     if (Q_UNLIKELY(i.key() <= offset && i.value().segmentEnd >= offset))
-        i.value().transferSegment->incomingDataPacket(offset, data);
+        i.value().transferSegment->incomingDataPacket(offset, data, length);
     else if (Q_LIKELY(i != transferSegmentTable.constBegin()))
     {
         --i;
         if (Q_LIKELY(i.key() <= offset && i.value().segmentEnd >= offset))
-            i.value().transferSegment->incomingDataPacket(offset, data);
+            i.value().transferSegment->incomingDataPacket(offset, data, length);
     }
     // if the offset was not found like this, it probably is not in the map.
 
@@ -136,7 +158,14 @@ void DownloadTransfer::requestHashBucket(QByteArray rootTTH, int bucketNumber, Q
     {
         bucketHashQueueLength++;
         congestionTest();
-        emit hashBucketRequest(rootTTH, bucketNumber, *bucket, peer);
+        if (downloadFileMap)
+        {
+            // Hash straight from the file, the hasher keeps it mapped until it replies
+            downloadFileMap->holdForHashing();
+            emit hashBucketRequest(rootTTH, bucketNumber, downloadFileMap->bucket(bucketNumber), peer);
+        }
+        else
+            emit hashBucketRequest(rootTTH, bucketNumber, *bucket, peer);
         // This is to prevent double requests when bucket ends and segment ends coincide.
         // A failed hash check must reset this.
         bucketFlushStateBitmap[bucketNumber] = BucketFlushed;
@@ -144,6 +173,18 @@ void DownloadTransfer::requestHashBucket(QByteArray rootTTH, int bucketNumber, Q
     }
 }
 
+// Segments that hashed the bucket as it came in skip the hash pool
+void DownloadTransfer::bucketHashed(QByteArray, int bucketNumber, QByteArray bucketTTH, QHostAddress peer)
+{
+    if (bucketFlushStateBitmap.at(bucketNumber) != BucketNotFlushed)
+        return;
+
+    bucketHashQueueLength++;
+    bucketFlushStateBitmap[bucketNumber] = BucketFlushed;
+    transferSegmentStateBitmap[bucketNumber] = SegmentCurrentlyHashing;
+    hashBucketReply(bucketNumber, bucketTTH, peer);
+}
+
 // The hash thread calls this when it has finished calculating the tiger tree hash of a 1MB bucket
 void DownloadTransfer::hashBucketReply(int bucketNumber, QByteArray bucketTTH, QHostAddress peer)
 {
@@ -151,32 +192,48 @@ void DownloadTransfer::hashBucketReply(int bucketNumber, QByteArray bucketTTH, Q
     {
         if (*downloadBucketHashLookupTable.value(bucketNumber) == bucketTTH)
         {
-            flushBucketToDisk(bucketNumber);
+            // The leaf is good, so whoever failed this bucket before sent bad data
+            hashTreeLeafSources.remove(bucketNumber);
+            foreach (QHostAddress failedPeer, bucketMismatchPeers.take(bucketNumber))
+                checksumMismatch(failedPeer);
+
+            // A mapped bucket is in the file already. One that does not match is just downloaded over again.
+            if (downloadFileMap)
+                bucketDone(bucketNumber);
+            else
+                flushBucketToDisk(bucketNumber);
             //qDebug() << "DownloadTransfer::hashBucketReply() checksum matched, flushing bucket" << bucketNumber;
+            checkEndgameLosers(bucketNumber, true);
         }
         else
         {
             transferSegmentStateBitmap[bucketNumber] = SegmentNotDownloaded;
             bucketFlushStateBitmap[bucketNumber] = BucketNotFlushed;
-            if (downloadBucketTable->value(bucketNumber))
-                downloadBucketTable->value(bucketNumber)->clear();
+            BucketPool::release(downloadBucketTable->take(bucketNumber));
             qDebug() << "DownloadTransfer::hashBucketReply() checksum mismatch" << bucketNumber;
-            remotePeerInfoTable[peer].checksumMismatchCount++;
-            if (remotePeerInfoTable.value(peer).checksumMismatchCount >= 10)
+
+            // A leaf from another peer may be the wrong one. The data peer is only charged once the leaf proves
+            // good or it fails the same leaf again, and a leaf that different peers' data keeps failing is dropped
+            // and asked for elsewhere.
+            QHostAddress treePeer = hashTreeLeafSources.value(bucketNumber);
+            if (treePeer.isNull() || treePeer == peer || bucketMismatchPeers.value(bucketNumber).contains(peer))
+                checksumMismatch(peer);
+            else
             {
-                remotePeerInfoTable[peer].blacklisted = true;
-                if (remotePeerInfoTable.value(peer).transferSegment)
-                    segmentFailed(remotePeerInfoTable.value(peer).transferSegment);
+                bucketMismatchPeers[bucketNumber].append(peer);
+                if (bucketMismatchPeers.value(bucketNumber).size() >= HASH_TREE_LEAF_MISMATCH_LIMIT)
+                    dropHashTreeLeaves(treePeer);
             }
+            checkEndgameLosers(bucketNumber, false);
         }
     }
     else
     {
         transferSegmentStateBitmap[bucketNumber] = SegmentNotDownloaded;
         bucketFlushStateBitmap[bucketNumber] = BucketNotFlushed;
-        if (downloadBucketTable->value(bucketNumber))
-            downloadBucketTable->value(bucketNumber)->clear();
+        BucketPool::release(downloadBucketTable->take(bucketNumber));
         qDebug() << "DownloadTransfer::hashBucketReply() bucket hashed not in hash tree" << bucketNumber;
+        checkEndgameLosers(bucketNumber, false);
         emit requeue(this, true);
     }
 
@@ -185,19 +242,37 @@ void DownloadTransfer::hashBucketReply(int bucketNumber, QByteArray bucketTTH, Q
     congestionTest();
 }
 
+void DownloadTransfer::checksumMismatch(QHostAddress peer)
+{
+    if (!remotePeerInfoTable.contains(peer))
+        return;
+
+    remotePeerInfoTable[peer].checksumMismatchCount++;
+    if (remotePeerInfoTable.value(peer).checksumMismatchCount >= 10)
+    {
+        remotePeerInfoTable[peer].blacklisted = true;
+        if (remotePeerInfoTable.value(peer).transferSegment)
+            segmentFailed(remotePeerInfoTable.value(peer).transferSegment);
+    }
+}
+
 // Our hash tree request's answers are sequentially dispatched to this entry point.
-void DownloadTransfer::TTHTreeReply(QByteArray tree)
+// Only leaves from a window that was asked from that peer are taken.
+void DownloadTransfer::TTHTreeReply(QHostAddress peer, QByteArray tree)
 {
     int iter = 0;
-    while (tree.length() >= 29)
+    ByteReader reader(tree);
+    while (reader.remaining() >= 29)
     {
-        int bucketNumber = getQuint32FromByteArray(&tree);
-        quint8 tthLength = getQuint8FromByteArray(&tree);
-        QByteArray *bucketHash = new QByteArray(tree.left(tthLength));
-        tree.remove(0, tthLength);
-        if (!downloadBucketHashLookupTable.contains(bucketNumber))
+        int bucketNumber = reader.readUInt32();
+        quint8 tthLength = reader.readUInt8();
+        const char *tth = reader.readBytes(tthLength);
+        if (!tth)
+            break;
+        if (!downloadBucketHashLookupTable.contains(bucketNumber) && isHashTreeLeafRequested(bucketNumber, peer))
         {
-            downloadBucketHashLookupTable.insert(bucketNumber, bucketHash);
+            downloadBucketHashLookupTable.insert(bucketNumber, new QByteArray(tth, tthLength));
+            hashTreeLeafSources.insert(bucketNumber, peer);
             iter++;
         }
     }
@@ -206,37 +281,41 @@ void DownloadTransfer::TTHTreeReply(QByteArray tree)
 
     treeUpdatesSinceTimer += iter;
 
-    //int prev = -1;
-    //QMapIterator<int, QByteArray*> i(downloadBucketHashLookupTable);
-    //while (i.hasNext())
-    //{
-    //    i.next();
-    //    if (i.key() == prev + 1)
-    //        prev++;
-    //    else
-    //        break;
-    //}
-    // Replacing above to use same method of checking for the highest index, seems like less work.
-    // BIG TODO: make sure that downloadBucketHashLookupTable gets populated with data from database if present.
-
-    int lastHashBucketReceived = getLastHashBucketNumberReceived();
-    int lastBucket = calculateBucketNumber(fileSize);
-    lastBucket = fileSize % HASH_BUCKET_SIZE == 0 ? lastBucket - 1 : lastBucket;
-
-    if (lastHashBucketReceived == hashTreeWindowEnd)
-        requestHashTree(lastHashBucketReceived);
-
-    //Start downloading if total hash tree has been downloaded
-    else if (lastHashBucketReceived == lastBucket)
+    while (downloadBucketHashLookupTable.contains(hashTreeKnownEnd))
+        hashTreeKnownEnd++;
+
+    // Keep the rest of the tree coming while the buckets we have leaves for are downloaded
+    requestHashTree();
+
+    // Downloading starts with the first leaves, buckets only wait for their own
+    if (status == TRANSFER_STATE_INITIALIZING)
+        startRunning();
+    else if (status & (TRANSFER_STATE_RUNNING | TRANSFER_STATE_STALLED))
+        addIdleSegments();
+}
+
+void DownloadTransfer::startRunning()
+{
+    status = TRANSFER_STATE_RUNNING;
+    QHashIterator<QHostAddress, RemotePeerInfoStruct> i(remotePeerInfoTable);
+    while (i.hasNext())
     {
-        status = TRANSFER_STATE_RUNNING;
-        QHashIterator<QHostAddress, RemotePeerInfoStruct> i(remotePeerInfoTable);
-        while (i.hasNext())
-        {
-            i.next();
-            if (i.value().transferSegment)
-                i.value().transferSegment->startDownloading();
-        }
+        i.next();
+        if (i.value().transferSegment)
+            i.value().transferSegment->startDownloading();
+    }
+    addIdleSegments();
+}
+
+// Segments retire when they run out of buckets with known leaves, new leaves put idle peers back to work
+void DownloadTransfer::addIdleSegments()
+{
+    while (currentActiveSegments() < segmentLimit)
+    {
+        int segments = currentActiveSegments();
+        addIdleSegment();
+        if (currentActiveSegments() == segments)
+            break;
     }
 }
 
@@ -246,8 +325,12 @@ int DownloadTransfer::getTransferType()
 }
 
 // Restore transfer segment block state bitmaps if the database knows about them
-void DownloadTransfer::setBucketFlushStateBitmap(QByteArray bitmap)
+void DownloadTransfer::setBucketFlushStateBitmap(QByteArray bitmap, QByteArray leaves)
 {
+    // The leaves belong to the TTH, they are good whether or not the file is still there.
+    // With them in, the transfer timer moves the download to running without asking the network for its tree.
+    restoreHashTreeLeaves(leaves);
+
     // if file does not exist (.incomplete file moved or deleted), do not restore bitmap
     // setFileName() should have been called by now, otherwise fileExists == false.
     if (!fileExists)
@@ -295,6 +378,13 @@ void DownloadTransfer::startTransfer()
         for (int i = 0; i <= lastBucketNumber; i++)
             bucketFlushStateBitmap.append(BucketNotFlushed);
 
+    // Receive straight into the file if it can be mapped, into buckets otherwise
+    if (!downloadFileMap)
+    {
+        downloadFileMap = DownloadFileMap::open(filePathName, fileSize, TTH);
+        setSegmentsDownloadFileMap(downloadFileMap);
+    }
+
     transferTimer->start();
     timerBrakes = 0;
 }
@@ -335,7 +425,12 @@ void DownloadTransfer::transferRateCalculation()
     else if ((status == TRANSFER_STATE_STALLED) && (bytesWrittenSinceCalculation > 0))
         status = TRANSFER_STATE_RUNNING;
 
+    segmentControlTick();
     bytesWrittenSinceCalculation = 0;
+
+    // Other downloads may have released the buckets we were waiting for
+    if (iowait)
+        congestionTest();
     // snapshot the transfer rate as the amount of bytes written in the last second
     //transferRate = bytesWrittenSinceUpdate;
     //bytesWrittenSinceUpdate = 0;
@@ -359,7 +454,7 @@ void DownloadTransfer::flushBucketToDisk(int &bucketNumber)
     congestionTest();
     downloadBucketTable->remove(bucketNumber); // just remove entry, bucket pointer gets deleted in BucketFlushThread
     transferSegmentStateBitmap[bucketNumber] = SegmentCurrentlyFlushing;
-    emit flushBucketDirect(filePathName, bucketNumber, bucketPtr, TTH);
+    emit flushBucketDirect(filePathName, bucketNumber, bucketPtr, TTH, fileSize);
 }
 
 // This timer event is mainly used to negotiate the transfer of hash trees before the segments are created and the download begins.
@@ -375,27 +470,20 @@ void DownloadTransfer::transferTimerEvent()
                 timerBrakes = 0;
             return;
         }
-        int lastHashBucketReceived = getLastHashBucketNumberReceived();
-
-        int lastBucket = calculateBucketNumber(fileSize);
-        lastBucket = fileSize % HASH_BUCKET_SIZE == 0 ? lastBucket - 1 : lastBucket;
-        if (lastHashBucketReceived == lastBucket)
-        {
-            status = TRANSFER_STATE_RUNNING;
-            QHashIterator<QHostAddress, RemotePeerInfoStruct> i(remotePeerInfoTable);
-            while (i.hasNext())
-            {
-                i.next();
-                if (i.value().transferSegment)
-                    i.value().transferSegment->startDownloading();
-            }
-        }
+        if (!downloadBucketHashLookupTable.isEmpty() || getTotalFileSegments() == 0)
+            startRunning();
         else if (treeUpdatesSinceTimer == 0)
+            requestHashTree();
+        treeUpdatesSinceTimer = 0;
+    }
+    // The rest of the tree is fetched alongside the data, windows that went missing are asked for again here
+    else if (hashTreeKnownEnd < getTotalFileSegments() && (status & (TRANSFER_STATE_RUNNING | TRANSFER_STATE_STALLED)))
+    {
+        if (++timerBrakes >= 50)
         {
-            requestHashTree(lastHashBucketReceived, true);
-            qDebug() << "Timer request TTH tree " << lastHashBucketReceived + 1;
+            timerBrakes = 0;
+            requestHashTree();
         }
-        treeUpdatesSinceTimer = 0;
     }
 }
 
@@ -407,14 +495,29 @@ inline int DownloadTransfer::calculateBucketNumber(quint64 fileOffset)
 // This gets called when a segment completes to perform some bookkeeping and allocate resources to download some more if applicable.
 void DownloadTransfer::segmentCompleted(TransferSegment *segment)
 {
-    qint64 lastTransferTime = QDateTime::currentMSecsSinceEpoch() - segment->getSegmentStartTime();
-    int lastSegmentLength = (segment->getSegmentEnd() - segment->getSegmentStart()) / HASH_BUCKET_SIZE;
-    int nextSegmentLengthHint = (10000 / lastTransferTime) * lastSegmentLength;
-    if (nextSegmentLengthHint == 0)
-        nextSegmentLengthHint = 1;
+    updatePeerEstimates(segment);
+
+    // First copy of endgame buckets in. The other one stops once they have been checked against their leaves, in
+    // case this copy turns out to be bad.
+    TransferSegment *partner = getEndgamePartner(segment);
+    if (partner)
+    {
+        endgameDuplicates.remove(segment);
+        endgameDuplicates.remove(partner);
+        removeTransferSegmentTableEntry(partner);
+        endgameLosers.insert(partner);
+        checkEndgameLosers(calculateBucketNumber(partner->getSegmentStart()), true);
+    }
+    endgameLosers.remove(segment);
 
-    transferSegmentTable.remove(segment->getSegmentStart());
-    downloadNextAvailableChunk(segment, nextSegmentLengthHint);
+    removeTransferSegmentTableEntry(segment);
+    // The segment controller lowered the limit, let this one go instead of giving it more work
+    if (currentActiveSegments() >= segmentLimit)
+    {
+        retireSegment(segment);
+        return;
+    }
+    downloadNextAvailableChunk(segment);
 }
 
 // This gets called when a segment fails and we need to perform some cleaning duties.
@@ -425,17 +528,37 @@ void DownloadTransfer::segmentFailed(TransferSegment *segment, quint8 error, boo
     // remote end dead, segment given up hope. mark everything not downloaded as not downloaded, so that
     // the block allocator can give them to other segments that do work.
     // do not worry if this is the last working segment, if it breaks, it can resume on successful TTH search reply.
+    // An endgame partner carries on by itself and keeps the buckets the two of them shared.
+    TransferSegment *partner = getEndgamePartner(segment);
+    qint64 partnerStart = 0;
+    qint64 partnerEnd = 0;
+    endgameLosers.remove(segment);
+    if (partner)
+    {
+        endgameDuplicates.remove(segment);
+        endgameDuplicates.remove(partner);
+        partnerStart = partner->getSegmentStart();
+        partnerEnd = partner->getSegmentEnd();
+    }
+
     int startBucket = calculateBucketNumber(segment->getSegmentStart());
     int endBucket = calculateBucketNumber(segment->getSegmentEnd());
     for (int i = startBucket; i <= endBucket; i++)
-        if (transferSegmentStateBitmap.at(i) == SegmentCurrentlyDownloading)
+        if (transferSegmentStateBitmap.at(i) == SegmentCurrentlyDownloading &&
+            !((qint64)i * HASH_BUCKET_SIZE >= partnerStart && (qint64)i * HASH_BUCKET_SIZE < partnerEnd))
         {
             transferSegmentStateBitmap[i] = SegmentNotDownloaded;
-            if (downloadBucketTable->value(i))
-                downloadBucketTable->value(i)->clear();
+            BucketPool::release(downloadBucketTable->take(i));
         }
 
-    transferSegmentTable.remove(segment->getSegmentStart());
+    removeTransferSegmentTableEntry(segment);
+    if (partner && !transferSegmentTable.contains(partnerStart))
+    {
+        TransferSegmentTableStruct t;
+        t.segmentEnd = partnerEnd;
+        t.transferSegment = partner;
+        transferSegmentTable.insert(partnerStart, t);
+    }
     // currently the object keeps sitting in remotePeerInfoTable and gets destroyed once the download completes.
     // this can be improved (TODO)
     // UPDATE: see if this breaks anything.
@@ -479,19 +602,7 @@ void DownloadTransfer::segmentFailed(TransferSegment *segment, quint8 error, boo
     // When a segment fails, it gets destroyed. Its funeral process should clean up behind it so that there are
     // no more clever pointers trying to find it or transferSegmentTable entries trying to get at it.
     if (startIdleSegment)
-    {
-        QHostAddress nextPeer = getBestIdlePeer();
-        if (!nextPeer.isNull())
-        {
-            TransferSegment *download = createTransferSegment(nextPeer);
-            if (download)
-            {
-                //currentActiveSegments++;
-                //remotePeerInfoTable[nextPeer].transferSegment = download;
-                downloadNextAvailableChunk(download);
-            }
-        }
-    }
+        addIdleSegment();
 }
 
 // This is the segment block allocator.
@@ -506,12 +617,14 @@ SegmentOffsetLengthStruct DownloadTransfer::getSegmentForDownloading(int segment
     int longestSegmentLength = 0;
     int currentSegmentStart = 0;
     int currentSegmentLength = 0;
-    char lastSegmentState = SegmentDownloaded;
+    bool lastBucketFree = false;
     for (int i = 0; i < transferSegmentStateBitmap.length(); i++)
     {
-        if (transferSegmentStateBitmap.at(i) == SegmentNotDownloaded)
+        // Buckets whose leaf has not arrived yet wait for the hash tree
+        bool bucketFree = transferSegmentStateBitmap.at(i) == SegmentNotDownloaded && isBucketVerifiable(i);
+        if (bucketFree)
         {
-            if (lastSegmentState != SegmentNotDownloaded)
+            if (!lastBucketFree)
             {
                 currentSegmentStart = i;
                 currentSegmentLength = 1;
@@ -534,7 +647,7 @@ SegmentOffsetLengthStruct DownloadTransfer::getSegmentForDownloading(int segment
                 longestSegmentLength = currentSegmentLength;
             }
         }
-        lastSegmentState = transferSegmentStateBitmap.at(i);
+        lastBucketFree = bucketFree;
     }
     segment.segmentBucketOffset = longestSegmentStart;
     segment.segmentBucketCount = longestSegmentLength;
@@ -556,21 +669,9 @@ void DownloadTransfer::receivedPeerProtocolCapability(QHostAddress peer, quint8
     if (remotePeerInfoRequestPool.isEmpty())
         protocolCapabilityRequestTimer->stop();
 
-    if (currentActiveSegments() < MAXIMUM_SIMULTANEOUS_SEGMENTS)
-    {
-        // Do not necessarily use this peer for the next segment, rather ask getBestIdlePeer() in case this one is already busy in another segment.
-        QHostAddress nextPeer = getBestIdlePeer();
-        TransferSegment *download = 0;
-        if (!nextPeer.isNull())
-            download = createTransferSegment(nextPeer);
-
-        if (download)
-        {
-            //currentActiveSegments++;
-            //remotePeerInfoTable[peer].transferSegment = download;
-            downloadNextAvailableChunk(download);
-        }
-    }
+    // Do not necessarily use this peer for the next segment, rather ask getBestIdlePeer() in case this one is already busy in another segment.
+    if (currentActiveSegments() < segmentLimit)
+        addIdleSegment();
 }
 
 // Add a peer to remotePeerInfoTable
@@ -585,9 +686,8 @@ void DownloadTransfer::newPeer(QHostAddress peer, quint8 protocols, QByteArray c
         rpis.transferSegment = 0;
         rpis.failureCount = 0;
         rpis.blacklisted = false;
-        rpis.lastStartTime = 0;
-        rpis.lastBytesQueued = 0;
-        rpis.lastTransferRate = 0;
+        rpis.throughputEstimate = 0;
+        rpis.rttEstimate = 0;
         rpis.checksumMismatchCount = 0;
         rpis.cid = cid;
         remotePeerInfoTable.insert(peer, rpis);
@@ -617,6 +717,7 @@ TransferSegment* DownloadTransfer::createTransferSegment(QHostAddress peer)
 
             remotePeerInfoTable[peer].transferSegment = download;
             download->setDownloadBucketTablePointer(downloadBucketTable);
+            download->setDownloadFileMap(downloadFileMap);
             download->setRemoteHost(peer);
             download->setTTH(TTH);
             download->setFileSize(fileSize);
@@ -642,9 +743,11 @@ TransferSegment* DownloadTransfer::newConnectedTransferSegment(TransferProtocol
     case uTPProtocol:
         download = new uTPTransferSegment(this);
         break;
-    case BasicTransferProtocol:
     case ArpmanetFECProtocol:
-        return download;
+        download = new FECTransferSegment(this);
+        break;
+    case BasicTransferProtocol:
+        download = new BTPTransferSegment(this);
         break;
     default:
         return download;
@@ -653,8 +756,11 @@ TransferSegment* DownloadTransfer::newConnectedTransferSegment(TransferProtocol
     emit setTransferSegmentPointer(download->getSegmentId(), download);
 
     connect(download, SIGNAL(hashBucketRequest(QByteArray,int,QByteArray*,QHostAddress)), this, SLOT(requestHashBucket(QByteArray,int,QByteArray*,QHostAddress)));
+    connect(download, SIGNAL(bucketHashed(QByteArray,int,QByteArray,QHostAddress)), this, SLOT(bucketHashed(QByteArray,int,QByteArray,QHostAddress)));
     connect(download, SIGNAL(sendDownloadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32,QByteArray)),
             this, SIGNAL(sendDownloadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32,QByteArray)));
+    connect(download, SIGNAL(sendSelectiveDownloadRequest(quint8,QHostAddress,QByteArray,QByteArray,quint32,QByteArray)),
+            this, SIGNAL(sendSelectiveDownloadRequest(quint8,QHostAddress,QByteArray,QByteArray,quint32,QByteArray)));
     connect(download, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)), this, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)));
     connect(transferTimer, SIGNAL(timeout()), download, SLOT(transferTimerEvent()));
     connect(download, SIGNAL(requestNextSegment(TransferSegment*)), this, SLOT(segmentCompleted(TransferSegment*)));
@@ -667,8 +773,13 @@ TransferSegment* DownloadTransfer::newConnectedTransferSegment(TransferProtocol
 // Get next chunk from block allocator
 // Update incoming packet dispatch segment map
 // Call startDownloading() in segment
-void DownloadTransfer::downloadNextAvailableChunk(TransferSegment *download, int length, int recursionLimit)
+void DownloadTransfer::downloadNextAvailableChunk(TransferSegment *download, int recursionLimit)
 {
+    int length = getSegmentLengthHint(download->getSegmentRemotePeer());
+    // Towards the end, the last buckets go out one at a time so that they spread over all peers
+    if (getUnallocatedBlockCount() <= ENDGAME_BUCKET_THRESHOLD)
+        length = 1;
+
     TransferSegmentTableStruct t;
     SegmentOffsetLengthStruct s = getSegmentForDownloading(length);
     qint64 segmentStart = (qint64)s.segmentBucketOffset * HASH_BUCKET_SIZE;
@@ -687,49 +798,25 @@ void DownloadTransfer::downloadNextAvailableChunk(TransferSegment *download, int
         t.transferSegment = download;
         transferSegmentTable.insert(segmentStart, t);
 
-        // calculate survival of the fittest stats
-        qint64 currentTime = QDateTime::currentMSecsSinceEpoch();
-        int delta = currentTime - remotePeerInfoTable.value(h).lastStartTime;
-        remotePeerInfoTable[h].lastTransferRate = remotePeerInfoTable.value(h).lastBytesQueued / delta;
-        remotePeerInfoTable[h].lastStartTime = currentTime;
-        remotePeerInfoTable[h].lastBytesQueued = t.segmentEnd - segmentStart;
-
         // commence transfer
         download->startDownloading();
     }
+    else if (getUnallocatedBlockCount() > 0)
+    {
+        // What is left waits for its hash tree leaves, the peer gets new work when they arrive
+        retireSegment(download);
+    }
     else if (recursionLimit > 0 && remotePeerInfoTable.contains(download->getSegmentRemotePeer()))
     {
-        // first we identify a slow segment for hostile takeover
-        TransferSegment *slowSegment = getSlowestActivePeer();
-        if (slowSegment && slowSegment != download)
+        // Nothing left to allocate: endgame. Rather than killing the slowest segment, download its buckets in parallel.
+        if (startEndgameSegment(download))
         {
-            qDebug() << "DownloadTransfer::downloadNextAvailableChunk() kick slow segment" << slowSegment->getSegmentId() << slowSegment;
-            segmentFailed(slowSegment, SlowSegmentHostileTakeover, false);
-            downloadNextAvailableChunk(download, 1, --recursionLimit);
+            qDebug() << "DownloadTransfer::downloadNextAvailableChunk() endgame duplicate" << download->getSegmentId() << download;
         }
         else // if unsuccessful, we are done here.
         {
-            QMutableHashIterator<QHostAddress, RemotePeerInfoStruct> mi(remotePeerInfoTable);
-            int count = 0;
-            while (mi.hasNext())
-            {
-                mi.next();
-                if (mi.value().transferSegment == download)
-                {
-                    mi.value().transferSegment = 0;
-                    count++;
-                }
-            }
-            //remotePeerInfoTable[h].transferSegment = 0;
-
             qDebug() << "DownloadTransfer::downloadNextAvailableChunk() no more blocks to download, destroying:" << download << remotePeerInfoTable[h].transferSegment << h;
-            remotePeerInfoTable[h].bytesTransferred = download->getBytesTransferred();
-            emit unflagDownloadPeer(h);
-            quint32 segmentId = download->getSegmentId();
-            emit removeTransferSegmentPointer(segmentId);
-            download->deleteLater();
-            //delete download;
-            //currentActiveSegments--;
+            retireSegment(download);
         }
     }
     else if (recursionLimit > 0)
@@ -740,7 +827,7 @@ void DownloadTransfer::downloadNextAvailableChunk(TransferSegment *download, int
 
 void DownloadTransfer::TTHSearchTimerEvent()
 {
-    if (currentActiveSegments() < MAXIMUM_SIMULTANEOUS_SEGMENTS)
+    if (currentActiveSegments() < segmentLimit)
         emit searchTTHAlternateSources(TTH);
     if (tthSearchInterval < 300000)  // 5 min max interval
         tthSearchInterval += tthSearchInterval;
@@ -763,12 +850,15 @@ int DownloadTransfer::getTransferProgress()
     qint64 dataReceivedNotFlushed = 0;
     int segmentsActive = 0;
 
-    //Go through all active segments and check the amount of data received
-    //UPDATE: actually, we only need to iterate downloadBucketTable - otherwise every segment ends up doing it and counting n * bytesReceivedNotFlushed.
-    foreach (QByteArray *data, *downloadBucketTable)
-        dataReceivedNotFlushed += data->size();
+    // Buckets come at their full size and mapped downloads have none at all, so bucket sizes say nothing about
+    // what arrived. Complete buckets that are still being checked or written count whole.
+    for (int i = 0; i < transferSegmentStateBitmap.length(); i++)
+    {
+        if (transferSegmentStateBitmap.at(i) == SegmentCurrentlyHashing || transferSegmentStateBitmap.at(i) == SegmentCurrentlyFlushing)
+            dataReceivedNotFlushed += HASH_BUCKET_SIZE;
+    }
 
-    // Count data inside segments not yet tipped into buckets. (FECTP et al)
+    // Each segment counts what it received into the buckets it is still filling
     foreach (TransferSegmentTableStruct t, transferSegmentTable)
     {
         if (t.transferSegment)
@@ -792,18 +882,6 @@ QByteArray DownloadTransfer::getTransferStateBitmap()
     return transferSegmentStateBitmap;
 }
 
-int DownloadTransfer::getLastHashBucketNumberReceived()
-{
-    int lastHashBucketReceived = -1;
-    if (!downloadBucketHashLookupTable.isEmpty())
-    {
-        QMap<int, QByteArray*>::const_iterator i = downloadBucketHashLookupTable.constEnd();
-        --i;
-        lastHashBucketReceived = i.key();
-    }
-    return lastHashBucketReceived;
-}
-
 int DownloadTransfer::getSegmentCount()
 {
     return currentActiveSegments();
@@ -811,14 +889,15 @@ int DownloadTransfer::getSegmentCount()
 
 SegmentStatusStruct DownloadTransfer::getSegmentStatuses()
 {
-    SegmentStatusStruct s = {0,0,0,0,0};
+    SegmentStatusStruct s = {0,0,0,0,0,segmentLimit,segmentLimitDecision};
         
     //Iterate through segments and test statuses
-    QMapIterator<qint64, TransferSegmentTableStruct> i(transferSegmentTable);
-    while (i.hasNext())
+    QList<TransferSegment *> segments = endgameDuplicates.keys() + endgameLosers.toList();
+    foreach (TransferSegmentTableStruct t, transferSegmentTable)
+        segments.append(t.transferSegment);
+    foreach (TransferSegment *segment, segments)
     {
-        i.next();
-        int status = i.value().transferSegment->getSegmentStatus();
+        int status = segment->getSegmentStatus();
         switch (status)
         {
         case TRANSFER_STATE_RUNNING:
@@ -843,37 +922,66 @@ SegmentStatusStruct DownloadTransfer::getSegmentStatuses()
 }
 
 void DownloadTransfer::incomingTransferError(qint64 offset, quint8 error)
+{
+    TransferSegment *t = getSegmentForOffset(offset);
+    if (t)
+        segmentFailed(t, error);
+}
+
+// The peer has no slot for us yet, the segment holds back until it is worth asking again
+void DownloadTransfer::incomingUploadQueued(QHostAddress fromHost, qint64 offset, int position, int retryMsecs)
+{
+    TransferSegment *t = getSegmentForOffset(offset);
+    if (t && t->getSegmentRemotePeer() == fromHost)
+        t->uploadQueued(position, retryMsecs);
+}
+
+TransferSegment *DownloadTransfer::getSegmentForOffset(qint64 offset)
 {
     if (transferSegmentTable.isEmpty())
-        return;
+        return 0;
 
-    TransferSegment *t =0;
     QMap<qint64, TransferSegmentTableStruct>::const_iterator i = transferSegmentTable.upperBound(offset);
     if (Q_UNLIKELY(i == transferSegmentTable.constEnd()))
         --i;
     if (Q_UNLIKELY(i.key() <= offset && i.value().segmentEnd >= offset))
-        t = i.value().transferSegment;
+        return i.value().transferSegment;
     else if (Q_LIKELY(i != transferSegmentTable.constBegin()))
     {
         --i;
         if (Q_LIKELY(i.key() <= offset && i.value().segmentEnd >= offset))
-            t = i.value().transferSegment;
+            return i.value().transferSegment;
     }
-    if (t)
-        segmentFailed(t, error);
+    return 0;
 }
 
+// A bucket that was queued twice is answered twice, it is only done once
 void DownloadTransfer::bucketFlushed(int bucketNo)
 {
     bucketFlushQueueLength--;
     congestionTest();
-    transferSegmentStateBitmap[bucketNo] = SegmentDownloaded;
+    if (transferSegmentStateBitmap.at(bucketNo) != SegmentDownloaded)
+        bucketDone(bucketNo);
+}
+
+// A bucket is verified and in the file, see if that was the last one.
+void DownloadTransfer::bucketDone(int bucketNumber)
+{
+    transferSegmentStateBitmap[bucketNumber] = SegmentDownloaded;
 
     int segmentsDone = getSegmentsDone();
     int fileBuckets = getTotalFileSegments();
     if (segmentsDone ==  fileBuckets)
     {
         status = TRANSFER_STATE_FINISHED;
+        // Write the pages back and unmap the file before it is renamed. Stray packets still in flight go to buckets.
+        if (downloadFileMap)
+        {
+            setSegmentsDownloadFileMap(0);
+            downloadFileMap->flush();
+            downloadFileMap->deref();
+            downloadFileMap = 0;
+        }
         emit renameIncompleteFile(filePathName); // TODO: revisit this when fixing resumable downloads
         emit transferFinished(TTH);
 
@@ -883,6 +991,16 @@ void DownloadTransfer::bucketFlushed(int bucketNo)
     }
 }
 
+// uTP segments are not our children, the peer table knows them
+void DownloadTransfer::setSegmentsDownloadFileMap(DownloadFileMap *map)
+{
+    foreach (TransferSegment *segment, findChildren<TransferSegment *>())
+        segment->setDownloadFileMap(map);
+    foreach (RemotePeerInfoStruct peerInfo, remotePeerInfoTable)
+        if (peerInfo.transferSegment)
+            peerInfo.transferSegment->setDownloadFileMap(map);
+}
+
 void DownloadTransfer::bucketFlushFailed(int bucketNo)
 {
     bucketFlushQueueLength--;
@@ -896,7 +1014,10 @@ void DownloadTransfer::congestionTest()
 {
     //qDebug() << "DownloadTransfer::congestionTest(): hash queue : bucket queue " << bucketHashQueueLength << bucketFlushQueueLength;
     QHashIterator<QHostAddress, RemotePeerInfoStruct> i(remotePeerInfoTable);
-    if (!iowait && (bucketFlushQueueLength + bucketHashQueueLength > HASH_BUCKET_QUEUE_CONGESTION_THRESHOLD))
+    // Buckets are shared by all downloads, when too many are out the ones with buckets waiting to be hashed or flushed wait
+    // for them. Those that only hold half filled buckets carry on, or nobody would ever give any back.
+    bool memoryPressure = !downloadFileMap && BucketPool::underPressure() && bucketFlushQueueLength + bucketHashQueueLength > 0;
+    if (!iowait && (memoryPressure || bucketFlushQueueLength + bucketHashQueueLength > HASH_BUCKET_QUEUE_CONGESTION_THRESHOLD))
     {
         iowait = true;
         status = TRANSFER_STATE_IOWAIT;
@@ -908,7 +1029,7 @@ void DownloadTransfer::congestionTest()
                 s->pauseDownload();
         }
     }
-    else if (iowait && (bucketFlushQueueLength + bucketHashQueueLength <= HASH_BUCKET_QUEUE_CONGESTION_THRESHOLD / 4))
+    else if (iowait && !memoryPressure && (bucketFlushQueueLength + bucketHashQueueLength <= HASH_BUCKET_QUEUE_CONGESTION_THRESHOLD / 4))
     {
         iowait = false;
         status = TRANSFER_STATE_RUNNING;
@@ -922,26 +1043,150 @@ void DownloadTransfer::congestionTest()
     }
 }
 
-void DownloadTransfer::requestHashTree(int lastHashBucketReceived, bool timerRequest)
+// Keeps HASH_TREE_PARALLEL_WINDOWS windows of the hash tree on their way, spread over the peers, instead of asking one
+// peer for one window after the other. Windows that are not in after HASH_TREE_REQUEST_TIMEOUT are asked for again,
+// from their first missing leaf, from the next peer in turn.
+void DownloadTransfer::requestHashTree()
 {
-    if (!remotePeerInfoTable.isEmpty() && timerRequest)
+    QList<QHostAddress> peers;
+    QList<QHostAddress> distrustedPeers;
+    QHashIterator<QHostAddress, RemotePeerInfoStruct> it(remotePeerInfoTable);
+    while (it.hasNext())
     {
-        int n = (int)((double)qrand() / RAND_MAX * remotePeerInfoTable.size());
-        QHashIterator<QHostAddress, RemotePeerInfoStruct> it(remotePeerInfoTable);
-        for (int i = 0; i <= n; i++)
-            if (it.hasNext())
-                treeRequestHost = it.next().key();
+        it.next();
+        if (it.value().blacklisted)
+            continue;
+        if (distrustedTreePeers.contains(it.key()))
+            distrustedPeers.append(it.key());
+        else
+            peers.append(it.key());
     }
-    if (!treeRequestHost.isNull())
+    if (peers.isEmpty())
+        peers = distrustedPeers;
+    if (peers.isEmpty())
     {
-        emit TTHTreeRequest(treeRequestHost, TTH, lastHashBucketReceived + 1, HASH_TREE_WINDOW_LENGTH);
-        hashTreeWindowEnd = lastHashBucketReceived + HASH_TREE_WINDOW_LENGTH;
-        qDebug() << "Request TTH tree " << lastHashBucketReceived + 1 << calculateBucketNumber(fileSize);
+        qDebug() << "Request TTH tree: no peers to ask, not sent.";
+        return;
     }
-    else
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMap<int, HashTreeRequestStruct> requests;
+    QMapIterator<int, HashTreeRequestStruct> i(hashTreeRequests);
+    while (i.hasNext())
+    {
+        i.next();
+        int firstMissing = qMax(i.key(), hashTreeKnownEnd);
+        while (firstMissing < i.value().windowEnd && downloadBucketHashLookupTable.contains(firstMissing))
+            firstMissing++;
+        if (firstMissing >= i.value().windowEnd)
+            continue;
+        if (now - i.value().requestTime < HASH_TREE_REQUEST_TIMEOUT)
+            requests.insert(i.key(), i.value());
+        else
+            requests.insert(firstMissing, sendHashTreeRequest(firstMissing, i.value().windowEnd, peers, now));
+    }
+
+    int totalBuckets = getTotalFileSegments();
+    while (requests.size() < HASH_TREE_PARALLEL_WINDOWS && nextHashTreeWindow < totalBuckets)
+    {
+        // Leaves restored from the database are not asked for again
+        if (downloadBucketHashLookupTable.contains(nextHashTreeWindow))
+        {
+            nextHashTreeWindow++;
+            continue;
+        }
+        int windowEnd = qMin(nextHashTreeWindow + HASH_TREE_WINDOW_LENGTH, totalBuckets);
+        requests.insert(nextHashTreeWindow, sendHashTreeRequest(nextHashTreeWindow, windowEnd, peers, now));
+        nextHashTreeWindow = windowEnd;
+    }
+    hashTreeRequests = requests;
+}
+
+HashTreeRequestStruct DownloadTransfer::sendHashTreeRequest(int windowStart, int windowEnd, const QList<QHostAddress> &peers, qint64 now)
+{
+    HashTreeRequestStruct request;
+    request.windowEnd = windowEnd;
+    request.host = peers.at(hashTreeRequestRotation++ % peers.size());
+    request.requestTime = now;
+    emit TTHTreeRequest(request.host, TTH, windowStart, windowEnd - windowStart);
+    qDebug() << "Request TTH tree " << request.host << windowStart << windowEnd << getTotalFileSegments();
+    return request;
+}
+
+// A bucket can only be downloaded once its leaf is here to check it against
+bool DownloadTransfer::isBucketVerifiable(int bucketNumber)
+{
+    return bucketNumber < hashTreeKnownEnd || downloadBucketHashLookupTable.contains(bucketNumber);
+}
+
+bool DownloadTransfer::isHashTreeLeafRequested(int bucketNumber, QHostAddress peer)
+{
+    QMapIterator<int, HashTreeRequestStruct> i(hashTreeRequests);
+    while (i.hasNext())
+    {
+        i.next();
+        if (i.key() > bucketNumber)
+            break;
+        if (bucketNumber < i.value().windowEnd && i.value().host == peer)
+            return true;
+    }
+    return false;
+}
+
+// The root TTH is a hash of the whole file and cannot vouch for single leaves, so a leaf is judged by the data:
+// once the data of different peers keeps failing against it, every leaf from that peer not yet borne out by a
+// matching bucket is dropped and asked for again from the other peers.
+void DownloadTransfer::dropHashTreeLeaves(QHostAddress treePeer)
+{
+    QList<int> dropped;
+    QMutableHashIterator<int, QHostAddress> i(hashTreeLeafSources);
+    while (i.hasNext())
+    {
+        i.next();
+        if (i.value() != treePeer)
+            continue;
+        dropped.append(i.key());
+        delete downloadBucketHashLookupTable.take(i.key());
+        bucketMismatchPeers.remove(i.key());
+        i.remove();
+    }
+    if (dropped.isEmpty())
+        return;
+
+    qSort(dropped);
+    qDebug() << "DownloadTransfer::dropHashTreeLeaves()" << treePeer << dropped.size() << "leaves from bucket" << dropped.first();
+    distrustedTreePeers.insert(treePeer);
+    hashTreeKnownEnd = qMin(hashTreeKnownEnd, dropped.first());
+    // Stored leaves are written again once the new ones are in
+    savedHashTreeLeafCount = -1;
+
+    // Windows still out at that peer go to the next one, the dropped runs are asked for right away
+    QMutableMapIterator<int, HashTreeRequestStruct> r(hashTreeRequests);
+    while (r.hasNext())
     {
-        qDebug() << "Request TTH tree: null request host, not sent.";
+        r.next();
+        if (r.value().host == treePeer)
+            r.value().requestTime = 0;
     }
+    int n = 0;
+    while (n < dropped.size())
+    {
+        int windowStart = dropped.at(n);
+        int windowEnd = windowStart;
+        while (n < dropped.size() && dropped.at(n) == windowEnd && windowEnd - windowStart < HASH_TREE_WINDOW_LENGTH)
+        {
+            windowEnd++;
+            n++;
+        }
+        HashTreeRequestStruct request;
+        request.windowEnd = windowEnd;
+        if (hashTreeRequests.contains(windowStart))
+            request.windowEnd = qMax(windowEnd, hashTreeRequests.value(windowStart).windowEnd);
+        request.host = treePeer;
+        request.requestTime = 0;
+        hashTreeRequests.insert(windowStart, request);
+    }
+    requestHashTree();
 }
 
 void DownloadTransfer::protocolCapabilityRequestTimerEvent()
@@ -963,6 +1208,23 @@ QHostAddress DownloadTransfer::getBestIdlePeer()
 {
     QHostAddress bestPeer = QHostAddress();
     double bestWeight = -1000;
+
+    // Peers go by how fast they would get a bucket to us. Unmeasured ones are taken to be as fast as the average
+    // measured one, so they still get tried before the known slow ones.
+    qint64 rateSum = 0;
+    int rateCount = 0;
+    QHashIterator<QHostAddress, RemotePeerInfoStruct> r(remotePeerInfoTable);
+    while (r.hasNext())
+    {
+        qint64 rate = getPeerBucketRate(r.next().value());
+        if (rate > 0)
+        {
+            rateSum += rate;
+            rateCount++;
+        }
+    }
+    qint64 unknownRate = rateCount ? rateSum / rateCount : 0;
+
     QHashIterator<QHostAddress, RemotePeerInfoStruct> i(remotePeerInfoTable);
     while (i.hasNext())
     {
@@ -970,7 +1232,8 @@ QHostAddress DownloadTransfer::getBestIdlePeer()
         RemotePeerInfoStruct s = i.next().value();
         if ((s.transferSegment == 0) && (!s.blacklisted))
         {
-            double weight = log10((double)s.bytesTransferred + 1) - s.failureCount;
+            qint64 rate = getPeerBucketRate(s);
+            double weight = log10((double)(rate > 0 ? rate : unknownRate) + 1) - s.failureCount;
             if (weight > bestWeight)
             {
                 if (!pCurrentDownloadingPeers->contains(h))
@@ -985,21 +1248,193 @@ QHostAddress DownloadTransfer::getBestIdlePeer()
     return bestPeer;
 }
 
-TransferSegment* DownloadTransfer::getSlowestActivePeer()
+// The segment an idle peer should duplicate in endgame: the slowest one that still has buckets in flight and is not
+// duplicated already. Peers we have no transfer rate for yet get a go as well, they may well be the fast ones.
+TransferSegment* DownloadTransfer::getEndgameCandidate(QHostAddress idlePeer)
 {
+    qint64 idleTransferRate = remotePeerInfoTable.value(idlePeer).throughputEstimate;
     TransferSegment *t = 0;
     qint64 worstTransferRate = LLONG_MAX;
     QHashIterator<QHostAddress, RemotePeerInfoStruct> i(remotePeerInfoTable);
     while (i.hasNext())
     {
-        const RemotePeerInfoStruct *s = &i.next().value();
-        if ((s->lastTransferRate < worstTransferRate) && s->transferSegment)
+        i.next();
+        const RemotePeerInfoStruct *s = &i.value();
+        if (!s->transferSegment || i.key() == idlePeer || getEndgamePartner(s->transferSegment) ||
+            endgameLosers.contains(s->transferSegment))
+            continue;
+        if (s->throughputEstimate >= worstTransferRate || (idleTransferRate > 0 && idleTransferRate <= s->throughputEstimate))
+            continue;
+        if (getFirstBucketInFlight(s->transferSegment) < 0)
+            continue;
+        worstTransferRate = s->throughputEstimate;
+        t = s->transferSegment;
+    }
+    return t;
+}
+
+// Points download at the buckets the endgame candidate has not received yet. Whichever of the two finishes first
+// wins, the other one is cancelled by checkEndgameLosers() once the winner's buckets check out.
+bool DownloadTransfer::startEndgameSegment(TransferSegment *download)
+{
+    TransferSegment *original = getEndgameCandidate(download->getSegmentRemotePeer());
+    if (!original)
+        return false;
+
+    qint64 segmentStart = (qint64)getFirstBucketInFlight(original) * HASH_BUCKET_SIZE;
+    download->setSegmentStart(segmentStart);
+    download->setSegmentEnd(original->getSegmentEnd());
+    endgameDuplicates.insert(download, original);
+    // Both write to the same buckets now, what either of them hashed on the way in may be overwritten
+    download->setIncrementalHashing(false);
+    original->setIncrementalHashing(false);
+
+    download->startDownloading();
+    return true;
+}
+
+// The endgame partner got there first. The segment is dropped without holding it against its peer.
+void DownloadTransfer::cancelEndgameSegment(TransferSegment *segment)
+{
+    qDebug() << "DownloadTransfer::cancelEndgameSegment()" << segment->getSegmentId() << segment;
+    removeTransferSegmentTableEntry(segment);
+
+    QHostAddress h = segment->getSegmentRemotePeer();
+    if (remotePeerInfoTable.value(h).transferSegment == segment)
+    {
+        remotePeerInfoTable[h].transferSegment = 0;
+        remotePeerInfoTable[h].bytesTransferred += segment->getBytesTransferred();
+    }
+
+    // Anything it wrote after its partner's buckets were verified is of no use to anybody
+    int startBucket = calculateBucketNumber(segment->getSegmentStart());
+    int endBucket = calculateBucketNumber(segment->getSegmentEnd());
+    for (int i = startBucket; i <= endBucket && i < transferSegmentStateBitmap.length(); i++)
+        if (transferSegmentStateBitmap.at(i) == SegmentDownloaded || transferSegmentStateBitmap.at(i) == SegmentCurrentlyFlushing)
+            BucketPool::release(downloadBucketTable->take(i));
+
+    emit unflagDownloadPeer(h);
+    emit removeTransferSegmentPointer(segment->getSegmentId());
+    segment->deleteLater();
+}
+
+TransferSegment* DownloadTransfer::getEndgamePartner(TransferSegment *segment)
+{
+    if (endgameDuplicates.contains(segment))
+        return endgameDuplicates.value(segment);
+    return endgameDuplicates.key(segment, 0);
+}
+
+// A bucket of an endgame loser was checked. Once all of its buckets match their leaves it has nothing left to add and
+// is cancelled. If one does not, the winner's copy was bad and the loser carries on as an ordinary segment.
+void DownloadTransfer::checkEndgameLosers(int bucketNumber, bool verified)
+{
+    foreach (TransferSegment *segment, endgameLosers)
+    {
+        if (segment->getSegmentEnd() <= segment->getSegmentStart())
+            continue;
+        int startBucket = calculateBucketNumber(segment->getSegmentStart());
+        int endBucket = calculateBucketNumber(segment->getSegmentEnd() - 1);
+        if (bucketNumber < startBucket || bucketNumber > endBucket)
+            continue;
+
+        if (!verified)
         {
-            worstTransferRate = s->lastTransferRate;
-            t = s->transferSegment;
+            endgameLosers.remove(segment);
+            if (!transferSegmentTable.contains(segment->getSegmentStart()))
+            {
+                TransferSegmentTableStruct t;
+                t.segmentEnd = segment->getSegmentEnd();
+                t.transferSegment = segment;
+                transferSegmentTable.insert(segment->getSegmentStart(), t);
+            }
+            continue;
+        }
+
+        bool done = true;
+        for (int i = startBucket; i <= endBucket && i < transferSegmentStateBitmap.length(); i++)
+            if (transferSegmentStateBitmap.at(i) != SegmentDownloaded && transferSegmentStateBitmap.at(i) != SegmentCurrentlyFlushing)
+                done = false;
+        if (done)
+        {
+            endgameLosers.remove(segment);
+            cancelEndgameSegment(segment);
         }
     }
-    return t;
+}
+
+// First bucket of the segment that is still being downloaded, -1 if there is none
+int DownloadTransfer::getFirstBucketInFlight(TransferSegment *segment)
+{
+    if (segment->getSegmentEnd() <= segment->getSegmentStart())
+        return -1;
+    int startBucket = calculateBucketNumber(segment->getSegmentStart());
+    int endBucket = calculateBucketNumber(segment->getSegmentEnd() - 1);
+    for (int i = startBucket; i <= endBucket && i < transferSegmentStateBitmap.length(); i++)
+        if (transferSegmentStateBitmap.at(i) == SegmentCurrentlyDownloading)
+            return i;
+    return -1;
+}
+
+// Endgame duplicates share their start with the segment they duplicate, so only remove the entry if it is ours.
+void DownloadTransfer::removeTransferSegmentTableEntry(TransferSegment *segment)
+{
+    QMap<qint64, TransferSegmentTableStruct>::iterator i = transferSegmentTable.find(segment->getSegmentStart());
+    if (i != transferSegmentTable.end() && i.value().transferSegment == segment)
+        transferSegmentTable.erase(i);
+}
+
+// calculate survival of the fittest stats
+// A completed segment gives a round trip time sample, from asking to the first data, and a throughput sample for the
+// rest. Both go into exponentially weighted moving averages, so one slow or lucky segment does not swing the estimate.
+void DownloadTransfer::updatePeerEstimates(TransferSegment *segment)
+{
+    QHostAddress peer = segment->getSegmentRemotePeer();
+    if (!remotePeerInfoTable.contains(peer))
+        return;
+
+    qint64 currentTime = QDateTime::currentMSecsSinceEpoch();
+    qint64 startTime = segment->getSegmentStartTime();
+    qint64 firstDataTime = segment->getFirstDataTime();
+    qint64 bytes = segment->getSegmentEnd() - segment->getSegmentStart();
+    if (startTime <= 0 || firstDataTime < startTime || bytes <= 0)
+        return;
+
+    qint64 rtt = firstDataTime - startTime;
+    qint64 throughput = bytes * 1000 / qMax(currentTime - firstDataTime, (qint64)1);
+
+    RemotePeerInfoStruct &s = remotePeerInfoTable[peer];
+    if (s.throughputEstimate == 0)
+    {
+        s.throughputEstimate = throughput;
+        s.rttEstimate = rtt;
+    }
+    else
+    {
+        s.throughputEstimate += (throughput - s.throughputEstimate) / PEER_ESTIMATE_GAIN;
+        s.rttEstimate += (rtt - s.rttEstimate) / PEER_ESTIMATE_GAIN;
+    }
+}
+
+// Number of buckets the peer should get through in SEGMENT_TARGET_COMPLETION_MSECS, one until we know how fast it is
+int DownloadTransfer::getSegmentLengthHint(QHostAddress peer)
+{
+    const RemotePeerInfoStruct s = remotePeerInfoTable.value(peer);
+    if (s.throughputEstimate <= 0)
+        return 1;
+
+    qint64 dataTime = qMax(SEGMENT_TARGET_COMPLETION_MSECS - s.rttEstimate, (qint64)SEGMENT_TARGET_COMPLETION_MSECS / 2);
+    qint64 buckets = s.throughputEstimate * dataTime / 1000 / HASH_BUCKET_SIZE;
+    return (int)qBound((qint64)1, buckets, (qint64)SEGMENT_MAXIMUM_BUCKETS);
+}
+
+// Rate at which a peer would get a single bucket to us, round trip included. 0 if it has not been measured yet.
+qint64 DownloadTransfer::getPeerBucketRate(const RemotePeerInfoStruct &s)
+{
+    if (s.throughputEstimate <= 0)
+        return 0;
+    qint64 bucketMsecs = s.rttEstimate + (qint64)HASH_BUCKET_SIZE * 1000 / s.throughputEstimate;
+    return (qint64)HASH_BUCKET_SIZE * 1000 / qMax(bucketMsecs, (qint64)1);
 }
 
 void DownloadTransfer::saveBucketStateBitmap()
@@ -1012,7 +1447,111 @@ void DownloadTransfer::saveBucketStateBitmap()
         else
             r[i] = BucketNotFlushed;
     }
-    emit saveBucketFlushStateBitmap(TTH, r);
+
+    // The leaves only go along when there are new ones, for a big file they run into megabytes
+    QByteArray leaves;
+    if (downloadBucketHashLookupTable.size() != savedHashTreeLeafCount)
+    {
+        leaves = getHashTreeLeaves();
+        savedHashTreeLeafCount = downloadBucketHashLookupTable.size();
+    }
+    emit saveBucketFlushStateBitmap(TTH, r, leaves);
+}
+
+// Received leaves as runs of consecutive buckets: quint32 first bucket, quint32 bucket count, quint8 leaf length,
+// quint32 IPv4 address of the peer that sent them or 0 once verified, and the leaves back to back. The tree mostly
+// arrives in order, so this is little more than the leaves themselves.
+QByteArray DownloadTransfer::getHashTreeLeaves()
+{
+    QByteArray leaves;
+    // An empty blob means the stored leaves are still good, so an empty table is a single run of nothing
+    if (downloadBucketHashLookupTable.isEmpty())
+    {
+        leaves.resize(13);
+        ByteWriter writer(leaves.data(), leaves.size());
+        writer.writeUInt32(0);
+        writer.writeUInt32(0);
+        writer.writeUInt8(HASH_TREE_LEAF_LENGTH);
+        writer.writeUInt32(0);
+        return leaves;
+    }
+
+    QMap<int, QByteArray*>::const_iterator i = downloadBucketHashLookupTable.constBegin();
+    while (i != downloadBucketHashLookupTable.constEnd())
+    {
+        int firstBucket = i.key();
+        int leafLength = i.value()->length();
+        QHostAddress source = hashTreeLeafSources.value(firstBucket);
+        int count = 0;
+        QMap<int, QByteArray*>::const_iterator j = i;
+        while (j != downloadBucketHashLookupTable.constEnd() && j.key() == firstBucket + count && j.value()->length() == leafLength
+               && hashTreeLeafSources.value(j.key()) == source)
+        {
+            count++;
+            ++j;
+        }
+
+        int runStart = leaves.size();
+        leaves.resize(runStart + 13 + count * leafLength);
+        ByteWriter writer(leaves.data() + runStart, leaves.size() - runStart);
+        writer.writeUInt32(firstBucket);
+        writer.writeUInt32(count);
+        writer.writeUInt8(leafLength);
+        writer.writeUInt32(source.toIPv4Address());
+        for (; i != j; ++i)
+            writer.writeBytes(*i.value());
+    }
+    return leaves;
+}
+
+void DownloadTransfer::restoreHashTreeLeaves(const QByteArray &leaves)
+{
+    // A damaged row is thrown away whole before anything goes in, the tree is simply fetched from the network again
+    qint64 totalBuckets = getTotalFileSegments();
+    ByteReader check(leaves);
+    while (check.remaining() >= 13)
+    {
+        qint64 firstBucket = check.readUInt32();
+        qint64 count = check.readUInt32();
+        quint8 leafLength = check.readUInt8();
+        check.skip(4);
+        if (leafLength != HASH_TREE_LEAF_LENGTH || firstBucket + count > totalBuckets || count * leafLength > check.remaining())
+        {
+            qDebug() << "DownloadTransfer::restoreHashTreeLeaves() discarding damaged leaves" << firstBucket << count << leafLength;
+            return;
+        }
+        check.skip(count * leafLength);
+    }
+
+    ByteReader reader(leaves);
+    int restored = 0;
+    while (reader.remaining() >= 13)
+    {
+        int firstBucket = reader.readUInt32();
+        int count = reader.readUInt32();
+        quint8 leafLength = reader.readUInt8();
+        // Leaves no bucket has matched yet stay on their peer's account, just like before they were saved
+        quint32 source = reader.readUInt32();
+        for (int n = 0; n < count; n++)
+        {
+            const char *leaf = reader.readBytes(leafLength);
+            if (!downloadBucketHashLookupTable.contains(firstBucket + n))
+            {
+                downloadBucketHashLookupTable.insert(firstBucket + n, new QByteArray(leaf, leafLength));
+                if (source)
+                    hashTreeLeafSources.insert(firstBucket + n, QHostAddress(source));
+            }
+            restored++;
+        }
+    }
+    if (restored == 0)
+        return;
+
+    // The row in the database holds these already
+    savedHashTreeLeafCount = downloadBucketHashLookupTable.size();
+    while (downloadBucketHashLookupTable.contains(hashTreeKnownEnd))
+        hashTreeKnownEnd++;
+    qDebug() << "DownloadTransfer::restoreHashTreeLeaves()" << restored << "leaves, known up to bucket" << hashTreeKnownEnd;
 }
 
 void DownloadTransfer::updateDirectBytesStats(int bytes)
@@ -1032,15 +1571,22 @@ void DownloadTransfer::newSegmentTimerEvent()
         //emit abort(this);  // fail the download without removing it from queue.
         emit requeue(this);
 
-    if ((currentActiveSegments() >= MAXIMUM_SIMULTANEOUS_SEGMENTS) || (!(status & (TRANSFER_STATE_RUNNING | TRANSFER_STATE_STALLED))))
+    if ((currentActiveSegments() >= segmentLimit) || (!(status & (TRANSFER_STATE_RUNNING | TRANSFER_STATE_STALLED))))
         return;
 
+    addIdleSegment();
+}
+
+// Puts the best idle peer to work in a new segment
+void DownloadTransfer::addIdleSegment()
+{
     // Do not try and create new segments when they will be destroyed directly afterwards!
     // I believe ping-ponging segment creation can cause the segfaulting that harasses us.
-    if (getUnallocatedBlockCount() == 0)
+    // In endgame, a new segment is only worth it when there is a slower segment for it to duplicate.
+    QHostAddress nextPeer = getBestIdlePeer();
+    if (getAllocatableBlockCount() == 0 && (getUnallocatedBlockCount() > 0 || nextPeer.isNull() || !getEndgameCandidate(nextPeer)))
         return;
 
-    QHostAddress nextPeer = getBestIdlePeer();
     if (!nextPeer.isNull())
     {
         TransferSegment *download = createTransferSegment(nextPeer);
@@ -1048,18 +1594,108 @@ void DownloadTransfer::newSegmentTimerEvent()
         {
             //remotePeerInfoTable[nextPeer].transferSegment = download;
             //currentActiveSegments++;
-            downloadNextAvailableChunk(download, 1);
+            downloadNextAvailableChunk(download);
         }
         else
             remotePeerInfoTable[nextPeer].transferSegment = 0;
     }
 }
 
+// A segment with nothing left to do goes away, its peer is free for other work
+void DownloadTransfer::retireSegment(TransferSegment *segment)
+{
+    QHostAddress h = segment->getSegmentRemotePeer();
+    QMutableHashIterator<QHostAddress, RemotePeerInfoStruct> mi(remotePeerInfoTable);
+    while (mi.hasNext())
+    {
+        mi.next();
+        if (mi.value().transferSegment == segment)
+            mi.value().transferSegment = 0;
+    }
+
+    remotePeerInfoTable[h].bytesTransferred += segment->getBytesTransferred();
+    emit unflagDownloadPeer(h);
+    quint32 segmentId = segment->getSegmentId();
+    emit removeTransferSegmentPointer(segmentId);
+    segment->deleteLater();
+}
+
+// Called every second with the bytes received in it
+void DownloadTransfer::segmentControlTick()
+{
+    if (!(status & (TRANSFER_STATE_RUNNING | TRANSFER_STATE_STALLED)))
+        return;
+
+    SegmentStatusStruct s = getSegmentStatuses();
+    segmentControlBytes += bytesWrittenSinceCalculation;
+    segmentControlSegmentTicks += s.running + s.stalled;
+    segmentControlStalledTicks += s.stalled;
+    if (++segmentControlTicks >= SEGMENT_CONTROL_INTERVAL)
+        adjustSegmentLimit();
+}
+
+// Hill climbs the number of segments on goodput. Another segment is tried while the limit is what holds the download
+// back and there are peers left to give it to; if the download got slower for it, it is taken away again. Stalling
+// segments and hash or flush queues that do not keep up only ever lower the limit.
+void DownloadTransfer::adjustSegmentLimit()
+{
+    qint64 goodput = segmentControlBytes / segmentControlTicks;
+    int stallPercent = segmentControlSegmentTicks ? segmentControlStalledTicks * 100 / segmentControlSegmentTicks : 0;
+    bool ioBound = iowait || (bucketHashQueueLength + bucketFlushQueueLength > HASH_BUCKET_QUEUE_CONGESTION_THRESHOLD / 2);
+    bool sourcesLeft = getAllocatableBlockCount() > 0 && !getBestIdlePeer().isNull();
+    qint64 margin = lastControlGoodput * SEGMENT_CONTROL_GOODPUT_MARGIN_PERCENT / 100;
+
+    int change = 0;
+    if (segmentControlHold > 0)
+        segmentControlHold--;
+
+    if (ioBound)
+    {
+        change = -1;
+        segmentLimitDecision = SegmentLimitShrunkIO;
+    }
+    else if (stallPercent > SEGMENT_CONTROL_STALL_PERCENT)
+    {
+        change = -1;
+        segmentLimitDecision = SegmentLimitShrunkStalls;
+    }
+    else if (lastSegmentLimitChange > 0 && goodput < lastControlGoodput - margin)
+    {
+        change = -1;
+        segmentLimitDecision = SegmentLimitShrunkGoodput;
+        segmentControlHold = SEGMENT_CONTROL_HOLD_INTERVALS;
+    }
+    else if (segmentControlHold == 0 && sourcesLeft && currentActiveSegments() >= segmentLimit &&
+             (lastSegmentLimitChange <= 0 || goodput > lastControlGoodput + margin))
+    {
+        change = 1;
+        segmentLimitDecision = SegmentLimitGrown;
+    }
+    else
+        segmentLimitDecision = SegmentLimitHeld;
+
+    int newLimit = qBound(MINIMUM_SIMULTANEOUS_SEGMENTS, segmentLimit + change, MAXIMUM_SIMULTANEOUS_SEGMENTS);
+    lastSegmentLimitChange = newLimit - segmentLimit;
+    if (lastSegmentLimitChange == 0 && change != 0)
+        segmentLimitDecision = SegmentLimitHeld;
+    segmentLimit = newLimit;
+
+    lastControlGoodput = goodput;
+    segmentControlTicks = 0;
+    segmentControlBytes = 0;
+    segmentControlSegmentTicks = 0;
+    segmentControlStalledTicks = 0;
+
+    // Segments above a lowered limit go away as they complete, a raised one is put to use right away
+    if (lastSegmentLimitChange > 0)
+        addIdleSegment();
+}
+
 bool DownloadTransfer::isNonDispatchedProtocol(TransferProtocol protocol)
 {
     // If we ever add a transfer protocol that does not run over DispatchIP:DispatchPort/udp, this function must return true for it, so that protocol negotiation can permanently fail for
     // it in case its path is blocked between two peers.
-    return false;
+    return protocol == BasicTransferProtocol;
 }
 
 int DownloadTransfer::getSegmentsDone()
@@ -1084,6 +1720,17 @@ int DownloadTransfer::getUnallocatedBlockCount()
     return unallocatedBlocks;
 }
 
+int DownloadTransfer::getAllocatableBlockCount()
+{
+    int allocatableBlocks = 0;
+    for (int i = 0; i < transferSegmentStateBitmap.length(); i++)
+    {
+        if (transferSegmentStateBitmap.at(i) == SegmentNotDownloaded && isBucketVerifiable(i))
+            allocatableBlocks++;
+    }
+    return allocatableBlocks;
+}
+
 int DownloadTransfer::getTotalFileSegments()
 {
     int fileBuckets = calculateBucketNumber(fileSize);
@@ -1101,5 +1748,5 @@ qint64 DownloadTransfer::getTransferRate()
 
 int DownloadTransfer::currentActiveSegments()
 {
-    return transferSegmentTable.count();
+    return transferSegmentTable.count() + endgameDuplicates.count() + endgameLosers.count();
 }
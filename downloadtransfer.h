@@ -20,11 +20,33 @@
 #include "transfer.h"
 #include "protocoldef.h"
 #include "fstptransfersegment.h"
+#include "fectransfersegment.h"
+#include "btptransfersegment.h"
 #include "utptransfersegment.h"
-
-#define MAXIMUM_SIMULTANEOUS_SEGMENTS 5// When downloading a ton of segments, the sheer number of ACKs and stalls actually slow down the transfer
+#include "downloadfilemap.h"
+
+// When downloading a ton of segments, the sheer number of ACKs and stalls actually slow down the transfer, while a fast
+// link needs more than a few to fill it. The segment controller moves each download's limit between these by goodput.
+#define INITIAL_SIMULTANEOUS_SEGMENTS 5
+#define MINIMUM_SIMULTANEOUS_SEGMENTS 1
+#define MAXIMUM_SIMULTANEOUS_SEGMENTS 32
+#define SEGMENT_CONTROL_INTERVAL 5 // seconds between segment controller decisions
+#define SEGMENT_CONTROL_HOLD_INTERVALS 6 // decisions to sit out after an extra segment made things worse
+#define SEGMENT_CONTROL_STALL_PERCENT 50
+#define SEGMENT_CONTROL_GOODPUT_MARGIN_PERCENT 5
 
 #define HASH_TREE_WINDOW_LENGTH 184 // 8 datagrams
+#define HASH_TREE_PARALLEL_WINDOWS 4 // windows on their way at the same time, each from the next peer in turn
+#define HASH_TREE_REQUEST_TIMEOUT 5000 // msecs before the missing part of a window is asked from another peer
+#define HASH_TREE_LEAF_LENGTH 24 // a tiger digest per bucket
+#define HASH_TREE_LEAF_MISMATCH_LIMIT 2 // peers whose data failed one bucket before its leaf is blamed instead of them
+
+#define ENDGAME_BUCKET_THRESHOLD 8 // Below this many unallocated buckets they are handed out one at a time
+
+// Segments are sized so that each peer finishes its one in about this long, however fast it is
+#define SEGMENT_TARGET_COMPLETION_MSECS 10000
+#define SEGMENT_MAXIMUM_BUCKETS 512
+#define PEER_ESTIMATE_GAIN 4 // New throughput and round trip time samples count for a quarter of the estimate
 
 typedef struct
 {
@@ -47,9 +69,8 @@ typedef struct
     QByteArray triedProtocols;
     int failureCount;
     bool blacklisted;
-    qint64 lastStartTime;
-    quint64 lastBytesQueued;
-    qint64 lastTransferRate;
+    qint64 throughputEstimate; // bytes per second once data flows, 0 until a segment completed
+    qint64 rttEstimate; // msecs from starting a segment to its first data
     int checksumMismatchCount;
     QByteArray cid;
 } RemotePeerInfoStruct;
@@ -60,6 +81,13 @@ typedef struct
     QByteArray cid;
 } RemotePeerInfoRequestPoolStruct;
 
+typedef struct
+{
+    int windowEnd;
+    QHostAddress host;
+    qint64 requestTime;
+} HashTreeRequestStruct;
+
 class DownloadTransfer : public Transfer
 {
     Q_OBJECT
@@ -69,10 +97,10 @@ public:
 
 public slots:
     void hashBucketReply(int bucketNumber, QByteArray bucketTTH, QHostAddress peer);
-    void TTHTreeReply(QByteArray tree);
+    void TTHTreeReply(QHostAddress peer, QByteArray tree);
     //void setProtocolPreference(QByteArray &preference);
     void receivedPeerProtocolCapability(QHostAddress peer, quint8 protocols);
-    void incomingDataPacket(quint8 transferProtocolVersion, qint64 offset, QByteArray data);
+    void incomingDataPacket(quint8 transferProtocolVersion, qint64 offset, const char *data, int length);
     int getTransferType();
     void startTransfer();
     void pauseTransfer();
@@ -84,7 +112,8 @@ public slots:
     int getSegmentCount();
     SegmentStatusStruct getSegmentStatuses();
     void incomingTransferError(qint64 offset, quint8 error);
-    void setBucketFlushStateBitmap(QByteArray bitmap);
+    void incomingUploadQueued(QHostAddress fromHost, qint64 offset, int position, int retryMsecs);
+    void setBucketFlushStateBitmap(QByteArray bitmap, QByteArray leaves);
 
     // Bucket flush callbacks
     void bucketFlushed(int bucketNo);
@@ -98,31 +127,67 @@ private slots:
     void segmentCompleted(TransferSegment *segment);
     void segmentFailed(TransferSegment *segment, quint8 error=0, bool startIdleSegment = true);
     void requestHashBucket(QByteArray rootTTH, int bucketNumber, QByteArray *bucket, QHostAddress peer);
+    void bucketHashed(QByteArray rootTTH, int bucketNumber, QByteArray bucketTTH, QHostAddress peer);
     void updateDirectBytesStats(int bytes);
 
 private:
     void transferRateCalculation();
     void flushBucketToDisk(int &bucketNumber);
+    void bucketDone(int bucketNumber);
+    void setSegmentsDownloadFileMap(DownloadFileMap *map);
     inline int calculateBucketNumber(quint64 fileOffset);
     SegmentOffsetLengthStruct getSegmentForDownloading(int segmentNumberOfBucketsHint);
     TransferSegment* newConnectedTransferSegment(TransferProtocol p);
     //void updateTransferSegmentTableRange(TransferSegment *segment, quint64 newStart, quint64 newEnd);
     void newPeer(QHostAddress peer, quint8 protocols, QByteArray cid);
     TransferSegment* createTransferSegment(QHostAddress peer);
-    void downloadNextAvailableChunk(TransferSegment *download, int length = 1, int recursionLimit = 5);
-    int getLastHashBucketNumberReceived();
+    TransferSegment* getSegmentForOffset(qint64 offset);
+    void downloadNextAvailableChunk(TransferSegment *download, int recursionLimit = 5);
     void congestionTest();
-    void requestHashTree(int lastHashBucketReceived, bool timerRequest = false);
+    void requestHashTree();
+    HashTreeRequestStruct sendHashTreeRequest(int windowStart, int windowEnd, const QList<QHostAddress> &peers, qint64 now);
+    bool isBucketVerifiable(int bucketNumber);
+    bool isHashTreeLeafRequested(int bucketNumber, QHostAddress peer);
+    void checksumMismatch(QHostAddress peer);
+    void dropHashTreeLeaves(QHostAddress treePeer);
+    void startRunning();
+    void addIdleSegments();
     QHostAddress getBestIdlePeer();
     void saveBucketStateBitmap();
+    QByteArray getHashTreeLeaves();
+    void restoreHashTreeLeaves(const QByteArray &leaves);
     bool isNonDispatchedProtocol(TransferProtocol protocol);
-    TransferSegment* getSlowestActivePeer();
+    TransferSegment* getEndgameCandidate(QHostAddress idlePeer);
+    bool startEndgameSegment(TransferSegment *download);
+    void cancelEndgameSegment(TransferSegment *segment);
+    TransferSegment* getEndgamePartner(TransferSegment *segment);
+    void checkEndgameLosers(int bucketNumber, bool verified);
+    int getFirstBucketInFlight(TransferSegment *segment);
+    void removeTransferSegmentTableEntry(TransferSegment *segment);
+    void updatePeerEstimates(TransferSegment *segment);
+    int getSegmentLengthHint(QHostAddress peer);
+    qint64 getPeerBucketRate(const RemotePeerInfoStruct &s);
+    void retireSegment(TransferSegment *segment);
+    void addIdleSegment();
+    void segmentControlTick();
+    void adjustSegmentLimit();
     int getSegmentsDone();
     int getUnallocatedBlockCount();
+    int getAllocatableBlockCount();
     int getTotalFileSegments();
 
     QHash<int, QByteArray*> *downloadBucketTable;
     QMap<int, QByteArray*> downloadBucketHashLookupTable;
+    // Hash tree windows on their way, by first bucket
+    QMap<int, HashTreeRequestStruct> hashTreeRequests;
+    // Peer each leaf came from until a bucket verified against it, saved and restored along with the leaves
+    QHash<int, QHostAddress> hashTreeLeafSources;
+    // Data peers whose bucket failed against an unverified leaf, charged once another peer's data matches it
+    QHash<int, QList<QHostAddress> > bucketMismatchPeers;
+    // Peers whose leaves were dropped, asked for the tree only when nobody else is left
+    QSet<QHostAddress> distrustedTreePeers;
+    // Mapped .incomplete file the segments write to, 0 when they fill buckets that get flushed instead
+    DownloadFileMap *downloadFileMap;
 
     QTimer *transferTimer;
     QTimer *TTHSearchTimer;
@@ -137,16 +202,35 @@ private:
     //int currentActiveSegments;
     int currentActiveSegments();
     int timerBrakes;
-    int hashTreeWindowEnd;
+    // Leaves are known for every bucket below this one
+    int hashTreeKnownEnd;
+    int nextHashTreeWindow;
+    int hashTreeRequestRotation;
+    // Leaves in the database, -1 if none were saved yet
+    int savedHashTreeLeafCount;
     int tthSearchInterval;
     int bucketHashQueueLength;
     int bucketFlushQueueLength;
     int treeUpdatesSinceTimer;
     bool iowait;
-    QHostAddress treeRequestHost;
     int zeroSegmentTimeoutCount;
 
+    // Segment controller
+    int segmentLimit;
+    int segmentLimitDecision;
+    int lastSegmentLimitChange;
+    int segmentControlHold;
+    int segmentControlTicks;
+    qint64 segmentControlBytes;
+    int segmentControlSegmentTicks;
+    int segmentControlStalledTicks;
+    qint64 lastControlGoodput;
+
     QMap<qint64, TransferSegmentTableStruct> transferSegmentTable;
+    // Endgame duplicates, which are not in transferSegmentTable, and the segments whose buckets they download as well
+    QHash<TransferSegment*, TransferSegment*> endgameDuplicates;
+    // Endgame segments whose partner finished first, kept going until the buckets they share have been verified
+    QSet<TransferSegment*> endgameLosers;
     QByteArray transferSegmentStateBitmap;
     QByteArray bucketFlushStateBitmap;
     QHash<QHostAddress, RemotePeerInfoStruct> remotePeerInfoTable;
@@ -0,0 +1,146 @@
+#include "feccodec.h"
+#include <QVector>
+#include <string.h>
+
+namespace
+{
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, full multiplication table so the inner loops are one lookup
+// per byte. Built once when the program loads.
+struct GaloisField
+{
+    quint8 exp[510];
+    quint8 log[256];
+    quint8 inverse[256];
+    quint8 mul[256][256];
+
+    GaloisField()
+    {
+        int x = 1;
+        for (int i = 0; i < 255; i++)
+        {
+            exp[i] = exp[i + 255] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100)
+                x ^= 0x11d;
+        }
+        log[0] = 0;
+
+        for (int a = 0; a < 256; a++)
+        {
+            for (int b = 0; b < 256; b++)
+                mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+            inverse[a] = a ? exp[255 - log[a]] : 0;
+        }
+    }
+};
+
+const GaloisField gf;
+
+// Cauchy matrix element for repair row r and source column i. Rows use field elements from sourceCount up, columns
+// the ones below, so x + y is never 0.
+inline quint8 coefficient(int sourceCount, int repairIndex, int sourceIndex)
+{
+    return gf.inverse[(quint8)((sourceCount + repairIndex) ^ sourceIndex)];
+}
+
+// dst += c * src
+inline void mulAdd(quint8 *dst, const quint8 *src, quint8 c, int size)
+{
+    if (c == 0)
+        return;
+    const quint8 *row = gf.mul[c];
+    for (int b = 0; b < size; b++)
+        dst[b] ^= row[src[b]];
+}
+
+}
+
+void FECCodec::encode(const char * const *sources, int sourceCount, int repairIndex, int symbolSize, char *repair)
+{
+    memset(repair, 0, symbolSize);
+    for (int i = 0; i < sourceCount; i++)
+        mulAdd((quint8 *)repair, (const quint8 *)sources[i], coefficient(sourceCount, repairIndex, i), symbolSize);
+}
+
+bool FECCodec::decode(char * const *sources, const bool *present, int sourceCount,
+                      const int *repairIndexes, const char * const *repairs, int repairCount, int symbolSize)
+{
+    QVector<int> missing;
+    for (int i = 0; i < sourceCount; i++)
+        if (!present[i])
+            missing.append(i);
+
+    int m = missing.size();
+    if (m == 0)
+        return true;
+    if (repairCount < m)
+        return false;
+
+    // What the first m repairs hold of the missing sources alone: the repair minus what the present sources put in
+    QVector<QByteArray> remainders(m);
+    for (int j = 0; j < m; j++)
+    {
+        remainders[j] = QByteArray(repairs[j], symbolSize);
+        quint8 *rhs = (quint8 *)remainders[j].data();
+        for (int i = 0; i < sourceCount; i++)
+            if (present[i])
+                mulAdd(rhs, (const quint8 *)sources[i], coefficient(sourceCount, repairIndexes[j], i), symbolSize);
+    }
+
+    // Invert the m x m part of the matrix that belongs to the missing sources, Gauss-Jordan on [A | I]
+    QVector<quint8> a(m * m);
+    QVector<quint8> inv(m * m, 0);
+    for (int j = 0; j < m; j++)
+    {
+        for (int c = 0; c < m; c++)
+            a[j * m + c] = coefficient(sourceCount, repairIndexes[j], missing.at(c));
+        inv[j * m + j] = 1;
+    }
+
+    for (int c = 0; c < m; c++)
+    {
+        int pivot = c;
+        while (pivot < m && a[pivot * m + c] == 0)
+            pivot++;
+        if (pivot == m)
+            return false; // can not happen with distinct repair indexes
+        if (pivot != c)
+        {
+            for (int k = 0; k < m; k++)
+            {
+                qSwap(a[c * m + k], a[pivot * m + k]);
+                qSwap(inv[c * m + k], inv[pivot * m + k]);
+            }
+        }
+
+        quint8 scale = gf.inverse[a[c * m + c]];
+        for (int k = 0; k < m; k++)
+        {
+            a[c * m + k] = gf.mul[scale][a[c * m + k]];
+            inv[c * m + k] = gf.mul[scale][inv[c * m + k]];
+        }
+
+        for (int j = 0; j < m; j++)
+        {
+            quint8 factor = a[j * m + c];
+            if (j == c || factor == 0)
+                continue;
+            for (int k = 0; k < m; k++)
+            {
+                a[j * m + k] ^= gf.mul[factor][a[c * m + k]];
+                inv[j * m + k] ^= gf.mul[factor][inv[c * m + k]];
+            }
+        }
+    }
+
+    for (int c = 0; c < m; c++)
+    {
+        quint8 *out = (quint8 *)sources[missing.at(c)];
+        memset(out, 0, symbolSize);
+        for (int j = 0; j < m; j++)
+            mulAdd(out, (const quint8 *)remainders.at(j).constData(), inv[c * m + j], symbolSize);
+    }
+    return true;
+}
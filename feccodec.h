@@ -0,0 +1,47 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FECCODEC_H
+#define FECCODEC_H
+
+// Systematic Reed-Solomon erasure code over GF(2^8) for ArpmanetFEC transfers.
+//
+// A block of up to 256 symbols is made of sourceCount source symbols, sent as they are, and repair symbols computed
+// from them with a Cauchy matrix. Any sourceCount of the symbols rebuild the block, whichever ones they are, so lost
+// packets are replaced by any repair packets that did arrive. Every square submatrix of a Cauchy matrix can be
+// inverted, which is what makes that work.
+//
+// All symbols in a block have the same size; a short last source symbol is padded with zeros on both sides.
+
+#define FEC_FIELD_SIZE 256
+
+class FECCodec
+{
+public:
+    // Repair symbols a block of sourceCount symbols can have
+    static int maximumRepairSymbols(int sourceCount) {return FEC_FIELD_SIZE - sourceCount;}
+
+    // Computes repair symbol repairIndex of the block made of sources
+    static void encode(const char * const *sources, int sourceCount, int repairIndex, int symbolSize, char *repair);
+
+    // Rebuilds the sources that are not present into the buffers sources points to, from at least as many repair
+    // symbols as there are missing sources. Returns false if there are not enough.
+    static bool decode(char * const *sources, const bool *present, int sourceCount,
+                       const int *repairIndexes, const char * const *repairs, int repairCount, int symbolSize);
+};
+
+#endif // FECCODEC_H
@@ -0,0 +1,553 @@
+#include "fectransfersegment.h"
+#include "feccodec.h"
+#include "datagrampool.h"
+#include "bytecursor.h"
+#include "pathmtudiscovery.h"
+#include "uploadblockcache.h"
+#include <QAtomicInt>
+
+namespace
+{
+
+QAtomicInt defaultRepairPercent(FEC_DEFAULT_REPAIR_PERCENT);
+
+}
+
+FECTransferSegment::FECTransferSegment(Transfer *parent) : TransferSegment(parent)
+{
+    status = TRANSFER_STATE_INITIALIZING;
+    prev_status = -1;
+    nextRequestOffset = 0;
+
+    repairPercent = defaultRepairPercent;
+    uploadRegion = 0;
+    uploadCredit = 0;
+    uploadCreditTime = 0;
+    peerReceiveRate = 0;
+    requestRateSampleStart = 0;
+    requestRateSampleBytes = 0;
+
+    pParent = parent;
+}
+
+FECTransferSegment::~FECTransferSegment()
+{
+    if (uploadRegion)
+        uploadRegion->deref();
+    if (inputFile.isOpen())
+        inputFile.close();
+}
+
+void FECTransferSegment::setRepairPercent(int percent)
+{
+    defaultRepairPercent.fetchAndStoreRelaxed(qBound(0, percent, FEC_MAXIMUM_REPAIR_PERCENT));
+}
+
+void FECTransferSegment::setFileName(QString filename)
+{
+    filePathName = filename;
+    inputFile.setFileName(filePathName);
+    inputFile.open(QIODevice::ReadOnly);
+    fileSize = inputFile.size();
+}
+
+void FECTransferSegment::setFileSize(quint64 size)
+{
+    fileSize = size;
+}
+
+int FECTransferSegment::symbolCount(int length, int symbolSize)
+{
+    return (length + symbolSize - 1) / symbolSize;
+}
+
+int FECTransferSegment::blockCount(int symbols)
+{
+    return (symbols + FEC_MAXIMUM_BLOCK_SOURCES - 1) / FEC_MAXIMUM_BLOCK_SOURCES;
+}
+
+// Symbols are spread over the blocks as evenly as they go, the first blocks get one more where it does not divide
+int FECTransferSegment::blockFirstSymbol(int symbols, int blocks, int block)
+{
+    return block * (symbols / blocks) + qMin(block, symbols % blocks);
+}
+
+// ------------------------------------ Uploading ------------------------------------
+
+void FECTransferSegment::startUploading()
+{
+    maxUploadRequestOffset = 0;
+
+    if (segmentStart > fileSize)
+    {
+        emit sendTransferError(remoteHost, InvalidOffsetError, TTH, segmentStart);
+        return;
+    }
+    else if (segmentStart + segmentLength > fileSize)
+        segmentLength = fileSize - segmentStart;
+
+    maxUploadRequestOffset = maxUploadRequestOffset < segmentStart ? segmentStart : maxUploadRequestOffset;
+    if (segmentStart + segmentLength == fileSize)
+        maxUploadRequestOffset = fileSize;
+
+    if (segmentLength <= 0)
+        return;
+
+    // Symbols go out as direct data packets, without a segment id the downloader could not tell them apart
+    if (segmentId == 0)
+    {
+        emit sendTransferError(remoteHost, TransferAbortingError, TTH, segmentStart);
+        return;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    updatePeerReceiveRate(segmentLength, now);
+
+    qint64 end = segmentStart + segmentLength;
+    int lastBucket = calculateBucketNumber(end - 1);
+    for (int bucketNumber = calculateBucketNumber(segmentStart); bucketNumber <= lastBucket; bucketNumber++)
+        queueUploadBucket(bucketNumber, end);
+
+    emit uploadPending(this);
+}
+
+// The downloader lays the bucket out from its start to the end of the bucket or of its request, so do we
+void FECTransferSegment::queueUploadBucket(int bucketNumber, qint64 requestEnd)
+{
+    qint64 bucketOffset = (qint64)bucketNumber * HASH_BUCKET_SIZE;
+    int length = (int)(qMin(bucketOffset + HASH_BUCKET_SIZE, requestEnd) - bucketOffset);
+    if (length <= 0)
+        return;
+
+    // Not started yet, asking twice changes nothing
+    foreach (FECSendBucketStruct pending, pendingUploadBuckets)
+        if (pending.bucketNumber == bucketNumber && pending.length == length && pending.column == 0 && pending.block == 0)
+            return;
+
+    FECSendBucketStruct bucket;
+    bucket.bucketNumber = bucketNumber;
+    bucket.length = length;
+
+    bucket.symbolSize = PathMTUDiscovery::dataPayloadSize(remoteHost);
+    int symbols = symbolCount(bucket.length, bucket.symbolSize);
+    bucket.blockCount = blockCount(symbols);
+    bucket.maximumSources = blockFirstSymbol(symbols, bucket.blockCount, 1) - blockFirstSymbol(symbols, bucket.blockCount, 0);
+
+    // A bucket asked for again lost more than its repair symbols could make up for, so it and the buckets after it
+    // get more. Every round uses repair symbols the downloader has not seen yet.
+    if (bucketRepairsSent.contains(bucketNumber))
+        repairPercent = qMin(repairPercent + FEC_REPAIR_PERCENT_STEP, FEC_MAXIMUM_REPAIR_PERCENT);
+    bucket.repairCount = qMax(1, (bucket.maximumSources * repairPercent + 99) / 100);
+    bucket.firstRepair = bucketRepairsSent.value(bucketNumber);
+    bucketRepairsSent.insert(bucketNumber, bucket.firstRepair + bucket.repairCount);
+
+    bucket.column = 0;
+    bucket.block = 0;
+    pendingUploadBuckets.enqueue(bucket);
+}
+
+// Sends at most maxPackets symbols, as far as the pacing credit allows. Returns the number sent.
+// Symbols go out column by column: symbol 0 of every block, then symbol 1 of every block and so on.
+int FECTransferSegment::sendUploadQuantum(int maxPackets)
+{
+    if (pendingUploadBuckets.isEmpty())
+        return 0;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int packetSize = PathMTUDiscovery::dataPayloadSize(remoteHost);
+    qint64 rate = qMax(2 * peerReceiveRate, (qint64)FEC_UPLOAD_MINIMUM_RATE);
+    qint64 burst = qMax(rate * FEC_UPLOAD_BURST_MSECS / 1000, (qint64)(FEC_UPLOAD_QUANTUM_PACKETS * packetSize));
+    qint64 add = rate * (now - uploadCreditTime) / 1000;
+    if (add > 0)
+    {
+        uploadCredit = qMin(uploadCredit + add, burst);
+        uploadCreditTime = now;
+    }
+
+    int packets = 0;
+    while (packets < maxPackets && !pendingUploadBuckets.isEmpty() && uploadCredit >= packetSize)
+    {
+        FECSendBucketStruct &bucket = pendingUploadBuckets.head();
+        qint64 bucketOffset = (qint64)bucket.bucketNumber * HASH_BUCKET_SIZE;
+        if (!uploadRegion || uploadRegion->offset() != bucketOffset)
+        {
+            if (uploadRegion)
+                uploadRegion->deref();
+            uploadRegion = UploadBlockCache::acquireBlock(TTH, filePathName, bucket.bucketNumber);
+            if (!uploadRegion || uploadRegion->length() < bucket.length)
+            {
+                emit sendTransferError(remoteHost, FileIOError, TTH, bucketOffset);
+                pendingUploadBuckets.dequeue();
+                continue;
+            }
+        }
+
+        if (bucket.column >= bucket.maximumSources + bucket.repairCount)
+        {
+            pendingUploadBuckets.dequeue();
+            continue;
+        }
+
+        int symbols = symbolCount(bucket.length, bucket.symbolSize);
+        int sources = blockFirstSymbol(symbols, bucket.blockCount, bucket.block + 1) - blockFirstSymbol(symbols, bucket.blockCount, bucket.block);
+        int symbolIndex = -1;
+        if (bucket.column < sources)
+            symbolIndex = bucket.column;
+        else if (bucket.column - sources < bucket.repairCount)
+            symbolIndex = sources + (bucket.firstRepair + bucket.column - sources) % FECCodec::maximumRepairSymbols(sources);
+
+        // Blocks with one source less are done a column early
+        if (symbolIndex >= 0 && sendSymbol(bucket, bucket.block, symbolIndex))
+        {
+            uploadCredit -= bucket.symbolSize;
+            packets++;
+        }
+
+        if (++bucket.block == bucket.blockCount)
+        {
+            bucket.block = 0;
+            bucket.column++;
+        }
+    }
+
+    return packets;
+}
+
+bool FECTransferSegment::sendSymbol(FECSendBucketStruct &bucket, int block, int symbolIndex)
+{
+    int symbols = symbolCount(bucket.length, bucket.symbolSize);
+    int firstSymbol = blockFirstSymbol(symbols, bucket.blockCount, block);
+    int sources = blockFirstSymbol(symbols, bucket.blockCount, block + 1) - firstSymbol;
+    bool repair = symbolIndex >= sources;
+    int headerLength = 14 + FEC_HEADER_SIZE;
+
+    MappedDatagramStruct datagram;
+    datagram.header = DatagramPool::acquire(headerLength + (repair ? bucket.symbolSize : 0));
+    ByteWriter writer(datagram.header->data(), datagram.header->length());
+    writer.writeUInt8(DirectDataPacket);
+    writer.writeUInt8(ArpmanetFECProtocol);
+    writer.writeUInt64((quint64)bucket.bucketNumber * HASH_BUCKET_SIZE);
+    writer.writeUInt32(segmentId);
+    writer.writeUInt16(bucket.symbolSize);
+    writer.writeUInt16(block);
+    writer.writeUInt8(symbolIndex);
+
+    const char *data = uploadRegion->data();
+    if (!repair)
+    {
+        // Source symbols are sent straight from the file map like FSTP data
+        int position = (firstSymbol + symbolIndex) * bucket.symbolSize;
+        datagram.region = uploadRegion;
+        datagram.region->ref();
+        datagram.payload = data + position;
+        datagram.payloadLength = qMin(bucket.symbolSize, bucket.length - position);
+    }
+    else
+    {
+        QVector<const char *> sourceSymbols(sources);
+        for (int i = 0; i < sources; i++)
+        {
+            int position = (firstSymbol + i) * bucket.symbolSize;
+            int length = bucket.length - position;
+            if (length >= bucket.symbolSize)
+                sourceSymbols[i] = data + position;
+            else
+            {
+                // The last symbol of the bucket is short, the code wants it zero padded
+                paddedSymbol.fill(0, bucket.symbolSize);
+                memcpy(paddedSymbol.data(), data + position, length);
+                sourceSymbols[i] = paddedSymbol.constData();
+            }
+        }
+        FECCodec::encode(sourceSymbols.constData(), sources, symbolIndex - sources, bucket.symbolSize, datagram.header->data() + headerLength);
+        datagram.region = 0;
+        datagram.payload = 0;
+        datagram.payloadLength = 0;
+    }
+
+    emit transmitMappedDatagram(remoteHost, datagram);
+    return true;
+}
+
+bool FECTransferSegment::hasPendingUpload()
+{
+    return !pendingUploadBuckets.isEmpty();
+}
+
+// The downloader asks for the next bucket as one is done, so the rate of requests is the rate at which it receives
+void FECTransferSegment::updatePeerReceiveRate(qint64 requestLength, qint64 now)
+{
+    qint64 elapsed = now - requestRateSampleStart;
+    if (elapsed > FEC_UPLOAD_RATE_IDLE_MSECS)
+    {
+        requestRateSampleStart = now;
+        requestRateSampleBytes = requestLength;
+        return;
+    }
+
+    requestRateSampleBytes += requestLength;
+    if (elapsed >= FEC_UPLOAD_RATE_SAMPLE_MSECS)
+    {
+        qint64 sample = requestRateSampleBytes * 1000 / elapsed;
+        peerReceiveRate = peerReceiveRate == 0 ? sample : (3 * peerReceiveRate + sample) / 4;
+        requestRateSampleStart = now;
+        requestRateSampleBytes = 0;
+    }
+}
+
+// ------------------------------------ Downloading ------------------------------------
+
+void FECTransferSegment::startDownloading()
+{
+    if (!(pParent->getTransferStatus() & (TRANSFER_STATE_STALLED | TRANSFER_STATE_RUNNING)))
+        return;
+    if (status & (TRANSFER_STATE_INITIALIZING | TRANSFER_STATE_FINISHED))
+    {
+        segmentStartTime = QDateTime::currentMSecsSinceEpoch();
+        receivingBuckets.clear();
+        nextRequestOffset = segmentStart;
+        status = TRANSFER_STATE_RUNNING;
+        requestBuckets();
+    }
+}
+
+void FECTransferSegment::pauseDownload()
+{
+    prev_status = status;
+    status = TRANSFER_STATE_PAUSED;
+}
+
+void FECTransferSegment::unpauseDownload()
+{
+    if (prev_status != -1)
+        status = prev_status;
+}
+
+// Nothing arrives until the uploader has a slot for us, the buckets are asked for again once the retry hint runs out
+void FECTransferSegment::uploadQueued(int, int retryMsecs)
+{
+    if (status != TRANSFER_STATE_RUNNING)
+        return;
+
+    qint64 retryTime = QDateTime::currentMSecsSinceEpoch() + retryMsecs - FEC_BUCKET_TIMEOUT;
+    QMutableHashIterator<int, FECReceiveBucketStruct> i(receivingBuckets);
+    while (i.hasNext())
+    {
+        FECReceiveBucketStruct &bucket = i.next().value();
+        if (bucket.lastPacketTime > 0)
+            continue;
+        bucket.requestTime = qMax(bucket.requestTime, retryTime);
+        bucket.retries = 0;
+    }
+}
+
+void FECTransferSegment::abortTransfer()
+{
+    emit transferRequestFailed(this, 0, false);
+}
+
+void FECTransferSegment::requestBuckets()
+{
+    if (status != TRANSFER_STATE_RUNNING)
+        return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while (receivingBuckets.size() < FEC_BUCKETS_IN_FLIGHT && nextRequestOffset < segmentEnd)
+    {
+        int bucketNumber = calculateBucketNumber(nextRequestOffset);
+        qint64 end = qMin((qint64)(bucketNumber + 1) * HASH_BUCKET_SIZE, segmentEnd);
+
+        FECReceiveBucketStruct bucket;
+        bucket.length = end - nextRequestOffset;
+        bucket.symbolSize = 0;
+        bucket.blocksDone = 0;
+        bucket.requestTime = now;
+        bucket.lastPacketTime = 0;
+        bucket.retries = 0;
+        receivingBuckets.insert(bucketNumber, bucket);
+
+        checkSendDownloadRequest(remoteHost, TTH, nextRequestOffset, bucket.length, status, ArpmanetFECProtocol);
+        nextRequestOffset = end;
+    }
+}
+
+void FECTransferSegment::initReceiveBucket(FECReceiveBucketStruct &bucket, int symbolSize)
+{
+    bucket.symbolSize = symbolSize;
+    int symbols = symbolCount(bucket.length, symbolSize);
+    int blocks = blockCount(symbols);
+    bucket.blocks.resize(blocks);
+    for (int i = 0; i < blocks; i++)
+    {
+        FECReceiveBlockStruct &block = bucket.blocks[i];
+        block.firstSymbol = blockFirstSymbol(symbols, blocks, i);
+        block.sourceCount = blockFirstSymbol(symbols, blocks, i + 1) - block.firstSymbol;
+        block.presentCount = 0;
+        block.present = QBitArray(block.sourceCount);
+        block.done = false;
+    }
+}
+
+void FECTransferSegment::incomingDataPacket(qint64 offset, const char *data, int length)
+{
+    if (status != TRANSFER_STATE_RUNNING)
+        return;
+
+    ByteReader reader(data, length);
+    int symbolSize = reader.readUInt16();
+    int blockIndex = reader.readUInt16();
+    int symbolIndex = reader.readUInt8();
+    if (!reader.ok() || symbolSize <= 0)
+        return;
+
+    int bucketNumber = calculateBucketNumber(offset);
+    QHash<int, FECReceiveBucketStruct>::iterator i = receivingBuckets.find(bucketNumber);
+    if (i == receivingBuckets.end() || offset != (qint64)bucketNumber * HASH_BUCKET_SIZE)
+        return;
+
+    FECReceiveBucketStruct &bucket = i.value();
+    // A later round may come with another symbol size if the path MTU changed, the first one seen wins
+    if (bucket.symbolSize == 0)
+        initReceiveBucket(bucket, symbolSize);
+    else if (symbolSize != bucket.symbolSize)
+        return;
+    if (blockIndex >= bucket.blocks.size())
+        return;
+
+    FECReceiveBlockStruct &block = bucket.blocks[blockIndex];
+    if (block.done)
+        return;
+
+    if (symbolIndex < block.sourceCount)
+    {
+        if (block.present.testBit(symbolIndex))
+            return;
+        int position = (block.firstSymbol + symbolIndex) * symbolSize;
+        int n = qMin(symbolSize, bucket.length - position);
+        if (reader.remaining() < n)
+            return;
+        memcpy(downloadBucketData(bucketNumber, bucket.length) + position, reader.current(), n);
+        addReceivedBucketBytes(offset + position, n);
+        block.present.setBit(symbolIndex);
+        block.presentCount++;
+
+        emit updateDirectBytesStats(n);
+        bytesTransferred += n;
+    }
+    else
+    {
+        int repairIndex = symbolIndex - block.sourceCount;
+        if (reader.remaining() < symbolSize || block.repairIndexes.contains(repairIndex))
+            return;
+        block.repairIndexes.append(repairIndex);
+        block.repairs.append(QByteArray(reader.current(), symbolSize));
+    }
+
+    bucket.lastPacketTime = QDateTime::currentMSecsSinceEpoch();
+    bucket.retries = 0;
+
+    if (block.presentCount + block.repairs.size() >= block.sourceCount && decodeBlock(bucketNumber, bucket, block))
+    {
+        block.done = true;
+        block.repairIndexes.clear();
+        block.repairs.clear();
+        if (++bucket.blocksDone == bucket.blocks.size())
+            bucketReceived(bucketNumber);
+    }
+}
+
+// Rebuilds the sources of a block that did not arrive from the repair symbols that did
+bool FECTransferSegment::decodeBlock(int bucketNumber, FECReceiveBucketStruct &bucket, FECReceiveBlockStruct &block)
+{
+    int missing = block.sourceCount - block.presentCount;
+    if (missing == 0)
+        return true;
+
+    char *data = downloadBucketData(bucketNumber, bucket.length);
+    QVector<char *> sources(block.sourceCount);
+    QVector<bool> present(block.sourceCount);
+    QByteArray padded;
+    int shortSymbol = -1;
+    for (int i = 0; i < block.sourceCount; i++)
+    {
+        int position = (block.firstSymbol + i) * bucket.symbolSize;
+        present[i] = block.present.testBit(i);
+        if (bucket.length - position >= bucket.symbolSize)
+            sources[i] = data + position;
+        else
+        {
+            // The short last symbol of the bucket is decoded zero padded, like the uploader encoded it
+            shortSymbol = i;
+            padded.fill(0, bucket.symbolSize);
+            if (present[i])
+                memcpy(padded.data(), data + position, bucket.length - position);
+            sources[i] = padded.data();
+        }
+    }
+
+    QVector<const char *> repairs(missing);
+    for (int j = 0; j < missing; j++)
+        repairs[j] = block.repairs.at(j).constData();
+
+    if (!FECCodec::decode(sources.constData(), present.constData(), block.sourceCount,
+                          block.repairIndexes.toVector().constData(), repairs.constData(), missing, bucket.symbolSize))
+        return false;
+
+    int recovered = 0;
+    for (int i = 0; i < block.sourceCount; i++)
+    {
+        if (present.at(i))
+            continue;
+        int position = (block.firstSymbol + i) * bucket.symbolSize;
+        int n = qMin(bucket.symbolSize, bucket.length - position);
+        if (i == shortSymbol)
+            memcpy(data + position, padded.constData(), n);
+        recovered += n;
+    }
+
+    addReceivedBucketBytes((qint64)bucketNumber * HASH_BUCKET_SIZE, recovered);
+    emit updateDirectBytesStats(recovered);
+    bytesTransferred += recovered;
+    return true;
+}
+
+void FECTransferSegment::bucketReceived(int bucketNumber)
+{
+    receivingBuckets.remove(bucketNumber);
+    downloadBucketComplete(bucketNumber);
+
+    if (receivingBuckets.isEmpty() && nextRequestOffset >= segmentEnd)
+    {
+        status = TRANSFER_STATE_FINISHED;  // local segment
+        emit requestNextSegment(this);
+    }
+    else
+        requestBuckets();
+}
+
+void FECTransferSegment::transferTimerEvent()
+{
+    if (!(pParent->getTransferStatus() & (TRANSFER_STATE_STALLED | TRANSFER_STATE_RUNNING)))
+        return;
+    if (status != TRANSFER_STATE_RUNNING)
+        return;
+
+    // Buckets that lost more than their repair symbols covered, or whose request got lost, are asked for again
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutableHashIterator<int, FECReceiveBucketStruct> i(receivingBuckets);
+    while (i.hasNext())
+    {
+        FECReceiveBucketStruct &bucket = i.next().value();
+        if (now - qMax(bucket.requestTime, bucket.lastPacketTime) < FEC_BUCKET_TIMEOUT)
+            continue;
+
+        if (++bucket.retries > FEC_MAXIMUM_RETRIES)
+        {
+            status = TRANSFER_STATE_FAILED;
+            emit transferRequestFailed(this);
+            return;
+        }
+        bucket.requestTime = now;
+        checkSendDownloadRequest(remoteHost, TTH, (qint64)i.key() * HASH_BUCKET_SIZE, bucket.length, status, ArpmanetFECProtocol);
+    }
+}
@@ -0,0 +1,150 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FECTRANSFERSEGMENT_H
+#define FECTRANSFERSEGMENT_H
+#include <QHash>
+#include <QList>
+#include <QQueue>
+#include <QVector>
+#include <QBitArray>
+#include "transfersegment.h"
+
+// ArpmanetFEC: forward error corrected transfers for lossy links.
+//
+// Data is requested a bucket at a time. The uploader splits the bucket into symbols of one packet each, groups them
+// into blocks of at most FEC_MAXIMUM_BLOCK_SOURCES and sends every source symbol followed by a number of repair
+// symbols per block (see FECCodec), interleaved across the blocks so that a burst of loss costs each block only a
+// little. The downloader rebuilds a block as soon as it holds as many symbols of it as the block has sources, lost
+// packets never need a round trip. Only when more is lost than the repair symbols cover does the bucket time out and
+// get asked for again; the uploader then sends it with fresh repair symbols and more of them.
+//
+// Packets are direct data packets for the bucket's offset, with a small header in front of the symbol:
+//     quint16 symbol size, quint16 block, quint8 symbol index (repair symbols come after the sources)
+
+#define FEC_HEADER_SIZE 5
+#define FEC_MAXIMUM_BLOCK_SOURCES 64
+// Repair symbols as a percentage of the sources, raised for a segment every time it has to send a bucket again
+#define FEC_DEFAULT_REPAIR_PERCENT 10
+#define FEC_REPAIR_PERCENT_STEP 10
+#define FEC_MAXIMUM_REPAIR_PERCENT 100
+// Buckets requested at a time
+#define FEC_BUCKETS_IN_FLIGHT 4
+// A bucket that got nothing for this long is asked for again, and the segment fails after as many tries in a row
+#define FEC_BUCKET_TIMEOUT 1500
+#define FEC_MAXIMUM_RETRIES 12
+// Upload pacing, as for FSTP
+#define FEC_UPLOAD_QUANTUM_PACKETS 4
+#define FEC_UPLOAD_BURST_MSECS 10
+#define FEC_UPLOAD_MINIMUM_RATE 1048576
+#define FEC_UPLOAD_RATE_SAMPLE_MSECS 250
+#define FEC_UPLOAD_RATE_IDLE_MSECS 2000
+
+// A bucket on its way in
+typedef struct
+{
+    int firstSymbol;
+    int sourceCount;
+    int presentCount;
+    QBitArray present;
+    QList<int> repairIndexes;
+    QList<QByteArray> repairs;
+    bool done;
+} FECReceiveBlockStruct;
+
+typedef struct
+{
+    int length;
+    int symbolSize;                         // 0 until the first packet says
+    int blocksDone;
+    QVector<FECReceiveBlockStruct> blocks;
+    qint64 requestTime;
+    qint64 lastPacketTime;
+    int retries;
+} FECReceiveBucketStruct;
+
+// A bucket on its way out
+typedef struct
+{
+    int bucketNumber;
+    int length;
+    int symbolSize;
+    int blockCount;
+    int maximumSources;
+    int firstRepair;
+    int repairCount;
+    int column;
+    int block;
+} FECSendBucketStruct;
+
+class Transfer;
+
+class FECTransferSegment : public TransferSegment
+{
+public:
+    FECTransferSegment(Transfer *parent = 0);
+    ~FECTransferSegment();
+
+    // Repair overhead new upload segments start with, thread safe
+    static void setRepairPercent(int percent);
+
+public slots:
+    void incomingDataPacket(qint64 offset, const char *data, int length);
+    void transferTimerEvent();
+    void setFileName(QString filename);
+    void setFileSize(quint64 size);
+    void startUploading();
+    void startDownloading();
+    void pauseDownload();
+    void unpauseDownload();
+    void abortTransfer();
+    void uploadQueued(int position, int retryMsecs);
+    int sendUploadQuantum(int maxPackets);
+    bool hasPendingUpload();
+
+private:
+    // Bucket layout, the same on both sides
+    static int symbolCount(int length, int symbolSize);
+    static int blockCount(int symbols);
+    static int blockFirstSymbol(int symbols, int blocks, int block);
+
+    // Downloading
+    void requestBuckets();
+    void initReceiveBucket(FECReceiveBucketStruct &bucket, int symbolSize);
+    bool decodeBlock(int bucketNumber, FECReceiveBucketStruct &bucket, FECReceiveBlockStruct &block);
+    void bucketReceived(int bucketNumber);
+    QHash<int, FECReceiveBucketStruct> receivingBuckets;
+    qint64 nextRequestOffset;
+
+    // Uploading
+    void queueUploadBucket(int bucketNumber, qint64 requestEnd);
+    bool sendSymbol(FECSendBucketStruct &bucket, int block, int symbolIndex);
+    void updatePeerReceiveRate(qint64 requestLength, qint64 now);
+    QQueue<FECSendBucketStruct> pendingUploadBuckets;
+    // Repair symbols used so far per bucket, the next round starts after them
+    QHash<int, int> bucketRepairsSent;
+    int repairPercent;
+    MappedFileRegion *uploadRegion;
+    QByteArray paddedSymbol;
+    qint64 uploadCredit;
+    qint64 uploadCreditTime;
+    qint64 peerReceiveRate;
+    qint64 requestRateSampleStart;
+    qint64 requestRateSampleBytes;
+};
+
+#endif // FECTRANSFERSEGMENT_H
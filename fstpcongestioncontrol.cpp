@@ -0,0 +1,121 @@
+#include "fstpcongestioncontrol.h"
+#include <QtGlobal>
+
+FSTPCongestionControl::FSTPCongestionControl()
+{
+    cwnd = FSTP_CC_INITIAL_WINDOW;
+    cwndFraction = 0;
+    slowStart = true;
+    lastDecrease = 0;
+    haveRtt = false;
+    srtt = 0;
+    rttvar = 0;
+    rtoBackoff = 1;
+    baseIntervalStart = 0;
+}
+
+void FSTPCongestionControl::rttSample(qint64 rtt, qint64 now)
+{
+    if (rtt < 0)
+        return;
+
+    // RFC 6298 smoothing for the retransmit timeout
+    if (!haveRtt)
+    {
+        srtt = rtt;
+        rttvar = rtt / 2;
+        haveRtt = true;
+    }
+    else
+    {
+        rttvar = (3 * rttvar + qAbs(srtt - rtt)) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
+    rtoBackoff = 1;
+
+    currentDelays.append(rtt);
+    if (currentDelays.size() > FSTP_CC_CURRENT_HISTORY)
+        currentDelays.removeFirst();
+
+    // One minimum per interval, so the base delay can follow a route change after a few minutes
+    if (baseDelays.isEmpty() || now - baseIntervalStart >= FSTP_CC_BASE_INTERVAL)
+    {
+        baseDelays.append(rtt);
+        baseIntervalStart = now;
+        if (baseDelays.size() > FSTP_CC_BASE_HISTORY)
+            baseDelays.removeFirst();
+    }
+    else if (rtt < baseDelays.last())
+        baseDelays.last() = rtt;
+
+    if (slowStart && queueingDelay() > FSTP_CC_TARGET_DELAY / 2)
+        slowStart = false;
+}
+
+void FSTPCongestionControl::bytesReceived(qint64 bytes, int packetSize)
+{
+    if (slowStart || !haveRtt)
+        cwnd += bytes;
+    else
+    {
+        // LEDBAT: at most one packet per window's worth of data, scaled by how far off target the delay is
+        qint64 offTarget = FSTP_CC_TARGET_DELAY - queueingDelay();
+        if (offTarget < -FSTP_CC_TARGET_DELAY)
+            offTarget = -FSTP_CC_TARGET_DELAY;
+        // Done in fixed point, in whole bytes this is 0 for every packet once the window passes a couple of MB
+        cwndFraction += offTarget * bytes * packetSize * FSTP_CC_WINDOW_FRACTION / (FSTP_CC_TARGET_DELAY * cwnd);
+        qint64 whole = cwndFraction / FSTP_CC_WINDOW_FRACTION;
+        cwnd += whole;
+        cwndFraction -= whole * FSTP_CC_WINDOW_FRACTION;
+    }
+
+    if (cwnd <= FSTP_CC_MINIMUM_WINDOW || cwnd >= FSTP_CC_MAXIMUM_WINDOW)
+        cwndFraction = 0;
+    cwnd = qBound((qint64)FSTP_CC_MINIMUM_WINDOW, cwnd, (qint64)FSTP_CC_MAXIMUM_WINDOW);
+}
+
+void FSTPCongestionControl::lossEvent(qint64 now)
+{
+    slowStart = false;
+
+    // Losses from the same round trip are one congestion event
+    if (now - lastDecrease < qMax(srtt, (qint64)1))
+        return;
+    lastDecrease = now;
+    cwnd = qMax(cwnd / 2, (qint64)FSTP_CC_MINIMUM_WINDOW);
+    cwndFraction = 0;
+}
+
+void FSTPCongestionControl::timeoutEvent(qint64 now)
+{
+    lossEvent(now);
+    if (retransmitTimeout() < FSTP_CC_MAXIMUM_RTO)
+        rtoBackoff *= 2;
+}
+
+qint64 FSTPCongestionControl::retransmitTimeout() const
+{
+    qint64 rto = haveRtt ? srtt + qMax(4 * rttvar, (qint64)FSTP_CC_MINIMUM_RTO) : FSTP_CC_INITIAL_RTO;
+    return qBound((qint64)FSTP_CC_MINIMUM_RTO, rto * rtoBackoff, (qint64)FSTP_CC_MAXIMUM_RTO);
+}
+
+qint64 FSTPCongestionControl::baseRtt() const
+{
+    qint64 base = -1;
+    foreach (qint64 delay, baseDelays)
+        if (base == -1 || delay < base)
+            base = delay;
+    return base;
+}
+
+qint64 FSTPCongestionControl::queueingDelay() const
+{
+    if (currentDelays.isEmpty())
+        return 0;
+
+    qint64 current = currentDelays.first();
+    foreach (qint64 delay, currentDelays)
+        if (delay < current)
+            current = delay;
+    return current - baseRtt();
+}
@@ -0,0 +1,88 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSTPCONGESTIONCONTROL_H
+#define FSTPCONGESTIONCONTROL_H
+
+#include <QList>
+
+// Receiver side congestion control for FSTP downloads.
+//
+// With FSTP the downloader decides how much data is in flight by what it asks for, so the window lives with the
+// downloading segment and not with the sender. The window is in bytes of requested data not yet received.
+//
+// RTT is sampled from a request going out to the first packet of its answer, never from a request that was sent more
+// than once. The window follows LEDBAT: the smallest RTT seen over the last few minutes stands for the empty path and
+// anything above it is queueing delay. The window grows while the queueing delay stays under target and shrinks once
+// it goes over, so FSTP backs off before it fills the queues other traffic waits in. Until the delay first gets near
+// target the window doubles every round trip (slow start). Loss halves the window, at most once per round trip.
+
+#define FSTP_CC_INITIAL_WINDOW 131072
+#define FSTP_CC_MINIMUM_WINDOW 65536
+#define FSTP_CC_MAXIMUM_WINDOW 16777216
+// LEDBAT growth per packet is a small fraction of a byte on a large window, it is accumulated in 1/65536ths of a byte
+#define FSTP_CC_WINDOW_FRACTION 65536
+// Queueing delay in ms we are prepared to add to the path
+#define FSTP_CC_TARGET_DELAY 50
+// Samples in the current delay filter, and one minute minimums kept for the base delay
+#define FSTP_CC_CURRENT_HISTORY 4
+#define FSTP_CC_BASE_HISTORY 10
+#define FSTP_CC_BASE_INTERVAL 60000
+// Retransmit timeout bounds in ms
+#define FSTP_CC_INITIAL_RTO 1000
+#define FSTP_CC_MINIMUM_RTO 200
+#define FSTP_CC_MAXIMUM_RTO 8000
+
+class FSTPCongestionControl
+{
+public:
+    FSTPCongestionControl();
+
+    // Request to first answering packet, in ms
+    void rttSample(qint64 rtt, qint64 now);
+    // New data arrived, packetSize is the payload size of a full packet on this path
+    void bytesReceived(qint64 bytes, int packetSize);
+    // Holes found after later data arrived
+    void lossEvent(qint64 now);
+    // Nothing came back in time, the retransmit timeout backs off until the next RTT sample
+    void timeoutEvent(qint64 now);
+
+    qint64 window() const {return cwnd;}
+    qint64 retransmitTimeout() const;
+    qint64 smoothedRtt() const {return srtt;}
+    qint64 baseRtt() const;
+    qint64 queueingDelay() const;
+    bool inSlowStart() const {return slowStart;}
+
+private:
+    qint64 cwnd;
+    // Growth or shrinkage not yet big enough to move cwnd by a whole byte, in 1/FSTP_CC_WINDOW_FRACTION bytes
+    qint64 cwndFraction;
+    bool slowStart;
+    qint64 lastDecrease;
+
+    bool haveRtt;
+    qint64 srtt;
+    qint64 rttvar;
+    int rtoBackoff;
+
+    QList<qint64> currentDelays;
+    QList<qint64> baseDelays;
+    qint64 baseIntervalStart;
+};
+
+#endif // FSTPCONGESTIONCONTROL_H
@@ -1,22 +1,36 @@
 #include "fstptransfersegment.h"
+#include "datagrampool.h"
+#include "bytecursor.h"
+#include "pathmtudiscovery.h"
+#include "uploadblockcache.h"
 
 FSTPTransferSegment::FSTPTransferSegment(Transfer *parent) : TransferSegment(parent)
 {
     status = TRANSFER_STATE_INITIALIZING;
     prev_status = -1;
     requestingOffset = 0;
-    //requestingLength = 65536;
-    requestingLength = 131072;
-    requestingTargetOffset = 0;
+    nextRequestOffset = 0;
+    highestReceivedOffset = 0;
+    receivedAboveRequestingOffset = 0;
     retransmitTimeoutCounter = 0;
     retransmitRetryCounter = 0;
     packetsSinceUpdate = 0;
+    uploadQueuedUntil = 0;
+
+    uploadRegion = 0;
+    uploadCredit = 0;
+    uploadCreditTime = 0;
+    peerReceiveRate = 0;
+    requestRateSampleStart = 0;
+    requestRateSampleBytes = 0;
 
     pParent = parent;
 }
 
 FSTPTransferSegment::~FSTPTransferSegment()
 {
+    if (uploadRegion)
+        uploadRegion->deref();
     if (inputFile.isOpen())
         inputFile.close();
 
@@ -54,50 +68,120 @@ void FSTPTransferSegment::startUploading()
     if (segmentStart + segmentLength == fileSize)
         maxUploadRequestOffset = fileSize;
 
-    const char * f = (char*)inputFile.map(segmentStart, segmentLength);
-    if (f == 0)
-    {
-        emit sendTransferError(remoteHost, FileIOError, TTH, segmentStart);
+    if (segmentLength <= 0)
         return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    updatePeerReceiveRate(segmentLength, now);
+
+    // A re-request for something still waiting in the queue would only send it twice
+    qint64 end = segmentStart + segmentLength;
+    foreach (FSTPUploadRangeStruct range, pendingUploadRanges)
+        if (segmentStart >= range.offset && end <= range.end)
+            return;
+
+    FSTPUploadRangeStruct range;
+    range.offset = segmentStart;
+    range.end = end;
+    pendingUploadRanges.enqueue(range);
+
+    // The transfer manager comes back for the packets a few at a time, see sendUploadQuantum()
+    emit uploadPending(this);
+}
+
+// Sends at most maxPackets of the queued ranges, as far as the pacing credit allows. Returns the number sent.
+int FSTPTransferSegment::sendUploadQuantum(int maxPackets)
+{
+    if (pendingUploadRanges.isEmpty())
+        return 0;
+
+    // PACKET_DATA_MTU unless path MTU discovery and the downloader's request agreed on something bigger
+    int payloadSize = PathMTUDiscovery::dataPayloadSize(remoteHost);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 rate = qMax(2 * peerReceiveRate, (qint64)FSTP_UPLOAD_MINIMUM_RATE);
+    qint64 burst = qMax(rate * FSTP_UPLOAD_BURST_MSECS / 1000, (qint64)(FSTP_UPLOAD_QUANTUM_PACKETS * payloadSize));
+    qint64 add = rate * (now - uploadCreditTime) / 1000;
+    if (add > 0)
+    {
+        uploadCredit = qMin(uploadCredit + add, burst);
+        uploadCreditTime = now;
     }
 
-    qint64 wptr = 0;
-    QByteArray header;
-    header.reserve(2);
-    if (segmentId > 0)
-        header.append(DirectDataPacket);
-    else
-        header.append(DataPacket);
-    header.append(FailsafeTransferProtocol);
-    QByteArray data(QByteArray::fromRawData(f, segmentLength));
-    while (wptr < segmentLength)
+    quint8 packetType = segmentId > 0 ? DirectDataPacket : DataPacket;
+    int headerLength = segmentId > 0 ? 14 : 10 + TTH.length();
+    int packets = 0;
+    while (packets < maxPackets && !pendingUploadRanges.isEmpty() && uploadCredit >= payloadSize)
     {
-        QByteArray *packet = new QByteArray(header);
-        packet->reserve(PACKET_MTU);
-        if (segmentId > 0)
+        FSTPUploadRangeStruct &range = pendingUploadRanges.head();
+        if (!uploadRegion || range.offset < uploadRegion->offset() || range.offset >= uploadRegion->offset() + uploadRegion->length())
         {
-            packet->append(quint64ToByteArray((quint64)(segmentStart + wptr)));
-            packet->append(quint32ToByteArray(segmentId));
-        }
-        else
-        {
-            packet->append(quint64ToByteArray((quint64)(segmentStart + wptr)));
-            packet->append(TTH);
-        }
-        //qDebug() << "Write data segmentStart " << segmentStart << " segmentLength " << segmentLength << " wptr " << wptr;
-        if (wptr + PACKET_DATA_MTU < segmentLength)
-        {
-            packet->append(data.mid(wptr, PACKET_DATA_MTU));
-            wptr += PACKET_DATA_MTU;
+            if (uploadRegion)
+                uploadRegion->deref();
+            uploadRegion = UploadBlockCache::acquireBlock(TTH, filePathName, calculateBucketNumber(range.offset));
+            if (!uploadRegion)
+            {
+                emit sendTransferError(remoteHost, FileIOError, TTH, range.offset);
+                pendingUploadRanges.dequeue();
+                continue;
+            }
         }
+
+        // Packets stop at block boundaries, the downloader does not mind a short one now and then
+        int chunk = qMin((qint64)payloadSize, qMin(range.end, uploadRegion->offset() + uploadRegion->length()) - range.offset);
+        // Only the header is written here, the payload stays in the file map until the kernel copies it out
+        MappedDatagramStruct datagram;
+        datagram.header = DatagramPool::acquire(headerLength);
+        ByteWriter writer(datagram.header->data(), datagram.header->length());
+        writer.writeUInt8(packetType);
+        writer.writeUInt8(FailsafeTransferProtocol);
+        writer.writeUInt64((quint64)range.offset);
+        if (segmentId > 0)
+            writer.writeUInt32(segmentId);
         else
-        {
-            packet->append(data.mid(wptr, segmentLength - wptr));
-            wptr += segmentLength - wptr;
-        }
-        emit transmitDatagram(remoteHost, packet);
+            writer.writeBytes(TTH);
+        datagram.region = uploadRegion;
+        datagram.region->ref();
+        datagram.payload = uploadRegion->data() + (range.offset - uploadRegion->offset());
+        datagram.payloadLength = chunk;
+        emit transmitMappedDatagram(remoteHost, datagram);
+
+        range.offset += chunk;
+        uploadCredit -= chunk;
+        packets++;
+
+        // Queued datagrams keep the block mapped until they are sent, whatever the cache does with it
+        if (range.offset >= range.end)
+            pendingUploadRanges.dequeue();
+    }
+
+    return packets;
+}
+
+bool FSTPTransferSegment::hasPendingUpload()
+{
+    return !pendingUploadRanges.isEmpty();
+}
+
+// The downloader asks for more as data arrives, so the rate of requests is the rate at which it receives
+void FSTPTransferSegment::updatePeerReceiveRate(qint64 requestLength, qint64 now)
+{
+    qint64 elapsed = now - requestRateSampleStart;
+    if (elapsed > FSTP_UPLOAD_RATE_IDLE_MSECS)
+    {
+        // Idle time says nothing about the peer, start over
+        requestRateSampleStart = now;
+        requestRateSampleBytes = requestLength;
+        return;
+    }
+
+    requestRateSampleBytes += requestLength;
+    if (elapsed >= FSTP_UPLOAD_RATE_SAMPLE_MSECS)
+    {
+        qint64 sample = requestRateSampleBytes * 1000 / elapsed;
+        peerReceiveRate = peerReceiveRate == 0 ? sample : (3 * peerReceiveRate + sample) / 4;
+        requestRateSampleStart = now;
+        requestRateSampleBytes = 0;
     }
-    inputFile.unmap((unsigned char *)f);
 }
 
 void FSTPTransferSegment::startDownloading()
@@ -108,12 +192,16 @@ void FSTPTransferSegment::startDownloading()
     {
         segmentStartTime = QDateTime::currentMSecsSinceEpoch();
         requestingOffset = segmentStart;
-        requestingTargetOffset = requestingOffset + requestingLength;
+        nextRequestOffset = segmentStart;
+        highestReceivedOffset = segmentStart;
+        receivedAboveRequestingOffset = 0;
+        receivedRanges.clear();
+        outstandingRequests.clear();
         retransmitTimeoutCounter = 0;
         retransmitRetryCounter = 0;
-        //qDebug() << "FSTPTransferSegment::startDownloading() call checkSendDownloadRequest()";
+        //qDebug() << "FSTPTransferSegment::startDownloading() call fillRequestPipeline()";
         status = TRANSFER_STATE_RUNNING;
-        checkSendDownloadRequest(remoteHost, TTH, requestingOffset, requestingLength, status, FailsafeTransferProtocol);
+        fillRequestPipeline();
     }
 }
 
@@ -129,109 +217,320 @@ void FSTPTransferSegment::unpauseDownload()
         status = prev_status;
 }
 
+// Nothing arrives until the uploader has a slot for us, and it starts sending the moment it has one. Asking again
+// before the retry hint runs out only costs both sides, and the silence must not count as a stall.
+void FSTPTransferSegment::uploadQueued(int, int retryMsecs)
+{
+    if (status != TRANSFER_STATE_RUNNING || requestingOffset != segmentStart || !receivedRanges.isEmpty())
+        return;
+
+    uploadQueuedUntil = QDateTime::currentMSecsSinceEpoch() + retryMsecs;
+    outstandingRequests.clear();
+    nextRequestOffset = requestingOffset;
+    retransmitTimeoutCounter = 0;
+}
+
 void FSTPTransferSegment::abortTransfer()
 {
     emit transferRequestFailed(this, 0, false);
 }
 
-void FSTPTransferSegment::incomingDataPacket(qint64 offset, QByteArray data)
+void FSTPTransferSegment::incomingDataPacket(qint64 offset, const char *data, int length)
 {
     //Ignore packet if transfer has failed and has not been restarted
     if (status == TRANSFER_STATE_FAILED && offset != segmentStart)
         return;
 
-    if (offset > requestingOffset)
-    {
-        status = TRANSFER_STATE_STALLED;
-        return;
-    }
-    if (offset < requestingOffset)
+    // Broken segments from old clients that do not support error reporting stop here, they can then time out and fail.
+    if (length <= 0)
         return;
 
-    int b = data.length();
+    // The uploader had a slot come free
+    uploadQueuedUntil = 0;
 
-    // Broken segments from old clients that do not support error reporting stop here, they can then time out and fail.
-    if (b == 0)
+    // Only the part we still need: nothing below requestingOffset, nothing past the segment
+    qint64 start = qMax(offset, requestingOffset);
+    qint64 end = qMin(offset + length, segmentEnd);
+    if (start >= end)
+        return;
+
+    // Packets that overtook a lost or late one are kept, only bytes we did not have yet count
+    qint64 newBytes = addReceivedRange(start, end);
+    if (newBytes == 0)
         return;
 
-    emit updateDirectBytesStats(b);
-    bytesTransferred += b;
+    placeData(start, data + (start - offset), end - start);
+    // A packet partly overlapping data we had is rare, its new bytes are put down to where it starts
+    addReceivedBucketBytes(start, newBytes);
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    // The first packet answering a request gives an RTT sample, unless the request went out more than once
+    for (int i = 0; i < outstandingRequests.size(); i++)
+    {
+        FSTPRequestStruct &request = outstandingRequests[i];
+        if (offset >= request.offset && offset < request.end)
+        {
+            if (!request.answered && request.retransmits == 0)
+                congestionControl.rttSample(now - request.sendTime, now);
+            request.answered = true;
+            break;
+        }
+    }
+    congestionControl.bytesReceived(newBytes, length);
+
+    emit updateDirectBytesStats(newBytes);
+    bytesTransferred += newBytes;
+    receivedAboveRequestingOffset += newBytes;
 
     status = TRANSFER_STATE_RUNNING;
     packetsSinceUpdate++;
     retransmitRetryCounter = 0;
+    if (end > highestReceivedOffset)
+        highestReceivedOffset = end;
 
-    int bucketNumber = calculateBucketNumber(offset);
-    if (!pDownloadBucketTable->contains(bucketNumber))
+    // Move requestingOffset up over everything that is contiguous now and hand completed buckets to the hasher.
+    // these last bucket numbers are for the *segment*, not the file: the last bucket ends at segmentEnd.
+    QMap<qint64, qint64>::iterator first = receivedRanges.begin();
+    if (first.key() == requestingOffset)
     {
-        QByteArray *bucket = new QByteArray();
-        bucket->reserve(1048576);
-        pDownloadBucketTable->insert(bucketNumber, bucket);
-    }
-    if ((pDownloadBucketTable->value(bucketNumber)->length() + data.length()) > HASH_BUCKET_SIZE)
-    {
-        int bucketRemaining = HASH_BUCKET_SIZE - pDownloadBucketTable->value(bucketNumber)->length();
-        pDownloadBucketTable->value(bucketNumber)->append(data.mid(0, bucketRemaining));
-        if (!pDownloadBucketTable->contains(bucketNumber + 1))
+        qint64 contiguousEnd = first.value();
+        receivedAboveRequestingOffset -= contiguousEnd - first.key();
+        receivedRanges.erase(first);
+        hashReceivedRange(requestingOffset, contiguousEnd);
+
+        int bucketNumber = calculateBucketNumber(requestingOffset);
+        qint64 bucketEnd = qMin((qint64)(bucketNumber + 1) * HASH_BUCKET_SIZE, segmentEnd);
+        while (bucketEnd <= contiguousEnd)
         {
-            QByteArray *nextBucket = new QByteArray(data.mid(bucketRemaining));
-            nextBucket->reserve(1048576);
-            pDownloadBucketTable->insert(bucketNumber + 1, nextBucket);
+            downloadBucketComplete(bucketNumber);
+            if (bucketEnd == segmentEnd)
+                break;
+            bucketNumber++;
+            bucketEnd = qMin(bucketEnd + HASH_BUCKET_SIZE, segmentEnd);
         }
-        // there should be no else - if the next bucket exists and data is sticking over, there is an error,
-        // since we segment on bucket boundaries. tth checksumming will catch the problems.
+
+        requestingOffset = contiguousEnd;
+        if (requestingOffset >= segmentEnd)
+            status = TRANSFER_STATE_FINISHED;  // local segment
     }
-    else
+
+    checkOutstandingRequests(now);
+    fillRequestPipeline();
+
+    if (requestingOffset >= segmentEnd)
     {
-        pDownloadBucketTable->value(bucketNumber)->append(data);
-        //qDebug() << "Append data " << requestingOffset << offset << pDownloadBucketTable->value(bucketNumber)->length();
+        emit requestNextSegment(this);
     }
+}
 
-    if (pDownloadBucketTable->value(bucketNumber)->length() == HASH_BUCKET_SIZE)
+// Adds [start, end) to the received ranges, merging with neighbours. Returns how many bytes were new.
+qint64 FSTPTransferSegment::addReceivedRange(qint64 start, qint64 end)
+{
+    qint64 mergedLength = 0;
+    QMap<qint64, qint64>::iterator i = receivedRanges.upperBound(start);
+    if (i != receivedRanges.begin())
     {
-        emit hashBucketRequest(TTH, bucketNumber, pDownloadBucketTable->value(bucketNumber), remoteHost);
-        //qDebug() << "FSTPTransferSegment emit hashBucketRequest() " << bucketNumber << pDownloadBucketTable->value(bucketNumber)->length();
+        --i;
+        if (i.value() < start)
+            ++i;
     }
 
-    // these last bucket numbers are for the *segment*, not the file.
-    // the length check is for in case it is also the last segment of the file.
-    if ((bucketNumber == lastBucketNumber) && (lastBucketSize == pDownloadBucketTable->value(bucketNumber)->length())) // End of Segment
+    while ((i != receivedRanges.end()) && (i.key() <= end))
     {
-        status = TRANSFER_STATE_FINISHED;  // local segment
-        //qDebug() << "FSTPTransferSegment emit hashBucketRequest() on finish " << bucketNumber << pDownloadBucketTable->value(bucketNumber)->length();
-        emit hashBucketRequest(TTH, bucketNumber, pDownloadBucketTable->value(bucketNumber), remoteHost);
+        start = qMin(start, i.key());
+        mergedLength += i.value() - i.key();
+        end = qMax(end, i.value());
+        i = receivedRanges.erase(i);
     }
 
-    requestingOffset += data.length();
-    if ((requestingOffset == requestingTargetOffset) && (requestingOffset < segmentEnd))
+    receivedRanges.insert(start, end);
+    return (end - start) - mergedLength;
+}
+
+// Writes data straight to its place in the file or bucket, even if the bytes before it have not arrived yet.
+// A bucket is grown over the hole, which gets filled in when the missing packets turn up.
+void FSTPTransferSegment::placeData(qint64 offset, const char *data, int length)
+{
+    while (length > 0)
     {
-        if (requestingLength <= FSTP_TRANSFER_MAXIMUM_SEGMENT / 2)
-            requestingLength *= 2;
+        int bucketNumber = calculateBucketNumber(offset);
+        int bucketOffset = offset - (qint64)bucketNumber * HASH_BUCKET_SIZE;
+        int n = qMin(length, (int)HASH_BUCKET_SIZE - bucketOffset);
+
+        memcpy(downloadBucketData(bucketNumber, bucketOffset + n) + bucketOffset, data, n);
 
-        requestingTargetOffset += requestingLength;
-        //qDebug() << "FSTPTransferSegment::incomingDataPacket() call checkSendDownloadRequest()";
-        checkSendDownloadRequest(remoteHost, TTH, requestingOffset, requestingLength, status, FailsafeTransferProtocol);
+        offset += n;
+        data += n;
+        length -= n;
     }
+}
 
-    if (requestingOffset >= segmentEnd)
+// Ranges between from and to that have not arrived
+QList<QPair<qint64, qint64> > FSTPTransferSegment::findMissingRanges(qint64 from, qint64 to)
+{
+    QList<QPair<qint64, qint64> > holes;
+    qint64 cursor = from;
+    QMapIterator<qint64, qint64> i(receivedRanges);
+    while (i.hasNext() && cursor < to)
     {
-        emit requestNextSegment(this);
+        i.next();
+        if (i.value() <= cursor)
+            continue;
+        if (i.key() > cursor)
+            holes.append(qMakePair(cursor, qMin(i.key(), to)));
+        cursor = i.value();
+    }
+    if (cursor < to)
+        holes.append(qMakePair(cursor, to));
+    return holes;
+}
+
+// Sends selective requests for the holes, a few dozen per message
+void FSTPTransferSegment::requestMissingRanges(const QList<QPair<qint64, qint64> > &holes)
+{
+    if (!(status & (TRANSFER_STATE_RUNNING | TRANSFER_STATE_STALLED)))
+        return;
+
+    for (int h = 0; h < holes.size(); h += FSTP_SELECTIVE_REQUEST_MAX_RANGES)
+    {
+        int count = qMin(holes.size() - h, FSTP_SELECTIVE_REQUEST_MAX_RANGES);
+        QByteArray ranges(count * 12, 0);
+        ByteWriter writer(ranges.data(), ranges.size());
+        for (int r = h; r < h + count; r++)
+        {
+            writer.writeUInt64((quint64)holes.at(r).first);
+            writer.writeUInt32((quint32)(holes.at(r).second - holes.at(r).first));
+        }
+        emit sendSelectiveDownloadRequest(FailsafeTransferProtocol, remoteHost, TTH, ranges, segmentId, remoteCID);
+    }
+}
+
+// Keeps requests going out until the congestion window is full, so the pipe never runs dry waiting for a round trip
+void FSTPTransferSegment::fillRequestPipeline()
+{
+    if (status != TRANSFER_STATE_RUNNING || uploadQueuedUntil > 0)
+        return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 window = congestionControl.window();
+    // A quarter window per request, the next ones go out while the earlier ones are still arriving
+    qint64 requestSize = qBound((qint64)FSTP_TRANSFER_MINIMUM_SEGMENT, window / 4, (qint64)FSTP_TRANSFER_MAXIMUM_SEGMENT);
+
+    while ((nextRequestOffset < segmentEnd) && (nextRequestOffset - requestingOffset < FSTP_MAXIMUM_REORDER_DISTANCE))
+    {
+        qint64 inFlight = nextRequestOffset - requestingOffset - receivedAboveRequestingOffset;
+        if (inFlight >= window)
+            break;
+
+        qint64 length = qMin(requestSize, segmentEnd - nextRequestOffset);
+        checkSendDownloadRequest(remoteHost, TTH, nextRequestOffset, length, status, FailsafeTransferProtocol);
+
+        FSTPRequestStruct request;
+        request.offset = nextRequestOffset;
+        request.end = nextRequestOffset + length;
+        request.sendTime = now;
+        request.answered = false;
+        request.retransmits = 0;
+        outstandingRequests.append(request);
+        nextRequestOffset += length;
+    }
+}
+
+// Finds requests that lost data: either later data has overtaken them or they ran out of time.
+// The first attempt asks for the holes only, the next one asks for the whole stretch again with a plain request, for
+// uploaders that do not know selective requests, and so on alternating.
+void FSTPTransferSegment::checkOutstandingRequests(qint64 now)
+{
+    if (status != TRANSFER_STATE_RUNNING)
+        return;
+
+    qint64 rto = congestionControl.retransmitTimeout();
+    bool lost = false;
+    bool timedOut = false;
+
+    QMutableListIterator<FSTPRequestStruct> i(outstandingRequests);
+    while (i.hasNext())
+    {
+        FSTPRequestStruct &request = i.next();
+        if (request.end <= requestingOffset)
+        {
+            i.remove();
+            continue;
+        }
+
+        bool overtaken = request.retransmits == 0 && highestReceivedOffset > request.end;
+        bool expired = now - request.sendTime >= rto;
+        if (!overtaken && !expired)
+            continue;
+
+        QList<QPair<qint64, qint64> > holes = findMissingRanges(qMax(request.offset, requestingOffset), request.end);
+        if (holes.isEmpty())
+        {
+            i.remove();
+            continue;
+        }
+
+        if (request.retransmits % 2 == 0)
+            requestMissingRanges(holes);
+        else
+            checkSendDownloadRequest(remoteHost, TTH, holes.first().first,
+                                     qMin(request.end - holes.first().first, (qint64)FSTP_TRANSFER_MAXIMUM_SEGMENT), status, FailsafeTransferProtocol);
+        request.retransmits++;
+        request.sendTime = now;
+
+        if (expired)
+            timedOut = true;
+        else
+            lost = true;
     }
+
+    if (timedOut)
+        congestionControl.timeoutEvent(now);
+    else if (lost)
+        congestionControl.lossEvent(now);
 }
 
 void FSTPTransferSegment::transferTimerEvent()
 {
     if (!(pParent->getTransferStatus() & (TRANSFER_STATE_STALLED | TRANSFER_STATE_RUNNING)))
         return;
-    if (status == TRANSFER_STATE_STALLED)
+    if (uploadQueuedUntil > 0)
+    {
+        // Queued at the uploader, ask again once the retry hint runs out
+        if (QDateTime::currentMSecsSinceEpoch() < uploadQueuedUntil)
+            return;
+        uploadQueuedUntil = 0;
+        fillRequestPipeline();
+    }
+    else if (status == TRANSFER_STATE_STALLED)
     {
         // Transfer some data
-        if (requestingLength > FSTP_TRANSFER_MINIMUM_SEGMENT)
-            requestingLength /= 2;
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        congestionControl.timeoutEvent(now);
         status = TRANSFER_STATE_RUNNING;
-        requestingTargetOffset = requestingOffset + requestingLength;
-        //qDebug() << "FSTPTransferSegment::transferTimerEvent() call checkSendDownloadRequest()" << requestingOffset << requestingLength;
-        checkSendDownloadRequest(remoteHost, TTH, requestingOffset, requestingLength, status, FailsafeTransferProtocol);
+        // Whatever is still missing after all this silence is lost. With part of the window in hand only the holes are
+        // asked for; every other retry goes the old way from requestingOffset, for uploaders without selective requests.
+        if (!receivedRanges.isEmpty() && (retransmitRetryCounter % 2 == 0))
+            requestMissingRanges(findMissingRanges(requestingOffset, nextRequestOffset));
+        else
+        {
+            qint64 length = qMin(congestionControl.window(), (qint64)FSTP_TRANSFER_MAXIMUM_SEGMENT);
+            nextRequestOffset = qMax(nextRequestOffset, qMin(requestingOffset + length, segmentEnd));
+            //qDebug() << "FSTPTransferSegment::transferTimerEvent() call checkSendDownloadRequest()" << requestingOffset << length;
+            checkSendDownloadRequest(remoteHost, TTH, requestingOffset, length, status, FailsafeTransferProtocol);
+        }
+        // Start the clocks on everything outstanding over, it has all just been asked for again
+        outstandingRequests.clear();
+        if (requestingOffset < nextRequestOffset)
+        {
+            FSTPRequestStruct request;
+            request.offset = requestingOffset;
+            request.end = nextRequestOffset;
+            request.sendTime = now;
+            request.answered = false;
+            request.retransmits = 1;
+            outstandingRequests.append(request);
+        }
         retransmitRetryCounter++;
         // retransmit timeout 2 seconds, 15 retransmits / 30 seconds deadness plenty enough to warrant a fail.
         if (retransmitRetryCounter == 15)
@@ -242,6 +541,10 @@ void FSTPTransferSegment::transferTimerEvent()
     }
     else if (status == TRANSFER_STATE_RUNNING)
     {
+        // Retransmit timeouts run at the timer's resolution when nothing is arriving
+        checkOutstandingRequests(QDateTime::currentMSecsSinceEpoch());
+        fillRequestPipeline();
+
         if (packetsSinceUpdate == 0)
         {
             retransmitTimeoutCounter++;
@@ -17,10 +17,43 @@
 
 #ifndef FSTPTRANSFERSEGMENT_H
 #define FSTPTRANSFERSEGMENT_H
+#include <QMap>
+#include <QList>
+#include <QQueue>
 #include "transfersegment.h"
+#include "fstpcongestioncontrol.h"
 
 #define FSTP_TRANSFER_MINIMUM_SEGMENT 65536
 #define FSTP_TRANSFER_MAXIMUM_SEGMENT 1048576//524288
+// Holes per selective request message, (quint64 offset, quint32 length) each
+#define FSTP_SELECTIVE_REQUEST_MAX_RANGES 64
+// Requests may run this far ahead of a hole that has not been filled yet
+#define FSTP_MAXIMUM_REORDER_DISTANCE (2 * FSTP_CC_MAXIMUM_WINDOW)
+
+// Uploads go out FSTP_UPLOAD_QUANTUM_PACKETS at a time, paced at twice the rate the peer asks for data, which follows
+// the rate it receives at. The headroom lets the downloader's window grow.
+#define FSTP_UPLOAD_QUANTUM_PACKETS 4
+#define FSTP_UPLOAD_BURST_MSECS 10
+#define FSTP_UPLOAD_MINIMUM_RATE 1048576
+#define FSTP_UPLOAD_RATE_SAMPLE_MSECS 250
+#define FSTP_UPLOAD_RATE_IDLE_MSECS 2000
+
+// A requested range waiting to be uploaded
+typedef struct
+{
+    qint64 offset;
+    qint64 end;
+} FSTPUploadRangeStruct;
+
+// A download request on its way, for RTT samples and loss detection
+typedef struct
+{
+    qint64 offset;
+    qint64 end;
+    qint64 sendTime;
+    bool answered;
+    int retransmits;
+} FSTPRequestStruct;
 
 class Transfer;
 
@@ -31,7 +64,7 @@ public:
     ~FSTPTransferSegment();
 
 public slots:
-    void incomingDataPacket(qint64 offset, QByteArray data);
+    void incomingDataPacket(qint64 offset, const char *data, int length);
     void transferTimerEvent();
     void setFileName(QString filename);
     void setFileSize(quint64 size);
@@ -40,14 +73,45 @@ public slots:
     void pauseDownload();
     void unpauseDownload();
     void abortTransfer();
+    int sendUploadQuantum(int maxPackets);
+    bool hasPendingUpload();
+    void uploadQueued(int position, int retryMsecs);
 
 private:
+    // Out of order reception
+    qint64 addReceivedRange(qint64 start, qint64 end);
+    void placeData(qint64 offset, const char *data, int length);
+    QList<QPair<qint64, qint64> > findMissingRanges(qint64 from, qint64 to);
+    void requestMissingRanges(const QList<QPair<qint64, qint64> > &holes);
+
+    // Paced uploading
+    void updatePeerReceiveRate(qint64 requestLength, qint64 now);
+    QQueue<FSTPUploadRangeStruct> pendingUploadRanges;
+    MappedFileRegion *uploadRegion;
+    qint64 uploadCredit;
+    qint64 uploadCreditTime;
+    qint64 peerReceiveRate;
+    qint64 requestRateSampleStart;
+    qint64 requestRateSampleBytes;
+
+    // Pipelining
+    void fillRequestPipeline();
+    void checkOutstandingRequests(qint64 now);
+
+    // Everything below requestingOffset has arrived, ranges above it that have arrived are in receivedRanges
     qint64 requestingOffset;
-    qint64 requestingLength;
-    qint64 requestingTargetOffset;
+    qint64 nextRequestOffset;
+    qint64 highestReceivedOffset;
+    qint64 receivedAboveRequestingOffset;
+    QMap<qint64, qint64> receivedRanges;
+    QList<FSTPRequestStruct> outstandingRequests;
+    // Survives from segment to segment, they all go to the same peer
+    FSTPCongestionControl congestionControl;
     int packetsSinceUpdate;
     int retransmitTimeoutCounter;
     int retransmitRetryCounter;
+    // Waiting for a slot at the uploader until then, 0 when not queued
+    qint64 uploadQueuedUntil;
 };
 
 #endif // FSTPTRANSFERSEGMENT_H
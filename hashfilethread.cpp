@@ -130,8 +130,8 @@ void HashFileThread::processBucket(QByteArray rootTTH, int bucketNumber, QByteAr
     Tiger totalTTH;
     QByteArray tth;
     
-    //Calculate TTH of bucket - can be any size
-    totalTTH.Update((byte *)bucket.data(), bucket.size());
+    //Calculate TTH of bucket - can be any size. Downloads hand us views of their mapped file, which must not be copied.
+    totalTTH.Update((const byte *)bucket.constData(), bucket.size());
 
     byte *digestTTH = new byte[totalTTH.DigestSize()];
     totalTTH.Final(digestTTH);
@@ -0,0 +1,92 @@
+#include "mappedfileregion.h"
+#include "datagrampool.h"
+
+#ifdef Q_WS_WIN //If windows
+#include <windows.h>
+#include <io.h>
+#else //If Q_OS_LINUX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+MappedFileRegion::MappedFileRegion()
+{
+    base = 0;
+    baseLength = 0;
+    start = 0;
+    regionOffset = 0;
+    regionLength = 0;
+}
+
+MappedFileRegion::~MappedFileRegion()
+{
+    if (!base)
+        return;
+#ifdef Q_WS_WIN
+    UnmapViewOfFile(base);
+#else
+    ::munmap(base, baseLength);
+#endif
+}
+
+MappedFileRegion *MappedFileRegion::map(QFile &file, qint64 offset, qint64 length)
+{
+    if (!file.isOpen() || file.handle() == -1 || offset < 0 || length <= 0)
+        return 0;
+
+    // Mappings have to start on an allocation boundary, the region starts somewhere after that
+#ifdef Q_WS_WIN
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    qint64 granularity = info.dwAllocationGranularity;
+#else
+    qint64 granularity = ::sysconf(_SC_PAGESIZE);
+#endif
+    qint64 baseOffset = offset - offset % granularity;
+    qint64 mapLength = length + (offset - baseOffset);
+
+#ifdef Q_WS_WIN
+    HANDLE fileHandle = (HANDLE)_get_osfhandle(file.handle());
+    HANDLE mapping = CreateFileMapping(fileHandle, 0, PAGE_READONLY, 0, 0, 0);
+    if (!mapping)
+        return 0;
+    // The view keeps the mapping object alive by itself
+    void *p = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(baseOffset >> 32), (DWORD)(baseOffset & 0xffffffff), (SIZE_T)mapLength);
+    CloseHandle(mapping);
+    if (!p)
+        return 0;
+#else
+    void *p = ::mmap(0, mapLength, PROT_READ, MAP_SHARED, file.handle(), baseOffset);
+    if (p == MAP_FAILED)
+        return 0;
+#endif
+
+    MappedFileRegion *region = new MappedFileRegion;
+    region->base = p;
+    region->baseLength = mapLength;
+    region->start = (const char *)p + (offset - baseOffset);
+    region->regionOffset = offset;
+    region->regionLength = length;
+    region->refCount = 1;
+    return region;
+}
+
+void MappedFileRegion::ref()
+{
+    refCount.ref();
+}
+
+void MappedFileRegion::deref()
+{
+    if (!refCount.deref())
+        delete this;
+}
+
+void releaseMappedDatagram(MappedDatagramStruct &datagram)
+{
+    DatagramPool::release(datagram.header);
+    datagram.header = 0;
+    if (datagram.region)
+        datagram.region->deref();
+    datagram.region = 0;
+}
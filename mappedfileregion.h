@@ -0,0 +1,76 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPEDFILEREGION_H
+#define MAPPEDFILEREGION_H
+
+#include <QFile>
+#include <QAtomicInt>
+#include <QByteArray>
+
+// Read only memory map of part of a file that can be handed across threads.
+//
+// QFile::map() ties a mapping to its QFile and the thread using it, which is no good when the upload segment maps a
+// range in the transfer thread and the dispatcher sends the packets from it later in its own thread. These regions are
+// mapped with the operating system directly and reference counted instead: every queued datagram pointing into the
+// region holds a reference, and whoever drops the last one unmaps it.
+
+class MappedFileRegion
+{
+public:
+    // Maps length bytes from offset, returns 0 if that is not possible. The caller holds the first reference.
+    static MappedFileRegion *map(QFile &file, qint64 offset, qint64 length);
+
+    const char *data() const {return start;}
+    qint64 offset() const {return regionOffset;}
+    qint64 length() const {return regionLength;}
+
+    void ref();
+    void deref();
+
+private:
+    MappedFileRegion();
+    ~MappedFileRegion();
+
+    QAtomicInt refCount;
+    void *base;
+    qint64 baseLength;
+    const char *start;
+    qint64 regionOffset;
+    qint64 regionLength;
+};
+
+// A datagram whose payload is still in the file: the header sits in a pooled buffer and the payload points into a
+// mapped region, so that only the kernel copies the data. Without a region the header buffer is the whole datagram.
+typedef struct
+{
+    QByteArray *header;
+    MappedFileRegion *region;
+    const char *payload;
+    int payloadLength;
+} MappedDatagramStruct;
+
+// Size on the wire
+inline int mappedDatagramSize(const MappedDatagramStruct &datagram)
+{
+    return datagram.header->size() + datagram.payloadLength;
+}
+
+// Hands the header back to the pool and drops the reference on the region
+void releaseMappedDatagram(MappedDatagramStruct &datagram);
+
+#endif // MAPPEDFILEREGION_H
@@ -1,4 +1,5 @@
 #include "networktopology.h"
+#include "bytecursor.h"
 
 NetworkTopology::NetworkTopology(QObject *parent) :
     QObject(parent)
@@ -131,16 +132,16 @@ void NetworkTopology::bucketContentsArrived(QByteArray bucket, QHostAddress send
     if (bucket.length() < 24)
         return;
 
-    QByteArray bucketID = bucket.mid(0, 24);
-    bucket.remove(0, 24);
+    ByteReader reader(bucket);
+    QByteArray bucketID = reader.readByteArray(24);
     int iter = 0;
     qint64 currentTime = QDateTime::currentMSecsSinceEpoch();
     qint64 cutoffTime = currentTime - 60000; // 1 minute
-    while (bucket.length() >= 6)
+    while (reader.remaining() >= 6)
     {
         iter++;
-        QHostAddress addr = QHostAddress(getQuint32FromByteArray(&bucket));
-        qint64 age = (qint64)(getQuint16FromByteArray(&bucket) * 1000);
+        QHostAddress addr = QHostAddress(reader.readUInt32());
+        qint64 age = (qint64)reader.readUInt16() * 1000;
         qint64 storedAge = getHostAge(bucketID, addr);
         if ((storedAge > age) || (storedAge == -1))
         {
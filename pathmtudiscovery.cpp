@@ -0,0 +1,253 @@
+#include "pathmtudiscovery.h"
+#include "bytecursor.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDateTime>
+#include <QStringList>
+#include <QDebug>
+
+#ifdef Q_WS_WIN //If windows
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else //If Q_OS_LINUX
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#endif
+
+namespace
+{
+
+typedef struct
+{
+    int localMTU;       // what we discovered ourselves
+    qint64 localTime;
+    int peerMTU;        // what the peer advertised
+    qint64 peerTime;
+} PathMTUCacheEntry;
+
+struct PathMTUCache
+{
+    QMutex mutex;
+    QHash<QHostAddress, PathMTUCacheEntry> entries;
+};
+
+Q_GLOBAL_STATIC(PathMTUCache, cache)
+
+void setLocalMTU(const QHostAddress &host, int mtu)
+{
+    PathMTUCache *c = cache();
+    if (!c)
+        return;
+    QMutexLocker locker(&c->mutex);
+    PathMTUCacheEntry &entry = c->entries[host];
+    entry.localMTU = mtu;
+    entry.localTime = QDateTime::currentMSecsSinceEpoch();
+}
+
+bool hasFreshLocalMTU(const QHostAddress &host)
+{
+    PathMTUCache *c = cache();
+    if (!c)
+        return false;
+    QMutexLocker locker(&c->mutex);
+    PathMTUCacheEntry entry = c->entries.value(host);
+    return entry.localMTU > 0 && QDateTime::currentMSecsSinceEpoch() - entry.localTime < PATH_MTU_CACHE_EXPIRY;
+}
+
+}
+
+PathMTUDiscovery::PathMTUDiscovery(quint16 port, QObject *parent) :
+    QObject(parent)
+{
+    dispatchPort = port;
+    nextProbeId = qrand();
+
+    // Probes need the don't fragment bit, which would hurt everything else, so they get their own socket
+    probeUdpSocket = new QUdpSocket(this);
+    probeUdpSocket->bind(QHostAddress::Any, 0);
+
+    int res = -1;
+#ifdef Q_WS_WIN
+    DWORD dontFragment = 1;
+    res = ::setsockopt(probeUdpSocket->socketDescriptor(), IPPROTO_IP, IP_DONTFRAGMENT, (char *)&dontFragment, sizeof(dontFragment));
+#elif defined(IP_MTU_DISCOVER)
+    int pmtuDiscover = IP_PMTUDISC_DO;
+    res = ::setsockopt(probeUdpSocket->socketDescriptor(), IPPROTO_IP, IP_MTU_DISCOVER, (char *)&pmtuDiscover, sizeof(pmtuDiscover));
+#elif defined(IP_DONTFRAG)
+    int dontFragment = 1;
+    res = ::setsockopt(probeUdpSocket->socketDescriptor(), IPPROTO_IP, IP_DONTFRAG, (char *)&dontFragment, sizeof(dontFragment));
+#endif
+    // Fragmented probes would arrive just fine and tell us lies, rather stick to PACKET_MTU
+    dontFragmentSet = res != -1;
+    if (!dontFragmentSet)
+        qDebug() << "PathMTUDiscovery::Constructor: Could not set don't fragment on probe socket, path MTU discovery disabled";
+
+    probeTimeoutTimer = new QTimer(this);
+    probeTimeoutTimer->setInterval(PATH_MTU_PROBE_TIMEOUT / 4);
+    connect(probeTimeoutTimer, SIGNAL(timeout()), this, SLOT(checkProbeTimeouts()));
+}
+
+PathMTUDiscovery::~PathMTUDiscovery()
+{
+    probeTimeoutTimer->deleteLater();
+    probeUdpSocket->deleteLater();
+}
+
+int PathMTUDiscovery::pathMTU(const QHostAddress &host)
+{
+    PathMTUCache *c = cache();
+    if (!c)
+        return PACKET_MTU;
+
+    PathMTUCacheEntry entry;
+    {
+        QMutexLocker locker(&c->mutex);
+        entry = c->entries.value(host);
+    }
+
+    // Only our own probes vouch for the path, a peer advertising jumbo frames may sit behind a smaller link
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (entry.localMTU <= 0 || now - entry.localTime >= PATH_MTU_CACHE_EXPIRY)
+        return PACKET_MTU;
+    int mtu = entry.localMTU;
+    if (entry.peerMTU > 0 && now - entry.peerTime < PATH_MTU_CACHE_EXPIRY)
+        mtu = qMin(mtu, entry.peerMTU);
+
+    return qBound(PACKET_MTU, mtu, PACKET_JUMBO_MTU);
+}
+
+int PathMTUDiscovery::dataPayloadSize(const QHostAddress &host)
+{
+    return pathMTU(host) - PACKET_DATA_HEADER_SIZE;
+}
+
+void PathMTUDiscovery::setPeerMTU(const QHostAddress &host, int mtu)
+{
+    PathMTUCache *c = cache();
+    if (!c)
+        return;
+    QMutexLocker locker(&c->mutex);
+    PathMTUCacheEntry &entry = c->entries[host];
+    entry.peerMTU = mtu;
+    entry.peerTime = QDateTime::currentMSecsSinceEpoch();
+}
+
+QString PathMTUDiscovery::getDebugCacheContents()
+{
+    PathMTUCache *c = cache();
+    if (!c)
+        return QString();
+
+    QList<QHostAddress> hosts;
+    {
+        QMutexLocker locker(&c->mutex);
+        hosts = c->entries.keys();
+    }
+
+    QStringList lines;
+    foreach (QHostAddress host, hosts)
+        lines.append(QString("%1 path MTU %2, data payload %3").arg(host.toString()).arg(pathMTU(host)).arg(dataPayloadSize(host)));
+    return lines.join("\n");
+}
+
+void PathMTUDiscovery::discover(QHostAddress host)
+{
+    if (!dontFragmentSet || host.isNull() || probes.contains(host) || hasFreshLocalMTU(host))
+        return;
+
+    // Go for the top first, on a jumbo frame network that settles it in one round trip
+    PathMTUProbeStruct probe;
+    probe.low = PACKET_MTU;
+    probe.high = PACKET_JUMBO_MTU + 1;
+    probe.probeSize = PACKET_JUMBO_MTU;
+    probe.attempts = 0;
+
+    if (!sendProbe(host, probe) && !nextProbe(host, probe, false))
+        return;
+
+    probes.insert(host, probe);
+    if (!probeTimeoutTimer->isActive())
+        probeTimeoutTimer->start();
+}
+
+void PathMTUDiscovery::probeReplyArrived(QHostAddress host, int size, quint32 probeId)
+{
+    QHash<QHostAddress, PathMTUProbeStruct>::iterator i = probes.find(host);
+    if (i == probes.end() || i.value().probeId != probeId || i.value().probeSize != size)
+        return;
+
+    if (!nextProbe(host, i.value(), true))
+        probes.erase(i);
+}
+
+void PathMTUDiscovery::setDispatchPort(quint16 port)
+{
+    dispatchPort = port;
+}
+
+void PathMTUDiscovery::checkProbeTimeouts()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutableHashIterator<QHostAddress, PathMTUProbeStruct> i(probes);
+    while (i.hasNext())
+    {
+        i.next();
+        PathMTUProbeStruct &probe = i.value();
+        if (now - probe.probeTime < PATH_MTU_PROBE_TIMEOUT)
+            continue;
+
+        // Give a lost probe another chance before calling it too big
+        bool searching;
+        if (probe.attempts < PATH_MTU_PROBE_RETRIES)
+        {
+            probe.attempts++;
+            searching = sendProbe(i.key(), probe) || nextProbe(i.key(), probe, false);
+        }
+        else
+            searching = nextProbe(i.key(), probe, false);
+
+        if (!searching)
+            i.remove();
+    }
+
+    if (probes.isEmpty())
+        probeTimeoutTimer->stop();
+}
+
+bool PathMTUDiscovery::sendProbe(const QHostAddress &host, PathMTUProbeStruct &probe)
+{
+    probe.probeId = nextProbeId++;
+    probe.probeTime = QDateTime::currentMSecsSinceEpoch();
+
+    // Zero padded up to the size being probed
+    QByteArray datagram(probe.probeSize, 0);
+    ByteWriter writer(datagram.data(), datagram.size());
+    writer.writeUInt8(UnicastPacket);
+    writer.writeUInt8(PathMTUProbePacket);
+    writer.writeUInt32(probe.probeId);
+    writer.writeUInt16(probe.probeSize);
+
+    return probeUdpSocket->writeDatagram(datagram, host, dispatchPort) == probe.probeSize;
+}
+
+bool PathMTUDiscovery::nextProbe(const QHostAddress &host, PathMTUProbeStruct &probe, bool probeArrived)
+{
+    if (probeArrived)
+        probe.low = probe.probeSize;
+    else
+        probe.high = probe.probeSize;
+
+    while (probe.high - probe.low > PATH_MTU_PROBE_RESOLUTION)
+    {
+        probe.probeSize = (probe.low + probe.high) / 2;
+        probe.attempts = 0;
+        if (sendProbe(host, probe))
+            return true;
+        probe.high = probe.probeSize;
+    }
+
+    qDebug() << "PathMTUDiscovery::nextProbe(): Path MTU to" << host << "is" << probe.low;
+    setLocalMTU(host, probe.low);
+    return false;
+}
@@ -0,0 +1,95 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATHMTUDISCOVERY_H
+#define PATHMTUDISCOVERY_H
+
+#include <QObject>
+#include <QHash>
+#include <QTimer>
+#include <QHostAddress>
+#include <QtNetwork/QUdpSocket>
+#include "protocoldef.h"
+
+// Per peer path MTU discovery, so that data packets can fill jumbo frames where the network allows it.
+//
+// Probes are padded unicast packets sent from a separate socket with the don't fragment bit set. The peer answers
+// every probe it receives with the size that arrived. A probe the kernel refuses outright (EMSGSIZE) or that goes
+// unanswered counts as too big, and the largest answered size is found by binary search between PACKET_MTU and
+// PACKET_JUMBO_MTU. Nothing ever goes below PACKET_MTU, the rest of the network already assumes that much.
+//
+// Results are kept in a process wide cache with expiry, readable from any thread. Download and tree requests carry
+// our path MTU to the peer, which stores it as the largest datagram we are prepared to receive from it. The sender
+// uses the smaller of what it discovered itself and what the receiver advertised, and sticks to PACKET_MTU until its
+// own probes got through. An advertised size above PACKET_MTU starts those probes.
+
+#define PATH_MTU_PROBE_TIMEOUT 1000
+#define PATH_MTU_PROBE_RETRIES 1
+#define PATH_MTU_PROBE_RESOLUTION 16
+#define PATH_MTU_CACHE_EXPIRY 1800000
+
+typedef struct
+{
+    int low;            // largest size known to get through
+    int high;           // smallest size known not to get through
+    int probeSize;
+    quint32 probeId;
+    int attempts;
+    qint64 probeTime;
+} PathMTUProbeStruct;
+
+class PathMTUDiscovery : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PathMTUDiscovery(quint16 dispatchPort, QObject *parent = 0);
+    ~PathMTUDiscovery();
+
+    // Thread safe cache lookups.
+    // Largest datagram to send to host, PACKET_MTU if nothing better is known.
+    static int pathMTU(const QHostAddress &host);
+    // Largest data packet payload to send to host, PACKET_DATA_MTU if nothing better is known.
+    static int dataPayloadSize(const QHostAddress &host);
+    // Path MTU the peer advertised in a request
+    static void setPeerMTU(const QHostAddress &host, int mtu);
+
+    static QString getDebugCacheContents();
+
+public slots:
+    // Start probing host unless a fresh result or a probe is already there
+    void discover(QHostAddress host);
+    void probeReplyArrived(QHostAddress host, int size, quint32 probeId);
+    void setDispatchPort(quint16 port);
+
+private slots:
+    void checkProbeTimeouts();
+
+private:
+    // Returns false if the kernel refused the probe, it is bigger than the path MTU it knows about
+    bool sendProbe(const QHostAddress &host, PathMTUProbeStruct &probe);
+    // Moves the search along after a probe got through or not, returns false once the search is done
+    bool nextProbe(const QHostAddress &host, PathMTUProbeStruct &probe, bool probeArrived);
+
+    QUdpSocket *probeUdpSocket;
+    bool dontFragmentSet;
+    quint16 dispatchPort;
+    QHash<QHostAddress, PathMTUProbeStruct> probes;
+    QTimer *probeTimeoutTimer;
+    quint32 nextProbeId;
+};
+
+#endif // PATHMTUDISCOVERY_H
@@ -45,8 +45,11 @@ enum MinorPacketType
     TTHSearchResultPacket=0x16,
     TransferErrorPacket=0x20,
     DownloadRequestPacket=0x21,
+    SelectiveDownloadRequestPacket=0x22,
     ProtocolCapabilityQueryPacket=0x31,
     ProtocolCapabilityResponsePacket=0x32,
+    PathMTUProbePacket=0x33,
+    PathMTUProbeReplyPacket=0x34,
     TTHTreeRequestPacket=0x41,
     TTHTreeReplyPacket=0x42,
     AnnouncePacket=0x71,
@@ -66,10 +69,12 @@ enum MinorPacketType
 
 #define HASH_BUCKET_SIZE (1LL<<20)
 #define HASH_BUCKET_QUEUE_CONGESTION_THRESHOLD 16
-#define HASH_BUCKET_QUEUE_CRITICAL_THRESHOLD 256
 
 #define PACKET_MTU 1436
 #define PACKET_DATA_MTU 1402
+// Largest datagram path MTU discovery will try, a 9000 byte jumbo frame with the same headroom PACKET_MTU leaves in 1500
+#define PACKET_JUMBO_MTU 8936
+#define PACKET_DATA_HEADER_SIZE (PACKET_MTU - PACKET_DATA_MTU)
 
 // Bitwise maskable states
 #define TRANSFER_STATE_PAUSED 1
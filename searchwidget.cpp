@@ -2,6 +2,7 @@
 #include "QCryptographicHash"
 #include "arpmanetdc.h"
 #include "transfermanager.h"
+#include "bytecursor.h"
 
 quint64 SearchWidget::staticID = 0;
 
@@ -445,12 +446,15 @@ void SearchWidget::processSearchResult()
         //minorVersion      qint16
         //tthRoot           QByteArray (variable size)
 
-        res.fileName = getStringFromByteArray(&r.result);
-        res.relativePath = getStringFromByteArray(&r.result);
-        res.fileSize = getQuint64FromByteArray(&r.result);
-        res.majorVersion = getQint16FromByteArray(&r.result);
-        res.minorVersion = getQint16FromByteArray(&r.result);
-        res.tthRoot = r.result;
+        ByteReader reader(r.result);
+        res.fileName = reader.readString();
+        res.relativePath = reader.readString();
+        res.fileSize = reader.readUInt64();
+        res.majorVersion = reader.readInt16();
+        res.minorVersion = reader.readInt16();
+        if (!reader.ok())
+            continue;
+        res.tthRoot = reader.readRemaining();
 
         //Convert to correct unit
         QString sizeStr = bytesToSize(res.fileSize);
@@ -32,10 +32,10 @@ SettingsManager::SettingsManager(sqlite3 *db, ArpmanetDC *parent)
     setDefault(DOWNLOAD_PATH, pParent->getDefaultDownloadPath(), "downloadPath");
     setDefault(LAST_DOWNLOAD_FOLDER, pParent->getDefaultDownloadPath(), "lastDownloadToFolder");
 
-    //Build default protocol value
+    //Build default protocol value, FEC costs bandwidth on a clean link and goes after the others
     QByteArray protocolHint;
-    foreach (char val, PROTOCOL_MAP)
-        protocolHint.append(val);
+    foreach (QString protocol, QString("FSTP;uTP;FECTP;BTP").split(";"))
+        protocolHint.append(PROTOCOL_MAP.value(protocol));
 
     setDefault(PROTOCOL_HINT, protocolHint.data(), "protocolHint");
     setDefault(LAST_SEEN_IP, ipString, "lastSeenIP");
@@ -49,6 +49,7 @@ SettingsManager::SettingsManager(sqlite3 *db, ArpmanetDC *parent)
     setDefault(SHOW_EMOTICONS, true, "showEmoticons");
     setDefault(FOCUS_PM_ON_NOTIFY, true, "focusPMOnNotify");
     setDefault(ENABLE_SOUNDS, false, "enableSounds");
+    setDefault(MAPPED_DOWNLOADS, true, "mappedDownloads");
 
     //Integer
     setDefault(HUB_PORT, 4012, "hubPort");
@@ -61,6 +62,12 @@ SettingsManager::SettingsManager(sqlite3 *db, ArpmanetDC *parent)
     setDefault(MAX_HASH_SPEED_MB, 300, "maxHashSpeedMB");
     setDefault(SHARE_SIZE_UPDATE_MULTIPLIER, 5, "shareSizeUpdateMultiplier");
     setDefault(BOOTSTRAP_NODE_UPDATE_MULTIPLIER, 5, "bootstrapNodeUpdateMultiplier");
+    setDefault(MAX_UPLOAD_RATE_KB, 0, "maxUploadRateKB");
+    setDefault(MAX_PEER_UPLOAD_RATE_KB, 0, "maxPeerUploadRateKB");
+    setDefault(UPLOAD_CACHE_SIZE_MB, 256, "uploadCacheSizeMB");
+    setDefault(MAX_UPLOADS_PER_PEER, 4, "maxUploadsPerPeer");
+    setDefault(FEC_REPAIR_PERCENT, 10, "fecRepairPercent");
+    setDefault(PROTOCOL_HINT_VERSION, 0, "protocolHintVersion");
 
     //Int64
     setDefault(AUTO_UPDATE_SHARE_INTERVAL, 3600000, "autoUpdateShareInterval");
@@ -401,6 +408,8 @@ bool SettingsManager::loadSettings()
             queryErrors[i] = error;
     }
 
+    migrateProtocolHint();
+
     return !pSettings.isEmpty();
 }
 
@@ -482,6 +491,27 @@ int SettingsManager::getSettingFromTag(const QString &tag)
     return -1;
 }
 
+//Hints saved before BTP and FECTP were advertised still have them in PROTOCOL_MAP order (BTP, FECTP, FSTP, uTP).
+//Move them behind FSTP and uTP, keeping the order the user chose for the rest. Fresh installs already match.
+void SettingsManager::migrateProtocolHint()
+{
+    if (pSettings[PROTOCOL_HINT_VERSION].value.toInt() >= 1)
+        return;
+
+    QByteArray demoted;
+    demoted.append(PROTOCOL_MAP.value("FECTP"));
+    demoted.append(PROTOCOL_MAP.value("BTP"));
+
+    QByteArray protocolHint;
+    protocolHint.append(pSettings[PROTOCOL_HINT].value.toString());
+    foreach (char protocol, demoted)
+        protocolHint.replace(protocol, "");
+    protocolHint.append(demoted);
+
+    pSettings[PROTOCOL_HINT].value = QString(protocolHint);
+    pSettings[PROTOCOL_HINT_VERSION].value = 1;
+}
+
 //--------------------==================== PRIVATE DEFAULT SET FUNCTIONS ====================--------------------
 
 void SettingsManager::setDefault(StringTypeSetting setting, const QString &value, QString settingTag)
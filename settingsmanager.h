@@ -101,6 +101,12 @@ public:
         MAX_HASH_SPEED_MB,                              //The maximum speed in megabytes that files should be hashed at
         SHARE_SIZE_UPDATE_MULTIPLIER,                   //The update period of the total share size in the GUI
         BOOTSTRAP_NODE_UPDATE_MULTIPLIER,               //The update period of the number of bootstrap nodes in the GUI
+        MAX_UPLOAD_RATE_KB,                             //The maximum total upload rate in kilobytes per second, 0 for unlimited
+        MAX_PEER_UPLOAD_RATE_KB,                        //The maximum upload rate to a single peer in kilobytes per second, 0 for unlimited
+        UPLOAD_CACHE_SIZE_MB,                           //Memory used to keep mapped blocks of uploaded files around, 0 to disable
+        MAX_UPLOADS_PER_PEER,                           //The amount of segments a single peer may download from us at the same time
+        FEC_REPAIR_PERCENT,                             //Repair packets sent with FEC uploads, as a percentage of the data packets
+        PROTOCOL_HINT_VERSION,                          //The protocol ordering the stored protocol hint has been brought up to
         INTTYPE_LAST
     };
 
@@ -123,6 +129,7 @@ public:
         SHOW_EMOTICONS,                                 //Should emoticons be used in main chat
         FOCUS_PM_ON_NOTIFY,                             //Should PM widget be automatically focussed when a new message arrives
         ENABLE_SOUNDS,                                  //Should sounds be played
+        MAPPED_DOWNLOADS,                               //Should downloads be received straight into a memory mapped file
         BOOLTYPE_LAST
     };
 
@@ -171,6 +178,9 @@ private:
     //Get the setting from a tag - WARNING! Slow (takes O(n) time - amort. 50% of linear)
     int getSettingFromTag(const QString &tag);
 
+    //Bring a protocol hint stored by an older version in line with the current default ordering
+    void migrateProtocolHint();
+
     //Setting lists
     QHash<int, SettingStruct> pSettings;
 
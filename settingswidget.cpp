@@ -97,6 +97,32 @@ QWidget *SettingsWidget::createGeneralSettingsPage()
         shareUpdateIntervalSpinBox->setSuffix(" minute");
     shareUpdateIntervalSpinBox->setSpecialValueText("Disabled");
 
+    uploadRateSpinBox = new QSpinBox(pWidget);
+    uploadRateSpinBox->setRange(0, 1048576); //Maximum is 1GB/s
+    uploadRateSpinBox->setValue(ArpmanetDC::settingsManager()->getSetting(SettingsManager::MAX_UPLOAD_RATE_KB));
+    uploadRateSpinBox->setSuffix(" KB/s");
+    uploadRateSpinBox->setSpecialValueText("Unlimited");
+
+    peerUploadRateSpinBox = new QSpinBox(pWidget);
+    peerUploadRateSpinBox->setRange(0, 1048576);
+    peerUploadRateSpinBox->setValue(ArpmanetDC::settingsManager()->getSetting(SettingsManager::MAX_PEER_UPLOAD_RATE_KB));
+    peerUploadRateSpinBox->setSuffix(" KB/s");
+    peerUploadRateSpinBox->setSpecialValueText("Unlimited");
+
+    uploadCacheSpinBox = new QSpinBox(pWidget);
+    uploadCacheSpinBox->setRange(0, 16384);
+    uploadCacheSpinBox->setValue(ArpmanetDC::settingsManager()->getSetting(SettingsManager::UPLOAD_CACHE_SIZE_MB));
+    uploadCacheSpinBox->setSuffix(" MB");
+    uploadCacheSpinBox->setSpecialValueText("Disabled");
+
+    fecRepairSpinBox = new QSpinBox(pWidget);
+    fecRepairSpinBox->setRange(0, 100);
+    fecRepairSpinBox->setValue(ArpmanetDC::settingsManager()->getSetting(SettingsManager::FEC_REPAIR_PERCENT));
+    fecRepairSpinBox->setSuffix(" %");
+
+    mappedDownloadsCheckBox = new QCheckBox(tr("Write downloads straight into a memory mapped file"), pWidget);
+    mappedDownloadsCheckBox->setChecked(ArpmanetDC::settingsManager()->getSetting(SettingsManager::MAPPED_DOWNLOADS));
+
     QHBoxLayout *downloadPathLayout = new QHBoxLayout;
     downloadPathLayout->addWidget(downloadPathLineEdit);
     downloadPathLayout->addWidget(browseDownloadPathButton);
@@ -104,6 +130,11 @@ QWidget *SettingsWidget::createGeneralSettingsPage()
     QFormLayout *sharingLayout = new QFormLayout;
     sharingLayout->addRow(tr("Download path:"), downloadPathLayout);
     sharingLayout->addRow(tr("Share update interval:"), shareUpdateIntervalSpinBox);
+    sharingLayout->addRow(tr("Upload rate limit:"), uploadRateSpinBox);
+    sharingLayout->addRow(tr("Upload rate limit per peer:"), peerUploadRateSpinBox);
+    sharingLayout->addRow(tr("Upload cache size:"), uploadCacheSpinBox);
+    sharingLayout->addRow(tr("FEC repair overhead:"), fecRepairSpinBox);
+    sharingLayout->addRow(mappedDownloadsCheckBox);
     sharingGroup->setLayout(sharingLayout);
 
     //Misc settings
@@ -461,6 +492,11 @@ void SettingsWidget::savePressed()
         ArpmanetDC::settingsManager()->setSetting(SettingsManager::EXTERNAL_PORT, externalPortLineEdit->text().toInt());
         ArpmanetDC::settingsManager()->setSetting(SettingsManager::DOWNLOAD_PATH, downloadPathLineEdit->text().replace("\\","/"));
         ArpmanetDC::settingsManager()->setSetting(SettingsManager::AUTO_UPDATE_SHARE_INTERVAL, shareUpdateIntervalSpinBox->value() * 60000);
+        ArpmanetDC::settingsManager()->setSetting(SettingsManager::MAX_UPLOAD_RATE_KB, uploadRateSpinBox->value());
+        ArpmanetDC::settingsManager()->setSetting(SettingsManager::MAX_PEER_UPLOAD_RATE_KB, peerUploadRateSpinBox->value());
+        ArpmanetDC::settingsManager()->setSetting(SettingsManager::UPLOAD_CACHE_SIZE_MB, uploadCacheSpinBox->value());
+        ArpmanetDC::settingsManager()->setSetting(SettingsManager::FEC_REPAIR_PERCENT, fecRepairSpinBox->value());
+        ArpmanetDC::settingsManager()->setSetting(SettingsManager::MAPPED_DOWNLOADS, mappedDownloadsCheckBox->isChecked());
         ArpmanetDC::settingsManager()->setSetting(SettingsManager::ENABLE_SOUNDS, enableSoundsCheckBox->isChecked());
         ArpmanetDC::settingsManager()->setSetting(SettingsManager::FOCUS_PM_ON_NOTIFY, focusPMCheckBox->isChecked());
 
@@ -125,9 +125,9 @@ private:
     QListWidgetItem *advancedPageButton, *generalPageButton, *userCommandsPageButton;
 
     //General settings widgets
-    QSpinBox *shareUpdateIntervalSpinBox;
+    QSpinBox *shareUpdateIntervalSpinBox, *uploadRateSpinBox, *peerUploadRateSpinBox, *uploadCacheSpinBox, *fecRepairSpinBox;
     QLineEdit *hubAddressLineEdit, *hubPortLineEdit, *nickLineEdit, *passwordLineEdit, *downloadPathLineEdit;
-    QCheckBox *enableSoundsCheckBox, *focusPMCheckBox;
+    QCheckBox *enableSoundsCheckBox, *focusPMCheckBox, *mappedDownloadsCheckBox;
     QPushButton *browseDownloadPathButton;
 
     //Advanced settings widgets
@@ -54,16 +54,6 @@ ShareSearch::ShareSearch(quint32 maxSearchResults, ArpmanetDC *parent)
 
     hashThread->start();
 
-    //Create hash thread for incoming buckets - file hashing blocks bucket hashing
-    hashBucketThread = new ExecThread();
-    pHashBucketThread = new HashFileThread();
-
-    connect(pHashBucketThread, SIGNAL(doneBucket(QByteArray, int, QByteArray,QHostAddress)), this, SLOT(hashBucketDone(QByteArray, int, QByteArray,QHostAddress)), Qt::QueuedConnection);
-    connect(this, SIGNAL(runHashBucket(QByteArray, int, QByteArray, ReturnEncoding,QHostAddress)), pHashBucketThread, SLOT(processBucket(QByteArray, int, QByteArray, ReturnEncoding,QHostAddress)), Qt::QueuedConnection);
-
-    pHashBucketThread->moveToThread(hashBucketThread);
-    hashBucketThread->start();
-
     //Create container thead
     containerThread = new ExecThread();
 
@@ -116,14 +106,6 @@ ShareSearch::~ShareSearch()
         delete hashThread;
     }
 
-    hashBucketThread->quit();
-    if (hashBucketThread->wait(5000))
-        delete hashBucketThread;
-    else
-    {
-        hashBucketThread->terminate();
-        delete hashBucketThread;
-    }
     containerThread->quit();
     if (containerThread->wait(5000))
         delete containerThread;
@@ -1381,26 +1363,6 @@ void ShareSearch::processContainer(QHostAddress host, QString containerPath, QSt
 }
 
 
-//------------------------------============================== HASH 1MB BUCKET (TRANSFER MANAGER) ==============================------------------------------
-
-//Hashes a 1MB bucket
-void ShareSearch::hashBucketRequest(QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer)
-{
-    if (!bucket.isEmpty())
-        //Start hash bucket thread
-        emit runHashBucket(rootTTH, bucketNumber, bucket, BinaryEncoded, peer);
-    else
-        //Meh. Not going to hash an empty bucket
-        emit hashBucketReply(rootTTH, bucketNumber, QByteArray(), peer);
-}
-
-//Hash bucket thread done
-void ShareSearch::hashBucketDone(QByteArray rootTTH, int bucketNumber, QByteArray bucketTTH, QHostAddress peer)
-{
-    //Signal the reply of the 1MB bucket hash
-    emit hashBucketReply(rootTTH, bucketNumber, bucketTTH, peer);
-}
-
 //------------------------------============================== TTH SOURCES FOR TRANSFERS (TRANSFER MANAGER) ==============================------------------------------
 
 //Save a source for a particular TTH
@@ -1552,18 +1514,32 @@ void ShareSearch::deleteTTHSources(QByteArray tthRoot)
 }
 
 //Save state bitmap to database
-void ShareSearch::saveBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitmap)
+void ShareSearch::saveBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitmap, QByteArray leaves)
 {
-    //Insert a bitmap
+    //Insert a bitmap, or only update it if the leaves stored with it did not change.
+    //The update keeps the stored leaves, if there is no row yet the bitmap is inserted without any.
     QStringList queries;
-    queries.append(tr("DELETE FROM FileStateBitmaps WHERE [tthRoot] = ?;"));
-    queries.append(tr("INSERT INTO FileStateBitmaps ([tthRoot], [bitmap]) VALUES (?, ?);"));
+    if (leaves.isEmpty())
+    {
+        queries.append(tr("UPDATE FileStateBitmaps SET [bitmap] = ?2 WHERE [tthRoot] = ?1;"));
+        queries.append(tr("INSERT INTO FileStateBitmaps ([tthRoot], [bitmap]) VALUES (?, ?);"));
+    }
+    else
+    {
+        queries.append(tr("DELETE FROM FileStateBitmaps WHERE [tthRoot] = ?;"));
+        queries.append(tr("INSERT INTO FileStateBitmaps ([tthRoot], [bitmap], [leaves]) VALUES (?, ?, ?);"));
+    }
 
     sqlite3 *db = pParent->database();    
     sqlite3_stmt *statement;
+    bool updated = false;
 
     for (int i = 0; i < queries.size(); ++i)
     {
+        //The row was there, nothing to insert
+        if (updated)
+            break;
+
         //Prepare a query
         QByteArray query;
         query.append(queries.at(i));
@@ -1574,16 +1550,21 @@ void ShareSearch::saveBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitm
             QString tthRootStr = QString(tthRoot.toBase64().data());
             res = res | sqlite3_bind_text16(statement, 1, tthRootStr.utf16(), tthRootStr.size()*2, SQLITE_STATIC);
 
-            if (query.contains("INSERT"))
-            {
-                QString bitmapStr = QString(bitmap.toBase64().data());
+            QString bitmapStr = QString(bitmap.toBase64().data());
+            if (query.contains("INSERT") || query.contains("UPDATE"))
                 res = res | sqlite3_bind_text16(statement, 2, bitmapStr.utf16(), bitmapStr.size()*2, SQLITE_STATIC);
-            }
+
+            QString leavesStr = QString(leaves.toBase64().data());
+            if (query.contains("[leaves]"))
+                res = res | sqlite3_bind_text16(statement, 3, leavesStr.utf16(), leavesStr.size()*2, SQLITE_STATIC);
 
             int cols = sqlite3_column_count(statement);
             int result = 0;
             while (sqlite3_step(statement) == SQLITE_ROW);
             sqlite3_finalize(statement);    
+
+            if (query.contains("UPDATE"))
+                updated = sqlite3_changes(db) > 0;
         }
 
         //Catch all error messages
@@ -1600,9 +1581,10 @@ void ShareSearch::saveBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitm
 void ShareSearch::loadBucketFlushStateBitmap(QByteArray tthRoot)
 {
     //Return the bitmap for a file
-    QString queryStr = tr("SELECT [bitmap] FROM FileStateBitmaps WHERE [tthRoot] = ?;");
+    QString queryStr = tr("SELECT [bitmap], [leaves] FROM FileStateBitmaps WHERE [tthRoot] = ?;");
 
     QByteArray bitmap;
+    QByteArray leaves;
     sqlite3 *db = pParent->database();    
     sqlite3_stmt *statement;
 
@@ -1622,6 +1604,12 @@ void ShareSearch::loadBucketFlushStateBitmap(QByteArray tthRoot)
         {
             bitmap.append(QString::fromUtf16((const unsigned short*)sqlite3_column_text16(statement, 0)));
             bitmap = QByteArray::fromBase64(bitmap);            
+            //Rows saved before the leaves were kept have none
+            if (sqlite3_column_type(statement, 1) != SQLITE_NULL)
+            {
+                leaves.append(QString::fromUtf16((const unsigned short*)sqlite3_column_text16(statement, 1)));
+                leaves = QByteArray::fromBase64(leaves);
+            }
         }
         sqlite3_finalize(statement);    
     }
@@ -1632,7 +1620,7 @@ void ShareSearch::loadBucketFlushStateBitmap(QByteArray tthRoot)
         QString error = "error";
 
     // Restore transfer state bitmap from database
-    emit restoreBucketFlushStateBitmap(tthRoot, bitmap);
+    emit restoreBucketFlushStateBitmap(tthRoot, bitmap, leaves);
 }
 
 //Delete state bitmap
@@ -1723,6 +1711,9 @@ void ShareSearch::incomingTTHTreeRequest(QHostAddress host, QByteArray tth, quin
     QByteArray tthTreePacket;
     tthTreePacket.append(tth);
 
+    //Fill packets up to what the path to the requester carries
+    int treePacketSize = PathMTUDiscovery::dataPayloadSize(host);
+
     //Return all 1MB TTHs for a root TTH
     QString queryStr = tr("SELECT [oneMBtth], [offset] FROM OneMBTTH WHERE [tth] = ? AND [offset] >= ? ORDER BY [offset] ASC LIMIT ?;");
 
@@ -1765,7 +1756,7 @@ void ShareSearch::incomingTTHTreeRequest(QHostAddress host, QByteArray tth, quin
             tthTreePacket.append(oneMBTTH);
 
             //Send the packet if it's full
-            if (tthTreePacket.size() + TTH_TREE_HASH_SIZE >= PACKET_DATA_MTU)
+            if (tthTreePacket.size() + TTH_TREE_HASH_SIZE >= treePacketSize)
             {
                 emit sendTTHTreeReply(host, tthTreePacket);
                 //Clear packet for next data
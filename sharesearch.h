@@ -120,11 +120,6 @@ public slots:
     //Process a container
     void processContainer(QHostAddress host, QString containerPath, QString downloadPath);
 
-    //----------========== HASH 1MB BUCKET (TRANSFER MANAGER) ==========----------
-
-    //Hashes a 1MB bucket
-    void hashBucketRequest(QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer);
-
     //----------========== TRANSFERS (TRANSFER MANAGER) ==========----------
     
     //Save a source for a particular TTH
@@ -140,7 +135,7 @@ public slots:
     void deleteTTHSources(QByteArray tthRoot);
 
     // Transfer state bitmap to/from database
-    void saveBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitmap);
+    void saveBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitmap, QByteArray leaves);
     void loadBucketFlushStateBitmap(QByteArray tthRoot);
     void deleteBucketFlushStateBitmap(QByteArray tthRoot);
 
@@ -216,9 +211,6 @@ private slots:
     //Parse directory thread failed
     void parseDirectoryThreadFailed(QString rootDir, ParseDirectoryThread *parseObj);
 
-    //Hash bucket thread done
-    void hashBucketDone(QByteArray rootTTH, int bucketNumber, QByteArray bucketTTH, QHostAddress peer);
-
     //Database commands
     void commitTransaction(bool startNewTransaction = true);
 
@@ -272,11 +264,6 @@ signals:
     //Save the containers to files in the directory specified
     void saveContainers(QHash<QString, ContainerContentsType> containerHash, QString containerDirectory);
 
-    //----------========== HASH 1MB BUCKET (TRANSFER MANAGER) ==========----------
-
-    //Signal the reply of the 1MB bucket hash
-    void hashBucketReply(QByteArray rootTTH, int bucketNumber, QByteArray bucketTTH, QHostAddress peer);
-
     //----------========== TRANSFERS (TRANSFER MANAGER) ==========----------
     
     //Filename request reply
@@ -286,7 +273,7 @@ signals:
     void tthSourceLoaded(QByteArray tthRoot, QHostAddress peerAddress);
     
     // Restore transfer state bitmap from database
-    void restoreBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitmap);
+    void restoreBucketFlushStateBitmap(QByteArray tthRoot, QByteArray bitmap, QByteArray leaves);
 
     //----------========== TTH REQUESTS FOR ALTERNATE SEARCHING ==========----------
 
@@ -340,7 +327,6 @@ signals:
     //Signals to interface with hashing thread objects
     void runHashThread(QString filePath, QString rootDir);
     void runParseThread(QString directoryPath);
-    void runHashBucket(QByteArray rootTTH, int bucketNumber, QByteArray bucket, ReturnEncoding encoding, QHostAddress peer);
 
     //Request all containers in a directory
     void getContainers(QString containerDirectory);
@@ -383,7 +369,7 @@ private:
 
     //Objects
     ArpmanetDC *pParent;
-    HashFileThread *pHashFileThread, *pHashBucketThread;
+    HashFileThread *pHashFileThread;
     ParseDirectoryThread *pParseDirectoryThread;
     ContainerThread *pContainerThread;
 
@@ -404,7 +390,7 @@ private:
     bool pStopHashing;
     bool pBusyHashing;
 
-    ExecThread *hashThread, *hashBucketThread, *containerThread;
+    ExecThread *hashThread, *containerThread;
 
     QList<FileListStruct> *pFileList;
     QList<QDir> *pDirList;
@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# Standalone harness for FSTPCongestionControl, runs it against a simulated
+# bottleneck link and prints goodput and loss. Not part of the client build.
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = fstpccsim
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += ../..
+
+SOURCES += main.cpp \
+    ../../fstpcongestioncontrol.cpp
+
+HEADERS += ../../fstpcongestioncontrol.h
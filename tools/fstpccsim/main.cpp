@@ -0,0 +1,226 @@
+#include "fstpcongestioncontrol.h"
+#include <QCoreApplication>
+#include <QStringList>
+#include <QList>
+#include <QTextStream>
+#include <QtGlobal>
+
+// Drives FSTPCongestionControl through a simulated bottleneck the way FSTPTransferSegment does, one millisecond at a
+// time: the downloader requests packets while the window has room, the uploader answers half a base RTT later, and the
+// answers queue at a link of fixed rate and buffer depth that tail drops and randomly loses packets. Holes are noticed
+// once later data arrives, or by the retransmit timeout if nothing arrives at all.
+//
+// Usage: fstpccsim [rate Mbit/s] [base RTT ms] [buffer ms] [loss %] [duration s]
+// Without arguments a fixed set of links is run.
+
+#define SIM_PACKET_SIZE 1400
+
+typedef struct
+{
+    QString name;
+    double rate;        // Mbit/s
+    int baseRtt;        // ms
+    int bufferDelay;    // ms of data the bottleneck holds before it drops
+    double lossPercent; // random loss on top of tail drops
+    int duration;       // s
+} ScenarioStruct;
+
+typedef struct
+{
+    qint64 sequence;
+    qint64 requestTime;
+    qint64 arrivalTime;
+    int size;
+} SimulatedPacketStruct;
+
+typedef struct
+{
+    qint64 goodputBytes;
+    qint64 sentPackets;
+    qint64 droppedPackets;
+    qint64 lossEvents;
+    qint64 timeouts;
+    double queueDelaySum;
+    double windowSum;
+    qint64 samples;
+    qint64 finalWindow;
+} SimulationResultStruct;
+
+static SimulationResultStruct simulate(const ScenarioStruct &scenario)
+{
+    FSTPCongestionControl congestionControl;
+    QList<SimulatedPacketStruct> toBottleneck;
+    QList<SimulatedPacketStruct> bottleneck;
+    QList<SimulatedPacketStruct> toDownloader;
+    QList<qint64> lostSequences;
+
+    double bytesPerMs = scenario.rate * 1000000 / 8 / 1000;
+    qint64 queueLimit = qMax((qint64)(bytesPerMs * scenario.bufferDelay), (qint64)(2 * SIM_PACKET_SIZE));
+    int requestDelay = scenario.baseRtt / 2;
+    int answerDelay = scenario.baseRtt - requestDelay;
+    double lossProbability = scenario.lossPercent / 100;
+
+    qint64 nextSequence = 0;
+    qint64 inFlight = 0;
+    qint64 queueBytes = 0;
+    qint64 lastProgress = 0;
+    double drainCredit = 0;
+
+    SimulationResultStruct result;
+    result.goodputBytes = 0;
+    result.sentPackets = 0;
+    result.droppedPackets = 0;
+    result.lossEvents = 0;
+    result.timeouts = 0;
+    result.queueDelaySum = 0;
+    result.windowSum = 0;
+    result.samples = 0;
+
+    qsrand(1);
+    qint64 end = (qint64)scenario.duration * 1000;
+    for (qint64 now = 0; now < end; now++)
+    {
+        // Downloader fills the window with requests
+        while (inFlight + SIM_PACKET_SIZE <= congestionControl.window())
+        {
+            SimulatedPacketStruct packet;
+            packet.sequence = nextSequence++;
+            packet.requestTime = now;
+            packet.arrivalTime = now + requestDelay;
+            packet.size = SIM_PACKET_SIZE;
+            toBottleneck.append(packet);
+            inFlight += packet.size;
+            result.sentPackets++;
+        }
+
+        // Answers reach the bottleneck, tail drop when its buffer is full
+        while (!toBottleneck.isEmpty() && toBottleneck.first().arrivalTime <= now)
+        {
+            SimulatedPacketStruct packet = toBottleneck.takeFirst();
+            if (qrand() / (RAND_MAX + 1.0) < lossProbability || queueBytes + packet.size > queueLimit)
+            {
+                lostSequences.append(packet.sequence);
+                result.droppedPackets++;
+                continue;
+            }
+            bottleneck.append(packet);
+            queueBytes += packet.size;
+        }
+
+        // Bottleneck drains at link rate, an idle link does not bank capacity
+        drainCredit += bytesPerMs;
+        while (!bottleneck.isEmpty() && drainCredit >= bottleneck.first().size)
+        {
+            SimulatedPacketStruct packet = bottleneck.takeFirst();
+            drainCredit -= packet.size;
+            queueBytes -= packet.size;
+            packet.arrivalTime = now + answerDelay;
+            toDownloader.append(packet);
+        }
+        if (bottleneck.isEmpty())
+            drainCredit = qMin(drainCredit, bytesPerMs);
+
+        // Downloader takes delivery, every packet answers its own request so each one is an RTT sample
+        while (!toDownloader.isEmpty() && toDownloader.first().arrivalTime <= now)
+        {
+            SimulatedPacketStruct packet = toDownloader.takeFirst();
+            congestionControl.rttSample(now - packet.requestTime, now);
+            congestionControl.bytesReceived(packet.size, SIM_PACKET_SIZE);
+            inFlight -= packet.size;
+            result.goodputBytes += packet.size;
+            lastProgress = now;
+
+            // Later data overtook the hole
+            while (!lostSequences.isEmpty() && lostSequences.first() < packet.sequence)
+            {
+                lostSequences.removeFirst();
+                inFlight -= SIM_PACKET_SIZE;
+                congestionControl.lossEvent(now);
+                result.lossEvents++;
+            }
+        }
+
+        // Nothing after the holes, only the timeout finds them
+        if (!lostSequences.isEmpty() && now - lastProgress >= congestionControl.retransmitTimeout())
+        {
+            inFlight -= lostSequences.size() * SIM_PACKET_SIZE;
+            lostSequences.clear();
+            congestionControl.timeoutEvent(now);
+            result.timeouts++;
+            lastProgress = now;
+        }
+
+        result.queueDelaySum += queueBytes / bytesPerMs;
+        result.windowSum += congestionControl.window();
+        result.samples++;
+    }
+
+    result.finalWindow = congestionControl.window();
+    return result;
+}
+
+static void printResult(QTextStream &out, const ScenarioStruct &scenario, const SimulationResultStruct &result)
+{
+    double goodput = result.goodputBytes * 8.0 / scenario.duration / 1000000;
+    double loss = result.sentPackets ? result.droppedPackets * 100.0 / result.sentPackets : 0;
+    out << QString("%1 %2 %3 %4 %5 | %6 %7 %8 %9 %10 %11\n")
+           .arg(scenario.name, -12)
+           .arg(scenario.rate, 8, 'f', 1)
+           .arg(scenario.baseRtt, 5)
+           .arg(scenario.bufferDelay, 6)
+           .arg(scenario.lossPercent, 6, 'f', 2)
+           .arg(goodput, 9, 'f', 2)
+           .arg(goodput * 100 / scenario.rate, 6, 'f', 1)
+           .arg(loss, 6, 'f', 2)
+           .arg(result.samples ? result.queueDelaySum / result.samples : 0, 7, 'f', 1)
+           .arg(result.samples ? result.windowSum / result.samples / 1024 : 0, 9, 'f', 0)
+           .arg(result.lossEvents + result.timeouts, 7);
+    out.flush();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+    QTextStream out(stdout);
+
+    QList<ScenarioStruct> scenarios;
+    if (args.size() > 1)
+    {
+        ScenarioStruct scenario;
+        scenario.name = "custom";
+        scenario.rate = args.value(1).toDouble();
+        scenario.baseRtt = args.size() > 2 ? args.at(2).toInt() : 20;
+        scenario.bufferDelay = args.size() > 3 ? args.at(3).toInt() : 100;
+        scenario.lossPercent = args.size() > 4 ? args.at(4).toDouble() : 0;
+        scenario.duration = args.size() > 5 ? args.at(5).toInt() : 60;
+        if (scenario.rate <= 0 || scenario.baseRtt < 0 || scenario.bufferDelay < 0 || scenario.duration <= 0)
+        {
+            out << "Usage: fstpccsim [rate Mbit/s] [base RTT ms] [buffer ms] [loss %] [duration s]\n";
+            return 1;
+        }
+        scenarios.append(scenario);
+    }
+    else
+    {
+        ScenarioStruct defaults[] = {
+            {"adsl",        8,    40, 200, 0,    60},
+            {"lan",         100,  2,  20,  0,    60},
+            {"gigabit",     1000, 4,  10,  0,    20},
+            {"longfat",     100,  150, 100, 0,   120},
+            {"lossy",       20,   30, 50,  1,    60},
+            {"shallow",     50,   20, 5,   0,    60},
+            {"lossylongfat", 100, 150, 100, 0.1, 120}
+        };
+        for (unsigned int i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+            scenarios.append(defaults[i]);
+    }
+
+    out << QString("%1 %2 %3 %4 %5 | %6 %7 %8 %9 %10 %11\n")
+           .arg("link", -12).arg("Mbit/s", 8).arg("rtt", 5).arg("buffer", 6).arg("loss%", 6)
+           .arg("goodput", 9).arg("util%", 6).arg("drop%", 6).arg("queue", 7).arg("cwnd KB", 9).arg("backoff", 7);
+    foreach (const ScenarioStruct &scenario, scenarios)
+        printResult(out, scenario, simulate(scenario));
+
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include "trafficshaper.h"
+#include <QDateTime>
+
+TrafficShaper::TrafficShaper(QObject *parent) :
+    QObject(parent)
+{
+    totalQueuedBytes = 0;
+    globalLimit = 0;
+    peerLimit = 0;
+    globalTokens = 0;
+    globalLastRefill = QDateTime::currentMSecsSinceEpoch();
+    lastStatusTime = globalLastRefill;
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT; i++)
+    {
+        classBytes[i] = 0;
+        lastStatusClassBytes[i] = 0;
+    }
+}
+
+TrafficShaper::~TrafficShaper()
+{
+    QHashIterator<QHostAddress, ShaperPeerStruct *> i(peers);
+    while (i.hasNext())
+    {
+        ShaperPeerStruct *peer = i.next().value();
+        while (!peer->queue.isEmpty())
+        {
+            MappedDatagramStruct datagram = peer->queue.dequeue();
+            releaseMappedDatagram(datagram);
+        }
+        delete peer;
+    }
+}
+
+void TrafficShaper::enqueue(QHostAddress &dstHost, QByteArray *datagram)
+{
+    MappedDatagramStruct d;
+    d.header = datagram;
+    d.region = 0;
+    d.payload = 0;
+    d.payloadLength = 0;
+    enqueue(dstHost, d);
+}
+
+void TrafficShaper::enqueue(QHostAddress &dstHost, const MappedDatagramStruct &datagram)
+{
+    ShaperPeerStruct *peer = peers.value(dstHost);
+    if (!peer)
+    {
+        peer = new ShaperPeerStruct;
+        peer->queuedBytes = 0;
+        peer->tokens = burstSize(peerLimit);
+        peer->lastRefill = QDateTime::currentMSecsSinceEpoch();
+        peer->deficit = 0;
+        peer->turnStarted = false;
+        peers.insert(dstHost, peer);
+    }
+
+    if (peer->queue.isEmpty())
+        activePeers.enqueue(dstHost);
+
+    int size = mappedDatagramSize(datagram);
+    peer->queue.enqueue(datagram);
+    peer->queuedBytes += size;
+    totalQueuedBytes += size;
+}
+
+bool TrafficShaper::dequeue(QHostAddress &dstHost, MappedDatagramStruct &datagram)
+{
+    if (activePeers.isEmpty())
+        return false;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    refill(globalTokens, globalLastRefill, globalLimit, now);
+
+    // Every peer gets at most two looks per call: one to top up its deficit and one to send.
+    // Peers held back by their own bucket are skipped without a top up, so they can not save up for a burst.
+    int visits = activePeers.size() * 2;
+    while (visits-- > 0)
+    {
+        ShaperPeerStruct *peer = peers.value(activePeers.head());
+        int size = mappedDatagramSize(peer->queue.head());
+
+        // The global bucket is dry, nobody gets to send
+        if (globalLimit > 0 && globalTokens < size)
+            return false;
+
+        refill(peer->tokens, peer->lastRefill, peerLimit, now);
+        bool peerBlocked = peerLimit > 0 && peer->tokens < size;
+
+        if (!peerBlocked && !peer->turnStarted)
+        {
+            peer->deficit += TRAFFIC_SHAPER_QUANTUM;
+            peer->turnStarted = true;
+        }
+
+        if (!peerBlocked && peer->deficit >= size)
+        {
+            datagram = peer->queue.dequeue();
+            peer->deficit -= size;
+            peer->queuedBytes -= size;
+            totalQueuedBytes -= size;
+            if (peerLimit > 0)
+                peer->tokens -= size;
+            if (globalLimit > 0)
+                globalTokens -= size;
+
+            dstHost = activePeers.head();
+            if (peer->queue.isEmpty())
+            {
+                activePeers.dequeue();
+                peer->deficit = 0;
+                peer->turnStarted = false;
+                // Nothing to remember about an unlimited peer
+                if (peerLimit <= 0)
+                    delete peers.take(dstHost);
+            }
+
+            account(datagram.header, size);
+            return true;
+        }
+
+        // Turn over, next peer
+        peer->turnStarted = false;
+        activePeers.enqueue(activePeers.dequeue());
+    }
+
+    return false;
+}
+
+void TrafficShaper::accountUnshaped(QByteArray *datagram)
+{
+    if (globalLimit > 0)
+    {
+        // Control traffic may run the bucket into debt, but not deeper than one burst
+        refill(globalTokens, globalLastRefill, globalLimit, QDateTime::currentMSecsSinceEpoch());
+        globalTokens -= datagram->size();
+        qint64 burst = burstSize(globalLimit);
+        if (globalTokens < -burst)
+            globalTokens = -burst;
+    }
+    account(datagram, datagram->size());
+}
+
+int TrafficShaper::msecsUntilReady()
+{
+    if (activePeers.isEmpty())
+        return -1;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    refill(globalTokens, globalLastRefill, globalLimit, now);
+
+    qint64 wait = -1;
+    foreach (QHostAddress host, activePeers)
+    {
+        ShaperPeerStruct *peer = peers.value(host);
+        int size = mappedDatagramSize(peer->queue.head());
+        qint64 peerWait = 0;
+
+        if (globalLimit > 0 && globalTokens < size)
+            peerWait = (size - globalTokens) * 1000 / globalLimit + 1;
+
+        if (peerLimit > 0)
+        {
+            refill(peer->tokens, peer->lastRefill, peerLimit, now);
+            if (peer->tokens < size)
+                peerWait = qMax(peerWait, (size - peer->tokens) * 1000 / peerLimit + 1);
+        }
+
+        if (wait == -1 || peerWait < wait)
+            wait = peerWait;
+        if (wait == 0)
+            break;
+    }
+
+    return (int)wait;
+}
+
+void TrafficShaper::setGlobalRateLimit(qint64 bytesPerSecond)
+{
+    globalLimit = bytesPerSecond > 0 ? bytesPerSecond : 0;
+    globalTokens = burstSize(globalLimit);
+    globalLastRefill = QDateTime::currentMSecsSinceEpoch();
+}
+
+void TrafficShaper::setPeerRateLimit(qint64 bytesPerSecond)
+{
+    peerLimit = bytesPerSecond > 0 ? bytesPerSecond : 0;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    foreach (ShaperPeerStruct *peer, peers)
+    {
+        peer->tokens = burstSize(peerLimit);
+        peer->lastRefill = now;
+    }
+}
+
+TrafficShaperStatusStruct TrafficShaper::getStatus()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 elapsed = now - lastStatusTime;
+
+    TrafficShaperStatusStruct status;
+    status.totalRate = 0;
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT; i++)
+    {
+        status.classBytes[i] = classBytes[i];
+        status.classRates[i] = elapsed > 0 ? (classBytes[i] - lastStatusClassBytes[i]) * 1000 / elapsed : 0;
+        status.totalRate += status.classRates[i];
+        lastStatusClassBytes[i] = classBytes[i];
+    }
+    status.queuedBytes = totalQueuedBytes;
+    status.queuedPeers = activePeers.size();
+    status.globalRateLimit = globalLimit;
+    status.peerRateLimit = peerLimit;
+    lastStatusTime = now;
+
+    removeIdlePeers(now);
+    return status;
+}
+
+TrafficClass TrafficShaper::trafficClass(const QByteArray *datagram)
+{
+    if (datagram->size() < 2)
+        return ControlTraffic;
+
+    quint8 datagramType = datagram->at(0);
+    if (datagramType != DataPacket && datagramType != DirectDataPacket)
+        return ControlTraffic;
+
+    switch ((quint8)datagram->at(1))
+    {
+    case FailsafeTransferProtocol:
+        return FSTPTraffic;
+    case BasicTransferProtocol:
+        return BasicTraffic;
+    case uTPProtocol:
+        return uTPTraffic;
+    case ArpmanetFECProtocol:
+        return FECTraffic;
+    default:
+        return ControlTraffic;
+    }
+}
+
+void TrafficShaper::refill(qint64 &tokens, qint64 &lastRefill, qint64 limit, qint64 now)
+{
+    if (limit <= 0)
+    {
+        lastRefill = now;
+        return;
+    }
+
+    qint64 elapsed = now - lastRefill;
+    qint64 add = limit * elapsed / 1000;
+    // Leave lastRefill alone until at least one byte is due, otherwise slow rates polled often would never fill up
+    if (add <= 0)
+        return;
+
+    tokens += add;
+    lastRefill = now;
+    qint64 burst = burstSize(limit);
+    if (tokens > burst)
+        tokens = burst;
+}
+
+qint64 TrafficShaper::burstSize(qint64 limit)
+{
+    return qMax(limit * TRAFFIC_SHAPER_BURST_MSECS / 1000, (qint64)TRAFFIC_SHAPER_MIN_BURST);
+}
+
+void TrafficShaper::account(const QByteArray *header, int size)
+{
+    classBytes[trafficClass(header)] += size;
+}
+
+void TrafficShaper::removeIdlePeers(qint64 now)
+{
+    QMutableHashIterator<QHostAddress, ShaperPeerStruct *> i(peers);
+    while (i.hasNext())
+    {
+        ShaperPeerStruct *peer = i.next().value();
+        if (peer->queue.isEmpty() && now - peer->lastRefill > TRAFFIC_SHAPER_PEER_TIMEOUT)
+        {
+            delete peer;
+            i.remove();
+        }
+    }
+}
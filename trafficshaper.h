@@ -0,0 +1,125 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRAFFICSHAPER_H
+#define TRAFFICSHAPER_H
+
+#include <QObject>
+#include <QHash>
+#include <QQueue>
+#include <QHostAddress>
+#include "protocoldef.h"
+#include "mappedfileregion.h"
+
+// Token bucket upload shaper for transfer data.
+//
+// Data packets are queued per destination peer and served deficit round robin, so one greedy download from us can not
+// starve the others. A packet only leaves when both the global bucket and the peer's own bucket hold enough tokens.
+// Control packets are never held back, but they are accounted for and do spend global tokens, so the configured limit
+// is a limit on everything we send.
+//
+// A rate limit of 0 means unlimited. The shaper does no sending itself; the dispatcher pulls packets out with
+// dequeue() and asks msecsUntilReady() how long to sleep when it gets nothing.
+
+// Traffic classes for accounting, the transfer classes follow TransferProtocol
+enum TrafficClass
+{
+    ControlTraffic=0,
+    FSTPTraffic=1,
+    BasicTraffic=2,
+    uTPTraffic=3,
+    FECTraffic=4
+};
+#define TRAFFIC_CLASS_COUNT 5
+
+// Bytes a peer may send per round robin turn, at least one packet of the largest size
+#define TRAFFIC_SHAPER_QUANTUM PACKET_JUMBO_MTU
+// Bucket depth in milliseconds worth of tokens, never less than a couple of the largest packets
+#define TRAFFIC_SHAPER_BURST_MSECS 50
+#define TRAFFIC_SHAPER_MIN_BURST (2 * PACKET_JUMBO_MTU)
+// Idle peers are forgotten after this long
+#define TRAFFIC_SHAPER_PEER_TIMEOUT 10000
+
+typedef struct
+{
+    quint64 totalRate;                           // bytes per second over the last status interval
+    quint64 classRates[TRAFFIC_CLASS_COUNT];
+    quint64 classBytes[TRAFFIC_CLASS_COUNT];     // totals since startup
+    quint64 queuedBytes;
+    int queuedPeers;
+    qint64 globalRateLimit;
+    qint64 peerRateLimit;
+} TrafficShaperStatusStruct;
+
+typedef struct
+{
+    QQueue<MappedDatagramStruct> queue;
+    qint64 queuedBytes;
+    qint64 tokens;
+    qint64 lastRefill;
+    int deficit;
+    bool turnStarted;
+} ShaperPeerStruct;
+
+class TrafficShaper : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TrafficShaper(QObject *parent = 0);
+    ~TrafficShaper();
+
+    // Takes ownership of the datagram
+    void enqueue(QHostAddress &dstHost, QByteArray *datagram);
+    void enqueue(QHostAddress &dstHost, const MappedDatagramStruct &datagram);
+    // Next datagram the limits allow, false if there is none. Ownership passes to the caller.
+    bool dequeue(QHostAddress &dstHost, MappedDatagramStruct &datagram);
+    // Account for a datagram that went out without being shaped
+    void accountUnshaped(QByteArray *datagram);
+
+    bool isEmpty() const {return activePeers.isEmpty();}
+    // Milliseconds until dequeue() can return something, 0 if it can right now, -1 if there is nothing queued
+    int msecsUntilReady();
+
+    void setGlobalRateLimit(qint64 bytesPerSecond);
+    void setPeerRateLimit(qint64 bytesPerSecond);
+    qint64 globalRateLimit() const {return globalLimit;}
+    qint64 peerRateLimit() const {return peerLimit;}
+
+    TrafficShaperStatusStruct getStatus();
+    static TrafficClass trafficClass(const QByteArray *datagram);
+
+private:
+    void refill(qint64 &tokens, qint64 &lastRefill, qint64 limit, qint64 now);
+    qint64 burstSize(qint64 limit);
+    void account(const QByteArray *header, int size);
+    void removeIdlePeers(qint64 now);
+
+    QHash<QHostAddress, ShaperPeerStruct *> peers;
+    QQueue<QHostAddress> activePeers;
+    qint64 totalQueuedBytes;
+
+    qint64 globalLimit;
+    qint64 peerLimit;
+    qint64 globalTokens;
+    qint64 globalLastRefill;
+
+    quint64 classBytes[TRAFFIC_CLASS_COUNT];
+    quint64 lastStatusClassBytes[TRAFFIC_CLASS_COUNT];
+    qint64 lastStatusTime;
+};
+
+#endif // TRAFFICSHAPER_H
@@ -11,19 +11,21 @@ Transfer::~Transfer()
 }
 
 // empty base class definitions, since these do not make sense for uploads
-void Transfer::incomingDataPacket(quint8, qint64, QByteArray){}
+void Transfer::incomingDataPacket(quint8, qint64, const char *, int){}
 void Transfer::hashBucketReply(int, QByteArray, QHostAddress){}
-void Transfer::TTHTreeReply(QByteArray){}
+void Transfer::TTHTreeReply(QHostAddress, QByteArray){}
 void Transfer::receivedPeerProtocolCapability(QHostAddress, quint8){}
 TransferSegment* Transfer::createUploadObject(quint8, quint32){return 0;}
+TransferSegment* Transfer::getUploadSegment(){return 0;}
 void Transfer::bucketFlushed(int){}
 void Transfer::bucketFlushFailed(int){}
 void Transfer::incomingTransferError(quint64, quint8){}
+void Transfer::incomingUploadQueued(QHostAddress, qint64, int, int){}
 void Transfer::setNextSegmentId(quint32){}
 void Transfer::addPeer(QHostAddress,QByteArray){}
-void Transfer::setBucketFlushStateBitmap(QByteArray){}
+void Transfer::setBucketFlushStateBitmap(QByteArray, QByteArray){}
 int Transfer::getSegmentCount() {return 0;}
-SegmentStatusStruct Transfer::getSegmentStatuses() {SegmentStatusStruct s = {0,0,0,0,0}; return s;}
+SegmentStatusStruct Transfer::getSegmentStatuses() {SegmentStatusStruct s = {0,0,0,0,0,0,0}; return s;}
 
 // ------------------------------------------------------------------------
 
@@ -26,6 +26,7 @@
 #include <QTimer>
 #include <QDateTime>
 #include "util.h"
+#include "mappedfileregion.h"
 #include "transfersegment.h"
 #include <math.h>
 class TransferSegment;
@@ -56,7 +57,18 @@ enum transferErrors
     NoSlotsAvailable=0x08,
     TransferAbortingError=0x10,
     FileNotSharedError=0x20,
-    SlowSegmentHostileTakeover=0x40
+    SlowSegmentHostileTakeover=0x40,
+    UploadQueued=0x80               // not an error, carries the queue position and a retry hint
+};
+
+// Why the download segment controller last changed the number of segments a download may run
+enum SegmentLimitDecision
+{
+    SegmentLimitHeld=0,
+    SegmentLimitGrown=1,
+    SegmentLimitShrunkGoodput=2,    // the last extra segment made the download slower
+    SegmentLimitShrunkStalls=3,     // too many segments stalled
+    SegmentLimitShrunkIO=4          // hashing and flushing can not keep up
 };
 
 struct SegmentStatusStruct
@@ -66,6 +78,8 @@ struct SegmentStatusStruct
     int finished;
     int stalled;
     int failed;
+    int segmentLimit;               // 0 if the transfer has no segment controller
+    int segmentLimitDecision;
 };
 
 class Transfer : public QObject
@@ -84,18 +98,24 @@ signals:
     void searchTTHAlternateSources(QByteArray tth);
     //void loadTTHSourcesFromDatabase(QByteArray tth);
     void sendDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, qint64 offset, qint64 length, quint32 segmentId, QByteArray cid);
+    void sendSelectiveDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, QByteArray ranges, quint32 segmentId, QByteArray cid);
     void sendTransferError(QHostAddress dstHost, quint8 error, QByteArray tth, qint64 offset);
     void transmitDatagram(QHostAddress dstHost, QByteArray *datagram);
+    void transmitMappedDatagram(QHostAddress dstHost, MappedDatagramStruct datagram);
     void transferFinished(QByteArray tth);
     void flushBucket(QString filename, QByteArray *bucket);
     void assembleOutputFile(QString tmpfilebase, QString outfile, int startbucket, int lastbucket);
-    void flushBucketDirect(QString outfile, int bucketno, QByteArray *bucket, QByteArray tth);
+    void flushBucketDirect(QString outfile, int bucketno, QByteArray *bucket, QByteArray tth, qint64 fileSize);
     void renameIncompleteFile(QString filename);
+    void closeIncompleteFile(QByteArray tth);
     void requestProtocolCapability(QHostAddress peer, Transfer *obj);
     void requestNextSegmentId(TransferSegment *segment);
-    void saveBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap);
+    // leaves is empty when they did not change since the last save
+    void saveBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap, QByteArray leaves);
     void setTransferSegmentPointer(quint32 segmentId, TransferSegment *segment);
     void removeTransferSegmentPointer(quint32 segmentId);
+    void uploadPending(TransferSegment *segment);
+    void sendRevConnect(QHostAddress dstHost, QByteArray tth, quint32 segmentId);
     void flagDownloadPeer(QHostAddress peer);
     void unflagDownloadPeer(QHostAddress peer);
 
@@ -106,6 +126,7 @@ public slots:
     void setSegmentLength(qint64 length);
     void setRemoteHost(QHostAddress remote);
     virtual TransferSegment* createUploadObject(quint8 protocol, quint32 segmentId);
+    virtual TransferSegment* getUploadSegment();
     void setFileSize(quint64 size);
     void setCurrentlyDownloadingPeers(QSet<QHostAddress> *dh);
     QByteArray* getTTH();
@@ -122,13 +143,14 @@ public slots:
     virtual void addPeer(QHostAddress peer, QByteArray cid);
     void setProtocolOrderPreference(QByteArray p);
     virtual void hashBucketReply(int bucketNumber, QByteArray bucketTTH, QHostAddress peer);
-    virtual void TTHTreeReply(QByteArray tree);
+    virtual void TTHTreeReply(QHostAddress peer, QByteArray tree);
     virtual void receivedPeerProtocolCapability(QHostAddress peer, quint8 protocols);
     virtual void incomingTransferError(quint64 offset, quint8 error);
+    virtual void incomingUploadQueued(QHostAddress fromHost, qint64 offset, int position, int retryMsecs);
     virtual void setNextSegmentId(quint32 id);
-    virtual void setBucketFlushStateBitmap(QByteArray bitmap);
+    virtual void setBucketFlushStateBitmap(QByteArray bitmap, QByteArray leaves);
 
-    virtual void incomingDataPacket(quint8 transferProtocolVersion, qint64 offset, QByteArray data);
+    virtual void incomingDataPacket(quint8 transferProtocolVersion, qint64 offset, const char *data, int length);
     virtual int getTransferType() = 0;
     virtual void startTransfer() = 0;
     virtual void pauseTransfer() = 0;
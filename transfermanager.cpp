@@ -1,16 +1,28 @@
 #include "transfermanager.h"
+#include "bytecursor.h"
+#include "datagrampool.h"
 
 TransferManager::TransferManager(QObject *parent) :
     QObject(parent)
 {
     currentDownloadCount = 0;
-    currentUploadCount = 0;
+    uploadScheduler.setMaximumUploadsPerPeer(DEFAULT_MAXIMUM_UPLOADS_PER_PEER);
     zeroHostAddress = QHostAddress("0.0.0.0");
     protocolOrderPreference = QByteArray();
     qsrand(QDateTime::currentMSecsSinceEpoch());
     nextSegmentId = qrand();
     if (nextSegmentId == 0)
         nextSegmentId++;
+
+    uploadPacingTimer = new QTimer(this);
+    uploadPacingTimer->setSingleShot(true);
+    connect(uploadPacingTimer, SIGNAL(timeout()), this, SLOT(uploadPacingTimerEvent()));
+
+    basicTransferServer = new QTcpServer(this);
+    connect(basicTransferServer, SIGNAL(newConnection()), this, SLOT(incomingBasicTransferConnection()));
+
+    bucketHashPool = new BucketHashPool(this);
+    connect(bucketHashPool, SIGNAL(resultsReady()), this, SLOT(bucketHashResultsReady()));
 }
 
 TransferManager::~TransferManager()
@@ -25,6 +37,8 @@ TransferManager::~TransferManager()
     QMapIterator<int, QList<DownloadTransferQueueItem>*> i(downloadTransferQueue);
     while (i.hasNext())
         delete i.next().value();
+
+    qDeleteAll(uploadTransferQueue);
 }
 
 // remove the pointer to the transfer object from the transfer object table before deleting the object.
@@ -35,11 +49,24 @@ void TransferManager::destroyTransferObject(Transfer* transferObject)
     if (transferObjectTable.remove(*transferObject->getTTH(), transferObject) != 0)
     {
         if (type == TRANSFER_TYPE_DOWNLOAD)
+        {
             currentDownloadCount--;
+            if (transferObject->getTTH()->length() == TTH_DEMUX_KEY_LENGTH)
+                downloadDemuxTable.remove(transferObject->getTTH()->constData(), transferObject);
+        }
         else if (type == TRANSFER_TYPE_UPLOAD)
         {
-            currentUploadCount--;
-            currentUploadingHosts.remove(*transferObject->getRemoteHost());
+            uploadScheduler.releaseSlot(*transferObject->getRemoteHost(), uploadLanes.take(transferObject));
+            QMutableHashIterator<UploadSegmentKey, Transfer *> i(uploadTransferTable);
+            while (i.hasNext())
+            {
+                if (i.next().value() == transferObject)
+                {
+                    i.remove();
+                    break;
+                }
+            }
+            startQueuedUploads();
         }
 
         QMutableHashIterator<QHostAddress, Transfer *> i(peerProtocolDiscoveryWaitingPool);
@@ -57,39 +84,41 @@ void TransferManager::destroyTransferObject(Transfer* transferObject)
 }
 
 // incoming data packets
-void TransferManager::incomingDataPacket(quint8 transferPacket, QHostAddress fromHost, QByteArray datagram)
-{
-    QByteArray tmp = datagram.mid(2, 8);
-    quint64 offset = getQuint64FromByteArray(&tmp);
-    if (offset > LLONG_MAX)
-        return;
-
-    QByteArray tth = datagram.mid(10, 24);
-    QByteArray data = datagram.mid(34);
-    if ((data.length() == datagram.length() - 34) && (transferObjectTable.contains(tth)))
+// The payload is handed down as a pointer into the datagram, which stays alive until this slot returns.
+// Segments copy what they need into their buckets, nothing is allocated per packet on the way there.
+void TransferManager::incomingDataPacket(quint8 transferPacket, QHostAddress fromHost, QByteArray *datagram)
+{
+    ByteReader reader(*datagram);
+    reader.skip(2);
+    quint64 offset = reader.readUInt64();
+    const char *tth = reader.readBytes(TTH_DEMUX_KEY_LENGTH);
+    if (reader.ok() && offset <= LLONG_MAX)
     {
-        Transfer *t = getTransferObjectPointer(tth, TRANSFER_TYPE_DOWNLOAD);
-        if (t)
-            t->incomingDataPacket(transferPacket, offset, data);
-        else
+        Transfer *t = downloadDemuxTable.value(tth);
+        if (!t)
         {
-            t = getTransferObjectPointer(tth, TRANSFER_TYPE_UPLOAD, &fromHost);
-            if (t)
+            // Uploads and downloads that did not fit in the demux table go the long way round
+            QByteArray tthKey(tth, TTH_DEMUX_KEY_LENGTH);
+            if (transferObjectTable.contains(tthKey))
             {
-                qDebug() << "TransferManager::incomingDataPacket() for upload" << t->getFileName();
-                t->incomingDataPacket(transferPacket, (qint64)offset, data);
+                t = getTransferObjectPointer(tthKey, TRANSFER_TYPE_DOWNLOAD);
+                if (!t)
+                    t = getTransferObjectPointer(tthKey, TRANSFER_TYPE_UPLOAD, &fromHost);
             }
         }
+        if (t)
+            t->incomingDataPacket(transferPacket, (qint64)offset, reader.current(), reader.remaining());
     }
+    DatagramPool::release(datagram);
 }
 
 // incoming direct dispatched data packets
-void TransferManager::incomingDirectDataPacket(quint32 segmentId, qint64 offset, QByteArray data)
+void TransferManager::incomingDirectDataPacket(quint32 segmentId, qint64 offset, QByteArray *data)
 {
     TransferSegment *t = getTransferSegmentPointer(segmentId);
-    qDebug() << "TransferManager::incomingDirectDataPacket()" << segmentId << t << data.length();
     if (t)
-        t->incomingDataPacket(offset, data);
+        t->incomingDataPacket(offset, data->constData(), data->length());
+    DatagramPool::release(data);
 }
 
 void TransferManager::incomingTransferError(QHostAddress fromHost, QByteArray tth, qint64 offset, quint8 error)
@@ -99,83 +128,219 @@ void TransferManager::incomingTransferError(QHostAddress fromHost, QByteArray tt
         t->incomingTransferError(offset, error);
 }
 
+void TransferManager::incomingUploadQueued(QHostAddress fromHost, QByteArray tth, qint64 offset, int position, int retryMsecs)
+{
+    Transfer *t = getTransferObjectPointer(tth, TRANSFER_TYPE_DOWNLOAD);
+    if (t)
+        t->incomingUploadQueued(fromHost, offset, position, retryMsecs);
+}
+
+// The uploader could not connect to us for a stream protocol segment
+void TransferManager::incomingRevConnect(QHostAddress fromHost, QByteArray tth, quint32 segmentId)
+{
+    TransferSegment *s = getTransferSegmentPointer(segmentId);
+    if (s && s->getSegmentRemotePeer() == fromHost)
+        s->reverseConnect(tth);
+}
+
 // incoming requests for files we share
+// Uploads are kept per requesting host and segment id, so one peer can pull several segments of a file, or several
+// files, at the same time. Slots are handed out by the upload scheduler once the file is known, requests that do not
+// get one are queued there and the requester is told where it stands.
 void TransferManager::incomingUploadRequest(quint8 protocol, QHostAddress fromHost, QByteArray tth, qint64 offset, qint64 length, quint32 segmentId)
 {
     //qDebug() << "TransferManager::incomingUploadRequest(): Data request offset " << offset << " length " << length;
-    Transfer *t = getTransferObjectPointer(tth, TRANSFER_TYPE_UPLOAD, &fromHost);
+    Transfer *t = getUploadTransferPointer(tth, fromHost, segmentId);
     if (t)
     {
         t->setFileOffset(offset);
         t->setSegmentLength(length);
         t->startTransfer();
+        return;
     }
-    else
+
+    UploadSchedulerEntry entry;
+    entry.protocol = protocol;
+    entry.requestingHost = fromHost;
+    entry.tth = tth;
+    entry.fileOffset = offset;
+    entry.requestLength = length;
+    entry.segmentId = segmentId;
+
+    // Asking again while queued keeps the place in line
+    if (uploadScheduler.isQueued(fromHost, tth, segmentId))
+    {
+        enqueueUpload(entry);
+        return;
+    }
+
+    // Further requests for a segment that is still waiting for its file name are queued along with the first one
+    if (!isUploadPending(tth, fromHost, segmentId) && uploadScheduler.peerAtLimit(fromHost))
+    {
+        emit sendTransferError(fromHost, PeerAlreadyTransferring, tth, offset);
+        return;
+    }
+
+    UploadTransferQueueItem *i = new UploadTransferQueueItem;
+    i->protocol = protocol;
+    i->requestingHost = fromHost;
+    i->fileOffset = offset;
+    i->requestLength = length;
+    i->segmentId = segmentId;
+    uploadTransferQueue.insertMulti(tth, i);
+
+    // One lookup per file is enough, everyone waiting for it gets served by the reply
+    if (uploadTransferQueue.count(tth) == 1)
+        emit filePathNameRequest(tth);
+}
+
+// sharing engine replies with file name for tth being requested for download
+// every request queued for the tth is handled here, in the order the requests arrived.
+void TransferManager::filePathNameReply(QByteArray tth, QString filename, quint64 fileSize)
+{
+    qDebug() << "TransferManager::filePathNameReply()" << filename << fileSize;
+    QList<UploadTransferQueueItem *> items = uploadTransferQueue.values(tth);
+    uploadTransferQueue.remove(tth);
+
+    // values() hands out the most recent insertion first
+    QSet<UploadSegmentKey> refused;
+    for (int n = items.size() - 1; n >= 0; n--)
     {
-        // Only allow one file transfer per host
-        if (currentUploadingHosts.contains(fromHost))
+        UploadTransferQueueItem *item = items.at(n);
+        UploadSegmentKey key(item->requestingHost, item->segmentId);
+        if (refused.contains(key))
         {
-            emit sendTransferError(fromHost, PeerAlreadyTransferring, tth, offset);
-            return;
+            delete item;
+            continue;
+        }
+
+        UploadSchedulerEntry entry;
+        entry.protocol = item->protocol;
+        entry.requestingHost = item->requestingHost;
+        entry.tth = tth;
+        entry.filePathName = filename;
+        entry.fileSize = fileSize;
+        entry.fileOffset = item->fileOffset;
+        entry.requestLength = item->requestLength;
+        entry.segmentId = item->segmentId;
+        delete item;
+
+        if (filename == "")
+        {
+            refused.insert(key);
+            emit sendTransferError(entry.requestingHost, FileNotSharedError, tth, entry.fileOffset);
+            qDebug() << "TransferManager::filePathNameReply() abort";
+            continue;
         }
 
-        //Only queue the item if there are "slots" open
-        if (currentUploadCount < maximumSimultaneousUploads)
+        Transfer *t = getUploadTransferPointer(tth, entry.requestingHost, entry.segmentId);
+        if (t)
+        {
+            t->setFileOffset(entry.fileOffset);
+            t->setSegmentLength(entry.requestLength);
+            t->startTransfer();
+        }
+        else if (uploadScheduler.isQueued(entry.requestingHost, tth, entry.segmentId))
+            enqueueUpload(entry);
+        else if (uploadScheduler.peerAtLimit(entry.requestingHost))
         {
-            currentUploadCount++;
-            UploadTransferQueueItem *i = new UploadTransferQueueItem;
-            i->protocol = protocol;
-            i->requestingHost = fromHost;
-            i->fileOffset = offset;
-            i->requestLength = length;
-            i->segmentId = segmentId;
-            uploadTransferQueue.insertMulti(tth, i);
-            currentUploadingHosts.insert(fromHost);
-            emit filePathNameRequest(tth);
+            refused.insert(key);
+            emit sendTransferError(entry.requestingHost, PeerAlreadyTransferring, tth, entry.fileOffset);
         }
         else
         {
-            emit sendTransferError(fromHost, NoSlotsAvailable, tth, offset);
+            UploadLane lane = uploadScheduler.acquireSlot(entry.requestingHost, fileSize);
+            if (lane == NoUploadLane)
+            {
+                if (!enqueueUpload(entry))
+                    refused.insert(key);
+            }
+            else if (!startUpload(entry, lane))
+                refused.insert(key);
         }
     }
 }
 
-// sharing engine replies with file name for tth being requested for download
-// this structure assumes only one user requests a specific file during the time it takes to dispatch the request to a transfer object.
-// should more than one user try simultaneously, their requests will be deleted off the queue in .remove(tth) and they should try again. oops.
-void TransferManager::filePathNameReply(QByteArray tth, QString filename, quint64 fileSize)
+// Returns false if the queue is full and the request was turned away
+bool TransferManager::enqueueUpload(const UploadSchedulerEntry &entry)
 {
-    qDebug() << "TransferManager::filePathNameReply()" << filename << fileSize;
-    if (filename == "" || !uploadTransferQueue.contains(tth))
+    int position = uploadScheduler.enqueue(entry);
+    if (position == 0)
     {
-        uploadTransferQueue.remove(tth);
-        currentUploadCount--;
-        if (uploadTransferQueue.contains(tth))
-        {
-            currentUploadingHosts.remove(uploadTransferQueue.value(tth)->requestingHost);
-            emit sendTransferError(uploadTransferQueue.value(tth)->requestingHost, FileNotSharedError, tth, uploadTransferQueue.value(tth)->fileOffset);
-        }
-        qDebug() << "TransferManager::filePathNameReply() abort";
-        return;
+        emit sendTransferError(entry.requestingHost, NoSlotsAvailable, entry.tth, entry.fileOffset);
+        return false;
     }
+
+    emit sendUploadQueued(entry.requestingHost, entry.tth, entry.fileOffset, position, UploadScheduler::retryMsecs(position));
+    return true;
+}
+
+// Hands free slots to queued requests
+void TransferManager::startQueuedUploads()
+{
+    UploadSchedulerEntry entry;
+    UploadLane lane;
+    while (uploadScheduler.takeNext(entry, lane))
+        startUpload(entry, lane);
+}
+
+// Starts an upload in a slot already taken from the scheduler, which gets it back if that fails
+bool TransferManager::startUpload(const UploadSchedulerEntry &entry, UploadLane lane)
+{
     Transfer *t = new UploadTransfer(this);
     connect(t, SIGNAL(abort(Transfer*)), this, SLOT(destroyTransferObject(Transfer*)));
     connect(t, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)), this, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)));
+    connect(t, SIGNAL(transmitMappedDatagram(QHostAddress,MappedDatagramStruct)), this, SIGNAL(transmitMappedDatagram(QHostAddress,MappedDatagramStruct)));
     connect(t, SIGNAL(sendTransferError(QHostAddress,quint8,QByteArray,qint64)), this, SIGNAL(sendTransferError(QHostAddress,quint8,QByteArray,qint64)));
     connect(t, SIGNAL(setTransferSegmentPointer(quint32,TransferSegment*)), this, SLOT(setTransferSegmentPointer(quint32,TransferSegment*)));
     connect(t, SIGNAL(removeTransferSegmentPointer(quint32)), this, SLOT(removeTransferSegmentPointer(quint32)));
-    TransferSegment *s = t->createUploadObject(uploadTransferQueue.value(tth)->protocol, uploadTransferQueue.value(tth)->segmentId);
+    connect(t, SIGNAL(uploadPending(TransferSegment*)), this, SLOT(uploadPending(TransferSegment*)));
+    connect(t, SIGNAL(sendRevConnect(QHostAddress,QByteArray,quint32)), this, SIGNAL(sendRevConnect(QHostAddress,QByteArray,quint32)));
+    TransferSegment *s = t->createUploadObject(entry.protocol, entry.segmentId);
     //via signal
-    //setTransferSegmentPointer(uploadTransferQueue.value(tth)->segmentId, s);
-    t->setFileName(filename);
-    t->setFileSize(fileSize);
-    t->setTTH(tth);
-    t->setFileOffset(uploadTransferQueue.value(tth)->fileOffset);
-    t->setSegmentLength(uploadTransferQueue.value(tth)->requestLength);
-    t->setRemoteHost(uploadTransferQueue.value(tth)->requestingHost);
-    uploadTransferQueue.remove(tth);
-    transferObjectTable.insertMulti(tth, t);
+    //setTransferSegmentPointer(entry.segmentId, s);
+    if (!s)
+    {
+        // Protocol we do not upload with, let the peer know rather than leave it waiting
+        t->deleteLater();
+        uploadScheduler.releaseSlot(entry.requestingHost, lane);
+        emit sendTransferError(entry.requestingHost, TransferAbortingError, entry.tth, entry.fileOffset);
+        return false;
+    }
+    t->setFileName(entry.filePathName);
+    t->setFileSize(entry.fileSize);
+    t->setTTH(entry.tth);
+    t->setRemoteHost(entry.requestingHost);
+    transferObjectTable.insertMulti(entry.tth, t);
+    uploadLanes.insert(t, lane);
+    if (entry.segmentId != 0)
+        uploadTransferTable.insert(UploadSegmentKey(entry.requestingHost, entry.segmentId), t);
+
+    t->setFileOffset(entry.fileOffset);
+    t->setSegmentLength(entry.requestLength);
     t->startTransfer();
+    return true;
+}
+
+// Peers that do not send segment ids get one upload per file, as it was before segment ids existed
+Transfer *TransferManager::getUploadTransferPointer(QByteArray &tth, QHostAddress &host, quint32 segmentId)
+{
+    if (segmentId == 0)
+        return getTransferObjectPointer(tth, TRANSFER_TYPE_UPLOAD, &host);
+
+    Transfer *t = uploadTransferTable.value(UploadSegmentKey(host, segmentId));
+    // A segment id is only unique per download, the same one for another file is a new upload
+    if (t && *t->getTTH() != tth)
+        return 0;
+    return t;
+}
+
+bool TransferManager::isUploadPending(QByteArray &tth, QHostAddress &host, quint32 segmentId)
+{
+    foreach (UploadTransferQueueItem *item, uploadTransferQueue.values(tth))
+        if (item->requestingHost == host && item->segmentId == segmentId)
+            return true;
+    return false;
 }
 
 // incoming requests from user interface for files we want to download
@@ -266,7 +431,7 @@ void TransferManager::startNextDownload()
     t->setCurrentlyDownloadingPeers(&currentDownloadingHosts);
     connect(t, SIGNAL(abort(Transfer*)), this, SLOT(destroyTransferObject(Transfer*)));
     connect(t, SIGNAL(requeue(Transfer *,bool)), this, SLOT(requeueDownload(Transfer *,bool)));
-    connect(t, SIGNAL(hashBucketRequest(QByteArray,int,QByteArray,QHostAddress)), this, SIGNAL(hashBucketRequest(QByteArray,int,QByteArray,QHostAddress)));
+    connect(t, SIGNAL(hashBucketRequest(QByteArray,int,QByteArray,QHostAddress)), this, SLOT(hashBucketRequest(QByteArray,int,QByteArray,QHostAddress)));
     connect(t, SIGNAL(TTHTreeRequest(QHostAddress,QByteArray,quint32,quint32)),
             this, SIGNAL(TTHTreeRequest(QHostAddress,QByteArray,quint32,quint32)));
     connect(t, SIGNAL(searchTTHAlternateSources(QByteArray)), this, SIGNAL(searchTTHAlternateSources(QByteArray)));
@@ -274,14 +439,17 @@ void TransferManager::startNextDownload()
     connect(t, SIGNAL(requestProtocolCapability(QHostAddress,Transfer*)), this, SLOT(requestPeerProtocolCapability(QHostAddress,Transfer*)));
     connect(t, SIGNAL(sendDownloadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32,QByteArray)),
             this, SIGNAL(sendDownloadRequest(quint8,QHostAddress,QByteArray,qint64,qint64,quint32,QByteArray)));
+    connect(t, SIGNAL(sendSelectiveDownloadRequest(quint8,QHostAddress,QByteArray,QByteArray,quint32,QByteArray)),
+            this, SIGNAL(sendSelectiveDownloadRequest(quint8,QHostAddress,QByteArray,QByteArray,quint32,QByteArray)));
     connect(t, SIGNAL(flushBucket(QString,QByteArray*)), this, SIGNAL(flushBucket(QString,QByteArray*)));
     connect(t, SIGNAL(assembleOutputFile(QString,QString,int,int)), this, SIGNAL(assembleOutputFile(QString,QString,int,int)));
-    connect(t, SIGNAL(flushBucketDirect(QString,int,QByteArray*,QByteArray)), this, SIGNAL(flushBucketDirect(QString,int,QByteArray*,QByteArray)));
+    connect(t, SIGNAL(flushBucketDirect(QString,int,QByteArray*,QByteArray,qint64)), this, SIGNAL(flushBucketDirect(QString,int,QByteArray*,QByteArray,qint64)));
     connect(t, SIGNAL(renameIncompleteFile(QString)), this, SIGNAL(renameIncompleteFile(QString)));
+    connect(t, SIGNAL(closeIncompleteFile(QByteArray)), this, SIGNAL(closeIncompleteFile(QByteArray)));
     connect(t, SIGNAL(transferFinished(QByteArray)), this, SLOT(transferDownloadCompleted(QByteArray)));
     connect(t, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)), this, SIGNAL(transmitDatagram(QHostAddress,QByteArray*)));
     connect(t, SIGNAL(requestNextSegmentId(TransferSegment*)), this, SLOT(requestNextSegmentId(TransferSegment*)));
-    connect(t, SIGNAL(saveBucketFlushStateBitmap(QByteArray,QByteArray)), this, SIGNAL(saveBucketFlushStateBitmap(QByteArray,QByteArray)));
+    connect(t, SIGNAL(saveBucketFlushStateBitmap(QByteArray,QByteArray,QByteArray)), this, SIGNAL(saveBucketFlushStateBitmap(QByteArray,QByteArray,QByteArray)));
     connect(t, SIGNAL(setTransferSegmentPointer(quint32,TransferSegment*)), this, SLOT(setTransferSegmentPointer(quint32,TransferSegment*)));
     connect(t, SIGNAL(removeTransferSegmentPointer(quint32)), this, SLOT(removeTransferSegmentPointer(quint32)));
     connect(t, SIGNAL(flagDownloadPeer(QHostAddress)), this, SLOT(addDownloadPeer(QHostAddress)));
@@ -294,6 +462,8 @@ void TransferManager::startNextDownload()
     // we can lose the ip address from the queue, alternate search tells us everything we need.
     t->addPeer(i.fileHost, i.tth);
     transferObjectTable.insertMulti(i.tth, t);
+    if (i.tth.length() == TTH_DEMUX_KEY_LENGTH)
+        downloadDemuxTable.insert(i.tth.constData(), t);
     emit loadBucketFlushStateBitmap(i.tth);
     //emit loadTTHSourcesFromDatabase(i.tth);
     emit searchTTHAlternateSources(i.tth);
@@ -371,10 +541,16 @@ void TransferManager::stopTransfer(QByteArray tth, int transferType, QHostAddres
 {
     Transfer *t;
 
-    if (transferType == TRANSFER_TYPE_DOWNLOAD)
-        t = getTransferObjectPointer(tth, transferType);
-    else
-        t = getTransferObjectPointer(tth, transferType, &hostAddr);
+    if (transferType == TRANSFER_TYPE_UPLOAD)
+    {
+        //A peer can be pulling several segments of the file, stop them all
+        foreach (Transfer *p, transferObjectTable.values(tth))
+            if (p->getTransferType() == TRANSFER_TYPE_UPLOAD && *p->getRemoteHost() == hostAddr)
+                p->abortTransfer();
+        return;
+    }
+
+    t = getTransferObjectPointer(tth, transferType);
     if (t)
     {
         //Abort transfer before deletion
@@ -465,15 +641,34 @@ void TransferManager::incomingTTHSource(QByteArray tth, QHostAddress sourcePeer,
 // packet containing part of a tree
 // qint32 bucket number followed by 24-byte QByteArray of bucket 1MBTTH
 // therefore, 2.25 petabyte max file size, should suffice.
-void TransferManager::incomingTTHTree(QByteArray tth, QByteArray tree)
+void TransferManager::incomingTTHTree(QHostAddress fromHost, QByteArray tth, QByteArray tree)
 {
     Transfer *t = getTransferObjectPointer(tth, TRANSFER_TYPE_DOWNLOAD);
     if (t)
-        t->TTHTreeReply(tree);
+        t->TTHTreeReply(fromHost, tree);
+}
+
+void TransferManager::hashBucketRequest(QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer)
+{
+    if (!bucket.isEmpty())
+        bucketHashPool->hashBucket(rootTTH, bucketNumber, bucket, peer);
+    else
+        //Meh. Not going to hash an empty bucket
+        hashBucketReply(rootTTH, bucketNumber, QByteArray(), peer);
+}
+
+void TransferManager::bucketHashResultsReady()
+{
+    QList<BucketHashResultStruct> results = bucketHashPool->takeResults();
+    foreach (const BucketHashResultStruct &r, results)
+        hashBucketReply(r.rootTTH, r.bucketNumber, r.bucketTTH, r.peer);
 }
 
 void TransferManager::hashBucketReply(QByteArray rootTTH, int bucketNumber, QByteArray bucketTTH, QHostAddress peer)
 {
+    // The hasher is done reading the mapped file, even if the download it came from is gone
+    DownloadFileMap::releaseFromHashing(rootTTH);
+
     Transfer *t = getTransferObjectPointer(rootTTH, TRANSFER_TYPE_DOWNLOAD);
     if (t)
         t->hashBucketReply(bucketNumber, bucketTTH, peer);
@@ -537,7 +732,14 @@ void TransferManager::setMaximumSimultaneousDownloads(int n)
 
 void TransferManager::setMaximumSimultaneousUploads(int n)
 {
-    maximumSimultaneousUploads = n;
+    uploadScheduler.setMaximumUploads(n);
+    startQueuedUploads();
+}
+
+void TransferManager::setMaximumUploadsPerPeer(int n)
+{
+    uploadScheduler.setMaximumUploadsPerPeer(n);
+    startQueuedUploads();
 }
 
 void TransferManager::setProtocolOrderPreference(QByteArray p)
@@ -545,6 +747,77 @@ void TransferManager::setProtocolOrderPreference(QByteArray p)
     protocolOrderPreference = p;
 }
 
+void TransferManager::setBasicTransferPort(quint16 port)
+{
+    BTPTransferSegment::setPort(port);
+    if (basicTransferServer->isListening())
+    {
+        if (basicTransferServer->serverPort() == port)
+            return;
+        basicTransferServer->close();
+    }
+    if (!basicTransferServer->listen(QHostAddress::Any, port))
+        qDebug() << "TransferManager::setBasicTransferPort(): Could not listen on port" << port << basicTransferServer->errorString();
+}
+
+void TransferManager::incomingBasicTransferConnection()
+{
+    // Connections that never said what they want
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutableHashIterator<QTcpSocket*, qint64> i(pendingBasicTransferSockets);
+    while (i.hasNext())
+    {
+        i.next();
+        if (now - i.value() > BTP_HELLO_TIMEOUT)
+        {
+            i.key()->deleteLater();
+            i.remove();
+        }
+    }
+
+    while (basicTransferServer->hasPendingConnections())
+    {
+        QTcpSocket *socket = basicTransferServer->nextPendingConnection();
+        pendingBasicTransferSockets.insert(socket, now);
+        connect(socket, SIGNAL(readyRead()), this, SLOT(basicTransferHelloReady()));
+    }
+}
+
+// The hello names the segment, which takes the connection over from here
+void TransferManager::basicTransferHelloReady()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket || !pendingBasicTransferSockets.contains(socket) || socket->bytesAvailable() < BTP_HELLO_SIZE)
+        return;
+
+    pendingBasicTransferSockets.remove(socket);
+    socket->disconnect(this);
+
+    QByteArray hello = socket->read(BTP_HELLO_SIZE);
+    ByteReader reader(hello);
+    quint8 protocol = reader.readUInt8();
+    quint8 role = reader.readUInt8();
+    quint32 segmentId = reader.readUInt32();
+    QByteArray tth = reader.readByteArray(24);
+
+    // A downloader connects to one of our uploads, which go by its segment id; anything else is for our own downloads
+    TransferSegment *s = 0;
+    if (role == BTPDownloaderRole)
+    {
+        Transfer *t = uploadTransferTable.value(UploadSegmentKey(socket->peerAddress(), segmentId));
+        if (t)
+            s = t->getUploadSegment();
+    }
+    else
+        s = getTransferSegmentPointer(segmentId);
+    if (reader.ok() && protocol == BasicTransferProtocol && s && s->getSegmentRemotePeer() == socket->peerAddress()
+            && s->attachStreamConnection(socket, role, tth))
+        return;
+
+    socket->abort();
+    socket->deleteLater();
+}
+
 void TransferManager::requestNextSegmentId(TransferSegment *segment)
 {
     nextSegmentId++;
@@ -554,32 +827,85 @@ void TransferManager::requestNextSegmentId(TransferSegment *segment)
     segment->setSegmentId(nextSegmentId);
 }
 
-void TransferManager::restoreBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap)
+void TransferManager::restoreBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap, QByteArray leaves)
 {
     Transfer *t = getTransferObjectPointer(tth, TRANSFER_TYPE_DOWNLOAD);
     if (t)
-        t->setBucketFlushStateBitmap(bitmap);
+        t->setBucketFlushStateBitmap(bitmap, leaves);
 }
 
 TransferSegment* TransferManager::getTransferSegmentPointer(quint32 segmentId)
 {
-    qDebug() << "TransferManager::getTransferSegmentPointer()" << segmentId << transferSegmentPointers;
+    TransferSegment *s = segmentDemuxTable.value(segmentId);
+    // transferSegmentPointers only holds the overflow when the demux table is full, which should never really happen.
     // QHash automatically returns 0 for TransferSegment* when key not found
-    return transferSegmentPointers.value(segmentId);
+    if (!s && !transferSegmentPointers.isEmpty())
+        s = transferSegmentPointers.value(segmentId);
+    return s;
 }
 
 void TransferManager::setTransferSegmentPointer(quint32 segmentId, TransferSegment *segment)
 {
     qDebug() << "TransferManager::setTransferSegmentPointer()" << segmentId << segment;
-    transferSegmentPointers.insert(segmentId, segment);
+    if (!segmentDemuxTable.insert(segmentId, segment))
+    {
+        qDebug() << "TransferManager::setTransferSegmentPointer() demux table full, using overflow hash" << segmentId;
+        transferSegmentPointers.insert(segmentId, segment);
+    }
 }
 
 void TransferManager::removeTransferSegmentPointer(quint32 segmentId)
 {
     qDebug() << "TransferManager::removeTransferSegmentPointer()" << segmentId;
+    segmentDemuxTable.remove(segmentId);
     transferSegmentPointers.remove(segmentId);
 }
 
+void TransferManager::uploadPending(TransferSegment *segment)
+{
+    if (!pacedUploads.contains(segment))
+        pacedUploads.append(segment);
+    if (!uploadPacingTimer->isActive())
+        uploadPacingTimer->start(0);
+}
+
+// Uploads take turns sending a few packets each, so no single segment holds up the others or the control traffic
+// waiting in the event loop behind it.
+void TransferManager::uploadPacingTimerEvent()
+{
+    int budget = UPLOAD_PACING_BATCH_PACKETS;
+    bool progress = true;
+    while (budget > 0 && progress)
+    {
+        progress = false;
+        QMutableListIterator<QPointer<TransferSegment> > i(pacedUploads);
+        while (i.hasNext() && budget > 0)
+        {
+            TransferSegment *segment = i.next();
+            if (!segment || !segment->hasPendingUpload())
+            {
+                i.remove();
+                continue;
+            }
+
+            int sent = segment->sendUploadQuantum(qMin(budget, FSTP_UPLOAD_QUANTUM_PACKETS));
+            budget -= sent;
+            if (sent > 0)
+                progress = true;
+        }
+    }
+
+    if (pacedUploads.isEmpty())
+        return;
+
+    // Whoever went first this time goes last next time
+    pacedUploads.append(pacedUploads.takeFirst());
+
+    // Out of budget means there is more to send right away, once the event loop has had its turn.
+    // Otherwise everybody is waiting for pacing credit.
+    uploadPacingTimer->start(budget == 0 ? 0 : UPLOAD_PACING_INTERVAL);
+}
+
 void TransferManager::addDownloadPeer(QHostAddress peer)
 {
     currentDownloadingHosts.insert(peer);
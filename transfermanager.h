@@ -20,10 +20,25 @@
 #include <QObject>
 #include <QList>
 #include <QHostAddress>
+#include <QPointer>
+#include <QPair>
+#include <QTimer>
+#include <QTcpServer>
+#include <QTcpSocket>
 //#include "transfer.h"
 #include "uploadtransfer.h"
 #include "downloadtransfer.h"
 #include "execthread.h"
+#include "demuxtable.h"
+#include "uploadscheduler.h"
+#include "buckethashpool.h"
+
+// Packets sent per pacing timer event before the event loop gets a turn
+#define UPLOAD_PACING_BATCH_PACKETS 64
+// Wait before trying again when every upload is out of pacing credit
+#define UPLOAD_PACING_INTERVAL 2
+// Upload segments a single peer may hold at the same time
+#define DEFAULT_MAXIMUM_UPLOADS_PER_PEER 4
 
 typedef struct
 {
@@ -34,6 +49,9 @@ typedef struct
     quint32 segmentId;
 } UploadTransferQueueItem;
 
+// Uploads are told apart by requesting host and segment id
+typedef QPair<QHostAddress, quint32> UploadSegmentKey;
+
 typedef struct
 {
     QString filePathName;
@@ -72,16 +90,18 @@ signals:
     void searchTTHAlternateSources(QByteArray tth);
     void TTHTreeRequest(QHostAddress hostAddr,QByteArray rootTTH, quint32 startBucket, quint32 bucketCount);
     void sendDownloadRequest(quint8 protocolPreference, QHostAddress dstHost, QByteArray tth, qint64 offset, qint64 length, quint32 segmentId, QByteArray cid);
+    void sendSelectiveDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, QByteArray ranges, quint32 segmentId, QByteArray cid);
     void sendTransferError(QHostAddress dstHost, quint8 error, QByteArray tth, qint64 offset);
+    void sendUploadQueued(QHostAddress dstHost, QByteArray tth, qint64 offset, int position, int retryMsecs);
+    void sendRevConnect(QHostAddress dstHost, QByteArray tth, quint32 segmentId);
     void flushBucket(QString filename, QByteArray *bucket);
     void assembleOutputFile(QString tmpfilebase, QString outfile, int startbucket, int lastbucket);
-    void flushBucketDirect(QString outfile, int bucketno, QByteArray *bucket, QByteArray tth);
+    void flushBucketDirect(QString outfile, int bucketno, QByteArray *bucket, QByteArray tth, qint64 fileSize);
     void renameIncompleteFile(QString filename);
-
-    // Request hashing of a bucket that has finished downloading
-    void hashBucketRequest(QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer);
+    void closeIncompleteFile(QByteArray tth);
 
     void transmitDatagram(QHostAddress dstHost, QByteArray *datagram);
+    void transmitMappedDatagram(QHostAddress dstHost, MappedDatagramStruct datagram);
 
     // GUI updates
     void downloadStarted(QByteArray tth);
@@ -95,16 +115,18 @@ signals:
     void requestProtocolCapability(QHostAddress peer);
 
     // Transfer state bitmap to/from database
-    void saveBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap);
+    void saveBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap, QByteArray leaves);
     void loadBucketFlushStateBitmap(QByteArray tth);
 
     // Notify when done handling closeClientEvent()
     void closeClientEventReturn();
 
 public slots:
-    void incomingDataPacket(quint8 transferProtocolVersion, QHostAddress fromHost, QByteArray datagram);
-    void incomingDirectDataPacket(quint32 segmentId, qint64 offset, QByteArray data);
+    void incomingDataPacket(quint8 transferProtocolVersion, QHostAddress fromHost, QByteArray *datagram);
+    void incomingDirectDataPacket(quint32 segmentId, qint64 offset, QByteArray *data);
     void incomingTransferError(QHostAddress fromHost, QByteArray tth, qint64 offset, quint8 error);
+    void incomingUploadQueued(QHostAddress fromHost, QByteArray tth, qint64 offset, int position, int retryMsecs);
+    void incomingRevConnect(QHostAddress fromHost, QByteArray tth, quint32 segmentId);
 
     // Request file name for given TTH from sharing engine, reply with empty string if not found.
     void filePathNameReply(QByteArray tth, QString filename, quint64 fileSize);
@@ -126,11 +148,14 @@ public slots:
     //Get transfer status
     void requestGlobalTransferStatus();
 
+    // Request hashing of a bucket that has finished downloading
+    void hashBucketRequest(QByteArray rootTTH, int bucketNumber, QByteArray bucket, QHostAddress peer);
     // Response from hashing engine when bucket finished hashing
     void hashBucketReply(QByteArray rootTTH, int bucketNumber, QByteArray bucketTTH, QHostAddress peer);
+    void bucketHashResultsReady();
 
     void incomingTTHSource(QByteArray tth, QHostAddress sourcePeer, QByteArray sourceCID);
-    void incomingTTHTree(QByteArray tth, QByteArray tree);
+    void incomingTTHTree(QHostAddress fromHost, QByteArray tth, QByteArray tree);
 
     // Protocol capability
     void incomingProtocolCapabilityResponse(QHostAddress fromHost, char protocols);
@@ -144,7 +169,7 @@ public slots:
     void requestNextSegmentId(TransferSegment*);
 
     // Restore transfer state bitmap from database
-    void restoreBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap);
+    void restoreBucketFlushStateBitmap(QByteArray tth, QByteArray bitmap, QByteArray leaves);
 
     QList<TransferItemStatus> getGlobalTransferStatus();
 
@@ -156,12 +181,22 @@ public slots:
     // Set functions
     void setMaximumSimultaneousDownloads(int n);
     void setMaximumSimultaneousUploads(int n);
+    void setMaximumUploadsPerPeer(int n);
     void setProtocolOrderPreference(QByteArray p);
 
     // Transfer segment pointers for direct dispatch
     void setTransferSegmentPointer(quint32 segmentId, TransferSegment *segment);
     void removeTransferSegmentPointer(quint32 segmentId);
 
+    // Paced uploads
+    void uploadPending(TransferSegment *segment);
+    void uploadPacingTimerEvent();
+
+    // Stream protocol connections, listened for on the dispatch port number
+    void setBasicTransferPort(quint16 port);
+    void incomingBasicTransferConnection();
+    void basicTransferHelloReady();
+
     // One download per peer checking
     void addDownloadPeer(QHostAddress peer);
     void removeDownloadPeer(QHostAddress peer);
@@ -169,27 +204,47 @@ public slots:
 
 private:
     Transfer* getTransferObjectPointer(QByteArray &tth, int transferType, QHostAddress *hostAddr = 0);
+    Transfer* getUploadTransferPointer(QByteArray &tth, QHostAddress &host, quint32 segmentId);
+    bool isUploadPending(QByteArray &tth, QHostAddress &host, quint32 segmentId);
+    bool enqueueUpload(const UploadSchedulerEntry &entry);
+    bool startUpload(const UploadSchedulerEntry &entry, UploadLane lane);
+    void startQueuedUploads();
     DownloadTransferQueueItem getNextQueuedDownload();
     void startNextDownload();
     QMap<int, QList<DownloadTransferQueueItem>* > downloadTransferQueue;
     QMultiHash<QByteArray, Transfer*> transferObjectTable;
     QMultiHash<QByteArray, UploadTransferQueueItem*> uploadTransferQueue;
+    QHash<UploadSegmentKey, Transfer*> uploadTransferTable;
     QHash<QHostAddress, char> peerProtocolCapabilities;
+    // Downloaded buckets are verified here
+    BucketHashPool *bucketHashPool;
     QMultiHash<QHostAddress, Transfer*> peerProtocolDiscoveryWaitingPool;
     int maximumSimultaneousDownloads;
-    int maximumSimultaneousUploads;
     int currentDownloadCount;
-    int currentUploadCount;
     quint32 nextSegmentId;
     QHostAddress zeroHostAddress;
     QByteArray protocolOrderPreference;
 
     // Transfer segment pointers for direct dispatch
     TransferSegment *getTransferSegmentPointer(quint32 segmentId);
+    SegmentDemuxTable segmentDemuxTable;
     QHash<quint32, TransferSegment*> transferSegmentPointers;
-    QSet<QHostAddress> currentUploadingHosts;
+
+    // Download transfers by TTH for data packet dispatch
+    TTHDemuxTable downloadDemuxTable;
+    // Upload slots and the queue for them
+    UploadScheduler uploadScheduler;
+    QHash<Transfer*, UploadLane> uploadLanes;
+
+    // Upload segments with data queued, served round robin
+    QList<QPointer<TransferSegment> > pacedUploads;
+    QTimer *uploadPacingTimer;
     QSet<QHostAddress> currentDownloadingHosts;
 
+    // Stream connections that have not said which segment they are for yet
+    QTcpServer *basicTransferServer;
+    QHash<QTcpSocket*, qint64> pendingBasicTransferSockets;
+
     const QHash<QString, QString> *pSettings;
 };
 
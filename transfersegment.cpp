@@ -1,30 +1,46 @@
 #include "transfersegment.h"
+#include "downloadfilemap.h"
+#include "bucketpool.h"
+#include "buckethashpool.h"
 
 TransferSegment::TransferSegment(QObject *parent) :
     QObject(parent)
 {
     pDownloadBucketTable = 0;
+    pDownloadFileMap = 0;
     maxUploadRequestOffset = 0;
     segmentStart = 0;
     segmentLength = 0;
     segmentEnd = 0;
+    segmentStartTime = 0;
+    firstDataTime = 0;
     bytesTransferred = 0;
+    incrementalHashing = true;
 }
 
 TransferSegment::~TransferSegment()
 {
     emit removeTransferSegmentPointer(segmentId);
+    clearBucketHashes();
     //qDebug() << "TransferSegment DESTROYING: " << this;
 }
 
 void TransferSegment::transferTimerEvent(){}
 void TransferSegment::setFileSize(quint64){}
-qint64 TransferSegment::getBytesReceivedNotFlushed(){return 0;}
+int TransferSegment::sendUploadQuantum(int){return 0;}
+bool TransferSegment::hasPendingUpload(){return false;}
+void TransferSegment::uploadQueued(int, int){}
+bool TransferSegment::attachStreamConnection(QTcpSocket *, int, QByteArray){return false;}
+void TransferSegment::reverseConnect(QByteArray){}
 qint64 TransferSegment::getMaxUploadRequestOffset(){return maxUploadRequestOffset;}
 
 void TransferSegment::setSegmentStart(qint64 start)
 {
     segmentStart = start;
+    firstDataTime = 0;
+    clearBucketHashes();
+    receivedBucketBytes.clear();
+    incrementalHashing = true;
     segmentLength = segmentEnd - segmentStart > 0 ? segmentEnd - segmentStart : 0;
     calculateLastBucketParams();
 }
@@ -66,6 +82,11 @@ qint64 TransferSegment::getSegmentStartTime()
     return segmentStartTime;
 }
 
+qint64 TransferSegment::getFirstDataTime()
+{
+    return firstDataTime;
+}
+
 QHostAddress TransferSegment::getSegmentRemotePeer()
 {
     return remoteHost;
@@ -106,11 +127,23 @@ void TransferSegment::setDownloadBucketTablePointer(QHash<int, QByteArray *> *db
     pDownloadBucketTable = dbt;
 }
 
+void TransferSegment::setDownloadFileMap(DownloadFileMap *map)
+{
+    pDownloadFileMap = map;
+}
+
 void TransferSegment::setSegmentId(quint32 id)
 {
     segmentId = id;
 }
 
+void TransferSegment::setIncrementalHashing(bool enabled)
+{
+    incrementalHashing = enabled;
+    if (!enabled)
+        clearBucketHashes();
+}
+
 void TransferSegment::checkSendDownloadRequest(QHostAddress peer, QByteArray TTH,
                                                qint64 requestingOffset, qint64 requestingLength, int status, quint8 protocol)
 {
@@ -135,3 +168,125 @@ int TransferSegment::calculateBucketNumber(quint64 fileOffset)
 {
     return (int)(fileOffset >> 20);
 }
+
+char *TransferSegment::downloadBucketData(int bucketNumber, int length)
+{
+    if (!firstDataTime)
+        firstDataTime = QDateTime::currentMSecsSinceEpoch();
+
+    if (pDownloadFileMap)
+        return pDownloadFileMap->bucketData(bucketNumber);
+
+    QByteArray *bucket = pDownloadBucketTable->value(bucketNumber);
+    if (!bucket)
+    {
+        // Buckets are taken at their final size right away, growing them as data comes in would reallocate
+        qint64 bucketLength = qBound((qint64)length, fileSize - (qint64)bucketNumber * HASH_BUCKET_SIZE, (qint64)HASH_BUCKET_SIZE);
+        bucket = BucketPool::acquire((int)bucketLength);
+        pDownloadBucketTable->insert(bucketNumber, bucket);
+    }
+    else if (bucket->length() < length)
+        bucket->resize(length);
+    return bucket->data();
+}
+
+void TransferSegment::hashReceivedRange(qint64 start, qint64 end)
+{
+    if (!incrementalHashing)
+        return;
+
+    while (start < end)
+    {
+        int bucketNumber = calculateBucketNumber(start);
+        int bucketOffset = start - (qint64)bucketNumber * HASH_BUCKET_SIZE;
+        int n = (int)qMin(end - start, (qint64)HASH_BUCKET_SIZE - bucketOffset);
+        start += n;
+
+        // The data is read back from where it was just written, while it is still in the cache
+        const char *data = 0;
+        if (pDownloadFileMap)
+            data = pDownloadFileMap->bucketData(bucketNumber);
+        else if (pDownloadBucketTable->value(bucketNumber))
+            data = pDownloadBucketTable->value(bucketNumber)->constData();
+
+        IncrementalBucketHash *hash = bucketHashes.value(bucketNumber);
+        if (!hash && bucketOffset == 0 && data)
+        {
+            hash = new IncrementalBucketHash;
+            bucketHashes.insert(bucketNumber, hash);
+        }
+        if (!hash)
+            continue;
+
+        // Anything but the next bytes in line and the bucket goes to the hash pool when it is done
+        if (!data || hash->getHashedLength() != bucketOffset)
+        {
+            delete bucketHashes.take(bucketNumber);
+            continue;
+        }
+        hash->update(data + bucketOffset, n);
+    }
+}
+
+void TransferSegment::addReceivedBucketBytes(qint64 offset, qint64 length)
+{
+    while (length > 0)
+    {
+        int bucketNumber = calculateBucketNumber(offset);
+        qint64 n = qMin(length, (qint64)(bucketNumber + 1) * HASH_BUCKET_SIZE - offset);
+        receivedBucketBytes[bucketNumber] += n;
+        offset += n;
+        length -= n;
+    }
+}
+
+// Received data in buckets that are still filling up. Complete ones are counted by the transfer from there on.
+qint64 TransferSegment::getBytesReceivedNotFlushed()
+{
+    qint64 bytes = 0;
+    foreach (qint64 n, receivedBucketBytes)
+        bytes += n;
+    return bytes;
+}
+
+void TransferSegment::clearBucketHashes()
+{
+    qDeleteAll(bucketHashes);
+    bucketHashes.clear();
+}
+
+void TransferSegment::downloadBucketComplete(int bucketNumber)
+{
+    receivedBucketBytes.remove(bucketNumber);
+
+    IncrementalBucketHash *hash = bucketHashes.take(bucketNumber);
+    if (hash)
+    {
+        int length = 0;
+        if (pDownloadFileMap)
+            length = pDownloadFileMap->bucketLength(bucketNumber);
+        else if (pDownloadBucketTable->value(bucketNumber))
+            length = pDownloadBucketTable->value(bucketNumber)->length();
+
+        QByteArray bucketTTH;
+        if (incrementalHashing && length > 0 && hash->getHashedLength() == length)
+            bucketTTH = hash->digest();
+        delete hash;
+        if (!bucketTTH.isEmpty())
+        {
+            emit bucketHashed(TTH, bucketNumber, bucketTTH, remoteHost);
+            return;
+        }
+    }
+
+    // The transfer hashes straight from the mapped file, there is no bucket to pass along
+    if (pDownloadFileMap)
+    {
+        emit hashBucketRequest(TTH, bucketNumber, 0, remoteHost);
+        return;
+    }
+
+    QByteArray *bucket = pDownloadBucketTable->value(bucketNumber);
+    if (bucket)
+        emit hashBucketRequest(TTH, bucketNumber, bucket, remoteHost);
+}
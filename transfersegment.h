@@ -25,8 +25,12 @@
 #include <QDateTime>
 #include "protocoldef.h"
 #include "util.h"
+#include "mappedfileregion.h"
 #include "transfer.h"
 class Transfer;
+class DownloadFileMap;
+class IncrementalBucketHash;
+class QTcpSocket;
 
 enum SegmentMode
 {
@@ -44,17 +48,26 @@ public:
 
 signals:
     void transmitDatagram(QHostAddress dstHost, QByteArray *datagram);
+    void transmitMappedDatagram(QHostAddress dstHost, MappedDatagramStruct datagram);
     void sendDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, qint64 offset, qint64 length, quint32 segmentId, QByteArray cid);
+    // ranges holds (quint64 offset, quint32 length) pairs, big endian, as they go on the wire
+    void sendSelectiveDownloadRequest(quint8 protocol, QHostAddress dstHost, QByteArray tth, QByteArray ranges, quint32 segmentId, QByteArray cid);
     void sendTransferError(QHostAddress dstHost, quint8 error, QByteArray tth, qint64 offset);
     void hashBucketRequest(QByteArray rootTTH, int bucketNumber, QByteArray *bucket, QHostAddress peer);
+    // The bucket was hashed while it came in, this is its hash
+    void bucketHashed(QByteArray rootTTH, int bucketNumber, QByteArray bucketTTH, QHostAddress peer);
     void requestNextSegment(TransferSegment *requestingSegmentObject);
     void transferRequestFailed(TransferSegment *requestingSegmentObject, quint8 error=0, bool startIdleSegment=true);
     void requestNextSegmentId(TransferSegment *segment);
     void removeTransferSegmentPointer(quint32 segmentId);
     void updateDirectBytesStats(int bytes);
+    // Upload data is queued, the transfer manager should start calling sendUploadQuantum()
+    void uploadPending(TransferSegment *segment);
+    // A stream protocol could not connect to the peer, ask it to connect to us instead
+    void sendRevConnect(QHostAddress dstHost, QByteArray tth, quint32 segmentId);
 
 public slots:
-    virtual void incomingDataPacket(qint64 offset, QByteArray data) = 0;
+    virtual void incomingDataPacket(qint64 offset, const char *data, int length) = 0;
     virtual void transferTimerEvent();
     virtual void setFileName(QString filename) = 0;
     virtual void setFileSize(quint64 size);
@@ -64,6 +77,8 @@ public slots:
     qint64 getSegmentStart();
     qint64 getSegmentEnd();
     qint64 getSegmentStartTime();
+    // When the first data of the current range arrived, 0 if none did yet
+    qint64 getFirstDataTime();
     QHostAddress getSegmentRemotePeer();
     int getSegmentStatus();
     quint32 getSegmentId();
@@ -74,8 +89,21 @@ public slots:
     virtual void pauseDownload() = 0;
     virtual void unpauseDownload() = 0;
     virtual void abortTransfer() = 0;
+    virtual int sendUploadQuantum(int maxPackets);
+    virtual bool hasPendingUpload();
+    // The uploader put our request in its queue, ask again in retryMsecs
+    virtual void uploadQueued(int position, int retryMsecs);
+    // Stream protocols: takes over a connection the peer opened to us, false if it is not for us.
+    // role is that of the connecting side, see BTPConnectionRole.
+    virtual bool attachStreamConnection(QTcpSocket *connection, int role, QByteArray tth);
+    // Stream protocols: the peer could not connect to us, so we connect to it
+    virtual void reverseConnect(QByteArray tth);
     void setDownloadBucketTablePointer(QHash<int, QByteArray*> *dbt);
+    // Received data goes straight into the mapped file instead of the bucket table, 0 to use the buckets
+    void setDownloadFileMap(DownloadFileMap *map);
     void setSegmentId(quint32 id);
+    // Off while another segment writes to the same buckets, the data hashed so far could be overwritten
+    void setIncrementalHashing(bool enabled);
     quint64 getBytesTransferred();
 
     virtual qint64 getBytesReceivedNotFlushed();
@@ -92,6 +120,7 @@ protected:
     qint64 segmentLength;
     qint64 segmentEnd;
     qint64 segmentStartTime;
+    qint64 firstDataTime;
     qint64 maxUploadRequestOffset;
     int status;
     int prev_status;
@@ -104,12 +133,27 @@ protected:
 
     QFile inputFile;
     QHash<int, QByteArray*> *pDownloadBucketTable;
+    DownloadFileMap *pDownloadFileMap;
+    QHash<int, IncrementalBucketHash*> bucketHashes;
+    bool incrementalHashing;
+    // Bytes received into buckets that are not complete yet, for the progress of the transfer
+    QHash<int, qint64> receivedBucketBytes;
 
     Transfer *pParent;
 
     virtual void checkSendDownloadRequest(QHostAddress peer, QByteArray TTH,
                                          qint64 requestingOffset, qint64 requestingLength, int status, quint8 protocol);
     virtual int calculateBucketNumber(quint64 fileOffset);
+    // Where bucketNumber of the file is received to: its place in the mapped file, or otherwise its bucket,
+    // which is grown to at least length bytes.
+    char *downloadBucketData(int bucketNumber, int length);
+    // Advances the hashes of the buckets over [start, end) of the file, which must have been received in order
+    void hashReceivedRange(qint64 start, qint64 end);
+    // Counts bytes newly received at offset of the file towards their buckets, until downloadBucketComplete()
+    void addReceivedBucketBytes(qint64 offset, qint64 length);
+    void clearBucketHashes();
+    // Hands a bucket that has been received completely to the hasher, or its hash if it was hashed on the way in
+    void downloadBucketComplete(int bucketNumber);
 };
 
 #endif // TRANSFERSEGMENT_H
@@ -11,6 +11,8 @@ TransferWidget::TransferWidget(TransferManager *transferManager, ArpmanetDC *par
 
     connect(this, SIGNAL(requestGlobalTransferStatus()), pTransferManager, SLOT(requestGlobalTransferStatus()), Qt::QueuedConnection);
     connect(pTransferManager, SIGNAL(returnGlobalTransferStatus(QList<TransferItemStatus>)), this, SLOT(returnGlobalTransferStatus(QList<TransferItemStatus>)), Qt::QueuedConnection);
+    connect(this, SIGNAL(requestTrafficShaperStatus()), pParent->dispatcherObject(), SLOT(requestTrafficShaperStatus()), Qt::QueuedConnection);
+    connect(pParent->dispatcherObject(), SIGNAL(returnTrafficShaperStatus(TrafficShaperStatusStruct)), this, SLOT(returnTrafficShaperStatus(TrafficShaperStatusStruct)), Qt::QueuedConnection);
 
     createWidgets();
     placeWidgets();
@@ -32,6 +34,8 @@ TransferWidget::~TransferWidget()
 
 void TransferWidget::createWidgets()
 {
+    pWidget = new QWidget((QWidget *)pParent);
+
     //===== Transfer list =====
     //Model
     transferListModel = new QStandardItemModel(0,10);
@@ -76,6 +80,11 @@ void TransferWidget::createWidgets()
     
     transferListTable->hideColumn(9);
 
+    //===== Upload rates =====
+    uploadRateLabel = new QLabel(tr("<b>Upload:</b> %1").arg(bytesToRate(0)), pWidget);
+    uploadLimitLabel = new QLabel(tr("<b>Limit:</b> Unlimited"), pWidget);
+    uploadQueueLabel = new QLabel(tr("<b>Queued:</b> %1").arg(bytesToSize(0)), pWidget);
+
     //Action
     deleteAction = new QAction(QIcon(":/ArpmanetDC/Resources/RemoveIcon.png"), tr("Stop transfer"), this);
 
@@ -86,7 +95,22 @@ void TransferWidget::createWidgets()
 
 void TransferWidget::placeWidgets()
 {
-    pWidget = transferListTable;
+    QHBoxLayout *bottomLayout = new QHBoxLayout;
+    bottomLayout->addStretch(1);
+    bottomLayout->addWidget(uploadRateLabel);
+    bottomLayout->addSpacing(5);
+    bottomLayout->addWidget(uploadLimitLabel);
+    bottomLayout->addSpacing(5);
+    bottomLayout->addWidget(uploadQueueLabel);
+    bottomLayout->setContentsMargins(5,5,5,5);
+
+    QVBoxLayout *layout = new QVBoxLayout;
+    layout->addWidget(transferListTable, 1);
+    layout->addLayout(bottomLayout, 0);
+    layout->setContentsMargins(0,0,0,0);
+    layout->setSpacing(0);
+
+    pWidget->setLayout(layout);
 }
 
 void TransferWidget::connectWidgets()
@@ -146,6 +170,37 @@ void TransferWidget::updateStatus()
 {
     //Get status from transfer manager
     emit requestGlobalTransferStatus();
+
+    //Get upload rates from dispatcher
+    emit requestTrafficShaperStatus();
+}
+
+//Show the upload rates from the dispatcher
+void TransferWidget::returnTrafficShaperStatus(TrafficShaperStatusStruct status)
+{
+    static const char *classNames[TRAFFIC_CLASS_COUNT] = {"Control", "FSTP", "Basic", "uTP", "FEC"};
+
+    //Only list the classes that have seen traffic
+    QStringList classRates;
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT; i++)
+        if (status.classBytes[i] > 0)
+            classRates.append(tr("%1 %2").arg(classNames[i]).arg(bytesToRate(status.classRates[i])));
+
+    if (classRates.isEmpty())
+        uploadRateLabel->setText(tr("<b>Upload:</b> %1").arg(bytesToRate(status.totalRate)));
+    else
+        uploadRateLabel->setText(tr("<b>Upload:</b> %1 (%2)").arg(bytesToRate(status.totalRate)).arg(classRates.join(", ")));
+
+    QString globalLimit = status.globalRateLimit > 0 ? bytesToRate(status.globalRateLimit) : tr("Unlimited");
+    if (status.peerRateLimit > 0)
+        uploadLimitLabel->setText(tr("<b>Limit:</b> %1, %2 per peer").arg(globalLimit).arg(bytesToRate(status.peerRateLimit)));
+    else
+        uploadLimitLabel->setText(tr("<b>Limit:</b> %1").arg(globalLimit));
+
+    if (status.queuedPeers > 0)
+        uploadQueueLabel->setText(tr("<b>Queued:</b> %1 to %2 peer(s)").arg(bytesToSize(status.queuedBytes)).arg(status.queuedPeers));
+    else
+        uploadQueueLabel->setText(tr("<b>Queued:</b> %1").arg(bytesToSize(0)));
 }
 
 //Return the status of transfers
@@ -347,7 +402,28 @@ QString TransferWidget::stateString(int state)
 
 QString TransferWidget::segmentStatusString(SegmentStatusStruct s)
 {
-    return tr("%1-%2-%3-%4-%5").arg(s.running).arg(s.stalled).arg(s.finished).arg(s.initializing).arg(s.failed);
+    QString str = tr("%1-%2-%3-%4-%5").arg(s.running).arg(s.stalled).arg(s.finished).arg(s.initializing).arg(s.failed);
+    if (s.segmentLimit == 0)
+        return str;
+
+    //Segment controller limit and why it last moved
+    QString decision;
+    switch (s.segmentLimitDecision)
+    {
+        case SegmentLimitGrown:
+            decision = tr(" +");
+            break;
+        case SegmentLimitShrunkGoodput:
+            decision = tr(" -rate");
+            break;
+        case SegmentLimitShrunkStalls:
+            decision = tr(" -stalls");
+            break;
+        case SegmentLimitShrunkIO:
+            decision = tr(" -I/O");
+            break;
+    }
+    return tr("%1 /%2%3").arg(str).arg(s.segmentLimit).arg(decision);
 }
 
 QString TransferWidget::progressString(int type, int progress)
@@ -20,6 +20,7 @@
 
 #include <QtGui>
 #include "transfermanager.h"
+#include "trafficshaper.h"
 
 class ArpmanetDC;
 
@@ -45,9 +46,13 @@ public slots:
     //Return the status of transfers
     void returnGlobalTransferStatus(QList<TransferItemStatus> status);
 
+    //Return the upload rates from the dispatcher
+    void returnTrafficShaperStatus(TrafficShaperStatusStruct status);
+
 signals:
     //Request the status of transfers
     void requestGlobalTransferStatus();
+    void requestTrafficShaperStatus();
 
 private slots:
     //Right-click menu
@@ -99,6 +104,9 @@ private:
     QTableView *transferListTable;
     QStandardItemModel *transferListModel;
     QSortFilterProxyModel *transferSortProxy;
+
+    //Upload rate labels
+    QLabel *uploadRateLabel, *uploadLimitLabel, *uploadQueueLabel;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include "uploadblockcache.h"
+#include "protocoldef.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QFile>
+
+namespace
+{
+
+typedef QPair<QByteArray, int> BlockKey;
+
+typedef struct
+{
+    MappedFileRegion *region;
+    quint64 lastUse;
+} CachedBlock;
+
+typedef struct
+{
+    QFile *file;
+    quint64 lastUse;
+} CachedFile;
+
+struct BlockCache
+{
+    QMutex mutex;
+    QHash<BlockKey, CachedBlock> blocks;
+    // Least recently used first
+    QMap<quint64, BlockKey> blockUse;
+    QHash<QByteArray, CachedFile> files;
+    quint64 useCounter;
+    qint64 capacity;
+    UploadBlockCacheStatistics stats;
+
+    BlockCache()
+    {
+        useCounter = 0;
+        capacity = UPLOAD_BLOCK_CACHE_DEFAULT_CAPACITY;
+        stats.hits = 0;
+        stats.misses = 0;
+        stats.evictions = 0;
+        stats.cachedBytes = 0;
+        stats.cachedBlocks = 0;
+        stats.openFiles = 0;
+        stats.capacity = capacity;
+    }
+
+    ~BlockCache()
+    {
+        foreach (CachedBlock block, blocks)
+            block.region->deref();
+        foreach (CachedFile file, files)
+            delete file.file;
+    }
+
+    void evictBlocks(qint64 room)
+    {
+        while (!blockUse.isEmpty() && stats.cachedBytes + room > capacity)
+        {
+            BlockKey key = blockUse.begin().value();
+            blockUse.erase(blockUse.begin());
+            CachedBlock block = blocks.take(key);
+            stats.cachedBytes -= block.region->length();
+            stats.evictions++;
+            block.region->deref();
+        }
+    }
+
+    QFile *openFile(const QByteArray &tth, const QString &filePathName)
+    {
+        QHash<QByteArray, CachedFile>::iterator i = files.find(tth);
+        if (i != files.end())
+        {
+            // Same content under another name, the share was rebuilt
+            if (i.value().file->fileName() == filePathName)
+            {
+                i.value().lastUse = ++useCounter;
+                return i.value().file;
+            }
+            delete i.value().file;
+            files.erase(i);
+        }
+
+        if (files.size() >= UPLOAD_BLOCK_CACHE_MAX_FILES)
+        {
+            QHash<QByteArray, CachedFile>::iterator oldest = files.begin();
+            for (QHash<QByteArray, CachedFile>::iterator j = files.begin(); j != files.end(); ++j)
+                if (j.value().lastUse < oldest.value().lastUse)
+                    oldest = j;
+            // Mapped blocks do not need the file to stay open
+            delete oldest.value().file;
+            files.erase(oldest);
+        }
+
+        QFile *file = new QFile(filePathName);
+        if (!file->open(QIODevice::ReadOnly))
+        {
+            delete file;
+            return 0;
+        }
+
+        CachedFile cachedFile;
+        cachedFile.file = file;
+        cachedFile.lastUse = ++useCounter;
+        files.insert(tth, cachedFile);
+        return file;
+    }
+};
+
+Q_GLOBAL_STATIC(BlockCache, cache)
+
+}
+
+MappedFileRegion *UploadBlockCache::acquireBlock(const QByteArray &tth, const QString &filePathName, int bucketNumber)
+{
+    BlockCache *c = cache();
+    if (!c)
+        return 0;
+    QMutexLocker locker(&c->mutex);
+
+    BlockKey key(tth, bucketNumber);
+    QHash<BlockKey, CachedBlock>::iterator i = c->blocks.find(key);
+    if (i != c->blocks.end())
+    {
+        c->blockUse.remove(i.value().lastUse);
+        i.value().lastUse = ++c->useCounter;
+        c->blockUse.insert(i.value().lastUse, key);
+        c->stats.hits++;
+        i.value().region->ref();
+        return i.value().region;
+    }
+
+    c->stats.misses++;
+    QFile *file = c->openFile(tth, filePathName);
+    if (!file)
+        return 0;
+
+    qint64 offset = (qint64)bucketNumber * HASH_BUCKET_SIZE;
+    qint64 length = qMin((qint64)HASH_BUCKET_SIZE, file->size() - offset);
+    MappedFileRegion *region = MappedFileRegion::map(*file, offset, length);
+    if (!region)
+        return 0;
+
+    // A cap smaller than one block means no caching at all, the caller gets the only reference
+    if (length > c->capacity)
+        return region;
+
+    c->evictBlocks(length);
+    CachedBlock block;
+    block.region = region;
+    block.lastUse = ++c->useCounter;
+    c->blocks.insert(key, block);
+    c->blockUse.insert(block.lastUse, key);
+    c->stats.cachedBytes += length;
+    region->ref();
+    return region;
+}
+
+void UploadBlockCache::setCapacity(qint64 bytes)
+{
+    BlockCache *c = cache();
+    if (!c)
+        return;
+    QMutexLocker locker(&c->mutex);
+    c->capacity = qMax(bytes, (qint64)0);
+    c->evictBlocks(0);
+}
+
+UploadBlockCacheStatistics UploadBlockCache::getStatistics()
+{
+    BlockCache *c = cache();
+    if (!c)
+    {
+        UploadBlockCacheStatistics stats = {0, 0, 0, 0, 0, 0, 0};
+        return stats;
+    }
+
+    QMutexLocker locker(&c->mutex);
+    UploadBlockCacheStatistics stats = c->stats;
+    stats.cachedBlocks = c->blocks.size();
+    stats.openFiles = c->files.size();
+    stats.capacity = c->capacity;
+    return stats;
+}
+
+QString UploadBlockCache::getDebugStatistics()
+{
+    UploadBlockCacheStatistics stats = getStatistics();
+    qint64 total = stats.hits + stats.misses;
+    return QString("Upload block cache: %1 hits, %2 misses (%3% hit rate), %4 evictions, %5 blocks / %6 of %7 MB cached, %8 files open")
+            .arg(stats.hits).arg(stats.misses).arg(total ? stats.hits * 100 / total : 0).arg(stats.evictions)
+            .arg(stats.cachedBlocks).arg(stats.cachedBytes >> 20).arg(stats.capacity >> 20).arg(stats.openFiles);
+}
@@ -0,0 +1,62 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPLOADBLOCKCACHE_H
+#define UPLOADBLOCKCACHE_H
+
+#include <QByteArray>
+#include <QString>
+#include "mappedfileregion.h"
+
+// Mapped 1MB blocks of shared files, kept around for every upload segment to send from.
+//
+// When a new file shows up, lots of peers download it from us at the same time and every one of their requests used
+// to open and map its own part of the file. Blocks are now mapped once per TTH and hash bucket and handed out with a
+// reference, so that FSTP and uTP uploads to different peers send from the same pages. The least recently used blocks
+// are dropped once the cached blocks exceed the memory cap; a block that is still being sent from stays mapped until
+// its last user lets go of it. Open files are cached per TTH the same way.
+//
+// Thread safe, all static.
+
+#define UPLOAD_BLOCK_CACHE_DEFAULT_CAPACITY (256 << 20)
+#define UPLOAD_BLOCK_CACHE_MAX_FILES 64
+
+typedef struct
+{
+    qint64 hits;
+    qint64 misses;
+    qint64 evictions;
+    qint64 cachedBytes;
+    int cachedBlocks;
+    int openFiles;
+    qint64 capacity;
+} UploadBlockCacheStatistics;
+
+class UploadBlockCache
+{
+public:
+    // Referenced region holding hash bucket bucketNumber of the file, 0 if it can not be mapped.
+    // Hand it back with deref().
+    static MappedFileRegion *acquireBlock(const QByteArray &tth, const QString &filePathName, int bucketNumber);
+
+    static void setCapacity(qint64 bytes);
+
+    static UploadBlockCacheStatistics getStatistics();
+    static QString getDebugStatistics();
+};
+
+#endif // UPLOADBLOCKCACHE_H
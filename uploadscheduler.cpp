@@ -0,0 +1,231 @@
+#include "uploadscheduler.h"
+#include <QDateTime>
+
+UploadScheduler::UploadScheduler()
+{
+    grantCounter = 0;
+    maximumUploads = 0;
+    maximumUploadsPerPeer = 1;
+    normalSlots = 0;
+    fastSlots = 0;
+}
+
+UploadLane UploadScheduler::acquireSlot(const QHostAddress &host, quint64 fileSize)
+{
+    if (peerAtLimit(host))
+        return NoUploadLane;
+
+    // Small files keep out of the normal lane while they can, it is the one everyone queues for
+    if (fileSize <= UPLOAD_FAST_LANE_MAX_FILE_SIZE && fastSlots < UPLOAD_FAST_LANE_SLOTS)
+    {
+        grant(host, FastUploadLane);
+        return FastUploadLane;
+    }
+
+    removeExpired(QDateTime::currentMSecsSinceEpoch());
+    if (normalSlots < maximumUploads && pickNormal(hostSlots, lastGrant, QList<bool>()) == -1)
+    {
+        grant(host, NormalUploadLane);
+        return NormalUploadLane;
+    }
+
+    return NoUploadLane;
+}
+
+void UploadScheduler::releaseSlot(const QHostAddress &host, UploadLane lane)
+{
+    if (lane == FastUploadLane)
+        fastSlots--;
+    else if (lane == NormalUploadLane)
+        normalSlots--;
+    else
+        return;
+
+    QHash<QHostAddress, int>::iterator i = hostSlots.find(host);
+    if (i != hostSlots.end() && --i.value() <= 0)
+        hostSlots.erase(i);
+}
+
+int UploadScheduler::enqueue(const UploadSchedulerEntry &entry)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    removeExpired(now);
+
+    int index = findEntry(entry.requestingHost, entry.tth, entry.segmentId);
+    if (index == -1)
+    {
+        if (queue.size() >= UPLOAD_QUEUE_MAX_ENTRIES)
+            return 0;
+        queue.append(entry);
+        index = queue.size() - 1;
+    }
+    else
+    {
+        // The requester asked again. Pipelined requests add up to one stretch, which is sent once the slot comes.
+        UploadSchedulerEntry &queued = queue[index];
+        quint64 end = qMax(queued.fileOffset + queued.requestLength, entry.fileOffset + entry.requestLength);
+        queued.fileOffset = qMin(queued.fileOffset, entry.fileOffset);
+        queued.requestLength = end - queued.fileOffset;
+    }
+
+    int place = position(index);
+    queue[index].expiry = now + 2 * retryMsecs(place) + UPLOAD_QUEUE_ENTRY_GRACE;
+    return place;
+}
+
+bool UploadScheduler::isQueued(const QHostAddress &host, const QByteArray &tth, quint32 segmentId)
+{
+    return findEntry(host, tth, segmentId) != -1;
+}
+
+bool UploadScheduler::takeNext(UploadSchedulerEntry &entry, UploadLane &lane)
+{
+    removeExpired(QDateTime::currentMSecsSinceEpoch());
+
+    int index = -1;
+    lane = NoUploadLane;
+    if (fastSlots < UPLOAD_FAST_LANE_SLOTS)
+    {
+        for (int i = 0; i < queue.size(); i++)
+        {
+            if (queue.at(i).fileSize <= UPLOAD_FAST_LANE_MAX_FILE_SIZE && !peerAtLimit(queue.at(i).requestingHost))
+            {
+                index = i;
+                lane = FastUploadLane;
+                break;
+            }
+        }
+    }
+    if (index == -1 && normalSlots < maximumUploads)
+    {
+        index = pickNormal(hostSlots, lastGrant, QList<bool>());
+        lane = NormalUploadLane;
+    }
+    if (index == -1)
+        return false;
+
+    entry = queue.takeAt(index);
+    grant(entry.requestingHost, lane);
+    return true;
+}
+
+int UploadScheduler::retryMsecs(int position)
+{
+    return qBound(UPLOAD_QUEUE_MINIMUM_RETRY, position * UPLOAD_QUEUE_RETRY_PER_POSITION, UPLOAD_QUEUE_MAXIMUM_RETRY);
+}
+
+int UploadScheduler::findEntry(const QHostAddress &host, const QByteArray &tth, quint32 segmentId)
+{
+    for (int i = 0; i < queue.size(); i++)
+    {
+        const UploadSchedulerEntry &e = queue.at(i);
+        if (e.segmentId == segmentId && e.requestingHost == host && e.tth == tth)
+            return i;
+    }
+    return -1;
+}
+
+// Place in line of queue[index], found by playing the normal lane forward one slot at a time.
+// Small files can also count on the fast lane, where it is first come first served.
+int UploadScheduler::position(int index)
+{
+    QHash<QHostAddress, int> slotCounts = hostSlots;
+    QHash<QHostAddress, quint64> grants = lastGrant;
+    quint64 counter = grantCounter;
+    QList<bool> taken;
+    for (int i = 0; i < queue.size(); i++)
+        taken.append(false);
+
+    int place = queue.size();
+    for (int k = 1; k <= queue.size(); k++)
+    {
+        int next = pickNormal(slotCounts, grants, taken);
+        if (next == -1)
+            break;
+        if (next == index)
+        {
+            place = k;
+            break;
+        }
+        taken[next] = true;
+        slotCounts[queue.at(next).requestingHost]++;
+        grants[queue.at(next).requestingHost] = ++counter;
+    }
+
+    if (queue.at(index).fileSize <= UPLOAD_FAST_LANE_MAX_FILE_SIZE)
+    {
+        int fastPlace = 1;
+        for (int i = 0; i < index; i++)
+            if (queue.at(i).fileSize <= UPLOAD_FAST_LANE_MAX_FILE_SIZE)
+                fastPlace++;
+        place = qMin(place, fastPlace);
+    }
+
+    return place;
+}
+
+// Queued request from the peer holding the fewest slots, the one served longest ago among equals, oldest request
+// first for the same peer. Peers at their own limit wait until one of theirs finishes.
+int UploadScheduler::pickNormal(const QHash<QHostAddress, int> &slotCounts, const QHash<QHostAddress, quint64> &grants, const QList<bool> &taken)
+{
+    int best = -1;
+    int bestSlots = 0;
+    quint64 bestGrant = 0;
+    for (int i = 0; i < queue.size(); i++)
+    {
+        if (!taken.isEmpty() && taken.at(i))
+            continue;
+
+        const QHostAddress &host = queue.at(i).requestingHost;
+        int held = slotCounts.value(host);
+        if (held >= maximumUploadsPerPeer)
+            continue;
+
+        quint64 granted = grants.value(host);
+        if (best == -1 || held < bestSlots || (held == bestSlots && granted < bestGrant))
+        {
+            best = i;
+            bestSlots = held;
+            bestGrant = granted;
+        }
+    }
+    return best;
+}
+
+void UploadScheduler::removeExpired(qint64 now)
+{
+    QMutableListIterator<UploadSchedulerEntry> i(queue);
+    while (i.hasNext())
+        if (i.next().expiry <= now)
+            i.remove();
+
+    // Round robin memory is only needed for peers still around
+    QMutableHashIterator<QHostAddress, quint64> g(lastGrant);
+    while (g.hasNext())
+    {
+        g.next();
+        if (hostSlots.contains(g.key()))
+            continue;
+        bool queued = false;
+        foreach (const UploadSchedulerEntry &e, queue)
+        {
+            if (e.requestingHost == g.key())
+            {
+                queued = true;
+                break;
+            }
+        }
+        if (!queued)
+            g.remove();
+    }
+}
+
+void UploadScheduler::grant(const QHostAddress &host, UploadLane lane)
+{
+    if (lane == FastUploadLane)
+        fastSlots++;
+    else
+        normalSlots++;
+    hostSlots[host]++;
+    lastGrant[host] = ++grantCounter;
+}
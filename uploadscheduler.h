@@ -0,0 +1,112 @@
+/* This file is part of ArpmanetDC. Copyright (C) 2012
+ * Source code can be found at http://code.google.com/p/arpmanetdc/
+ *
+ * ArpmanetDC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArpmanetDC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArpmanetDC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPLOADSCHEDULER_H
+#define UPLOADSCHEDULER_H
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QHostAddress>
+
+// Upload slot admission.
+//
+// Requests that find every slot taken wait in a queue instead of being turned away, and the requester is told its
+// place in line and how long to wait before asking again. It has to ask again: entries that are not refreshed in
+// time are dropped, so peers that gave up do not hold up the queue.
+//
+// When a slot comes free it goes to the queued peer holding the fewest slots right now, round robin among equals,
+// so a few peers pulling large files can not keep everyone else out. Small files get a fast lane of their own on top
+// of the normal slots, they are over in a moment and should not have to wait behind a film.
+
+// Extra slots only files up to UPLOAD_FAST_LANE_MAX_FILE_SIZE can use
+#define UPLOAD_FAST_LANE_SLOTS 2
+#define UPLOAD_FAST_LANE_MAX_FILE_SIZE (4 << 20)
+// Longer queues get NoSlotsAvailable, as before
+#define UPLOAD_QUEUE_MAX_ENTRIES 256
+// Retry hints grow with the queue position
+#define UPLOAD_QUEUE_RETRY_PER_POSITION 1000
+#define UPLOAD_QUEUE_MINIMUM_RETRY 2000
+#define UPLOAD_QUEUE_MAXIMUM_RETRY 30000
+// A queued request is dropped when the requester has not asked again within two retry hints and this much
+#define UPLOAD_QUEUE_ENTRY_GRACE 5000
+
+enum UploadLane
+{
+    NoUploadLane = 0,
+    NormalUploadLane = 1,
+    FastUploadLane = 2
+};
+
+typedef struct
+{
+    quint8 protocol;
+    QHostAddress requestingHost;
+    QByteArray tth;
+    QString filePathName;
+    quint64 fileSize;
+    quint64 fileOffset;
+    quint64 requestLength;
+    quint32 segmentId;
+    qint64 expiry;
+} UploadSchedulerEntry;
+
+class UploadScheduler
+{
+public:
+    UploadScheduler();
+
+    void setMaximumUploads(int n) {maximumUploads = n;}
+    void setMaximumUploadsPerPeer(int n) {maximumUploadsPerPeer = n;}
+
+    // Slots held by host, in either lane
+    int heldSlots(const QHostAddress &host) const {return hostSlots.value(host);}
+    bool peerAtLimit(const QHostAddress &host) const {return heldSlots(host) >= maximumUploadsPerPeer;}
+
+    // A slot for a new upload right now, NoUploadLane if it has to queue. Nobody jumps a queue for the normal lane.
+    UploadLane acquireSlot(const QHostAddress &host, quint64 fileSize);
+    void releaseSlot(const QHostAddress &host, UploadLane lane);
+
+    // Queues the request, or refreshes it if it is queued already. Returns its place in line counting from 1,
+    // or 0 if the queue is full.
+    int enqueue(const UploadSchedulerEntry &entry);
+    bool isQueued(const QHostAddress &host, const QByteArray &tth, quint32 segmentId);
+    // Takes the next queued request a free slot can go to, false if there is none
+    bool takeNext(UploadSchedulerEntry &entry, UploadLane &lane);
+
+    static int retryMsecs(int position);
+
+private:
+    int findEntry(const QHostAddress &host, const QByteArray &tth, quint32 segmentId);
+    int position(int index);
+    int pickNormal(const QHash<QHostAddress, int> &slotCounts, const QHash<QHostAddress, quint64> &grants, const QList<bool> &taken);
+    void removeExpired(qint64 now);
+    void grant(const QHostAddress &host, UploadLane lane);
+
+    QList<UploadSchedulerEntry> queue;
+    QHash<QHostAddress, int> hostSlots;
+    // When each peer was last given a slot, for round robin among peers holding the same number
+    QHash<QHostAddress, quint64> lastGrant;
+    quint64 grantCounter;
+
+    int maximumUploads;
+    int maximumUploadsPerPeer;
+    int normalSlots;
+    int fastSlots;
+};
+
+#endif // UPLOADSCHEDULER_H
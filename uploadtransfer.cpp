@@ -24,14 +24,14 @@ UploadTransfer::~UploadTransfer()
 {
     transferRateCalculationTimer->deleteLater();
     transferInactivityTimer->deleteLater();
-    emit removeTransferSegmentPointer(upload->getSegmentId());
-    upload->deleteLater();
+    if (upload)
+        upload->deleteLater();
 }
 
-void UploadTransfer::incomingDataPacket(quint8 transferProtocolVersion, quint64 offset, QByteArray data)
+void UploadTransfer::incomingDataPacket(quint8, qint64 offset, const char *data, int length)
 {
     if (upload)
-        upload->incomingDataPacket(offset, data);
+        upload->incomingDataPacket(offset, data, length);
 }
 
 void UploadTransfer::setFileName(QString filename)
@@ -56,10 +56,7 @@ TransferSegment* UploadTransfer::createUploadObject(quint8 protocol, quint32 seg
 {
     qDebug() << "TransferSegment::createUploadObject()" << protocol << segmentId;
     if (upload)
-    {
-        emit removeTransferSegmentPointer(upload->getSegmentId());
         upload->deleteLater();
-    }
 
     upload = 0;
 
@@ -71,22 +68,36 @@ TransferSegment* UploadTransfer::createUploadObject(quint8 protocol, quint32 seg
     case uTPProtocol:
         upload = new uTPTransferSegment(this);
         break;
-    case BasicTransferProtocol:
     case ArpmanetFECProtocol:
+        upload = new FECTransferSegment(this);
+        break;
+    case BasicTransferProtocol:
+        upload = new BTPTransferSegment(this);
         break;
     }
 
     if (!upload)
         return 0;
 
+    // The id is the downloader's, it can clash with our own download segment ids and stays out of the demux table.
+    // TransferManager finds the upload by requesting host and segment id instead.
     upload->setSegmentId(segmentId);
-    qDebug() << "UploadTransfer::createUploadObject() setTransferSegmentPointer()" << upload->getSegmentId() << upload;
-    emit setTransferSegmentPointer(upload->getSegmentId(), upload);
 
     //Used to intercept the amount of data actually transmitted
     connect(upload, SIGNAL(transmitDatagram(QHostAddress, QByteArray *)), this, SLOT(dataTransmitted(QHostAddress, QByteArray *)));
     connect(upload, SIGNAL(transmitDatagram(QHostAddress, QByteArray *)), this, SIGNAL(transmitDatagram(QHostAddress, QByteArray *)));
+    connect(upload, SIGNAL(transmitMappedDatagram(QHostAddress,MappedDatagramStruct)), this, SLOT(mappedDataTransmitted(QHostAddress,MappedDatagramStruct)));
+    connect(upload, SIGNAL(transmitMappedDatagram(QHostAddress,MappedDatagramStruct)), this, SIGNAL(transmitMappedDatagram(QHostAddress,MappedDatagramStruct)));
     connect(upload, SIGNAL(sendTransferError(QHostAddress,quint8,QByteArray,qint64)), this, SIGNAL(sendTransferError(QHostAddress,quint8,QByteArray,qint64)));
+    connect(upload, SIGNAL(uploadPending(TransferSegment*)), this, SIGNAL(uploadPending(TransferSegment*)));
+    //Stream protocols do not go through the dispatcher
+    connect(upload, SIGNAL(updateDirectBytesStats(int)), this, SLOT(streamDataTransmitted(int)));
+    connect(upload, SIGNAL(sendRevConnect(QHostAddress,QByteArray,quint32)), this, SIGNAL(sendRevConnect(QHostAddress,QByteArray,quint32)));
+    return upload;
+}
+
+TransferSegment* UploadTransfer::getUploadSegment()
+{
     return upload;
 }
 
@@ -140,6 +151,18 @@ void UploadTransfer::dataTransmitted(QHostAddress host, QByteArray *data)
     bytesWrittenSinceCalculation += bytesWrittenSinceUpdate;
 }
 
+void UploadTransfer::mappedDataTransmitted(QHostAddress, MappedDatagramStruct datagram)
+{
+    bytesWrittenSinceUpdate += mappedDatagramSize(datagram);
+    bytesWrittenSinceCalculation += bytesWrittenSinceUpdate;
+}
+
+void UploadTransfer::streamDataTransmitted(int bytes)
+{
+    bytesWrittenSinceUpdate += bytes;
+    bytesWrittenSinceCalculation += bytesWrittenSinceUpdate;
+}
+
 int UploadTransfer::getTransferProgress()
 {
     //Only a decent guess for upload progress - cannot determine exactly what the downstream client received or in what order/segment
@@ -175,6 +198,8 @@ SegmentStatusStruct UploadTransfer::getSegmentStatuses()
     s.initializing = 0;
     s.running = 0;
     s.stalled = 0;
+    s.segmentLimit = 0;
+    s.segmentLimitDecision = SegmentLimitHeld;
     if (upload)
     {
         switch (upload->getSegmentStatus())
@@ -19,6 +19,8 @@
 #define UPLOADTRANSFER_H
 #include "transfer.h"
 #include "fstptransfersegment.h"
+#include "fectransfersegment.h"
+#include "btptransfersegment.h"
 #include "utptransfersegment.h"
 #include "protocoldef.h"
 
@@ -33,6 +35,7 @@ public:
     void setFileName(QString filename);
     void setTTH(QByteArray tth);
     TransferSegment* createUploadObject(quint8 protocol, quint32 segmentId);
+    TransferSegment* getUploadSegment();
 
 public slots:
     int getTransferProgress();
@@ -40,10 +43,12 @@ public slots:
     qint64 getTransferRate();
     int getSegmentCount();
     SegmentStatusStruct getSegmentStatuses();
-    void incomingDataPacket(quint8 transferProtocolVersion, quint64 offset, QByteArray data);
+    void incomingDataPacket(quint8 transferProtocolVersion, qint64 offset, const char *data, int length);
 
 private slots:
     void dataTransmitted(QHostAddress host, QByteArray *data);
+    void mappedDataTransmitted(QHostAddress host, MappedDatagramStruct datagram);
+    void streamDataTransmitted(int bytes);
 
 private:
     QTimer* transferInactivityTimer;
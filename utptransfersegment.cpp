@@ -1,4 +1,7 @@
 #include "utptransfersegment.h"
+#include "datagrampool.h"
+#include "bytecursor.h"
+#include "uploadblockcache.h"
 
 uTPTransferSegment::uTPTransferSegment(Transfer *parent)
 {
@@ -38,7 +41,7 @@ uTPTransferSegment::uTPTransferSegment(Transfer *parent)
     UTP_SetCallbacks(utpSocket, &utp_callbacks, this);
 
     segmentMode = UndefinedSegment;
-    fileMap = 0;
+    uploadRegion = 0;
     segmentOffset = 0;
 }
 
@@ -46,8 +49,8 @@ uTPTransferSegment::~uTPTransferSegment()
 {
     if (inputFile.isOpen())
         inputFile.close();
-    if (fileMap)
-        inputFile.unmap((unsigned char *)fileMap);
+    if (uploadRegion)
+        uploadRegion->deref();
     UTP_Close(utpSocket);
     qDebug() << "uTPTransferSegment destroyed";
 }
@@ -58,11 +61,10 @@ void uTPTransferSegment::transferTimerEvent()
 }
 
 // not interested in offset here, for uTP it only denotes the relevant segment start
-void uTPTransferSegment::incomingDataPacket(qint64 offset, QByteArray data)
+void uTPTransferSegment::incomingDataPacket(qint64, const char *data, int length)
 {
-    qDebug() << "uTPTransferSegment::incomingDataPacket()" << offset;
     UTP_IsIncomingUTP(uTPTransferSegment::utp_incoming, uTPTransferSegment::utp_sendto, this,
-                      (const unsigned char *)data.constData(), data.length(),
+                      (const unsigned char *)data, length,
                       (const sockaddr *)&addr, sizeof(addr));
 }
 
@@ -91,17 +93,13 @@ void uTPTransferSegment::startUploading()
         segmentLength = fileSize - segmentStart;
 
     segmentOffset = 0;
-
-    if (fileMap)
-        inputFile.unmap((unsigned char *)fileMap);
-    fileMap = inputFile.map(segmentStart, segmentLength);
-
 }
 
 void uTPTransferSegment::startDownloading()
 {
     segmentMode = DownloadingSegment;
     status = TRANSFER_STATE_RUNNING;
+    segmentStartTime = QDateTime::currentMSecsSinceEpoch();
     qDebug() << "uTPTransferSegment::startDownloading()";
     segmentOffset = 0;
     // checkSendDownloadRequest wakes up a uTPTransferSegment object we can connect to at the other side.
@@ -139,45 +137,27 @@ void uTPTransferSegment::uTPRead(const byte *bytes, size_t count)
     qDebug() << "uTPTransferSegment::uTPRead()" << segmentMode << count;
     if (segmentMode == DownloadingSegment)
     {
-
-        int bucketNumber = calculateBucketNumber(segmentOffset);
-        if (!pDownloadBucketTable->contains(bucketNumber))
+        // The stream arrives in order, write it to its place in the file and hash buckets as they fill up.
+        // The last bucket of the segment ends at segmentEnd, which may be short of a bucket boundary at the end of the file.
+        const char *data = (const char *)bytes;
+        qint64 fileOffset = segmentStart + segmentOffset;
+        qint64 end = qMin(fileOffset + (qint64)count, segmentEnd);
+        while (fileOffset < end)
         {
-            QByteArray *bucket = new QByteArray();
-            pDownloadBucketTable->insert(bucketNumber, bucket);
-        }
-        QByteArray data = QByteArray((const char *)bytes, count); // TODO: optimize this to work directly with *bytes
-        if ((pDownloadBucketTable->value(bucketNumber)->length() + data.length()) > HASH_BUCKET_SIZE)
-        {
-            int bucketRemaining = HASH_BUCKET_SIZE - pDownloadBucketTable->value(bucketNumber)->length();
-            pDownloadBucketTable->value(bucketNumber)->append(data.mid(0, bucketRemaining));
-            if (!pDownloadBucketTable->contains(bucketNumber + 1))
+            int bucketNumber = calculateBucketNumber(fileOffset);
+            int bucketOffset = fileOffset - (qint64)bucketNumber * HASH_BUCKET_SIZE;
+            qint64 bucketEnd = qMin((qint64)(bucketNumber + 1) * HASH_BUCKET_SIZE, segmentEnd);
+            int n = (int)(qMin(end, bucketEnd) - fileOffset);
+            memcpy(downloadBucketData(bucketNumber, bucketOffset + n) + bucketOffset, data, n);
+            addReceivedBucketBytes(fileOffset, n);
+            hashReceivedRange(fileOffset, fileOffset + n);
+            fileOffset += n;
+            data += n;
+            if (fileOffset == bucketEnd)
             {
-                QByteArray *nextBucket = new QByteArray(data.mid(bucketRemaining));
-                pDownloadBucketTable->insert(bucketNumber + 1, nextBucket);
+                qDebug() << "uTPTransferSegment emit hashBucketRequest() " << bucketNumber;
+                downloadBucketComplete(bucketNumber);
             }
-            // there should be no else - if the next bucket exists and data is sticking over, there is an error,
-            // since we segment on bucket boundaries. tth checksumming will catch the problems.
-        }
-        else
-        {
-            pDownloadBucketTable->value(bucketNumber)->append(data);
-            //qDebug() << "Append data " << requestingOffset << offset << pDownloadBucketTable->value(bucketNumber)->length();
-        }
-
-        if (pDownloadBucketTable->value(bucketNumber)->length() == HASH_BUCKET_SIZE)
-        {
-            emit hashBucketRequest(TTH, bucketNumber, pDownloadBucketTable->value(bucketNumber), remoteHost);
-            qDebug() << "uTPTransferSegment emit hashBucketRequest() " << bucketNumber << pDownloadBucketTable->value(bucketNumber)->length();
-        }
-
-        // these last bucket numbers are for the *segment*, not the file.
-        // the length check is for in case it is also the last segment of the file.
-        if ((bucketNumber == lastBucketNumber) && (lastBucketSize == pDownloadBucketTable->value(bucketNumber)->length())) // End of Segment
-        {
-            //status = TRANSFER_STATE_FINISHED;  // local segment
-            qDebug() << "uTPTransferSegment emit hashBucketRequest() on finish " << bucketNumber << pDownloadBucketTable->value(bucketNumber)->length();
-            emit hashBucketRequest(TTH, bucketNumber, pDownloadBucketTable->value(bucketNumber), remoteHost);
         }
         segmentOffset += count;
         bytesTransferred += count;
@@ -200,8 +180,31 @@ void uTPTransferSegment::uTPWrite(byte *bytes, size_t count)
     {
         if (segmentOffset + count > segmentLength)
             count = segmentLength - segmentOffset;  // TODO + check
-        memcpy(bytes, (unsigned char *)fileMap + segmentOffset, count);
-        segmentOffset += count;
+
+        // libutp may ask for a piece that straddles two blocks
+        while (count > 0)
+        {
+            qint64 fileOffset = segmentStart + segmentOffset;
+            if (!uploadRegion || fileOffset < uploadRegion->offset() || fileOffset >= uploadRegion->offset() + uploadRegion->length())
+            {
+                if (uploadRegion)
+                    uploadRegion->deref();
+                uploadRegion = UploadBlockCache::acquireBlock(TTH, filePathName, calculateBucketNumber(fileOffset));
+                if (!uploadRegion)
+                {
+                    qDebug() << "uTPTransferSegment::uTPWrite() could not map" << filePathName << fileOffset;
+                    memset(bytes, 0, count);
+                    segmentOffset += count;
+                    break;
+                }
+            }
+
+            size_t piece = qMin((qint64)count, uploadRegion->offset() + uploadRegion->length() - fileOffset);
+            memcpy(bytes, uploadRegion->data() + (fileOffset - uploadRegion->offset()), piece);
+            bytes += piece;
+            count -= piece;
+            segmentOffset += piece;
+        }
     }
     else if (segmentMode == DownloadingSegment)
     {
@@ -256,13 +259,13 @@ void uTPTransferSegment::uTPOverhead(bool send, size_t count, int type)
 // this thing gets called when the uTP layer wants to push a packet onto the "wire"
 void uTPTransferSegment::uTPSendTo(const byte *p, size_t len, const struct sockaddr *to, socklen_t tolen)
 {
-    QByteArray *packet = new QByteArray;
-    packet->append(DirectDataPacket);
-    packet->append(uTPProtocol);
-    packet->append(quint64ToByteArray((quint64)segmentStart));
-    packet->append(quint32ToByteArray(segmentId));
-    packet->append((const char *)p, len);
-    qDebug() << "uTPTransferSegment::uTPSendTo()" << len << packet->length() << remoteHost;
+    QByteArray *packet = DatagramPool::acquire(14 + len);
+    ByteWriter writer(packet->data(), packet->length());
+    writer.writeUInt8(DirectDataPacket);
+    writer.writeUInt8(uTPProtocol);
+    writer.writeUInt64((quint64)segmentStart);
+    writer.writeUInt32(segmentId);
+    writer.writeBytes((const char *)p, len);
     emit transmitDatagram(remoteHost, packet);
 }
 
@@ -35,7 +35,7 @@ public:
     ~uTPTransferSegment();
 
 public slots:
-    void incomingDataPacket(qint64 offset, QByteArray data);
+    void incomingDataPacket(qint64 offset, const char *data, int length);
     void transferTimerEvent();
     void setFileName(QString filename);
     void setFileSize(quint64 size);
@@ -50,7 +50,7 @@ private:
     sockaddr_in addr;
     UTPFunctionTable utp_callbacks;
     
-    const unsigned char * fileMap;
+    MappedFileRegion *uploadRegion;
     qint64 segmentOffset;
 
     bool connect_called;